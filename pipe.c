@@ -22,6 +22,11 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
  * THE SOFTWARE.
  */
+// memfd_create, for mirrored buffers. This has to come before any system header.
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include "pipe.h"
 
 #include <assert.h>
@@ -74,6 +79,16 @@ const char _pipe_copyright[] =
 // number if you are coping small or few objects into pipes at once.
 #define MUTEX_SPINS 8192
 
+// Pipes with a spinning wait policy (see pipe_wait_t) default to MUTEX_SPINS
+// laps. Adaptive ones start at INITIAL_SPIN_BUDGET, and never go below
+// MIN_SPIN_BUDGET, or they'd never find out that spinning has started to pay
+// off again. A sleep shorter than SHORT_SLEEP_NS means the other side was
+// almost there, and we should have spun a little longer.
+#define INITIAL_SPIN_BUDGET 1024
+#define MIN_SPIN_BUDGET     16
+#define SHORT_SLEEP_NS      50000ULL
+#define SPIN_YIELD_EVERY    1024
+
 // Standard threading stuff. This lets us support simple synchronization
 // primitives on multiple platforms painlessly.
 
@@ -91,6 +106,14 @@ const char _pipe_copyright[] =
 #define mutex_unlock        ReleaseSRWLockExclusive
 #define mutex_destroy(m)
 
+// SRW locks can only be tried since Windows 7. Before that, "trying" just
+// means waiting for it, which is always successful.
+#if _WIN32_WINNT >= 0x0601
+#define mutex_trylock(m)    (TryAcquireSRWLockExclusive(m) != 0)
+#else
+#define mutex_trylock(m)    (AcquireSRWLockExclusive(m), true)
+#endif
+
 #define cond_t              CONDITION_VARIABLE
 
 #define cond_init           InitializeConditionVariable
@@ -99,6 +122,11 @@ const char _pipe_copyright[] =
 #define cond_wait(c, m)     SleepConditionVariableSRW((c), (m), INFINITE, 0)
 #define cond_destroy(c)
 
+// Evaluates to false if `ms' milliseconds pass without a wakeup.
+#define cond_timedwait_ms(c, m, ms)                  \
+    (SleepConditionVariableSRW((c), (m), (ms), 0)    \
+     || GetLastError() != ERROR_TIMEOUT)
+
 // Oh god. Microsoft has slow locks and lacks native condition variables on
 // anything lower than Vista. Looks like we're rolling our own today.
 #else /* vista+ */
@@ -107,6 +135,7 @@ const char _pipe_copyright[] =
 
 #define mutex_init(m)   InitializeCriticalSectionAndSpinCount((m), MUTEX_SPINS)
 #define mutex_lock      EnterCriticalSection
+#define mutex_trylock(m) (TryEnterCriticalSection(m) != 0)
 #define mutex_unlock    LeaveCriticalSection
 #define mutex_destroy   DeleteCriticalSection
 
@@ -167,7 +196,8 @@ static void cond_broadcast(cond_t* c)
     LeaveCriticalSection(&c->waiters_count_lock);
 }
 
-static void cond_wait(cond_t* c, mutex_t* m)
+// Returns false if `ms' milliseconds pass without us being released.
+static bool cond_timedwait_ms(cond_t* c, mutex_t* m, DWORD ms)
 {
     EnterCriticalSection(&c->waiters_count_lock);
 
@@ -178,11 +208,11 @@ static void cond_wait(cond_t* c, mutex_t* m)
     LeaveCriticalSection(&c->waiters_count_lock);
     mutex_unlock(m);
 
-    bool wait_done;
+    bool wait_done, timed_out;
 
     do
     {
-        WaitForSingleObject(c->event, INFINITE);
+        timed_out = WaitForSingleObject(c->event, ms) == WAIT_TIMEOUT;
 
         EnterCriticalSection(&c->waiters_count_lock);
         int release_count = c->release_count;
@@ -192,18 +222,29 @@ static void cond_wait(cond_t* c, mutex_t* m)
         wait_done = release_count > 0
                  && wait_generation_count != my_generation;
     }
-    while(!wait_done);
+    while(!wait_done && !timed_out);
 
     mutex_lock(m);
     EnterCriticalSection(&c->waiters_count_lock);
     c->waiters_count--;
-    int release_count = --c->release_count;
+
+    // A release may have been meant for us after we gave up. If so, take it
+    // anyway; leaving it lying around would keep the event set with nobody
+    // left to reset it.
+    wait_done = wait_done || (c->release_count > 0
+                           && c->wait_generation_count != my_generation);
+
+    int release_count = wait_done ? --c->release_count : -1;
     LeaveCriticalSection(&c->waiters_count_lock);
 
     if(release_count == 0) // we're the last waiter
         ResetEvent(c->event);
+
+    return wait_done;
 }
 
+#define cond_wait(c, m) ((void)cond_timedwait_ms((c), (m), INFINITE))
+
 static void cond_destroy(cond_t* c)
 {
     DeleteCriticalSection(&c->waiters_count_lock);
@@ -212,10 +253,16 @@ static void cond_destroy(cond_t* c)
 
 #endif /* vista+ */
 
+#define cpu_relax       YieldProcessor
+#define thread_yield()  ((void)SwitchToThread())
+
 // Fall back on pthreads if we haven't special-cased the current OS.
 #else /* windows */
 
+#include <errno.h>
 #include <pthread.h>
+#include <sched.h>
+#include <time.h>
 
 #define mutex_t pthread_mutex_t
 #define cond_t  pthread_cond_t
@@ -223,576 +270,3241 @@ static void cond_destroy(cond_t* c)
 #define mutex_init(m)  pthread_mutex_init((m), NULL)
 
 #define mutex_lock     pthread_mutex_lock
+#define mutex_trylock(m) (pthread_mutex_trylock(m) == 0)
 #define mutex_unlock   pthread_mutex_unlock
 #define mutex_destroy  pthread_mutex_destroy
 
-#define cond_init(c)   pthread_cond_init((c), NULL)
 #define cond_signal    pthread_cond_signal
 #define cond_broadcast pthread_cond_broadcast
 #define cond_wait      pthread_cond_wait
 #define cond_destroy   pthread_cond_destroy
 
-#endif /* windows */
-
-// End threading.
+#define thread_yield() ((void)sched_yield())
 
-/*
- * Pipe implementation overview
- * =================================
- *
- * A pipe is implemented as a circular buffer. There are two special cases for
- * this structure: nowrap and wrap.
- *
- * Nowrap:
- *
- *     buffer          begin               end                 bufend
- *       [               >==================>                    ]
- *
- * In this case, the data storage is contiguous, allowing easy access. This is
- * the simplest case.
- *
- * Wrap:
- *
- *     buffer        end                 begin                 bufend
- *       [============>                    >=====================]
- *
- * In this case, the data storage is split up, wrapping around to the beginning
- * of the buffer when it hits bufend. Hackery must be done in this case to
- * ensure the structure is maintained and data can be easily copied in/out.
- *
- * Data is 'push'ed after the end pointer and 'pop'ed from the begin pointer.
- * There is always one sentinel element in the pipe, to distinguish between an
- * empty pipe and a full pipe.
- *
- * Invariants:
- *
- * The invariants of a pipe are documented in the check_invariants function,
- * and double-checked frequently in debug builds. This helps restore sanity when
- * making modifications, but may slow down calls. It's best to disable the
- * checks in release builds.
- *
- * Thread-safety:
- *
- * pipe_t has been designed with high threading workloads foremost in my mind.
- * Its initial purpose was to serve as a task queue, with multiple threads
- * feeding data in (from disk, network, etc) and multiple threads reading it
- * and processing it in parallel. This created the need for a fully re-entrant,
- * lightweight, accommodating data structure.
- *
- * We have two locks guarding the pipe, instead of the naive solution of having
- * one. One guards writes to the begin pointer, the other guards writes to the
- * end pointer. This is due to the realization that when pushing, you don't need
- * an up-to-date value for begin, and when popping you don't need an up-to-date
- * value for end (since either can only move forward in the buffer). As long as
- * neither moves backwards, there will be no conflicts when they move
- * independently of each other. This optimization has improved benchmarks by
- * 15-20%.
- *
- * Complexity:
- *
- * Pushing and popping must run in O(n) where n is the number of elements being
- * inserted/removed. It must also run in O(1) with respect to the number of
- * elements in the pipe.
- *
- * Efficiency:
- *
- * Asserts are used liberally, and many of them, when inlined, can be turned
- * into no-ops. Therefore, it is recommended that you compile with -O1 in
- * debug builds as the pipe can easily become a bottleneck.
- */
-struct pipe_t {
-    size_t elem_size,  // The size of each element. This is read-only and
-                       // therefore does not need to be locked to read.
-           min_cap,    // The smallest sane capacity before the buffer refuses
-                       // to shrink because it would just end up growing again.
-                       // To modify this variable, you must lock the whole pipe.
-           max_cap;    // The maximum capacity of the pipe before push requests
-                       // are blocked. To read or write to this variable, you
-                       // must hold 'end_lock'.
+// Tells the processor we're spinning, so it can save power and stop
+// speculating us into a pipeline flush once whatever we're waiting for happens.
+#if defined(__i386__) || defined(__x86_64__)
+#define cpu_relax()    __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax()    __asm__ __volatile__("yield" ::: "memory")
+#else
+#define cpu_relax()    ((void)0)
+#endif
 
-    char*  buffer,     // The internal buffer, holding the enqueued elements.
-                       // to modify this variable, you must lock the whole pipe.
-        *  bufend,     // One past the end of the buffer, so that the actual
-                       // elements are stored in in interval [buffer, bufend).
-        *  begin,      // Always points to the sentinel element. `begin + elem_size`
-                       // points to the left-most element in the pipe.
-                       // To modify this variable, you must lock begin_lock.
-        *  end;        // Always points past the right-most element in the pipe.
-                       // To modify this variable, you must lock end_lock.
+// Timed waits are measured against CLOCK_MONOTONIC, so that deadlines aren't
+// moved around by someone changing the wall clock. OS X can't set a condition
+// variable's clock, but it can wait for a relative amount of time instead.
+static void cond_init(cond_t* c)
+{
+#if defined(__APPLE__) || !defined(CLOCK_MONOTONIC)
+    pthread_cond_init(c, NULL);
+#else
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(c, &attr);
+    pthread_condattr_destroy(&attr);
+#endif
+}
 
-    // The number of producers/consumers in the pipe.
-    size_t producer_refcount, // Guarded by begin_lock.
-           consumer_refcount; // Guarded by end_lock.
+#endif /* windows */
 
-    // Our lovely mutexes. To lock the pipe, call lock_pipe. Depending on what
-    // you modify, you may be able to get away with only locking one of them.
-    mutex_t begin_lock,
-            end_lock;
+// Time. Deadlines are absolute readings of a monotonic clock, in nanoseconds,
+// with NO_DEADLINE meaning "wait forever".
+//
+//   now_ns()                   -> the current reading of the clock.
+//   cond_wait_until(c, m, t)   -> cond_wait, but gives up once the clock reads
+//                                 `t'. Returns false if it gave up.
 
-    cond_t just_pushed, // Signaled immediately after a push.
-           just_popped; // Signaled immediately after a pop.
-};
+#define NO_DEADLINE (~0ULL)
 
-// Converts a pointer to either a producer or consumer into a suitable pipe_t*.
-#define PIPIFY(handle) ((pipe_t*)(handle))
+#if defined(_WIN32) || defined(_WIN64)
 
-// We wrap elem_size in a function so we can annotate it with PURE, allowing
-// the compiler's CSE to eliminate extraneous memory accesses.
-static inline PURE size_t __pipe_elem_size(pipe_t* p)
+static unsigned long long now_ns(void)
 {
-    return p->elem_size;
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+
+    unsigned long long f = (unsigned long long)freq.QuadPart,
+                       c = (unsigned long long)count.QuadPart;
+
+    // Split up to avoid overflowing after a few hours of uptime.
+    return c / f * 1000000000ULL + c % f * 1000000000ULL / f;
 }
 
-size_t pipe_elem_size(pipe_generic_t* p)
+static bool cond_wait_until(cond_t* c, mutex_t* m, unsigned long long deadline)
 {
-    return __pipe_elem_size(PIPIFY(p));
-}
+    DWORD ms = INFINITE;
 
+    if(deadline != NO_DEADLINE)
+    {
+        unsigned long long now = now_ns();
 
-// Represents a snapshot of a pipe. We often don't need all our values
-// up-to-date (usually only one of begin or end). By passing this around, we
-// avoid constantly wrecking our cache by accessing the real pipe_t.
-typedef struct {
-    char*   buffer,
-        *   bufend,
-        *   begin,
-        *   end;
-    size_t elem_size;
-} snapshot_t;
+        if(now >= deadline)
+            return false;
 
-static inline snapshot_t make_snapshot(pipe_t* p)
-{
-    return (snapshot_t) {
-        .buffer = p->buffer,
-        .bufend = p->bufend,
-        .begin  = p->begin,
-        .end    = p->end,
-        .elem_size = __pipe_elem_size(p),
-    };
+        // Round up, or we'd wake up just before the deadline and spin.
+        ms = (DWORD)min((deadline - now + 999999) / 1000000,
+                        (unsigned long long)INFINITE - 1);
+    }
+
+    return cond_timedwait_ms(c, m, ms);
 }
 
-// The initial minimum capacity of the pipe. This can be overridden dynamically
-// with pipe_reserve.
-#ifdef PIPE_DEBUG
-#define DEFAULT_MINCAP  2
-#else
-#define DEFAULT_MINCAP  32
-#endif
+#else /* windows */
 
-// Returns the maximum number of bytes the buffer can hold, excluding the
-// sentinel element.
-static inline size_t capacity(snapshot_t s)
+static unsigned long long now_ns(void)
 {
-    return s.bufend - s.buffer - s.elem_size;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL
+         + (unsigned long long)ts.tv_nsec;
 }
 
-// Does the buffer wrap around?
-//   true  -> wrap
-//   false -> nowrap
-static inline bool wraps_around(snapshot_t s)
+static bool cond_wait_until(cond_t* c, mutex_t* m, unsigned long long deadline)
 {
-    return unlikely(s.begin >= s.end);
+    if(deadline == NO_DEADLINE)
+        return pthread_cond_wait(c, m), true;
+
+    unsigned long long now = now_ns();
+
+    if(now >= deadline)
+        return false;
+
+#if defined(__APPLE__)
+    unsigned long long left = deadline - now;
+    struct timespec ts = { (time_t)(left / 1000000000ULL),
+                           (long)  (left % 1000000000ULL) };
+    return pthread_cond_timedwait_relative_np(c, m, &ts) != ETIMEDOUT;
+#else
+    struct timespec ts = { (time_t)(deadline / 1000000000ULL),
+                           (long)  (deadline % 1000000000ULL) };
+    return pthread_cond_timedwait(c, m, &ts) != ETIMEDOUT;
+#endif
 }
 
-// Returns the number of bytes currently in use in the buffer, excluding the
-// sentinel element.
-static inline size_t bytes_in_use(snapshot_t s)
+#endif /* windows */
+
+// End threading.
+
+// Atomics. We only need a handful of operations for the lock-free engines, and
+// most of our supported compilers predate <stdatomic.h>, so we lean on compiler
+// builtins instead.
+
+#if defined(__ATOMIC_ACQUIRE) // gcc 4.7+, clang, icc
+
+#define atomic_load_relaxed(ptr)      __atomic_load_n((ptr), __ATOMIC_RELAXED)
+#define atomic_load_acquire(ptr)      __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define atomic_store_relaxed(ptr, v)  __atomic_store_n((ptr), (v), __ATOMIC_RELAXED)
+#define atomic_store_release(ptr, v)  __atomic_store_n((ptr), (v), __ATOMIC_RELEASE)
+#define atomic_fence()                __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+// All three return the new value.
+#define atomic_add_fetch(ptr, v)      __atomic_add_fetch((ptr), (v), __ATOMIC_ACQ_REL)
+#define atomic_sub_fetch(ptr, v)      __atomic_sub_fetch((ptr), (v), __ATOMIC_ACQ_REL)
+#define atomic_add_relaxed(ptr, v)    __atomic_add_fetch((ptr), (v), __ATOMIC_RELAXED)
+
+// On failure, *expected is updated with the value that was actually there.
+#define atomic_cas(ptr, expected, desired)                          \
+    __atomic_compare_exchange_n((ptr), (expected), (desired), true, \
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+
+#elif defined(__GNUC__) // older gcc only has the __sync family: full barriers.
+
+#define atomic_load_relaxed(ptr)      (*(volatile __typeof__(*(ptr))*)(ptr))
+#define atomic_load_acquire(ptr)      __extension__ ({        \
+        __typeof__(*(ptr)) __v = *(volatile __typeof__(*(ptr))*)(ptr); \
+        __sync_synchronize(); __v; })
+#define atomic_store_relaxed(ptr, v)  ((void)(*(volatile __typeof__(*(ptr))*)(ptr) = (v)))
+#define atomic_store_release(ptr, v)  do {                    \
+        __sync_synchronize();                                 \
+        *(volatile __typeof__(*(ptr))*)(ptr) = (v);           \
+    } while(0)
+#define atomic_fence()                __sync_synchronize()
+
+#define atomic_add_fetch(ptr, v)      __sync_add_and_fetch((ptr), (v))
+#define atomic_sub_fetch(ptr, v)      __sync_sub_and_fetch((ptr), (v))
+#define atomic_add_relaxed(ptr, v)    __sync_add_and_fetch((ptr), (v))
+
+#define atomic_cas(ptr, expected, desired) __extension__ ({       \
+        __typeof__(*(ptr)) __e = *(expected);                     \
+        __typeof__(*(ptr)) __o = __sync_val_compare_and_swap((ptr), __e, (desired)); \
+        *(expected) = __o;                                        \
+        __o == __e; })
+
+#else
+#error "pipe.c needs atomic builtins. Please add support for your compiler."
+#endif
+
+// End atomics.
+
+// Mirrored memory. A mirrored buffer of `size' bytes is really `2*size' bytes of
+// address space, where the second half maps the same pages as the first. That
+// way, `buf[i]' and `buf[i + size]' are always the same byte. All we need from
+// each platform is:
+//
+//   mirror_granule() -> what mirrored sizes must be a multiple of, or 0 if we
+//                       can't mirror anything here.
+//   mirror_alloc(n)  -> a mirrored buffer of `n' bytes, or NULL on failure.
+//   mirror_free(b, n)
+
+#if defined(_WIN32) || defined(_WIN64)
+
+// VirtualAlloc2 and MapViewOfFile3 are only declared when targeting Windows 10,
+// and only exist since 1803. We look them up at runtime, so that older versions
+// just quietly go without.
+#if defined(_WIN32_WINNT) && _WIN32_WINNT >= 0x0A00 && defined(MEM_RESERVE_PLACEHOLDER)
+
+typedef PVOID (WINAPI* virtual_alloc2_t)(HANDLE, PVOID, SIZE_T, ULONG, ULONG,
+                                         MEM_EXTENDED_PARAMETER*, ULONG);
+typedef PVOID (WINAPI* map_view_of_file3_t)(HANDLE, HANDLE, PVOID, ULONG64,
+                                            SIZE_T, ULONG, ULONG,
+                                            MEM_EXTENDED_PARAMETER*, ULONG);
+
+static size_t mirror_granule(void)
 {
-    return (wraps_around(s)
-    //         v   right half   v   v     left half    v
-            ? ((s.end - s.buffer) + (s.bufend - s.begin))
-            : (s.end - s.begin))
-        // exclude the sentinel element.
-        - s.elem_size;
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return si.dwAllocationGranularity;
 }
 
-static inline char* wrap_ptr_if_necessary(char* buffer,
-                                          char* p,
-                                          char* bufend)
+static char* mirror_alloc(size_t size)
 {
-    if(p >= bufend) {
-        size_t diff = p - bufend;
-        return buffer + diff;
-    } else {
-        return p;
+    HMODULE kernelbase = GetModuleHandleA("kernelbase.dll");
+
+    if(kernelbase == NULL)
+        return NULL;
+
+    virtual_alloc2_t virtual_alloc2 =
+        (virtual_alloc2_t)GetProcAddress(kernelbase, "VirtualAlloc2");
+    map_view_of_file3_t map_view_of_file3 =
+        (map_view_of_file3_t)GetProcAddress(kernelbase, "MapViewOfFile3");
+
+    if(virtual_alloc2 == NULL || map_view_of_file3 == NULL)
+        return NULL;
+
+    HANDLE section = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL,
+                                        PAGE_READWRITE,
+                                        (DWORD)((unsigned long long)size >> 32),
+                                        (DWORD)size, NULL);
+    if(section == NULL)
+        return NULL;
+
+    // Reserve both halves as one placeholder, then split it in two so we can
+    // map the section into each half.
+    char* base = virtual_alloc2(NULL, NULL, 2*size,
+                                MEM_RESERVE | MEM_RESERVE_PLACEHOLDER,
+                                PAGE_NOACCESS, NULL, 0);
+
+    bool  split = base && VirtualFree(base, size,
+                                      MEM_RELEASE | MEM_PRESERVE_PLACEHOLDER);
+    char* lo    = NULL,
+        * hi    = NULL;
+
+    if(split)
+    {
+        lo = map_view_of_file3(section, NULL, base, 0, size,
+                               MEM_REPLACE_PLACEHOLDER, PAGE_READWRITE,
+                               NULL, 0);
+        hi = map_view_of_file3(section, NULL, base + size, 0, size,
+                               MEM_REPLACE_PLACEHOLDER, PAGE_READWRITE,
+                               NULL, 0);
     }
-}
 
-static inline char* rev_wrap_ptr_if_necessary(char* buffer,
-                                              char* p,
-                                              char* bufend)
-{
-    if(p < buffer) {
-        size_t diff = buffer - p;
-        return bufend - diff;
-    } else {
-        return p;
+    // The views keep the section alive.
+    CloseHandle(section);
+
+    if(likely(lo && hi))
+        return lo;
+
+    if(split)
+    {
+        if(lo) UnmapViewOfFile(lo); else VirtualFree(base, 0, MEM_RELEASE);
+        if(hi) UnmapViewOfFile(hi); else VirtualFree(base + size, 0, MEM_RELEASE);
     }
-}
+    else if(base)
+        VirtualFree(base, 0, MEM_RELEASE);
 
-// Runs a memcpy, then returns the end of the range copied.
-// Has identical functionality as mempcpy, but is portable.
-static inline void* offset_memcpy(void* restrict dest,
-                                  const void* restrict src,
-                                  size_t n)
-{
-    memcpy(dest, src, n);
-    return (char*)dest + n;
+    return NULL;
 }
 
-static size_t CONSTEXPR next_pow2(size_t n)
+static void mirror_free(char* buf, size_t size)
 {
-    // I don't see why we would even try. Maybe a stacktrace will help.
-    assertume(n != 0);
+    UnmapViewOfFile(buf);
+    UnmapViewOfFile(buf + size);
+}
 
-    // In binary, top is equal to 10000...0:  A 1 right-padded by as many zeros
-    // as needed to fill up a size_t.
-    size_t top = (~(size_t)0 >> 1) + 1;
+#else // Windows 10
 
-    // If when we round up we will overflow our size_t, avoid rounding up and
-    // exit early.
-    if(unlikely(n >= top))
-        return n;
+static size_t mirror_granule(void)            { return 0; }
+static char*  mirror_alloc(size_t size)       { (void)size; return NULL; }
+static void   mirror_free(char* b, size_t n)  { (void)b; (void)n; }
 
-    // Since we don't have to worry about overflow anymore, we can just use
-    // the algorithm documented at:
-    //   http://bits.stephan-brumme.com/roundUpToNextPowerOfTwo.html
-    // It's my favorite due to being branch-free (the loop will be unrolled),
-    // and portable. However, on x86, it will be faster to use the BSR (bit-scan
-    // reverse) instruction. Since this isn't straight C, it has been omitted,
-    // but may be best for your platform.
-    //
-    // clang 3.0 is smart enough to turn this code into a bsr. gcc 4.6 isn't. I
-    // haven't tested higher versions.
-    n--;
+#endif // Windows 10
 
-    for(size_t shift = 1; shift < (sizeof n)*8; shift <<= 1)
-        n |= n >> shift;
+#elif defined(__unix__) || defined(__APPLE__)
 
-    n++;
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
-    return n;
+static size_t mirror_granule(void)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    return page > 0 ? (size_t)page : 0;
 }
 
-#define in_bounds(left, x, right) ((x) >= (left) && (x) <= (right))
-
-// You know all those assumptions we make about our data structure whenever we
-// use it? This function checks them, and is called liberally through the
-// codebase. It would be best to read this function over, as it also acts as
-// documentation. Code AND documentation? What is this witchcraft?
-static inline void check_invariants(pipe_t* p)
+// Returns an anonymous file of `size' bytes to map, or -1.
+static int mirror_fd(size_t size)
 {
-    if(p == NULL) return;
+    int fd = -1;
 
-    // p->buffer may be NULL. When it is, we must have no issued consumers.
-    // It's just a way to save memory when we've deallocated all consumers
-    // and people are still trying to push like idiots.
-    if(p->buffer == NULL)
-    {
-        assertume(p->consumer_refcount == 0);
-        return;
-    }
-    else
-    {
-        assertume(p->consumer_refcount != 0);
-    }
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+    fd = memfd_create("pipe", MFD_CLOEXEC);
+#elif !defined(__linux__)
+    // No memfd here, so make a named one and unlink it right away. The stack
+    // address keeps concurrent callers from colliding with each other.
+    char name[64];
+    snprintf(name, sizeof name, "/pipe-%ld-%lx",
+             (long)getpid(), (unsigned long)(uintptr_t)name);
 
-    snapshot_t s = make_snapshot(p);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
 
-    assertume(s.begin);
-    assertume(s.end);
-    assertume(s.bufend);
+    if(fd >= 0)
+        shm_unlink(name);
+#endif
 
-    assertume(p->elem_size != 0);
+    if(fd >= 0 && ftruncate(fd, (off_t)size) != 0)
+        fd = (close(fd), -1);
 
-    assertume(bytes_in_use(s) <= capacity(s)
-            && "There are more elements in the buffer than its capacity.");
+    return fd;
+}
 
-    assertume(in_bounds(s.buffer, s.begin, s.bufend));
-    assertume(in_bounds(s.buffer, s.end, s.bufend));
+static char* mirror_alloc(size_t size)
+{
+    int fd = mirror_fd(size);
 
-    if(s.begin == s.end)
-        assertume(bytes_in_use(s) == capacity(s));
+    if(fd < 0)
+        return NULL;
 
-    assertume(in_bounds(DEFAULT_MINCAP*p->elem_size, p->min_cap, p->max_cap));
-    assertume(in_bounds(p->min_cap, capacity(s) + p->elem_size, p->max_cap));
+    // Grab enough address space for both halves, then map the file over each.
+    char* base = mmap(NULL, 2*size, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    bool ok = base != MAP_FAILED
+           && mmap(base, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_FIXED, fd, 0) == base
+           && mmap(base + size, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_FIXED, fd, 0) == base + size;
+
+    // The mappings keep the file alive.
+    close(fd);
+
+    if(likely(ok))
+        return base;
+
+    if(base != MAP_FAILED)
+        munmap(base, 2*size);
+
+    return NULL;
 }
 
-static inline void lock_pipe(pipe_t* p)
+static void mirror_free(char* buf, size_t size)
 {
-    // watch the locking order VERY carefully. end_lock must ALWAYS be locked
-    // before begin_lock when dealing with both at once.
-    mutex_lock(&p->end_lock);
-    mutex_lock(&p->begin_lock);
-    check_invariants(p);
+    munmap(buf, 2*size);
 }
 
-static inline void unlock_pipe(pipe_t* p)
+#else // unix
+
+static size_t mirror_granule(void)            { return 0; }
+static char*  mirror_alloc(size_t size)       { (void)size; return NULL; }
+static void   mirror_free(char* b, size_t n)  { (void)b; (void)n; }
+
+#endif // unix
+
+// End mirrored memory.
+
+// Shared memory. See pipe_new_shared.
+//
+//   shm_create(name, n)      -> maps a new named region of `n' zeroed bytes,
+//                               or returns NULL if the name is taken.
+//   shm_attach(name, &n)     -> maps an existing region, and says how big it
+//                               is.
+//   shm_detach(b, n)         -> unmaps a region.
+//   shm_remove(name)         -> removes a region's name. Whoever still has it
+//                               mapped keeps it until they detach.
+//   shm_lock_init(m)         -> initializes a mutex, or a condition variable,
+//   shm_cond_init(c)            that works across processes. Returns false if
+//                               the platform can't do that.
+
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(_WIN32)
+
+#include <sys/stat.h>
+
+static char* shm_map(int fd, size_t size)
 {
-    check_invariants(p);
-    mutex_unlock(&p->begin_lock);
-    mutex_unlock(&p->end_lock);
-}
+    char* buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 
-// runs some code while automatically locking and unlocking the pipe. If `break'
-// is used, the pipe will be unlocked before control returns from the macro.
-#define WHILE_LOCKED(stuff) do { \
-    lock_pipe(p);                \
-    do { stuff; } while(0);      \
-    unlock_pipe(p);              \
- } while(0)
+    close(fd);
+
+    return buf != MAP_FAILED ? buf : NULL;
+}
 
-pipe_t* pipe_new(size_t elem_size, size_t original_limit)
+static char* shm_create(const char* name, size_t size)
 {
-    assertume(elem_size != 0);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
 
-    if(elem_size == 0)
+    if(fd < 0)
         return NULL;
 
-    pipe_t* p = malloc(sizeof *p);
+    if(ftruncate(fd, (off_t)size) != 0)
+    {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
 
-    assert(DEFAULT_MINCAP >= 1);
+    char* buf = shm_map(fd, size);
 
-    size_t cap = DEFAULT_MINCAP * elem_size;
-    char*  buf = malloc(cap);
+    if(buf == NULL)
+        shm_unlink(name);
 
-    // Change the limit from being in "elements" to being in "bytes", and make
-    // room for the sentinel element.
-    size_t limit = (original_limit + 1) * elem_size;
+    return buf;
+}
 
-    if(unlikely(p == NULL || buf == NULL))
-        return free(p), free(buf), NULL;
+static char* shm_attach(const char* name, size_t* size)
+{
+    int fd = shm_open(name, O_RDWR, 0);
+    struct stat st;
 
-    *p = (pipe_t) {
-        .elem_size  = elem_size,
-        .min_cap = cap,
-        .max_cap = original_limit ? next_pow2(max(limit, cap)) : ~(size_t)0,
+    if(fd < 0)
+        return NULL;
 
-        .buffer = buf,
-        .bufend = buf + cap,
-        .begin  = buf,
-        .end    = buf + elem_size,
+    if(fstat(fd, &st) != 0 || st.st_size <= 0)
+        return close(fd), NULL;
 
-        // Since we're issuing a pipe_t, it counts as both a producer and a
-        // consumer since it can issue new instances of both. Therefore, the
-        // refcounts both start at 1; not the intuitive 0.
-        .producer_refcount = 1,
-        .consumer_refcount = 1,
-    };
+    *size = (size_t)st.st_size;
 
-    mutex_init(&p->begin_lock);
-    mutex_init(&p->end_lock);
+    return shm_map(fd, *size);
+}
 
-    cond_init(&p->just_pushed);
-    cond_init(&p->just_popped);
+static void shm_detach(char* buf, size_t size) { munmap(buf, size); }
+static void shm_remove(const char* name)       { shm_unlink(name);  }
 
-    check_invariants(p);
+static bool shm_lock_init(mutex_t* m)
+{
+    pthread_mutexattr_t attr;
+    bool ok;
 
-    return p;
+    pthread_mutexattr_init(&attr);
+    ok = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) == 0
+      && pthread_mutex_init(m, &attr) == 0;
+    pthread_mutexattr_destroy(&attr);
+
+    return ok;
 }
 
-// Instead of allocating a special handle, the pipe_*_new() functions just
-// return the original pipe, cast into a user-friendly form. This saves needless
-// malloc calls. Also, since we have to refcount anyways, it's free.
-pipe_producer_t* pipe_producer_new(pipe_t* p)
+// Just like cond_init, these wait on the monotonic clock wherever they can.
+static bool shm_cond_init(cond_t* c)
 {
-    mutex_lock(&p->begin_lock);
-        p->producer_refcount++;
-    mutex_unlock(&p->begin_lock);
+    pthread_condattr_t attr;
+    bool ok;
 
-    return (pipe_producer_t*)p;
+    pthread_condattr_init(&attr);
+    ok = pthread_condattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) == 0
+#if !defined(__APPLE__) && defined(CLOCK_MONOTONIC)
+      && pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) == 0
+#endif
+      && pthread_cond_init(c, &attr) == 0;
+    pthread_condattr_destroy(&attr);
+
+    return ok;
 }
 
-pipe_consumer_t* pipe_consumer_new(pipe_t* p)
-{
-    mutex_lock(&p->end_lock);
-        p->consumer_refcount++;
-    mutex_unlock(&p->end_lock);
+#else // unix
 
-    return (pipe_consumer_t*)p;
+static char* shm_create(const char* name, size_t n)
+{
+    (void)name; (void)n; return NULL;
 }
 
-static void deallocate(pipe_t* p)
+static char* shm_attach(const char* name, size_t* n)
 {
-    assertume(p->producer_refcount == 0);
-    assertume(p->consumer_refcount == 0);
+    (void)name; (void)n; return NULL;
+}
 
-    mutex_destroy(&p->begin_lock);
-    mutex_destroy(&p->end_lock);
+static void shm_detach(char* b, size_t n)   { (void)b; (void)n; }
+static void shm_remove(const char* name)    { (void)name; }
+static bool shm_lock_init(mutex_t* m)       { (void)m; return false; }
+static bool shm_cond_init(cond_t* c)        { (void)c; return false; }
 
-    cond_destroy(&p->just_pushed);
-    cond_destroy(&p->just_popped);
+#endif // unix
 
-    free(p->buffer);
-    free(p);
-}
+// End shared memory.
 
-void pipe_free(pipe_t* p)
+// Spill files. See pipe_options_t's spill_dir. Offsets and sizes must all be
+// multiples of spill_granule().
+//
+//   spill_granule()            -> the page size, or 0 if we can't spill here.
+//   spill_open(dir)            -> a new file in `dir', with no name, or -1.
+//   spill_reserve(fd, off, n)  -> makes sure the disk has room for the `n'
+//                                 bytes at `off', growing the file if it has
+//                                 to. Returns false if it doesn't.
+//   spill_map(fd, off, n)      -> maps the `n' bytes at `off', or NULL.
+//   spill_unmap(b, n)
+//   spill_evict(fd, b, off, n) -> gets [b, b + n), which is mapped from `off',
+//                                 out of memory. It's read back in the next
+//                                 time it's touched.
+//   spill_discard(fd, b, off, n) -> the same, but throws the contents away, and
+//                                 gives the disk space back if it can.
+//   spill_prefetch(b, n)       -> starts reading [b, b + n) back in.
+//   spill_close(fd)
+
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(_WIN32)
+
+static size_t spill_granule(void) { return mirror_granule(); }
+
+static int spill_open(const char* dir)
 {
-    size_t new_producer_refcount,
-           new_consumer_refcount;
-
-    mutex_lock(&p->begin_lock);
-        assertume(p->producer_refcount > 0);
-        new_producer_refcount = --p->producer_refcount;
-    mutex_unlock(&p->begin_lock);
+    int fd = -1;
 
-    mutex_lock(&p->end_lock);
-        assertume(p->consumer_refcount > 0);
-        new_consumer_refcount = --p->consumer_refcount;
-    mutex_unlock(&p->end_lock);
+#if defined(__linux__) && defined(O_TMPFILE)
+    fd = open(dir, O_RDWR | O_TMPFILE | O_CLOEXEC, 0600);
+#endif
 
-    if(unlikely(new_consumer_refcount == 0))
+    // Not every filesystem can do O_TMPFILE, so fall back to making a named
+    // file and unlinking it right away.
+    if(fd < 0)
     {
-        p->buffer = (free(p->buffer), NULL);
+        static const char suffix[] = "/pipe-spill-XXXXXX";
 
-        if(likely(new_producer_refcount > 0))
-            cond_broadcast(&p->just_popped);
-        else
-            deallocate(p);
+        size_t len  = strlen(dir);
+        char*  path = malloc(len + sizeof suffix);
+
+        if(path == NULL)
+            return -1;
+
+        memcpy(path, dir, len);
+        memcpy(path + len, suffix, sizeof suffix);
+
+        if((fd = mkstemp(path)) >= 0)
+        {
+            unlink(path);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+
+        free(path);
     }
-    else if(unlikely(new_producer_refcount == 0))
-        cond_broadcast(&p->just_pushed);
+
+    return fd;
 }
 
-void pipe_producer_free(pipe_producer_t* handle)
+static bool spill_reserve(int fd, long long off, size_t size)
 {
-    pipe_t* p = PIPIFY(handle);
-    size_t new_producer_refcount;
+#if defined(__linux__)
+    // Actually allocating the blocks means running out of disk shows up here,
+    // instead of as a SIGBUS when we write to the mapping.
+    return posix_fallocate(fd, (off_t)off, (off_t)size) == 0;
+#else
+    struct stat st;
 
-    mutex_lock(&p->begin_lock);
-        assertume(p->producer_refcount > 0);
-        new_producer_refcount = --p->producer_refcount;
-    mutex_unlock(&p->begin_lock);
+    return fstat(fd, &st) == 0
+        && (st.st_size >= (off_t)(off + size)
+         || ftruncate(fd, (off_t)(off + size)) == 0);
+#endif
+}
 
-    if(unlikely(new_producer_refcount == 0))
-    {
-        size_t consumer_refcount;
+static char* spill_map(int fd, long long off, size_t size)
+{
+    char* buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fd, (off_t)off);
 
-        mutex_lock(&p->end_lock);
-            consumer_refcount = p->consumer_refcount;
-        mutex_unlock(&p->end_lock);
+    if(buf == MAP_FAILED)
+        return NULL;
 
-        // If there are still consumers, wake them up if they're waiting on
-        // input from a producer. Otherwise, since we're the last handle
-        // altogether, we can free the pipe.
-        if(likely(consumer_refcount > 0))
-            cond_broadcast(&p->just_pushed);
-        else
-            deallocate(p);
-    }
+    // It's written once and read once, both in order.
+    posix_madvise(buf, size, POSIX_MADV_SEQUENTIAL);
+
+    return buf;
 }
 
-void pipe_consumer_free(pipe_consumer_t* handle)
+static void spill_unmap(char* buf, size_t size) { munmap(buf, size); }
+static void spill_close(int fd)                 { close(fd);         }
+
+static void spill_evict(int fd, char* buf, long long off, size_t size)
 {
-    pipe_t* p = PIPIFY(handle);
-    size_t new_consumer_refcount;
+#if defined(__linux__)
+    // Unmapping the pages leaves them in the page cache, dirty or not, so
+    // nothing is lost. fadvise then starts writing them out, and drops them
+    // from the cache once they're clean.
+    madvise(buf, size, MADV_DONTNEED);
+    posix_fadvise(fd, (off_t)off, (off_t)size, POSIX_FADV_DONTNEED);
+#else
+    (void)fd; (void)off;
+    posix_madvise(buf, size, POSIX_MADV_DONTNEED);
+#endif
+}
 
-    mutex_lock(&p->end_lock);
-        new_consumer_refcount = --p->consumer_refcount;
-    mutex_unlock(&p->end_lock);
+static void spill_discard(int fd, char* buf, long long off, size_t size)
+{
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+    // Punching a hole drops the pages everywhere, without writing them out.
+    if(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                 (off_t)off, (off_t)size) == 0)
+        return;
+#endif
 
-    if(unlikely(new_consumer_refcount == 0))
-    {
-        size_t producer_refcount;
+    spill_evict(fd, buf, off, size);
+}
 
-        mutex_lock(&p->begin_lock);
-            producer_refcount = p->producer_refcount;
-        mutex_unlock(&p->begin_lock);
+static void spill_prefetch(char* buf, size_t size)
+{
+    posix_madvise(buf, size, POSIX_MADV_WILLNEED);
+}
 
-        // If there are still producers, wake them up if they're waiting on
-        // room to free up from a consumer. Otherwise, since we're the last
-        // handle altogether, we can free the pipe.
-        if(likely(producer_refcount > 0))
-            cond_broadcast(&p->just_popped);
-        else
-            deallocate(p);
-    }
+#else // unix
+
+static size_t spill_granule(void)                    { return 0; }
+static int    spill_open(const char* dir)            { (void)dir; return -1; }
+static void   spill_unmap(char* b, size_t n)         { (void)b; (void)n; }
+static void   spill_close(int fd)                    { (void)fd; }
+static void   spill_prefetch(char* b, size_t n)      { (void)b; (void)n; }
+
+static bool spill_reserve(int fd, long long off, size_t n)
+{
+    (void)fd; (void)off; (void)n; return false;
 }
 
-// Returns the end of the buffer (buf + number_of_bytes_copied).
-static inline char* copy_pipe_into_new_buf(snapshot_t s,
-                                           char* restrict buf)
+static char* spill_map(int fd, long long off, size_t n)
 {
-    if(wraps_around(s))
-    {
-        buf = offset_memcpy(buf, s.begin, s.bufend - s.begin);
-        buf = offset_memcpy(buf, s.buffer, s.end - s.buffer);
-    }
-    else
-    {
-        buf = offset_memcpy(buf, s.begin, s.end - s.begin);
-    }
+    (void)fd; (void)off; (void)n; return NULL;
+}
 
-    return buf;
+static void spill_evict(int fd, char* b, long long off, size_t n)
+{
+    (void)fd; (void)b; (void)off; (void)n;
 }
 
-// Resizes the buffer to make room for at least 'new_size' elements, returning
-// an updated snapshot of the pipe state.
-//
-// The new size MUST be bigger than the number of elements currently in the
-// pipe.
-//
-// The pipe must be fully locked on entrance to this function.
-static snapshot_t resize_buffer(pipe_t* p, size_t new_size)
+static void spill_discard(int fd, char* b, long long off, size_t n)
 {
-    check_invariants(p);
+    (void)fd; (void)b; (void)off; (void)n;
+}
 
-    const size_t max_cap   = p->max_cap,
-                 min_cap   = p->min_cap,
-                 elem_size = __pipe_elem_size(p);
+#endif // unix
 
-    assertume(new_size >= bytes_in_use(make_snapshot(p)));
+// End spill files.
 
-    if(unlikely(new_size >= max_cap))
-        new_size = max_cap;
+// NUMA placement.
+//
+//   numa_bind(b, n, node) -> makes sure the pages in [b, b + n) live on
+//                            `node', moving them there if they already exist.
+//                            Only whole pages are bound. This is just a hint,
+//                            so failing is fine.
 
-    if(new_size <= min_cap)
-        return make_snapshot(p);
+#if defined(__linux__)
 
-    char* new_buf = malloc(new_size + elem_size);
-    p->end = copy_pipe_into_new_buf(make_snapshot(p), new_buf);
+#include <sys/syscall.h>
+#include <unistd.h>
 
-    p->begin  =
-    p->buffer = (free(p->buffer), new_buf);
+#endif
 
-    p->bufend = new_buf + new_size + elem_size;
+#if defined(__linux__) && defined(SYS_mbind)
 
-    check_invariants(p);
+// From <numaif.h>, which needs libnuma.
+#define MPOL_BIND    2
+#define MPOL_MF_MOVE (1 << 1)
 
-    return make_snapshot(p);
-}
+// The biggest node number we can bind to.
+#define NUMA_MAX_NODES 1024
 
-static inline snapshot_t validate_size(pipe_t* p,
-                                       snapshot_t s,
-                                       size_t new_bytes)
+static void numa_bind(void* buf, size_t size, unsigned node)
 {
-    size_t elem_size    = __pipe_elem_size(p),
-           cap          = capacity(s),
-           bytes_needed = bytes_in_use(s) + new_bytes;
+    static const size_t bits = 8 * sizeof(unsigned long);
 
-    if(unlikely(bytes_needed > cap))
-    {
-        // upgrade our lock, then re-check. By taking both locks (end and begin)
-        // in order, we have an equivalent operation to lock_pipe().
-        { mutex_lock(&p->begin_lock);
+    long page = sysconf(_SC_PAGESIZE);
 
-            s            = make_snapshot(p);
-            bytes_needed = bytes_in_use(s) + new_bytes;
-            size_t elems_needed = bytes_needed / elem_size;
+    if(page <= 0 || node >= NUMA_MAX_NODES)
+        return;
 
-            if(likely(bytes_needed > cap))
-                s = resize_buffer(p, next_pow2(elems_needed+1)*elem_size);
-        }
+    uintptr_t mask_lo = ~((uintptr_t)page - 1),
+              lo      = ((uintptr_t)buf + (uintptr_t)page - 1) & mask_lo,
+              hi      = ((uintptr_t)buf + size) & mask_lo;
 
-        // Unlock the pipe if requested.
-        mutex_unlock(&p->begin_lock);
-    }
+    if(hi <= lo)
+        return;
 
-    return s;
+    unsigned long nodes[NUMA_MAX_NODES / (8 * sizeof(unsigned long))] = { 0 };
+    nodes[node / bits] = 1UL << (node % bits);
+
+    // The kernel reads one less bit than we tell it to. It's always been that
+    // way.
+    syscall(SYS_mbind, (void*)lo, (unsigned long)(hi - lo), MPOL_BIND,
+            nodes, (unsigned long)NUMA_MAX_NODES + 1, MPOL_MF_MOVE);
 }
 
-// Runs the actual push, assuming there is enough room in the buffer.
+#else // linux
+
+static void numa_bind(void* b, size_t n, unsigned node)
+{
+    (void)b; (void)n; (void)node;
+}
+
+#endif // linux
+
+// End NUMA placement.
+
+// Notification descriptors. These are what pipe_readable_fd and
+// pipe_writable_fd hand out: something a reactor can wait on, which we can
+// switch on and off from anywhere.
+//
+//   notify_new(n)   -> creates `n' switched off. Returns false on failure.
+//   notify_set(n)   -> switches it on (wakes up whoever is waiting on it).
+//   notify_clear(n) -> switches it off.
+//   notify_fd(n)    -> what to give to the user.
+//   notify_free(n)
+
+#if defined(_WIN32) || defined(_WIN64)
+
+typedef HANDLE notify_t;
+
+static bool notify_new(notify_t* n)
+{
+    // Manual-reset, so it stays signaled until we say otherwise.
+    *n = CreateEvent(NULL, true, false, NULL);
+    return *n != NULL;
+}
+
+static void      notify_set(notify_t* n)   { SetEvent(*n);    }
+static void      notify_clear(notify_t* n) { ResetEvent(*n);  }
+static pipe_fd_t notify_fd(notify_t* n)    { return *n;       }
+static void      notify_free(notify_t* n)  { CloseHandle(*n); }
+
+#else // windows
+
+#include <fcntl.h>
+#include <unistd.h>
+
+typedef struct {
+    int rd, wr; // The same descriptor, if we have eventfd.
+} notify_t;
+
+#if defined(__linux__)
+
+#include <sys/eventfd.h>
+
+static bool notify_new(notify_t* n)
+{
+    n->rd = n->wr = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return n->rd >= 0;
+}
+
+static void notify_set(notify_t* n)
+{
+    uint64_t one = 1;
+    ssize_t  ret = write(n->wr, &one, sizeof one);
+    (void)ret; // It can only fail if the counter's about to overflow.
+}
+
+static void notify_clear(notify_t* n)
+{
+    // Not a semaphore, so this resets the whole counter.
+    uint64_t value;
+    ssize_t  ret = read(n->rd, &value, sizeof value);
+    (void)ret; // It fails with EAGAIN if it was already clear.
+}
+
+static void notify_free(notify_t* n)
+{
+    close(n->rd);
+}
+
+#else // linux
+
+// Good old-fashioned self-pipe.
+static bool notify_new(notify_t* n)
+{
+    int fds[2];
+
+    if(pipe(fds) != 0)
+        return false;
+
+    for(int i = 0; i < 2; ++i)
+    {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    n->rd = fds[0];
+    n->wr = fds[1];
+
+    return true;
+}
+
+static void notify_set(notify_t* n)
+{
+    char    c   = 0;
+    ssize_t ret = write(n->wr, &c, 1);
+    (void)ret; // If the pipe is full, it's definitely readable already.
+}
+
+static void notify_clear(notify_t* n)
+{
+    char buf[64];
+    while(read(n->rd, buf, sizeof buf) > 0)
+        ;
+}
+
+static void notify_free(notify_t* n)
+{
+    close(n->rd);
+    close(n->wr);
+}
+
+#endif // linux
+
+static pipe_fd_t notify_fd(notify_t* n) { return n->rd; }
+
+#endif // windows
+
+// End notification descriptors.
+
+/*
+ * Pipe implementation overview
+ * =================================
+ *
+ * A pipe is implemented as a circular buffer. There are two special cases for
+ * this structure: nowrap and wrap.
+ *
+ * Nowrap:
+ *
+ *     buffer          begin               end                 bufend
+ *       [               >==================>                    ]
+ *
+ * In this case, the data storage is contiguous, allowing easy access. This is
+ * the simplest case.
+ *
+ * Wrap:
+ *
+ *     buffer        end                 begin                 bufend
+ *       [============>                    >=====================]
+ *
+ * In this case, the data storage is split up, wrapping around to the beginning
+ * of the buffer when it hits bufend. Hackery must be done in this case to
+ * ensure the structure is maintained and data can be easily copied in/out.
+ *
+ * Data is 'push'ed after the end pointer and 'pop'ed from the begin pointer.
+ * There is always one sentinel element in the pipe, to distinguish between an
+ * empty pipe and a full pipe.
+ *
+ * Invariants:
+ *
+ * The invariants of a pipe are documented in the check_invariants function,
+ * and double-checked frequently in debug builds. This helps restore sanity when
+ * making modifications, but may slow down calls. It's best to disable the
+ * checks in release builds.
+ *
+ * Thread-safety:
+ *
+ * pipe_t has been designed with high threading workloads foremost in my mind.
+ * Its initial purpose was to serve as a task queue, with multiple threads
+ * feeding data in (from disk, network, etc) and multiple threads reading it
+ * and processing it in parallel. This created the need for a fully re-entrant,
+ * lightweight, accommodating data structure.
+ *
+ * We have two locks guarding the pipe, instead of the naive solution of having
+ * one. One guards writes to the begin pointer, the other guards writes to the
+ * end pointer. This is due to the realization that when pushing, you don't need
+ * an up-to-date value for begin, and when popping you don't need an up-to-date
+ * value for end (since either can only move forward in the buffer). As long as
+ * neither moves backwards, there will be no conflicts when they move
+ * independently of each other. This optimization has improved benchmarks by
+ * 15-20%.
+ *
+ * Complexity:
+ *
+ * Pushing and popping must run in O(n) where n is the number of elements being
+ * inserted/removed. It must also run in O(1) with respect to the number of
+ * elements in the pipe.
+ *
+ * Engines:
+ *
+ * Everything above describes the default engine. Pipes created with
+ * pipe_new_spsc use the same circular buffer, but promise that only one thread
+ * will ever be pushing and only one will ever be popping. The producer then
+ * owns `end', the consumer owns `begin', and each side publishes its pointer
+ * with a release store that the other side reads with an acquire load. Nobody
+ * takes a lock unless it has to go to sleep: a side that finds the buffer
+ * full (or empty) raises its `*_waiting' flag and waits on the usual condition
+ * variable under its usual lock, and the other side only bothers to signal it
+ * when it sees that flag. Since the buffer can't be resized without both
+ * sides' cooperation, SPSC pipes have a fixed capacity.
+ *
+ * Pipes created with pipe_new_mpmc don't use the circular buffer described
+ * above at all. They're a bounded array of slots, each tagged with a sequence
+ * number, as described at:
+ *   http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+ * A producer claims the slots at `enqueue_pos' with a single CAS, copies its
+ * elements in, then bumps each slot's sequence number to hand it over to the
+ * consumers. Consumers do the same thing from `dequeue_pos'. The sequence
+ * numbers alone tell each side whether a slot is ready for it, so neither side
+ * ever needs to look at the other's position. Sleeping works just like in the
+ * SPSC engine.
+ *
+ * Segmented pipes don't have a single buffer either. Their elements live in a
+ * singly linked chain of segments, each with room for the same whole number of
+ * elements (`seg_bytes'). Producers write into the last one (`tails[0]') under
+ * end_lock, and link on a new segment once it's full. Consumers read from the
+ * first one (`heads[0]') under begin_lock, and move on to the next once they've
+ * finished it, handing the old one to a small free list (`spares', guarded by
+ * spare_lock, which nests inside either side's lock). Each side counts the
+ * bytes it has ever moved, and publishes that count with a release store, so
+ * the other side can tell how full the pipe is without its lock. Since the
+ * count is only bumped after any new segment has been linked on, a consumer
+ * which sees there are elements past the end of its segment can always follow
+ * `next' to them. Neither side ever needs both locks, and nothing is copied
+ * when the pipe grows or shrinks.
+ *
+ * With more than one lane (see pipe_push_lane), each lane is a chain of its
+ * own, with its own `tails[i]' and `heads[i]'. Producers bump the lane's count
+ * before the pipe's total, so consumers who see the total go up can always
+ * find the elements in one of the lanes. segmented_pick decides which.
+ *
+ * Segmented pipes can also spill to a file (see spill_dir in pipe_options_t).
+ * Once there are more than `spill_after' bytes in the pipe, new segments come
+ * from the file instead of the allocator: a little header from malloc, whose
+ * `data' points into a mapping of the file. Producers push each one out to
+ * disk as soon as they've moved on from it, and consumers page it back in
+ * when they get to it, so the chain stays in order but only the segments at
+ * either end of it take up memory. Finished spilled segments give their disk
+ * space back, and wait on `spill_spares' to be reused before the file grows.
+ *
+ * Shared pipes (see pipe_new_shared) can't use pointers, since every process
+ * maps them somewhere else. They keep a fixed ring of `cap' bytes in shared
+ * memory, right after a shared_t, which holds the same two-lock arrangement as
+ * the default engine's, made to work across processes. Instead of `begin' and
+ * `end', each side counts the bytes it has ever moved, and the ring is indexed
+ * by those counts modulo `cap', so there's no sentinel either. Each process
+ * has its own pipe_t, whose refcounts work as usual. The shared_t only counts
+ * whole processes: one has producers (or consumers) for as long as its pipe_t's
+ * producer_refcount (or consumer_refcount) is above 0.
+ *
+ * Broadcast pipes work the same way, but within one process. Every subscriber
+ * has its own pipe_t, and they all share a broadcast_t holding a fixed ring of
+ * `cap' bytes. Producers push into it under its push_lock, counting the bytes
+ * in `pushed'. Each subscriber keeps its own `cursor', moved by its own
+ * consumers under its own begin_lock, and sleeps on its own just_pushed, so
+ * subscribers never hold each other up. Producers find the room left from the
+ * slowest cursor on the `subs' list. With PIPE_LAG_DROP, they make room
+ * instead, by moving the laggards' cursors forward under their begin_locks,
+ * so nobody ever reads bytes that are being overwritten.
+ *
+ * Mirroring:
+ *
+ * If a pipe is created with PIPE_MIRRORED (and the platform cooperates), its
+ * buffer is mapped twice in a row, so `bufend' is immediately followed by
+ * `buffer' all over again. The layout is exactly the same as above, and the
+ * pointers still wrap at bufend, but anything which would have been split
+ * across the wrap can just be copied (or handed out) in one piece, straight off
+ * the end of the buffer. Mirrored sizes must be a multiple of the page size, so
+ * their capacity is rounded up, possibly past max_cap. The extra room just goes
+ * unused.
+ *
+ * Polling:
+ *
+ * A pipe_poller_t lets one thread sleep on many pipes at once. Every pipe keeps
+ * an intrusive list of the pollers watching it, guarded by end_lock. Whenever a
+ * producer pushes (or the last one leaves), it pokes each of them, using the
+ * same waiter-count trick as the lock-free engines so that nothing is locked
+ * unless a poller is actually asleep. The poller itself just checks each of its
+ * pipes in turn, and goes to sleep if none of them are ready. Since pokes come
+ * from under end_lock, and pollers check pipes under begin_lock, the lock order
+ * is end_lock, then the poller's lock, then begin_lock.
+ *
+ * Notification descriptors:
+ *
+ * pipe_readable_fd and pipe_writable_fd lazily create a descriptor for either
+ * side of the pipe, which we keep signaled exactly when a pop (or push) would
+ * return right away. Whoever might have changed that (a push for the readable
+ * one, a pop for the writable one, or the last handle on the other side
+ * leaving) re-checks the pipe under notify_lock and flips the descriptor to
+ * match. That costs a syscall and a couple of locks, so both sides skip it when
+ * they can tell it's unnecessary: a push can only ever make the pipe more
+ * readable, so if the readable descriptor is already set, there's nothing to
+ * do. A pop can only make it less readable if it emptied the pipe (as far as
+ * it could tell). When flipping a descriptor off, we re-check the pipe one more
+ * time after clearing it, with a fence in between, so that racing with a push
+ * that skipped its own check can't leave it off. notify_lock comes before
+ * end_lock (and therefore begin_lock), and isn't held by anything else.
+ *
+ * Wakers:
+ *
+ * Each side keeps a list of pipe_waker_t's, guarded by notify_lock. Whoever
+ * calls a notifier's refresh (or would, if it had one) also takes the whole
+ * list for that side, if there is one, and calls everything on it once
+ * notify_lock is dropped. Registering a waker puts it on the list first, and
+ * only then checks whether the pipe is already ready, with a fence in between,
+ * so either we see their change, or they see our waker. If it turns out to be
+ * ready, it comes straight back off, all under notify_lock, so nobody else can
+ * have taken it yet. Cancelling one takes it off under notify_lock too, so it
+ * either comes off before anyone takes the list, or it's theirs to call.
+ *
+ * Waiting:
+ *
+ * By default, a thread that has to wait (for room, for elements, or for a
+ * lock) goes straight to sleep. A pipe's wait policy can instead have it spin
+ * for a while first: the lock-free engines spin on the pipe's state without
+ * taking any locks at all, and fall back on their usual sleeping protocol if
+ * that runs out. The default engine has to check its state under a lock, so it
+ * drops the lock between laps to let the other side in. Adaptive waiters keep a
+ * per-pipe spin budget, which grows when waits turn out to be short (spinning a
+ * little longer would have avoided a sleep) and shrinks when they're long (the
+ * spinning was wasted). Pure spinning and yielding never sleep, so they have to
+ * notice the other side leaving by themselves, which is why the refcounts are
+ * always written with release stores.
+ *
+ * Wakeups:
+ *
+ * Every engine puts threads to sleep the same way (see announce_waiter):
+ * sleepers count themselves in `*_waiting' before taking one last look at the
+ * pipe, and the other side only bothers with their lock and condition variable
+ * when that count isn't 0. A push of n elements then wakes at most n consumers,
+ * and a pop of n elements at most n producers, since any more would just find
+ * nothing to do and go back to sleep. Pipes are only deallocated once every
+ * handle is completely done with them (see `handles'), so a *_free can safely
+ * keep waking up the other side after it's dropped its refcount.
+ *
+ * Efficiency:
+ *
+ * Asserts are used liberally, and many of them, when inlined, can be turned
+ * into no-ops. Therefore, it is recommended that you compile with -O1 in
+ * debug builds as the pipe can easily become a bottleneck.
+ */
+typedef struct poll_watch_t poll_watch_t;
+
+// One of a pipe's notification descriptors. See "Notification descriptors".
+typedef struct {
+    notify_t n;
+    int      active, // Whether `n' has been created yet.
+             set;    // Whether `n' is currently signaled.
+} notifier_t;
+
+// Which set of algorithms a pipe uses. See "Engines" above.
+typedef enum {
+    ENGINE_LOCKED = PIPE_ENGINE_LOCKED, // the default two-lock engine.
+    ENGINE_SPSC   = PIPE_ENGINE_SPSC,   // single-producer single-consumer.
+    ENGINE_MPMC   = PIPE_ENGINE_MPMC,   // multi-producer multi-consumer.
+    ENGINE_SEGMENTED = PIPE_ENGINE_SEGMENTED, // a chain of segments.
+    ENGINE_BROADCAST = PIPE_ENGINE_BROADCAST, // a ring every subscriber reads.
+    ENGINE_SHARED,                       // a ring in shared memory.
+} engine_t;
+
+// Fields written by different threads are kept at least this far apart, so
+// that a producer writing `end' doesn't keep stealing the cache line a consumer
+// is writing `begin' into. Most hardware has 64-byte lines, but modern x86
+// chips also prefetch lines in pairs, so we play it safe. Building with
+// PIPE_NO_CACHE_ISOLATION packs everything back together (and turns off the
+// SPSC engine's cached indices), which is only useful for benchmarking.
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 128
+#endif
+
+#ifdef PIPE_NO_CACHE_ISOLATION
+#define CACHE_PAD(name)
+#define CACHED_INDICES 0
+#else
+#define CACHE_PAD(name) char name[CACHE_LINE_SIZE];
+#define CACHED_INDICES 1
+#endif
+
+// A link in a segmented pipe's chain. See "Engines" above.
+typedef struct segment_t   segment_t;
+typedef struct shared_t    shared_t;
+typedef struct broadcast_t broadcast_t;
+
+// A piece of a segmented pipe's spill file, mapped in. See spill_take.
+typedef struct spill_extent_t spill_extent_t;
+
+// Where one side of a segmented pipe is in one of its lanes.
+typedef struct {
+    segment_t* seg;   // The segment this side is in.
+    size_t     used,  // How far into it this side has got.
+               bytes; // How many bytes this side has ever moved through it.
+} lane_t;
+
+// Shared pipes start with this, so that pipe_open_shared has some idea of what
+// it's opening. Pipe names can be no longer than this, including the NUL.
+#define SHARED_MAGIC    0x706970652d73686dULL
+#define SHARED_NAME_MAX 256
+
+// What one side of a pipe counts when built with PIPE_STATS. See pipe_stats_t.
+// Each side keeps its own, next to the rest of its fields, so that counting
+// doesn't drag the other side's cache lines around. Everything is updated with
+// relaxed atomic adds, since the lock-free engines have no lock to count under,
+// and pipe_get_stats reads it all without one.
+#ifdef PIPE_STATS
+typedef struct {
+    unsigned long long calls,  // Pushes (or pops) that moved anything.
+                       elems;  // How many elements they moved.
+    pipe_wait_stats_t  sleeps, // Time spent parked on the other side.
+                       lock;   // Time spent waiting for our own side's lock.
+} side_stats_t;
+#endif
+
+struct pipe_t {
+    // Everything up to the first pad is read by both sides on every push and
+    // pop, but almost never written.
+
+    engine_t engine;   // Read-only after pipe creation.
+
+    // Whether this is a PIPE_MESSAGES pipe. Read-only after pipe creation.
+    bool     messages;
+
+    // Only used by the shared engine. Everything the pipe's processes share,
+    // mapped into ours. Read-only after pipe creation.
+    shared_t* shm;
+    size_t    shm_size;
+
+    // Only used by the broadcast engine. The ring this subscriber reads, along
+    // with everyone else. Read-only after pipe creation.
+    broadcast_t* bcast;
+
+    // How threads wait on this pipe. See "Waiting" above. Read-only after pipe
+    // creation.
+    pipe_wait_t wait;
+    unsigned    spin_limit;
+
+    size_t elem_size,  // The size of each element. This is read-only and
+                       // therefore does not need to be locked to read.
+           min_cap,    // The smallest sane capacity before the buffer refuses
+                       // to shrink because it would just end up growing again.
+                       // To modify this variable, you must lock the whole pipe.
+           max_cap;    // The maximum capacity of the pipe before push requests
+                       // are blocked. To read or write to this variable, you
+                       // must hold 'end_lock'.
+
+    char*  buffer,     // The internal buffer, holding the enqueued elements.
+                       // to modify this variable, you must lock the whole pipe.
+        *  bufend;     // One past the end of the buffer, so that the actual
+                       // elements are stored in in interval [buffer, bufend).
+
+    size_t granule;    // If the buffer is mirrored, its size is a multiple of
+                       // this. Otherwise, it's 0. To modify this variable, you
+                       // must lock the whole pipe.
+
+    // Only used by the MPMC engine. `buffer' holds `slot_mask + 1' elements,
+    // and slot_seq holds the same number of sequence numbers.
+    size_t* slot_seq,
+            slot_mask;
+
+    // Only used by the segmented engine. The number of bytes of elements each
+    // segment holds. Read-only after pipe creation.
+    size_t seg_bytes;
+
+    // Only used by the segmented engine. How many lanes it has (at least 1),
+    // and how many bytes each lane gets to pop per round, or all 0s if the
+    // highest lane always goes first. See segmented_pick. Read-only after pipe
+    // creation.
+    unsigned lanes;
+    size_t   quantum[PIPE_MAX_LANES];
+
+    // Only used by segmented pipes with a spill file (see spill_dir in
+    // pipe_options_t). Read-only after pipe creation.
+    bool   spill;
+    int    spill_fd;
+    size_t spill_after, // In bytes.
+           spill_slot;  // How much of the file each segment takes up.
+
+    // Where `buffer' (and slot_seq, and segments) come from. Never NULL.
+    // Read-only after pipe creation.
+    const pipe_allocator_t* allocator;
+
+    // Whether to bind everything we allocate to `numa_node'. Read-only after
+    // pipe creation.
+    bool     bind_numa;
+    unsigned numa_node;
+
+    // How the buffer is resized. See pipe_resize_t. Read-only after pipe
+    // creation.
+    pipe_resize_t resize;
+    unsigned      shrink_window;
+
+    // The number of producers/consumers in the pipe. Spinning waiters read
+    // them without the lock, so they're written with release stores.
+    size_t producer_refcount, // Guarded by begin_lock.
+           consumer_refcount; // Guarded by end_lock.
+
+    // The number of threads on each side that are about to sleep, so the
+    // other side knows whether it has to take the lock and signal, and how
+    // many of them are worth signaling. See announce_waiter.
+    int    producers_waiting, // Written under end_lock.
+           consumers_waiting; // Written under begin_lock.
+
+    // The pollers watching this pipe. Guarded by end_lock, but the lock-free
+    // engines peek at it without locking to see if they have anyone to poke.
+    poll_watch_t* watches;
+
+    // Guards all the notifiers' fields, but `active' and `set' are also peeked
+    // at without it.
+    mutex_t    notify_lock;
+    notifier_t readable, // Set when a pop wouldn't block.
+               writable; // Set when a push wouldn't block.
+
+    // The wakers waiting on either side. See "Wakers" above. Guarded by
+    // notify_lock, but peeked at without it, like `watches'.
+    pipe_waker_t* readers,
+                * writers;
+
+    CACHE_PAD(producer_pad)
+
+    // The producers' side.
+
+    char*  end;        // Always points past the right-most element in the pipe.
+                       // To modify this variable, you must lock end_lock.
+
+    // Only used by the SPSC engine, and owned by the producer: the last value
+    // of `begin' it saw. Since begin only ever moves forwards, this can only
+    // make the pipe look fuller than it is, so the producer only bothers to
+    // look at the real thing (and the consumer's cache line) when it looks
+    // like there isn't enough room.
+    char*  cached_begin;
+
+    // Only used by the MPMC engine. The next slot a producer will claim.
+    size_t enqueue_pos;
+
+    // Only used by the segmented engine, and guarded by end_lock. Where the
+    // producers are in each lane, and how many bytes have ever been pushed
+    // into any of them. The byte counts are read by consumers without the
+    // lock, so they're written with release stores.
+    lane_t tails[PIPE_MAX_LANES];
+    size_t pushed_bytes;
+
+    // Only used when spilling, and guarded by end_lock. Every piece of the
+    // spill file we've mapped so far, how much of the newest one hasn't been
+    // handed out yet, and where that starts, in memory and in the file.
+    spill_extent_t* extents;
+    size_t          spill_left;
+    char*           spill_next;
+    long long       spill_off;
+
+    // Our lovely mutexes. To lock the pipe, call lock_pipe. Depending on what
+    // you modify, you may be able to get away with only locking one of them.
+    mutex_t end_lock;
+    cond_t  just_popped; // Signaled immediately after a pop.
+
+    // The number of bytes handed out by pipe_push_reserve, but not committed
+    // yet. Guarded by end_lock, which the reserving producer holds until it
+    // commits. In SPSC pipes, the producer owns it.
+    size_t reserved;
+
+#ifdef PIPE_STATS
+    side_stats_t       push_stats;
+    unsigned long long high_water; // In elements.
+#endif
+
+    CACHE_PAD(consumer_pad)
+
+    // The consumers' side. Everything here is the same as on the producers',
+    // but the other way around.
+
+    char*  begin;      // Always points to the sentinel element. `begin + elem_size`
+                       // points to the left-most element in the pipe.
+                       // To modify this variable, you must lock begin_lock.
+
+    char*  cached_end;
+    size_t dequeue_pos;
+
+    lane_t heads[PIPE_MAX_LANES];
+    size_t popped_bytes;
+
+    // Only used by segmented pipes with a quantum. How many bytes each lane
+    // has left to pop this round. Guarded by begin_lock.
+    size_t credit[PIPE_MAX_LANES];
+
+    // Only used by the broadcast engine, and guarded by begin_lock. How many
+    // bytes this subscriber has read (or skipped), and how many elements it's
+    // skipped. Producers read `cursor' without the lock, so it's written with
+    // release stores. The next subscriber is guarded by bcast->sub_lock.
+    unsigned long long cursor,
+                       dropped;
+    pipe_t*            next_sub;
+
+    mutex_t begin_lock;
+    cond_t  just_pushed; // Signaled immediately after a push.
+
+    // The same thing as `reserved' for pipe_pop_acquire, guarded by
+    // begin_lock. In SPSC pipes, the consumer owns it. Segmented pipes also
+    // remember which lane it came from.
+    size_t   acquired;
+    unsigned acquired_lane;
+
+    // Where pipe_pop_msg_acquire copies messages which wrap around the end of
+    // the buffer, and how big it is. Guarded by begin_lock.
+    char*  msg_scratch;
+    size_t msg_scratch_size;
+
+    // How many pops in a row have found the buffer under a quarter full. Only
+    // used by PIPE_RESIZE_HYSTERESIS. Guarded by begin_lock.
+    unsigned quiet_pops;
+
+#ifdef PIPE_STATS
+    side_stats_t pop_stats;
+#endif
+
+    CACHE_PAD(shared_pad)
+
+    // Things everyone writes, but rarely.
+
+    // The sum of the two refcounts, counted separately (and atomically) so it
+    // can be dropped as the very last thing a *_free does. Whoever drops it to
+    // 0 deallocates the pipe. That way, nobody frees the pipe while someone
+    // else is still waking up its waiters.
+    size_t handles;
+
+    // Only used by adaptive waiters, who all update it without any locking.
+    // Losing an update now and then just makes the next guess a little worse.
+    unsigned spin_budget;
+
+    // Only used by the segmented engine. Finished segments waiting to be
+    // reused, linked through their `next'.
+    mutex_t    spare_lock;
+    segment_t* spares;
+    size_t     spare_count;
+
+    // The same, for segments in the spill file. There's no limit on these,
+    // since their elements don't take up any memory.
+    segment_t* spill_spares;
+
+#ifdef PIPE_STATS
+    // Resizes happen with the whole pipe locked (or, for segmented pipes,
+    // end_lock), so this is rarely written.
+    unsigned long long resizes,
+                       spills;
+#endif
+};
+
+// Everything a shared pipe keeps in shared memory. See "Engines" below. Each
+// process has its own pipe_t pointing at it, which only the process's own
+// threads use. The elements follow the header, in a ring of `cap' bytes.
+struct shared_t {
+    uint64_t magic;     // SHARED_MAGIC once the rest is set up. Written with a
+                        // release store by the creator.
+
+    size_t   elem_size, // These three are read-only after creation.
+             cap,
+             size;      // The size of the whole mapping.
+
+    // How many processes have it mapped. Only changed with atomics. Whoever
+    // drops it to 0 removes the name.
+    size_t   attached;
+    char     name[SHARED_NAME_MAX];
+
+    CACHE_PAD(producer_pad)
+
+    // The producers' side, like a pipe_t's. `pushed' is how many bytes have
+    // ever been pushed, and is written under push_lock with release stores.
+    // `consumers' counts the processes that still have consumers.
+    mutex_t            push_lock;
+    cond_t             just_popped;
+    unsigned long long pushed;
+    size_t             consumers;
+    int                producers_waiting;
+
+    CACHE_PAD(consumer_pad)
+
+    // And the consumers'.
+    mutex_t            pop_lock;
+    cond_t             just_pushed;
+    unsigned long long popped;
+    size_t             producers;
+    int                consumers_waiting;
+
+    CACHE_PAD(data_pad)
+};
+
+// Everything a broadcast pipe's subscribers share. See "Engines" above.
+struct broadcast_t {
+    size_t      elem_size, // Everything up to the pad is read-only.
+                cap;       // In bytes.
+    char*       ring;
+    pipe_lag_t  lag;
+
+    const pipe_allocator_t* allocator;
+
+    // How many pipe_t's point here. Only changed with atomics. Whoever drops
+    // it to 0 frees it.
+    size_t      members;
+
+    CACHE_PAD(producer_pad)
+
+    // The producers' side, like a pipe_t's. `pushed' is how many bytes have
+    // ever been pushed, and is written under push_lock with release stores.
+    mutex_t            push_lock;
+    cond_t             just_popped;
+    unsigned long long pushed;
+    int                producers_waiting;
+
+    CACHE_PAD(subscriber_pad)
+
+    // Everyone who's subscribed and still has consumers, linked through
+    // `next_sub', and how many subscribers still have producers. Both are
+    // guarded by sub_lock, which nests inside push_lock, but `producers' is
+    // also read without it, so it's written with release stores.
+    mutex_t  sub_lock;
+    pipe_t*  subs;
+    size_t   producers;
+};
+
+// Producers lock end_lock and sleep on just_popped, and consumers the other
+// way around. Shared and broadcast pipes have producers use the ones they
+// share instead. Tells stats and traces which side was waiting.
+static inline bool is_push_lock(pipe_t* p, mutex_t* m)
+{
+    return m == &p->end_lock
+        || (p->shm   && m == &p->shm->push_lock)
+        || (p->bcast && m == &p->bcast->push_lock);
+}
+
+static inline bool is_room_cond(pipe_t* p, cond_t* c)
+{
+    return c == &p->just_popped
+        || (p->shm   && c == &p->shm->just_popped)
+        || (p->bcast && c == &p->bcast->just_popped);
+}
+
+// Converts a pointer to either a producer or consumer into a suitable pipe_t*.
+#define PIPIFY(handle) ((pipe_t*)(handle))
+
+// We wrap elem_size in a function so we can annotate it with PURE, allowing
+// the compiler's CSE to eliminate extraneous memory accesses.
+static inline PURE size_t __pipe_elem_size(pipe_t* p)
+{
+    return p->elem_size;
+}
+
+size_t pipe_elem_size(pipe_generic_t* p)
+{
+    return __pipe_elem_size(PIPIFY(p));
+}
+
+// Statistics. See pipe_get_stats. Without PIPE_STATS, all of these are empty,
+// and the compiler throws them away along with their arguments, so an
+// unmeasured pipe doesn't pay for any of it.
+#ifdef PIPE_STATS
+
+static inline void stats_max(unsigned long long* at, unsigned long long v)
+{
+    unsigned long long seen = atomic_load_relaxed(at);
+
+    while(seen < v && !atomic_cas(at, &seen, v))
+        ;
+}
+
+static void stats_wait(pipe_wait_stats_t* w, unsigned long long ns)
+{
+    unsigned bucket = 0;
+
+    while(bucket < PIPE_STATS_BUCKETS - 1 && ns >> (bucket + 1))
+        ++bucket;
+
+    atomic_add_relaxed(&w->count, 1);
+    atomic_add_relaxed(&w->total_ns, ns);
+    atomic_add_relaxed(&w->histogram[bucket], 1);
+    stats_max(&w->max_ns, ns);
+}
+
+// When a wait started, for stats_slept and stats_locked.
+#define stats_clock() now_ns()
+
+// The producers track the high water mark, since only a push can raise it.
+static inline void stats_pushed(pipe_t* p, size_t elems)
+{
+    atomic_add_relaxed(&p->push_stats.calls, 1);
+
+    unsigned long long pushed = atomic_add_relaxed(&p->push_stats.elems, elems),
+                       popped = atomic_load_relaxed(&p->pop_stats.elems);
+
+    if(likely(pushed > popped))
+        stats_max(&p->high_water, pushed - popped);
+}
+
+static inline void stats_popped(pipe_t* p, size_t elems)
+{
+    atomic_add_relaxed(&p->pop_stats.calls, 1);
+    atomic_add_relaxed(&p->pop_stats.elems, elems);
+}
+
+static inline void stats_resized(pipe_t* p)
+{
+    atomic_add_relaxed(&p->resizes, 1);
+}
+
+static inline void stats_spilled(pipe_t* p)
+{
+    atomic_add_relaxed(&p->spills, 1);
+}
+
+// Producers sleep on just_popped, and consumers on just_pushed.
+static inline void stats_slept(pipe_t* p, cond_t* cond,
+                               unsigned long long since)
+{
+    stats_wait(is_room_cond(p, cond) ? &p->push_stats.sleeps
+                                     : &p->pop_stats.sleeps,
+               now_ns() - since);
+}
+
+static inline void stats_locked(pipe_t* p, mutex_t* lock,
+                                unsigned long long since)
+{
+    stats_wait(is_push_lock(p, lock) ? &p->push_stats.lock
+                                     : &p->pop_stats.lock,
+               now_ns() - since);
+}
+
+#else /* PIPE_STATS */
+
+#define stats_clock()             0ULL
+#define stats_pushed(p, elems)    ((void)(p), (void)(elems))
+#define stats_popped(p, elems)    ((void)(p), (void)(elems))
+#define stats_resized(p)          ((void)0)
+#define stats_spilled(p)          ((void)0)
+#define stats_slept(p, c, since)  ((void)(since))
+#define stats_locked(p, m, since) ((void)(since))
+
+#endif /* PIPE_STATS */
+
+// Tracing. See pipe_set_tracer. Like the statistics, this is all compiled out
+// without PIPE_TRACE. USDT probes are named after their event, so that
+// trace_event(p, PIPE_TRACE_PUSH, n) fires pipe:PIPE_TRACE_PUSH.
+#ifdef PIPE_TRACE
+
+#ifdef PIPE_USDT
+#include <sys/sdt.h>
+#define usdt_probe(p, event, count) DTRACE_PROBE2(pipe, event, (p), (count))
+#else
+#define usdt_probe(p, event, count) ((void)0)
+#endif
+
+static const pipe_tracer_t* tracer = NULL;
+
+static void call_tracer(pipe_t* p, pipe_trace_event_t event, size_t count)
+{
+    const pipe_tracer_t* t = atomic_load_acquire(&tracer);
+
+    if(likely(t == NULL))
+        return;
+
+    pipe_trace_t e = {
+        .event = event,
+        .pipe  = PIPE_GENERIC(p),
+        .count = count,
+        .time  = now_ns(),
+    };
+
+    t->trace(&e, t->ctx);
+}
+
+#define trace_event(p, event, count) do { \
+        usdt_probe(p, event, count);      \
+        call_tracer(p, event, count);     \
+    } while(0)
+
+#else /* PIPE_TRACE */
+
+#define trace_event(p, event, count) ((void)(p), (void)(count))
+
+#endif /* PIPE_TRACE */
+
+int pipe_set_tracer(const pipe_tracer_t* t)
+{
+#ifdef PIPE_TRACE
+    atomic_store_release(&tracer, t);
+    return 1;
+#else
+    (void)t;
+    return 0;
+#endif
+}
+
+void pipe_trace(pipe_generic_t* gen, pipe_trace_event_t event, size_t count)
+{
+    pipe_t* p = PIPIFY(gen);
+
+    // Each probe needs its own name, so they can't share a call.
+    switch(event)
+    {
+    case PIPE_TRACE_PUSH:        trace_event(p, PIPE_TRACE_PUSH,        count); break;
+    case PIPE_TRACE_POP:         trace_event(p, PIPE_TRACE_POP,         count); break;
+    case PIPE_TRACE_WAIT_ROOM:   trace_event(p, PIPE_TRACE_WAIT_ROOM,   count); break;
+    case PIPE_TRACE_WAIT_ELEMS:  trace_event(p, PIPE_TRACE_WAIT_ELEMS,  count); break;
+    case PIPE_TRACE_WAIT_END:    trace_event(p, PIPE_TRACE_WAIT_END,    count); break;
+    case PIPE_TRACE_STAGE_BEGIN: trace_event(p, PIPE_TRACE_STAGE_BEGIN, count); break;
+    case PIPE_TRACE_STAGE_END:   trace_event(p, PIPE_TRACE_STAGE_END,   count); break;
+    }
+
+    (void)p;
+    (void)count;
+}
+
+// Every push and pop that moved anything ends up here, once it's done.
+static inline void note_push(pipe_t* p, size_t elems)
+{
+    if(elems == 0)
+        return;
+
+    stats_pushed(p, elems);
+    trace_event(p, PIPE_TRACE_PUSH, elems);
+}
+
+static inline void note_pop(pipe_t* p, size_t elems)
+{
+    if(elems == 0)
+        return;
+
+    stats_popped(p, elems);
+    trace_event(p, PIPE_TRACE_POP, elems);
+}
+
+
+// Represents a snapshot of a pipe. We often don't need all our values
+// up-to-date (usually only one of begin or end). By passing this around, we
+// avoid constantly wrecking our cache by accessing the real pipe_t.
+typedef struct {
+    char*   buffer,
+        *   bufend,
+        *   begin,
+        *   end;
+    size_t elem_size;
+    bool   mirrored;
+} snapshot_t;
+
+// Whoever takes a snapshot only holds one of the locks (at least), so the other
+// side's pointer may be moving under us. Each side publishes its pointer with a
+// release store, which we pair with acquire loads here.
+static inline snapshot_t make_snapshot(pipe_t* p)
+{
+    return (snapshot_t) {
+        .buffer = p->buffer,
+        .bufend = p->bufend,
+        .begin  = atomic_load_acquire(&p->begin),
+        .end    = atomic_load_acquire(&p->end),
+        .elem_size = __pipe_elem_size(p),
+        .mirrored  = p->granule != 0,
+    };
+}
+
+// The initial minimum capacity of the pipe. This can be overridden dynamically
+// with pipe_reserve.
+#ifdef PIPE_DEBUG
+#define DEFAULT_MINCAP  2
+#else
+#define DEFAULT_MINCAP  32
+#endif
+
+// How many pops in a row a PIPE_RESIZE_HYSTERESIS pipe has to spend under a
+// quarter full before it shrinks, unless it was told otherwise.
+#define DEFAULT_SHRINK_WINDOW 64
+
+// Returns the maximum number of bytes the buffer can hold, excluding the
+// sentinel element.
+static inline size_t capacity(snapshot_t s)
+{
+    return s.bufend - s.buffer - s.elem_size;
+}
+
+// Does the buffer wrap around?
+//   true  -> wrap
+//   false -> nowrap
+static inline bool wraps_around(snapshot_t s)
+{
+    return unlikely(s.begin >= s.end);
+}
+
+// Returns the number of bytes currently in use in the buffer, excluding the
+// sentinel element.
+static inline size_t bytes_in_use(snapshot_t s)
+{
+    return (wraps_around(s)
+    //         v   right half   v   v     left half    v
+            ? ((s.end - s.buffer) + (s.bufend - s.begin))
+            : (s.end - s.begin))
+        // exclude the sentinel element.
+        - s.elem_size;
+}
+
+// Returns how many more bytes can be pushed without going past `max_cap', or
+// past the end of the buffer we really have, if growing it failed.
+static inline size_t room_left(snapshot_t s, size_t max_cap)
+{
+    return min(capacity(s), max_cap) - bytes_in_use(s);
+}
+
+static inline char* wrap_ptr_if_necessary(char* buffer,
+                                          char* p,
+                                          char* bufend)
+{
+    if(p >= bufend) {
+        size_t diff = p - bufend;
+        return buffer + diff;
+    } else {
+        return p;
+    }
+}
+
+static inline char* rev_wrap_ptr_if_necessary(char* buffer,
+                                              char* p,
+                                              char* bufend)
+{
+    if(p < buffer) {
+        size_t diff = buffer - p;
+        return bufend - diff;
+    } else {
+        return p;
+    }
+}
+
+// Runs a memcpy, then returns the end of the range copied.
+// Has identical functionality as mempcpy, but is portable.
+static inline void* offset_memcpy(void* restrict dest,
+                                  const void* restrict src,
+                                  size_t n)
+{
+    memcpy(dest, src, n);
+    return (char*)dest + n;
+}
+
+static size_t CONSTEXPR next_pow2(size_t n)
+{
+    // I don't see why we would even try. Maybe a stacktrace will help.
+    assertume(n != 0);
+
+    // In binary, top is equal to 10000...0:  A 1 right-padded by as many zeros
+    // as needed to fill up a size_t.
+    size_t top = (~(size_t)0 >> 1) + 1;
+
+    // If when we round up we will overflow our size_t, avoid rounding up and
+    // exit early.
+    if(unlikely(n >= top))
+        return n;
+
+    // Since we don't have to worry about overflow anymore, we can just use
+    // the algorithm documented at:
+    //   http://bits.stephan-brumme.com/roundUpToNextPowerOfTwo.html
+    // It's my favorite due to being branch-free (the loop will be unrolled),
+    // and portable. However, on x86, it will be faster to use the BSR (bit-scan
+    // reverse) instruction. Since this isn't straight C, it has been omitted,
+    // but may be best for your platform.
+    //
+    // clang 3.0 is smart enough to turn this code into a bsr. gcc 4.6 isn't. I
+    // haven't tested higher versions.
+    n--;
+
+    for(size_t shift = 1; shift < (sizeof n)*8; shift <<= 1)
+        n |= n >> shift;
+
+    n++;
+
+    return n;
+}
+
+#define in_bounds(left, x, right) ((x) >= (left) && (x) <= (right))
+
+static size_t CONSTEXPR gcd(size_t a, size_t b)
+{
+    while(b != 0)
+    {
+        size_t t = a % b;
+        a = b;
+        b = t;
+    }
+
+    return a;
+}
+
+// Mirroring elements bigger than this would make the buffer absurdly large,
+// since its size has to be a multiple of both the element size and the page
+// size.
+#define MAX_MIRROR_GRANULE (1 << 20)
+
+// Returns what a mirrored buffer of `elem_size'-byte elements must be a
+// multiple of, or 0 if we shouldn't mirror them.
+static size_t mirror_granule_for(size_t elem_size)
+{
+    size_t page = mirror_granule();
+
+    if(page == 0 || elem_size > MAX_MIRROR_GRANULE)
+        return 0;
+
+    size_t granule = page / gcd(page, elem_size) * elem_size;
+
+    return granule <= MAX_MIRROR_GRANULE ? granule : 0;
+}
+
+// Rounds the size of a buffer up to a whole number of granules. An unmirrored
+// buffer (granule == 0) can be any size.
+static inline size_t round_to_granule(size_t bytes, size_t granule)
+{
+    return granule ? (bytes + granule - 1) / granule * granule : bytes;
+}
+
+static void* default_alloc(void* ctx, size_t bytes)
+{
+    (void)ctx;
+    return malloc(bytes);
+}
+
+static void default_free(void* ctx, void* ptr, size_t bytes)
+{
+    (void)ctx; (void)bytes;
+    free(ptr);
+}
+
+// What pipes use when they aren't given an allocator.
+static const pipe_allocator_t default_allocator = {
+    .alloc = &default_alloc,
+    .free  = &default_free,
+};
+
+// Allocates a buffer of `bytes' bytes from `a', or mirrored if `*granule' is
+// nonzero. In that case, `*bytes' is rounded up to a whole number of granules
+// first. If mirroring fails, we settle for a normal buffer of the original
+// size, and set `*granule' to 0.
+static char* alloc_buffer(const pipe_allocator_t* a,
+                          size_t* bytes, size_t* granule)
+{
+    if(*granule)
+    {
+        size_t rounded = round_to_granule(*bytes, *granule);
+        char*  buf     = mirror_alloc(rounded);
+
+        if(likely(buf != NULL))
+            return *bytes = rounded, buf;
+
+        *granule = 0;
+    }
+
+    return a->alloc(a->ctx, *bytes);
+}
+
+static void free_buffer(pipe_t* p)
+{
+    if(p->buffer == NULL)
+        return;
+
+    if(p->granule)
+        mirror_free(p->buffer, p->bufend - p->buffer);
+    else
+        p->allocator->free(p->allocator->ctx,
+                           p->buffer, p->bufend - p->buffer);
+}
+
+// Puts freshly allocated pipe memory where it belongs. See PIPE_NUMA_BIND.
+static inline void place_memory(pipe_t* p, void* ptr, size_t bytes)
+{
+    if(p->bind_numa && ptr != NULL)
+        numa_bind(ptr, bytes, p->numa_node);
+}
+
+// You know all those assumptions we make about our data structure whenever we
+// use it? This function checks them, and is called liberally through the
+// codebase. It would be best to read this function over, as it also acts as
+// documentation. Code AND documentation? What is this witchcraft?
+static inline void check_invariants(pipe_t* p)
+{
+    if(p == NULL) return;
+
+    // Segmented pipes don't have a buffer at all.
+    if(p->engine == ENGINE_SEGMENTED)
+    {
+        assertume(p->lanes >= 1 && p->lanes <= PIPE_MAX_LANES);
+
+        for(unsigned i = 0; i < p->lanes; ++i)
+        {
+            assertume(p->heads[i].seg && p->tails[i].seg);
+            assertume(p->tails[i].used <= p->seg_bytes);
+            assertume(p->heads[i].used <= p->seg_bytes);
+            assertume(p->tails[i].bytes - p->heads[i].bytes
+                   <= p->pushed_bytes - p->popped_bytes);
+        }
+
+        assertume(p->pushed_bytes - p->popped_bytes <= p->max_cap);
+        return;
+    }
+
+    // p->buffer may be NULL. When it is, we must have no issued consumers.
+    // It's just a way to save memory when we've deallocated all consumers
+    // and people are still trying to push like idiots.
+    if(p->buffer == NULL)
+    {
+        assertume(p->consumer_refcount == 0);
+        return;
+    }
+
+    // The MPMC and shared engines don't have any begin or end pointers to
+    // check.
+    if(p->engine == ENGINE_MPMC || p->engine == ENGINE_SHARED)
+        return;
+    else
+    {
+        assertume(p->consumer_refcount != 0);
+    }
+
+    snapshot_t s = make_snapshot(p);
+
+    assertume(s.begin);
+    assertume(s.end);
+    assertume(s.bufend);
+
+    assertume(p->elem_size != 0);
+
+    assertume(bytes_in_use(s) <= capacity(s)
+            && "There are more elements in the buffer than its capacity.");
+
+    assertume(in_bounds(s.buffer, s.begin, s.bufend));
+    assertume(in_bounds(s.buffer, s.end, s.bufend));
+
+    if(s.begin == s.end)
+        assertume(bytes_in_use(s) == capacity(s));
+
+    if(p->granule)
+        assertume((size_t)(s.bufend - s.buffer) % p->granule == 0);
+
+    // Fixed-size engines never resize, so the sizing bounds don't apply.
+    if(p->engine != ENGINE_LOCKED)
+    {
+        if(p->granule)
+            assertume(capacity(s) >= p->max_cap);
+        else
+            assertume(capacity(s) == p->max_cap);
+
+        return;
+    }
+
+    assertume(in_bounds(DEFAULT_MINCAP*p->elem_size, p->min_cap, p->max_cap));
+
+    assertume(capacity(s) + p->elem_size >= p->min_cap);
+
+    // Mirrored buffers are rounded up, so they may overshoot max_cap.
+    if(!p->granule)
+        assertume(capacity(s) <= p->max_cap);
+}
+
+static inline void lock_pipe(pipe_t* p)
+{
+    // watch the locking order VERY carefully. end_lock must ALWAYS be locked
+    // before begin_lock when dealing with both at once.
+    mutex_lock(&p->end_lock);
+    mutex_lock(&p->begin_lock);
+    check_invariants(p);
+}
+
+static inline void unlock_pipe(pipe_t* p)
+{
+    check_invariants(p);
+    mutex_unlock(&p->begin_lock);
+    mutex_unlock(&p->end_lock);
+}
+
+// runs some code while automatically locking and unlocking the pipe. If `break'
+// is used, the pipe will be unlocked before control returns from the macro.
+#define WHILE_LOCKED(stuff) do { \
+    lock_pipe(p);                \
+    do { stuff; } while(0);      \
+    unlock_pipe(p);              \
+ } while(0)
+
+// Sets up all the locks and condition variables of a freshly filled-in pipe.
+static void init_sync(pipe_t* p)
+{
+    mutex_init(&p->begin_lock);
+    mutex_init(&p->end_lock);
+    mutex_init(&p->notify_lock);
+    mutex_init(&p->spare_lock);
+
+    cond_init(&p->just_pushed);
+    cond_init(&p->just_popped);
+}
+
+static pipe_t* locked_new(size_t elem_size, size_t original_limit,
+                          size_t granule, const pipe_allocator_t* allocator)
+{
+    pipe_t* p = malloc(sizeof *p);
+
+    // Check this before allocating the buffer, since a failed pipe can't tell
+    // free_buffer whether it was mirrored.
+    if(unlikely(p == NULL))
+        return NULL;
+
+    assert(DEFAULT_MINCAP >= 1);
+
+    size_t cap   = DEFAULT_MINCAP * elem_size,
+           bytes = cap;
+    char*  buf   = alloc_buffer(allocator, &bytes, &granule);
+
+    // Change the limit from being in "elements" to being in "bytes", and make
+    // room for the sentinel element.
+    size_t limit = (original_limit + 1) * elem_size;
+
+    if(unlikely(buf == NULL))
+        return free(p), NULL;
+
+    *p = (pipe_t) {
+        .elem_size  = elem_size,
+        .min_cap = cap,
+        // Keep max_cap a whole number of elements, so a full pipe never has
+        // room for just part of one.
+        .max_cap = original_limit
+                 ? next_pow2(max(limit, cap)) / elem_size * elem_size
+                 : ~(size_t)0,
+
+        .buffer  = buf,
+        .bufend  = buf + bytes,
+        .begin   = buf,
+        .end     = buf + elem_size,
+        .granule = granule,
+
+        .allocator = allocator,
+
+        // Since we're issuing a pipe_t, it counts as both a producer and a
+        // consumer since it can issue new instances of both. Therefore, the
+        // refcounts both start at 1; not the intuitive 0.
+        .producer_refcount = 1,
+        .consumer_refcount = 1,
+        .handles           = 2,
+    };
+
+    init_sync(p);
+
+    check_invariants(p);
+
+    return p;
+}
+
+// The capacity of an SPSC pipe created with a limit of 0. SPSC pipes can't
+// grow, so this has to be large enough to absorb reasonable bursts.
+#define DEFAULT_SPSC_CAP 4096
+
+static pipe_t* spsc_new(size_t elem_size, size_t limit, size_t granule,
+                        const pipe_allocator_t* allocator)
+{
+    if(limit == 0)
+        limit = DEFAULT_SPSC_CAP;
+
+    // Leave room for the sentinel, too.
+    if(limit >= ~(size_t)0 / elem_size)
+        return NULL;
+
+    pipe_t* p = malloc(sizeof *p);
+
+    // See locked_new.
+    if(unlikely(p == NULL))
+        return NULL;
+
+    // One extra element for the sentinel.
+    size_t cap   = limit * elem_size,
+           bytes = cap + elem_size;
+    char*  buf   = alloc_buffer(allocator, &bytes, &granule);
+
+    if(unlikely(buf == NULL))
+        return free(p), NULL;
+
+    *p = (pipe_t) {
+        .engine    = ENGINE_SPSC,
+        .elem_size = elem_size,
+        .min_cap   = cap,
+        .max_cap   = cap,
+
+        .buffer  = buf,
+        .bufend  = buf + bytes,
+        .begin   = buf,
+        .end     = buf + elem_size,
+        .granule = granule,
+
+        .cached_begin = buf,
+        .cached_end   = buf + elem_size,
+
+        .allocator = allocator,
+
+        .producer_refcount = 1,
+        .consumer_refcount = 1,
+        .handles           = 2,
+    };
+
+    init_sync(p);
+
+    check_invariants(p);
+
+    return p;
+}
+
+static pipe_t* mpmc_new(size_t elem_size, size_t limit,
+                        const pipe_allocator_t* a)
+{
+    // The slot index is just the position masked off, so the number of slots
+    // has to be a power of two.
+    size_t slots = next_pow2(limit ? limit : DEFAULT_SPSC_CAP);
+
+    // next_pow2 gives up past the top bit.
+    if((slots & (slots - 1)) != 0
+    || slots > ~(size_t)0 / elem_size
+    || slots > ~(size_t)0 / sizeof(size_t))
+        return NULL;
+
+    pipe_t* p   = malloc(sizeof *p);
+    char*   buf = a->alloc(a->ctx, slots * elem_size);
+    size_t* seq = a->alloc(a->ctx, slots * sizeof *seq);
+
+    if(unlikely(p == NULL || buf == NULL || seq == NULL))
+    {
+        if(buf) a->free(a->ctx, buf, slots * elem_size);
+        if(seq) a->free(a->ctx, seq, slots * sizeof *seq);
+        return free(p), NULL;
+    }
+
+    // Slot `i' is initially ready for the producer which claims position `i'.
+    for(size_t i = 0; i < slots; ++i)
+        seq[i] = i;
+
+    *p = (pipe_t) {
+        .engine    = ENGINE_MPMC,
+        .elem_size = elem_size,
+        .min_cap   = slots * elem_size,
+        .max_cap   = slots * elem_size,
+
+        .buffer = buf,
+        .bufend = buf + slots * elem_size,
+
+        .producer_refcount = 1,
+        .consumer_refcount = 1,
+        .handles           = 2,
+
+        .slot_seq  = seq,
+        .slot_mask = slots - 1,
+
+        .allocator = a,
+    };
+
+    init_sync(p);
+
+    return p;
+}
+
+// Defined further down, with the rest of the resizing code.
+static bool resize_buffer(pipe_t* p, size_t new_size);
+
+// The default size of a segment, in bytes. Segments always hold at least one
+// element, though.
+#define DEFAULT_SEGMENT_BYTES 65536
+
+// How many finished segments a segmented pipe keeps around for reuse, unless
+// its resize policy says to keep them all. A couple is enough to stop a pipe
+// which hovers around a segment boundary from going back to the allocator on
+// every lap.
+#define SEGMENT_SPARES 2
+
+// The default for spill_after, in bytes.
+#define DEFAULT_SPILL_BYTES (64 << 20)
+
+// How much of the spill file we map at a time. Mapping a segment at a time
+// would run into the limit on how many mappings a process can have.
+#define SPILL_EXTENT_BYTES (16 << 20)
+
+struct segment_t {
+    segment_t*  next;
+    char*       data;    // `storage', unless it's in the spill file.
+    long long   spilled; // Where `data' is in the spill file, or -1.
+    long double storage[]; // long double, so elements are as aligned as
+                           // malloc's.
+};
+
+struct spill_extent_t {
+    spill_extent_t* next;
+    char*           base;
+    size_t          size;
+};
+
+static inline char* segment_data(segment_t* s)
+{
+    return s->data;
+}
+
+static inline size_t segment_size(pipe_t* p)
+{
+    return sizeof(segment_t) + p->seg_bytes;
+}
+
+static inline bool is_spilled(segment_t* s)
+{
+    return s->spilled >= 0;
+}
+
+// Frees a whole chain of segments, starting at `s'. Spilled segments' data is
+// unmapped along with the rest of the file, in spill_free.
+static void free_segments(pipe_t* p, segment_t* s)
+{
+    while(s != NULL)
+    {
+        segment_t* next = s->next;
+
+        if(is_spilled(s))
+            free(s);
+        else
+            p->allocator->free(p->allocator->ctx, s, segment_size(p));
+
+        s = next;
+    }
+}
+
+// Makes a new segment from the allocator, or returns NULL.
+static segment_t* alloc_segment(pipe_t* p)
+{
+    segment_t* s = p->allocator->alloc(p->allocator->ctx, segment_size(p));
+
+    if(unlikely(s == NULL))
+        return NULL;
+
+    place_memory(p, s, segment_size(p));
+
+    s->data    = (char*)s->storage;
+    s->spilled = -1;
+
+    return s;
+}
+
+// Sets a segmented pipe up to spill into a new file in `dir', once it's
+// holding more than `after' elements. Returns false if we can't.
+static bool spill_init(pipe_t* p, const char* dir, size_t after)
+{
+    size_t granule = spill_granule();
+
+    if(granule == 0 || (p->spill_fd = spill_open(dir)) < 0)
+        return false;
+
+    p->spill       = true;
+    p->spill_after = after ? after * p->elem_size : DEFAULT_SPILL_BYTES;
+    p->spill_slot  = (p->seg_bytes + granule - 1) / granule * granule;
+
+    return true;
+}
+
+// Unmaps the whole spill file, and closes it.
+static void spill_free(pipe_t* p)
+{
+    if(!p->spill)
+        return;
+
+    free_segments(p, p->spill_spares);
+
+    for(spill_extent_t* e = p->extents, * next; e != NULL; e = next)
+    {
+        next = e->next;
+        spill_unmap(e->base, e->size);
+        free(e);
+    }
+
+    spill_close(p->spill_fd);
+}
+
+// Takes a segment from the spill file, reusing an old one if we can. Returns
+// NULL if we can't, like when the disk is full. end_lock must be held.
+static segment_t* spill_take(pipe_t* p)
+{
+    segment_t* s;
+
+    mutex_lock(&p->spare_lock);
+        if((s = p->spill_spares) != NULL)
+            p->spill_spares = s->next;
+    mutex_unlock(&p->spare_lock);
+
+    // Its disk space was given back when it was put on the free list.
+    if(s != NULL)
+    {
+        if(likely(spill_reserve(p->spill_fd, s->spilled, p->spill_slot)))
+            return s;
+
+        mutex_lock(&p->spare_lock);
+            s->next         = p->spill_spares;
+            p->spill_spares = s;
+        mutex_unlock(&p->spare_lock);
+
+        return NULL;
+    }
+
+    if(p->spill_left == 0)
+    {
+        size_t size = max(SPILL_EXTENT_BYTES / p->spill_slot, (size_t)1)
+                    * p->spill_slot;
+
+        spill_extent_t* e = malloc(sizeof *e);
+
+        if(unlikely(e == NULL))
+            return NULL;
+
+        if(unlikely(!spill_reserve(p->spill_fd, p->spill_off, size))
+        || unlikely((e->base = spill_map(p->spill_fd, p->spill_off, size))
+                    == NULL))
+            return free(e), NULL;
+
+        e->size    = size;
+        e->next    = p->extents;
+        p->extents = e;
+
+        p->spill_next = e->base;
+        p->spill_left = size;
+    }
+
+    if(unlikely((s = malloc(sizeof *s)) == NULL))
+        return NULL;
+
+    s->data    = p->spill_next;
+    s->spilled = p->spill_off;
+
+    p->spill_next += p->spill_slot;
+    p->spill_off  += p->spill_slot;
+    p->spill_left -= p->spill_slot;
+
+    return s;
+}
+
+// Takes a segment off the free list, or allocates a new one if it's empty.
+// Pipes holding more than `spill_after' bytes take one from the spill file
+// instead, or from the allocator if the file's out of room. Returns NULL if
+// that fails too. end_lock must be held.
+static segment_t* take_segment(pipe_t* p)
+{
+    segment_t* s = NULL;
+
+    if(p->spill
+    && p->pushed_bytes - atomic_load_acquire(&p->popped_bytes)
+       >= p->spill_after
+    && (s = spill_take(p)) != NULL)
+        stats_spilled(p);
+
+    if(s == NULL)
+    {
+        mutex_lock(&p->spare_lock);
+            if((s = p->spares) != NULL)
+            {
+                p->spares = s->next;
+                p->spare_count--;
+            }
+        mutex_unlock(&p->spare_lock);
+    }
+
+    if(s == NULL)
+    {
+        s = alloc_segment(p);
+        stats_resized(p);
+    }
+
+    if(likely(s != NULL))
+        s->next = NULL;
+
+    return s;
+}
+
+// Puts a segment nobody is using any more on the free list, or frees it if we
+// already have enough spares.
+static void give_segment(pipe_t* p, segment_t* s)
+{
+    bool keep_all = p->resize == PIPE_RESIZE_FIXED
+                 || p->resize == PIPE_RESIZE_NEVER_SHRINK,
+         kept;
+
+    if(is_spilled(s))
+    {
+        spill_discard(p->spill_fd, s->data, s->spilled, p->spill_slot);
+
+        mutex_lock(&p->spare_lock);
+            s->next         = p->spill_spares;
+            p->spill_spares = s;
+        mutex_unlock(&p->spare_lock);
+
+        return;
+    }
+
+    mutex_lock(&p->spare_lock);
+        if((kept = keep_all || p->spare_count < SEGMENT_SPARES))
+        {
+            s->next   = p->spares;
+            p->spares = s;
+            p->spare_count++;
+        }
+    mutex_unlock(&p->spare_lock);
+
+    if(!kept)
+        p->allocator->free(p->allocator->ctx, s, segment_size(p));
+}
+
+static pipe_t* segmented_new(size_t elem_size, size_t limit,
+                             size_t segment_elems, unsigned lanes,
+                             const pipe_allocator_t* a)
+{
+    if(segment_elems == 0)
+        segment_elems = max(DEFAULT_SEGMENT_BYTES / elem_size, (size_t)1);
+
+    // Each segment has its header in front, too.
+    if(segment_elems > (~(size_t)0 - sizeof(segment_t)) / elem_size
+    || limit > ~(size_t)0 / elem_size)
+        return NULL;
+
+    size_t  seg_bytes = segment_elems * elem_size;
+    pipe_t* p         = malloc(sizeof *p);
+
+    if(unlikely(p == NULL))
+        return NULL;
+
+    *p = (pipe_t) {
+        .engine    = ENGINE_SEGMENTED,
+        .elem_size = elem_size,
+        .min_cap   = seg_bytes,
+        .max_cap   = limit ? limit * elem_size : ~(size_t)0,
+        .seg_bytes = seg_bytes,
+        .lanes     = lanes,
+
+        .allocator = a,
+
+        .producer_refcount = 1,
+        .consumer_refcount = 1,
+        .handles           = 2,
+    };
+
+    // Every lane starts out with a segment of its own, so neither side ever
+    // has to wonder where a lane begins.
+    for(unsigned i = 0; i < lanes; ++i)
+    {
+        segment_t* first = alloc_segment(p);
+
+        if(unlikely(first == NULL))
+        {
+            while(i-- > 0)
+                free_segments(p, p->heads[i].seg);
+
+            return free(p), NULL;
+        }
+
+        first->next = NULL;
+
+        p->tails[i].seg = first;
+        p->heads[i].seg = first;
+    }
+
+    init_sync(p);
+
+    check_invariants(p);
+
+    return p;
+}
+
+// Makes a new subscriber to `b', which waits the same way as `like' if there is
+// one.
+static pipe_t* broadcast_member(broadcast_t* b, pipe_t* like)
+{
+    pipe_t* p = malloc(sizeof *p);
+
+    if(unlikely(p == NULL))
+        return NULL;
+
+    *p = (pipe_t) {
+        .engine    = ENGINE_BROADCAST,
+        .elem_size = b->elem_size,
+        .max_cap   = b->cap,
+        .bcast     = b,
+
+        .wait        = like ? like->wait       : PIPE_WAIT_PARK,
+        .spin_limit  = like ? like->spin_limit : MUTEX_SPINS,
+        .spin_budget = min(like ? like->spin_limit : MUTEX_SPINS,
+                           INITIAL_SPIN_BUDGET),
+
+        .allocator = b->allocator,
+
+        .producer_refcount = 1,
+        .consumer_refcount = 1,
+        .handles           = 2,
+    };
+
+    init_sync(p);
+
+    atomic_add_fetch(&b->members, 1);
+
+    return p;
+}
+
+static void broadcast_free(broadcast_t* b)
+{
+    mutex_destroy(&b->push_lock);
+    mutex_destroy(&b->sub_lock);
+    cond_destroy(&b->just_popped);
+
+    b->allocator->free(b->allocator->ctx, b->ring, b->cap);
+    free(b);
+}
+
+static pipe_t* broadcast_new(size_t elem_size, size_t limit, pipe_lag_t lag,
+                             const pipe_allocator_t* a)
+{
+    if(limit == 0)
+        limit = DEFAULT_SPSC_CAP;
+
+    if(limit > ~(size_t)0 / elem_size)
+        return NULL;
+
+    broadcast_t* b    = malloc(sizeof *b);
+    char*        ring = b ? a->alloc(a->ctx, limit * elem_size) : NULL;
+
+    if(unlikely(ring == NULL))
+        return free(b), NULL;
+
+    *b = (broadcast_t) {
+        .elem_size = elem_size,
+        .cap       = limit * elem_size,
+        .ring      = ring,
+        .lag       = lag,
+        .allocator = a,
+        .producers = 1,
+    };
+
+    mutex_init(&b->push_lock);
+    mutex_init(&b->sub_lock);
+    cond_init(&b->just_popped);
+
+    pipe_t* p = broadcast_member(b, NULL);
+
+    if(unlikely(p == NULL))
+        return broadcast_free(b), NULL;
+
+    b->subs = p;
+
+    return p;
+}
+
+// Allocates everything a PIPE_RESIZE_FIXED pipe will ever need. Returns false
+// if that fails.
+static bool preallocate(pipe_t* p)
+{
+    if(p->engine == ENGINE_LOCKED)
+    {
+        // Grow to the limit, then make that the minimum so nothing ever
+        // shrinks it again.
+        if(!resize_buffer(p, p->max_cap))
+            return false;
+
+        p->min_cap = p->max_cap;
+
+        return capacity(make_snapshot(p)) >= p->max_cap;
+    }
+
+    if(p->engine == ENGINE_SEGMENTED)
+    {
+        // One for every full segment's worth of limit, plus one, since the
+        // consumers' segment may be half-finished. We already have one.
+        size_t segments = (p->max_cap + p->seg_bytes - 1) / p->seg_bytes;
+
+        for(size_t i = 0; i < segments; ++i)
+        {
+            segment_t* s = alloc_segment(p);
+
+            if(unlikely(s == NULL))
+                return false;
+
+            give_segment(p, s);
+        }
+    }
+
+    return true;
+}
+
+pipe_t* pipe_new_ex(size_t elem_size, size_t limit,
+                    const pipe_options_t* options)
+{
+    static const pipe_options_t defaults = { .engine = PIPE_ENGINE_LOCKED };
+
+    assertume(elem_size != 0);
+
+    if(elem_size == 0)
+        return NULL;
+
+    if(options == NULL)
+        options = &defaults;
+
+    bool messages = (options->flags & PIPE_MESSAGES) != 0;
+
+    // Messages are framed in bytes, and only the default engine can push a
+    // whole one at once. See pipe_push_msg.
+    if(messages && (elem_size != 1 || options->engine != PIPE_ENGINE_LOCKED))
+        return NULL;
+
+    // Only segments can be put somewhere else one at a time.
+    if(options->spill_dir && options->engine != PIPE_ENGINE_SEGMENTED)
+        return NULL;
+
+    // The same goes for having several of them on the go at once.
+    unsigned lanes = options->lanes ? options->lanes : 1;
+
+    if(lanes > PIPE_MAX_LANES
+    || (lanes > 1 && options->engine != PIPE_ENGINE_SEGMENTED))
+        return NULL;
+
+    const pipe_allocator_t* a = options->allocator ? options->allocator
+                                                   : &default_allocator;
+
+    size_t granule = (options->flags & PIPE_MIRRORED)
+                   ? mirror_granule_for(elem_size)
+                   : 0;
+
+    pipe_t* p;
+
+    switch(options->engine)
+    {
+    case PIPE_ENGINE_SPSC: p = spsc_new(elem_size, limit, granule, a); break;
+    case PIPE_ENGINE_MPMC: p = mpmc_new(elem_size, limit, a);          break;
+    case PIPE_ENGINE_SEGMENTED:
+        p = segmented_new(elem_size, limit, options->segment, lanes, a);
+        break;
+    case PIPE_ENGINE_BROADCAST:
+        p = broadcast_new(elem_size, limit, options->lag, a);
+        break;
+    default:               p = locked_new(elem_size, limit, granule, a);
+    }
+
+    if(p == NULL)
+        return NULL;
+
+    // Nobody else can see the pipe yet, so there's no need to lock.
+    p->messages    = messages;
+    p->wait        = options->wait;
+    p->spin_limit  = options->spins ? options->spins : MUTEX_SPINS;
+    p->spin_budget = min(p->spin_limit, INITIAL_SPIN_BUDGET);
+
+    p->bind_numa = (options->flags & PIPE_NUMA_BIND) != 0;
+    p->numa_node = options->numa_node;
+
+    // A weight of 0 would never get a turn, which is what not having any
+    // weights is for.
+    if(options->lane_weights)
+        for(unsigned i = 0; i < p->lanes; ++i)
+            p->quantum[i] = p->credit[i] =
+                max(options->lane_weights[i], 1u) * elem_size;
+
+    place_memory(p, p->buffer, p->bufend - p->buffer);
+    for(unsigned i = 0; i < p->lanes; ++i)
+        place_memory(p, p->heads[i].seg, segment_size(p));
+
+    if(p->slot_seq)
+        place_memory(p, p->slot_seq, (p->slot_mask + 1) * sizeof *p->slot_seq);
+
+    if(p->bcast)
+        place_memory(p, p->bcast->ring, p->bcast->cap);
+
+    p->resize        = options->resize;
+    p->shrink_window = options->shrink_window ? options->shrink_window
+                                              : DEFAULT_SHRINK_WINDOW;
+
+    if(options->spill_dir
+    && unlikely(!spill_init(p, options->spill_dir, options->spill_after)))
+        return pipe_free(p), NULL;
+
+    if(p->resize == PIPE_RESIZE_FIXED && limit == 0)
+        p->resize = PIPE_RESIZE_NEVER_SHRINK;
+    else if(p->resize == PIPE_RESIZE_FIXED && unlikely(!preallocate(p)))
+        return pipe_free(p), NULL;
+
+    // Don't count the allocations it took to make the pipe.
+#ifdef PIPE_STATS
+    memset(&p->push_stats, 0, sizeof p->push_stats);
+    memset(&p->pop_stats,  0, sizeof p->pop_stats);
+    p->high_water = 0;
+    p->resizes    = 0;
+    p->spills     = 0;
+#endif
+
+    return p;
+}
+
+pipe_t* pipe_new(size_t elem_size, size_t limit)
+{
+    return pipe_new_ex(elem_size, limit, NULL);
+}
+
+pipe_t* pipe_new_spsc(size_t elem_size, size_t limit)
+{
+    pipe_options_t options = { .engine = PIPE_ENGINE_SPSC };
+    return pipe_new_ex(elem_size, limit, &options);
+}
+
+pipe_t* pipe_new_mpmc(size_t elem_size, size_t limit)
+{
+    pipe_options_t options = { .engine = PIPE_ENGINE_MPMC };
+    return pipe_new_ex(elem_size, limit, &options);
+}
+
+// Shared pipes keep their elements this far into the mapping.
+#define SHARED_HEADER \
+    ((sizeof(shared_t) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE)
+
+static inline char* shared_ring(shared_t* s)
+{
+    return (char*)s + SHARED_HEADER;
+}
+
+// Makes this process's pipe_t for a shared pipe that's already mapped in.
+static pipe_t* shared_new(shared_t* s, size_t size)
+{
+    pipe_t* p = malloc(sizeof *p);
+
+    if(unlikely(p == NULL))
+        return NULL;
+
+    *p = (pipe_t) {
+        .engine    = ENGINE_SHARED,
+        .elem_size = s->elem_size,
+        .max_cap   = s->cap,
+        .shm       = s,
+        .shm_size  = size,
+
+        .spin_limit  = MUTEX_SPINS,
+        .spin_budget = min(MUTEX_SPINS, INITIAL_SPIN_BUDGET),
+
+        .allocator = &default_allocator,
+
+        .producer_refcount = 1,
+        .consumer_refcount = 1,
+        .handles           = 2,
+    };
+
+    init_sync(p);
+
+    return p;
+}
+
+pipe_t* pipe_new_shared(const char* name, size_t elem_size, size_t limit)
+{
+    if(elem_size == 0 || strlen(name) >= SHARED_NAME_MAX)
+        return NULL;
+
+    if(limit == 0)
+        limit = DEFAULT_SPSC_CAP;
+
+    if(limit > (~(size_t)0 - SHARED_HEADER) / elem_size)
+        return NULL;
+
+    size_t    cap  = limit * elem_size,
+              size = SHARED_HEADER + cap;
+    shared_t* s    = (shared_t*)shm_create(name, size);
+
+    if(s == NULL)
+        return NULL;
+
+    // The mapping starts out zeroed, so only the nonzero fields need filling
+    // in. Nobody can use it until the magic number shows up.
+    s->elem_size = elem_size;
+    s->cap       = cap;
+    s->size      = size;
+    s->attached  = 1;
+    s->producers = 1;
+    s->consumers = 1;
+    strcpy(s->name, name);
+
+    pipe_t* p = NULL;
+
+    if(shm_lock_init(&s->push_lock) && shm_lock_init(&s->pop_lock)
+    && shm_cond_init(&s->just_popped) && shm_cond_init(&s->just_pushed))
+        p = shared_new(s, size);
+
+    if(unlikely(p == NULL))
+    {
+        shm_remove(name);
+        shm_detach((char*)s, size);
+        return NULL;
+    }
+
+    atomic_store_release(&s->magic, SHARED_MAGIC);
+
+    return p;
+}
+
+pipe_t* pipe_open_shared(const char* name)
+{
+    size_t    size;
+    shared_t* s = (shared_t*)shm_attach(name, &size);
+
+    if(s == NULL)
+        return NULL;
+
+    bool ok = size >= SHARED_HEADER
+           && atomic_load_acquire(&s->magic) == SHARED_MAGIC
+           && s->size == size;
+
+    // Once the last process lets go, it's on its way out.
+    size_t attached = ok ? atomic_load_relaxed(&s->attached) : 0;
+
+    while(attached > 0 && !atomic_cas(&s->attached, &attached, attached + 1))
+        ;
+
+    pipe_t* p = attached > 0 ? shared_new(s, size) : NULL;
+
+    if(unlikely(p == NULL))
+    {
+        if(attached > 0 && atomic_sub_fetch(&s->attached, 1) == 0)
+            shm_remove(s->name);
+
+        shm_detach((char*)s, size);
+        return NULL;
+    }
+
+    // Our pipe_t counts as a producer and a consumer, just like the creator's.
+    mutex_lock(&s->pop_lock);
+        atomic_store_release(&s->producers, s->producers + 1);
+    mutex_unlock(&s->pop_lock);
+
+    mutex_lock(&s->push_lock);
+        atomic_store_release(&s->consumers, s->consumers + 1);
+    mutex_unlock(&s->push_lock);
+
+    return p;
+}
+
+// Tells the other processes that this one's last producer (or consumer) is
+// gone, once its pipe_t's refcount drops to 0.
+static void shared_leave(pipe_t* p, bool producers)
+{
+    shared_t* s = p->shm;
+
+    if(producers)
+    {
+        mutex_lock(&s->pop_lock);
+            atomic_store_release(&s->producers, s->producers - 1);
+            cond_broadcast(&s->just_pushed);
+        mutex_unlock(&s->pop_lock);
+    }
+    else
+    {
+        mutex_lock(&s->push_lock);
+            atomic_store_release(&s->consumers, s->consumers - 1);
+            cond_broadcast(&s->just_popped);
+        mutex_unlock(&s->push_lock);
+    }
+}
+
+pipe_t* pipe_subscribe(pipe_generic_t* handle)
+{
+    pipe_t*      like = PIPIFY(handle);
+    broadcast_t* b    = like->bcast;
+
+    if(b == NULL)
+        return NULL;
+
+    pipe_t* p = broadcast_member(b, like);
+
+    if(unlikely(p == NULL))
+        return NULL;
+
+    // Taking push_lock means nothing gets pushed between picking our cursor
+    // and getting on the list, so we can't miss anything.
+    mutex_lock(&b->push_lock);
+    mutex_lock(&b->sub_lock);
+        p->cursor   = b->pushed;
+        p->next_sub = b->subs;
+        b->subs     = p;
+
+        atomic_store_release(&b->producers, b->producers + 1);
+    mutex_unlock(&b->sub_lock);
+    mutex_unlock(&b->push_lock);
+
+    return p;
+}
+
+// Tells everyone else that this subscriber's last producer (or consumer) is
+// gone, once its pipe_t's refcount drops to 0.
+static void broadcast_leave(pipe_t* p, bool producers)
+{
+    broadcast_t* b = p->bcast;
+
+    if(producers)
+    {
+        mutex_lock(&b->sub_lock);
+            atomic_store_release(&b->producers, b->producers - 1);
+
+            // Every subscriber just ran out of producers.
+            if(b->producers == 0)
+                for(pipe_t* s = b->subs; s != NULL; s = s->next_sub)
+                {
+                    mutex_lock(&s->begin_lock);
+                        cond_broadcast(&s->just_pushed);
+                    mutex_unlock(&s->begin_lock);
+                }
+        mutex_unlock(&b->sub_lock);
+
+        return;
+    }
+
+    mutex_lock(&b->sub_lock);
+        for(pipe_t** s = &b->subs; *s != NULL; s = &(*s)->next_sub)
+            if(*s == p)
+            {
+                *s = p->next_sub;
+                break;
+            }
+    mutex_unlock(&b->sub_lock);
+
+    // We might have been the slowest one, or the last.
+    mutex_lock(&b->push_lock);
+        cond_broadcast(&b->just_popped);
+    mutex_unlock(&b->push_lock);
+}
+
+unsigned long long pipe_dropped(pipe_consumer_t* handle)
+{
+    pipe_t* p = PIPIFY(handle);
+    unsigned long long dropped;
+
+    mutex_lock(&p->begin_lock);
+        dropped = p->dropped;
+    mutex_unlock(&p->begin_lock);
+
+    return dropped;
+}
+
+// Instead of allocating a special handle, the pipe_*_new() functions just
+// return the original pipe, cast into a user-friendly form. This saves needless
+// malloc calls. Also, since we have to refcount anyways, it's free.
+pipe_producer_t* pipe_producer_new(pipe_t* p)
+{
+    atomic_add_fetch(&p->handles, 1);
+
+    mutex_lock(&p->begin_lock);
+        atomic_store_release(&p->producer_refcount, p->producer_refcount + 1);
+    mutex_unlock(&p->begin_lock);
+
+    return (pipe_producer_t*)p;
+}
+
+pipe_consumer_t* pipe_consumer_new(pipe_t* p)
+{
+    atomic_add_fetch(&p->handles, 1);
+
+    mutex_lock(&p->end_lock);
+        atomic_store_release(&p->consumer_refcount, p->consumer_refcount + 1);
+    mutex_unlock(&p->end_lock);
+
+    return (pipe_consumer_t*)p;
+}
+
+static void deallocate(pipe_t* p)
+{
+    assertume(p->producer_refcount == 0);
+    assertume(p->consumer_refcount == 0);
+    assertume(p->watches == NULL
+           && "A consumer was freed while it was still being polled.");
+
+    mutex_destroy(&p->begin_lock);
+    mutex_destroy(&p->end_lock);
+    mutex_destroy(&p->notify_lock);
+    mutex_destroy(&p->spare_lock);
+
+    cond_destroy(&p->just_pushed);
+    cond_destroy(&p->just_popped);
+
+    for(unsigned i = 0; i < p->lanes; ++i)
+        free_segments(p, p->heads[i].seg);
+
+    free_segments(p, p->spares);
+    spill_free(p);
+
+    free(p->msg_scratch);
+
+    if(p->readable.active) notify_free(&p->readable.n);
+    if(p->writable.active) notify_free(&p->writable.n);
+
+    if(p->slot_seq)
+        p->allocator->free(p->allocator->ctx, p->slot_seq,
+                           (p->slot_mask + 1) * sizeof *p->slot_seq);
+
+    free_buffer(p);
+
+    if(p->shm)
+    {
+        if(atomic_sub_fetch(&p->shm->attached, 1) == 0)
+            shm_remove(p->shm->name);
+
+        shm_detach((char*)p->shm, p->shm_size);
+    }
+
+    if(p->bcast && atomic_sub_fetch(&p->bcast->members, 1) == 0)
+        broadcast_free(p->bcast);
+
+    free(p);
+}
+
+// See "Polling" and "Notification descriptors" above. These are defined
+// further down, with the rest of the poller.
+static void notify_pollers(pipe_t* p);
+static void refresh_readable(pipe_t* p);
+static void refresh_writable(pipe_t* p);
+static void after_push(pipe_t* p, bool looks_full);
+static void after_pop(pipe_t* p, bool looks_empty);
+static void run_wakers(pipe_t* p, pipe_waker_t** list);
+
+// Drops `n' handles, deallocating the pipe if they were the last ones. This has
+// to be the last thing a *_free does, since the pipe may be gone afterwards.
+static void drop_handles(pipe_t* p, size_t n)
+{
+    if(atomic_sub_fetch(&p->handles, n) == 0)
+        deallocate(p);
+}
+
+void pipe_free(pipe_t* p)
+{
+    size_t new_producer_refcount,
+           new_consumer_refcount;
+
+    mutex_lock(&p->begin_lock);
+        assertume(p->producer_refcount > 0);
+        new_producer_refcount = p->producer_refcount - 1;
+        atomic_store_release(&p->producer_refcount, new_producer_refcount);
+    mutex_unlock(&p->begin_lock);
+
+    mutex_lock(&p->end_lock);
+        assertume(p->consumer_refcount > 0);
+        new_consumer_refcount = p->consumer_refcount - 1;
+        atomic_store_release(&p->consumer_refcount, new_consumer_refcount);
+    mutex_unlock(&p->end_lock);
+
+    if(p->shm && new_producer_refcount == 0)
+        shared_leave(p, true);
+
+    if(p->shm && new_consumer_refcount == 0)
+        shared_leave(p, false);
+
+    if(p->bcast && new_producer_refcount == 0)
+        broadcast_leave(p, true);
+
+    if(p->bcast && new_consumer_refcount == 0)
+        broadcast_leave(p, false);
+
+    if(unlikely(new_consumer_refcount == 0) && likely(new_producer_refcount > 0))
+    {
+        // An SPSC producer writes into the buffer without holding any locks,
+        // so we can't pull it out from under it. It'll be freed along with the
+        // rest of the pipe.
+        if(p->engine == ENGINE_LOCKED)
+            p->buffer = (free_buffer(p), NULL);
+
+        cond_broadcast(&p->just_popped);
+        refresh_writable(p);
+        run_wakers(p, &p->writers);
+    }
+    else if(unlikely(new_producer_refcount == 0) && likely(new_consumer_refcount > 0))
+    {
+        cond_broadcast(&p->just_pushed);
+
+        mutex_lock(&p->end_lock);
+            notify_pollers(p);
+        mutex_unlock(&p->end_lock);
+
+        refresh_readable(p);
+        run_wakers(p, &p->readers);
+    }
+
+    drop_handles(p, 2);
+}
+
+void pipe_producer_free(pipe_producer_t* handle)
+{
+    pipe_t* p = PIPIFY(handle);
+    size_t new_producer_refcount;
+
+    mutex_lock(&p->begin_lock);
+        assertume(p->producer_refcount > 0);
+        new_producer_refcount = p->producer_refcount - 1;
+        atomic_store_release(&p->producer_refcount, new_producer_refcount);
+    mutex_unlock(&p->begin_lock);
+
+    if(unlikely(new_producer_refcount == 0) && p->shm)
+        shared_leave(p, true);
+
+    if(unlikely(new_producer_refcount == 0) && p->bcast)
+        broadcast_leave(p, true);
+
+    if(unlikely(new_producer_refcount == 0))
+    {
+        bool consumers_left;
+
+        mutex_lock(&p->end_lock);
+            consumers_left = p->consumer_refcount > 0;
+
+            // Anyone polling this pipe will want to know it's done for.
+            if(likely(consumers_left))
+                notify_pollers(p);
+        mutex_unlock(&p->end_lock);
+
+        // If there are still consumers, wake them up if they're waiting on
+        // input from a producer.
+        if(likely(consumers_left))
+        {
+            cond_broadcast(&p->just_pushed);
+            refresh_readable(p);
+            run_wakers(p, &p->readers);
+        }
+    }
+
+    drop_handles(p, 1);
+}
+
+void pipe_consumer_free(pipe_consumer_t* handle)
+{
+    pipe_t* p = PIPIFY(handle);
+    size_t new_consumer_refcount;
+
+    mutex_lock(&p->end_lock);
+        assertume(p->consumer_refcount > 0);
+        new_consumer_refcount = p->consumer_refcount - 1;
+        atomic_store_release(&p->consumer_refcount, new_consumer_refcount);
+    mutex_unlock(&p->end_lock);
+
+    if(unlikely(new_consumer_refcount == 0) && p->shm)
+        shared_leave(p, false);
+
+    if(unlikely(new_consumer_refcount == 0) && p->bcast)
+        broadcast_leave(p, false);
+
+    if(unlikely(new_consumer_refcount == 0))
+    {
+        bool producers_left;
+
+        mutex_lock(&p->begin_lock);
+            producers_left = p->producer_refcount > 0;
+        mutex_unlock(&p->begin_lock);
+
+        // If there are still producers, wake them up if they're waiting on
+        // room to free up from a consumer.
+        if(likely(producers_left))
+        {
+            cond_broadcast(&p->just_popped);
+            refresh_writable(p);
+            run_wakers(p, &p->writers);
+        }
+    }
+
+    drop_handles(p, 1);
+}
+
+// Returns the end of the buffer (buf + number_of_bytes_copied).
+static inline char* copy_pipe_into_new_buf(snapshot_t s,
+                                           char* restrict buf)
+{
+    // Everything from the sentinel onwards, straight off the end if we need to.
+    if(s.mirrored)
+        return offset_memcpy(buf, s.begin, bytes_in_use(s) + s.elem_size);
+
+    if(wraps_around(s))
+    {
+        buf = offset_memcpy(buf, s.begin, s.bufend - s.begin);
+        buf = offset_memcpy(buf, s.buffer, s.end - s.buffer);
+    }
+    else
+    {
+        buf = offset_memcpy(buf, s.begin, s.end - s.begin);
+    }
+
+    return buf;
+}
+
+// Resizes the buffer to make room for at least 'new_size' elements. Returns
+// false if the allocator couldn't give us a new buffer, in which case the old
+// one is left just as it was. Take a new snapshot either way.
+//
+// The new size MUST be bigger than the number of elements currently in the
+// pipe.
+//
+// The pipe must be fully locked on entrance to this function.
+static bool resize_buffer(pipe_t* p, size_t new_size)
+{
+    check_invariants(p);
+
+    const size_t max_cap   = p->max_cap,
+                 min_cap   = p->min_cap,
+                 elem_size = __pipe_elem_size(p);
+
+    assertume(new_size >= bytes_in_use(make_snapshot(p)));
+
+    if(unlikely(new_size >= max_cap))
+        new_size = max_cap;
+
+    // Don't shrink below min_cap. This has to compare the whole buffer, since
+    // a limited pipe can be allowed to grow to exactly min_cap's capacity.
+    if(new_size + elem_size <= min_cap)
+        return true;
+
+    // Mirrored buffers only come in whole granules. Don't bother copying
+    // everything over if we'd end up with the same size anyways.
+    size_t bytes   = new_size + elem_size,
+           granule = p->granule;
+
+    if(round_to_granule(bytes, granule) == (size_t)(p->bufend - p->buffer))
+        return true;
+
+    char* new_buf = alloc_buffer(p->allocator, &bytes, &granule);
+
+    // Shrinking can fail harmlessly. Anyone growing has to make do with the
+    // room that's already there.
+    if(unlikely(new_buf == NULL))
+        return false;
+
+    place_memory(p, new_buf, bytes);
+    p->end = copy_pipe_into_new_buf(make_snapshot(p), new_buf);
+
+    stats_resized(p);
+
+    free_buffer(p);
+
+    p->begin   =
+    p->buffer  = new_buf;
+    p->bufend  = new_buf + bytes;
+    p->granule = granule;
+
+    check_invariants(p);
+
+    return true;
+}
+
+// Tries to make room for `new_bytes' more bytes, growing the buffer if that's
+// what it takes. The snapshot it returns may still have less room than that,
+// if growing failed, so never push more than room_left says there is.
+static inline snapshot_t validate_size(pipe_t* p,
+                                       snapshot_t s,
+                                       size_t new_bytes)
+{
+    size_t elem_size    = __pipe_elem_size(p),
+           cap          = capacity(s),
+           bytes_needed = bytes_in_use(s) + new_bytes;
+
+    if(unlikely(bytes_needed > cap))
+    {
+        // upgrade our lock, then re-check. By taking both locks (end and begin)
+        // in order, we have an equivalent operation to lock_pipe().
+        { mutex_lock(&p->begin_lock);
+
+            s            = make_snapshot(p);
+            bytes_needed = bytes_in_use(s) + new_bytes;
+            size_t elems_needed = bytes_needed / elem_size;
+
+            if(likely(bytes_needed > cap))
+            {
+                resize_buffer(p, next_pow2(elems_needed+1)*elem_size);
+                s = make_snapshot(p);
+            }
+        }
+
+        // Unlock the pipe if requested.
+        mutex_unlock(&p->begin_lock);
+    }
+
+    return s;
+}
+
+// Runs the actual push, assuming there is enough room in the buffer.
 //
 // Returns the new 'end' pointer.
 static inline char* process_push(snapshot_t s,
@@ -800,312 +3512,2978 @@ static inline char* process_push(snapshot_t s,
                                 size_t bytes_to_copy
                                )
 {
-    assertume(bytes_to_copy != 0);
+    assertume(bytes_to_copy != 0);
+
+    // This shouldn't be necessary.
+    //s.end = wrap_ptr_if_necessary(s.buffer, s.end, s.bufend);
+    assertume(s.end != s.bufend);
+
+    // The mirror takes care of any wrapping for us.
+    if(s.mirrored)
+    {
+        s.end = offset_memcpy(s.end, elems, bytes_to_copy);
+        return wrap_ptr_if_necessary(s.buffer, s.end, s.bufend);
+    }
+
+    // If we currently have a nowrap buffer, we may have to wrap the new
+    // elements. Copy as many as we can at the end, then start copying into the
+    // beginning. This basically reduces the problem to only deal with wrapped
+    // buffers, which can be dealt with using a single offset_memcpy.
+    if(!wraps_around(s))
+    {
+        size_t at_end = min(bytes_to_copy, (size_t)(s.bufend - s.end));
+
+        s.end = offset_memcpy(s.end, elems, at_end);
+
+        elems = (const char*)elems + at_end;
+        bytes_to_copy -= at_end;
+    }
+
+    // Now copy any remaining data...
+    if(unlikely(bytes_to_copy))
+    {
+        s.end = wrap_ptr_if_necessary(s.buffer, s.end, s.bufend);
+        s.end = offset_memcpy(s.end, elems, bytes_to_copy);
+    }
+
+    s.end = wrap_ptr_if_necessary(s.buffer, s.end, s.bufend);
+
+    // ...and update the end pointer!
+    return s.end;
+}
+
+// Nobody takes the other side's lock to signal unless someone is actually going
+// to sleep. A thread that's about to sleep announces itself while holding its
+// side's usual lock, then re-checks the pipe before calling cond_wait. The
+// other side publishes its changes to the pipe, then checks for waiters before
+// bothering to lock and signal. Both sides put a full fence between their store
+// and their load, so at least one of them is guaranteed to see the other:
+// either the waiter sees the new state and never sleeps, or the waker sees the
+// waiter and signals it. Since the waker signals under the same lock, the
+// waiter can't miss it by being between its check and its cond_wait.
+static inline void announce_waiter(int* waiting)
+{
+    atomic_store_relaxed(waiting, *waiting + 1);
+    atomic_fence();
+}
+
+static inline void retire_waiter(int* waiting)
+{
+    atomic_store_relaxed(waiting, *waiting - 1);
+}
+
+// Wakes up to `n' of the threads waiting on `cond'. We only ever have room for
+// (or elements for) `n' of them, and any more would just find nothing to do
+// and go back to sleep, so there's no point in waking them.
+static inline void wake_waiters(int* waiting,
+                                mutex_t* lock, cond_t* cond,
+                                size_t n)
+{
+    atomic_fence();
+
+    if(likely(atomic_load_relaxed(waiting) == 0))
+        return;
+
+    mutex_lock(lock);
+        // Waiters only come and go under `lock', so this is exact.
+        size_t sleepers = (size_t)atomic_load_relaxed(waiting);
+
+        if(n >= sleepers)
+            cond_broadcast(cond);
+        else
+            while(n--)
+                cond_signal(cond);
+    mutex_unlock(lock);
+}
+
+// Wait policies. See "Waiting" above. Every wait loop goes something like:
+//
+//   spinner_t sp = spin_start(p);
+//
+//   while(!ready && should_spin(&sp, deadline))
+//       spin_once(p, &sp);
+//
+//   while(!ready && park(p, &sp, cond, lock, deadline))
+//       ;
+//
+//   spin_end(p, &sp);
+
+typedef struct {
+    unsigned long long spins,  // Laps we've taken so far.
+                       limit,  // Laps we may take before we have to park.
+                       parked; // When we first went to sleep, or 0.
+} spinner_t;
+
+static inline spinner_t spin_start(pipe_t* p)
+{
+    unsigned long long limit;
+
+    switch(p->wait)
+    {
+    case PIPE_WAIT_SPIN:
+    case PIPE_WAIT_YIELD:    limit = ~0ULL;                                break;
+    case PIPE_WAIT_ADAPTIVE: limit = atomic_load_relaxed(&p->spin_budget); break;
+    default:                 limit = 0;
+    }
+
+    return (spinner_t) { .spins = 0, .limit = limit, .parked = 0 };
+}
+
+// Should we take another lap instead of parking? We give up on spinning once
+// the deadline passes, too, but only check the clock every so often, since it
+// costs more than a lap.
+static inline bool should_spin(spinner_t* sp, unsigned long long deadline)
+{
+    if(sp->spins >= sp->limit)
+        return false;
+
+    if(deadline != NO_DEADLINE && sp->spins % 64 == 0 && now_ns() >= deadline)
+        return false;
+
+    return true;
+}
+
+static inline void spin_once(pipe_t* p, spinner_t* sp)
+{
+    // Even pure spinners yield every so often. If they turn out to be sharing
+    // a core with whoever they're waiting for, they'd otherwise hold them up
+    // for a whole timeslice. With a core to themselves, it costs next to
+    // nothing.
+    bool yield = p->wait == PIPE_WAIT_YIELD
+               ? sp->spins >= p->spin_limit
+               : sp->spins % SPIN_YIELD_EVERY == SPIN_YIELD_EVERY - 1;
+
+    if(yield)
+        thread_yield();
+    else
+        cpu_relax();
+
+    sp->spins++;
+}
+
+// Like cond_wait_until, but remembers when we first went to sleep.
+static inline bool park(pipe_t* p, spinner_t* sp,
+                        cond_t* cond, mutex_t* lock,
+                        unsigned long long deadline)
+{
+    if(p->wait == PIPE_WAIT_ADAPTIVE && sp->parked == 0)
+        sp->parked = now_ns();
+
+    unsigned long long since = stats_clock();
+
+    if(is_room_cond(p, cond))
+        trace_event(p, PIPE_TRACE_WAIT_ROOM, 0);
+    else
+        trace_event(p, PIPE_TRACE_WAIT_ELEMS, 0);
+
+    bool woken = cond_wait_until(cond, lock, deadline);
+
+    trace_event(p, PIPE_TRACE_WAIT_END, 0);
+    stats_slept(p, cond, since);
+
+    return woken;
+}
+
+// Learns from a finished wait how long the next ones should spin.
+static void spin_end(pipe_t* p, spinner_t* sp)
+{
+    if(likely(p->wait != PIPE_WAIT_ADAPTIVE) || sp->spins == 0)
+        return;
+
+    unsigned long long budget = atomic_load_relaxed(&p->spin_budget);
+
+    if(sp->parked == 0)
+        // Spinning paid off. Drift towards twice what it took this time, so
+        // that a slightly slower wait next time still pays off.
+        budget = budget - budget / 8 + sp->spins / 4;
+    else if(now_ns() - sp->parked < SHORT_SLEEP_NS)
+        budget *= 2;
+    else
+        budget /= 2;
+
+    budget = max(budget, (unsigned long long)MIN_SPIN_BUDGET);
+    budget = min(budget, (unsigned long long)p->spin_limit);
+
+    atomic_store_relaxed(&p->spin_budget, (unsigned)budget);
+}
+
+// Takes `m' according to the pipe's wait policy. Since the lock is usually
+// only held for a memcpy or two, it's often worth spinning for.
+static inline void spin_lock(pipe_t* p, mutex_t* m)
+{
+    if(likely(p->wait == PIPE_WAIT_PARK))
+    {
+        mutex_lock(m);
+        return;
+    }
+
+    spinner_t sp = spin_start(p);
+
+    while(!mutex_trylock(m))
+    {
+        if(!should_spin(&sp, NO_DEADLINE))
+        {
+            mutex_lock(m);
+            return;
+        }
+
+        spin_once(p, &sp);
+    }
+}
+
+// Measured pipes only count the times they didn't get the lock right away.
+static inline void policy_lock(pipe_t* p, mutex_t* m)
+{
+#ifdef PIPE_STATS
+    if(likely(mutex_trylock(m)))
+        return;
+
+    unsigned long long since = stats_clock();
+    spin_lock(p, m);
+    stats_locked(p, m, since);
+#else
+    spin_lock(p, m);
+#endif
+}
+
+// The spinning half of a wait loop, for when the waiter can check whether to
+// stop without taking a lock. Returns whether `ready(p)' came true.
+static inline bool spin_until(pipe_t* p, spinner_t* sp,
+                              bool (*ready)(pipe_t*),
+                              unsigned long long deadline)
+{
+    for(;;)
+    {
+        if(ready(p))
+            return true;
+
+        if(!should_spin(sp, deadline))
+            return false;
+
+        spin_once(p, sp);
+    }
+}
+
+// The same, for the default engine, which has to hold `lock' to check whether
+// it's ready. It drops the lock between laps, so that whoever we're waiting for
+// can get at the pipe. Returns false once it's time to park instead, with the
+// lock held either way.
+static inline bool spin_unlocked(pipe_t* p, spinner_t* sp, mutex_t* lock,
+                                 unsigned long long deadline)
+{
+    if(!should_spin(sp, deadline))
+        return false;
+
+    mutex_unlock(lock);
+        spin_once(p, sp);
+    policy_lock(p, lock);
+
+    return true;
+}
+
+// Will spin until there is room in the buffer for `need' bytes, or until
+// `deadline' passes. Returns the number of elements currently in the buffer.
+// `end_lock` should be locked on entrance to this function.
+static inline snapshot_t wait_for_room(pipe_t* p, size_t need,
+                                       size_t* max_cap,
+                                       unsigned long long deadline)
+{
+    spinner_t  sp = spin_start(p);
+    snapshot_t s;
+    bool       announced = false,
+               timed_out = false;
+
+    for(;;)
+    {
+        s        = make_snapshot(p);
+        *max_cap = p->max_cap;
+
+        // If we're out of time, the pipe was still worth one last look.
+        if(likely(*max_cap - bytes_in_use(s) >= need)
+        || unlikely(p->consumer_refcount == 0)
+        || timed_out)
+            break;
+
+        if(spin_unlocked(p, &sp, &p->end_lock, deadline))
+            continue;
+
+        // Consumers only signal if they see a waiter, so we have to take
+        // another look after announcing ourselves. See announce_waiter.
+        if(!announced)
+        {
+            announce_waiter(&p->producers_waiting);
+            announced = true;
+            continue;
+        }
+
+        timed_out = !park(p, &sp, &p->just_popped, &p->end_lock, deadline);
+    }
+
+    if(announced)
+        retire_waiter(&p->producers_waiting);
+
+    spin_end(p, &sp);
+
+    return s;
+}
+
+// The SPSC engine's snapshots. Each side may read its own pointer with a
+// plain load, since nobody else writes it, but must acquire the other side's.
+// That's the one load which has to fetch a cache line the other side keeps
+// writing to, so each side starts from its cached copy (see `cached_begin'),
+// and only acquires the real thing if the cached copy doesn't show `need'
+// bytes of room (or elements). Only the producer may take a producer snapshot,
+// and only the consumer a consumer one, since they write the caches.
+static inline snapshot_t spsc_producer_snapshot(pipe_t* p, size_t need)
+{
+    snapshot_t s = {
+        .buffer = p->buffer,
+        .bufend = p->bufend,
+        .begin  = p->cached_begin,
+        .end    = p->end,
+        .elem_size = __pipe_elem_size(p),
+        .mirrored  = p->granule != 0,
+    };
+
+    if(!CACHED_INDICES || p->max_cap - bytes_in_use(s) < need)
+        s.begin = p->cached_begin = atomic_load_acquire(&p->begin);
+
+    return s;
+}
+
+static inline snapshot_t spsc_consumer_snapshot(pipe_t* p, size_t need)
+{
+    snapshot_t s = {
+        .buffer = p->buffer,
+        .bufend = p->bufend,
+        .begin  = p->begin,
+        .end    = p->cached_end,
+        .elem_size = __pipe_elem_size(p),
+        .mirrored  = p->granule != 0,
+    };
+
+    if(!CACHED_INDICES || bytes_in_use(s) < need)
+        s.end = p->cached_end = atomic_load_acquire(&p->end);
+
+    return s;
+}
+
+// Would an SPSC push stop waiting? Used for spinning, so it can't lock.
+static bool spsc_may_push(pipe_t* p)
+{
+    return bytes_in_use(spsc_producer_snapshot(p, p->elem_size)) != p->max_cap
+        || atomic_load_acquire(&p->consumer_refcount) == 0;
+}
+
+// Puts an SPSC producer to sleep until there's room for at least one element.
+// Returns false if every consumer is gone, since pushing is then pointless, or
+// if `deadline' passed before any room showed up.
+static bool spsc_wait_for_room(pipe_t* p, unsigned long long deadline)
+{
+    const size_t cap = p->max_cap;
+    spinner_t sp = spin_start(p);
+    bool room, timed_out = false;
+
+    if(spin_until(p, &sp, spsc_may_push, deadline))
+    {
+        spin_end(p, &sp);
+        return atomic_load_acquire(&p->consumer_refcount) > 0;
+    }
+
+    mutex_lock(&p->end_lock);
+        announce_waiter(&p->producers_waiting);
+
+        while(!(room = bytes_in_use(spsc_producer_snapshot(p, p->elem_size))
+                    != cap)
+           && p->consumer_refcount > 0
+           && !timed_out)
+            timed_out = !park(p, &sp, &p->just_popped, &p->end_lock, deadline);
+
+        retire_waiter(&p->producers_waiting);
+        room = room && p->consumer_refcount > 0;
+    mutex_unlock(&p->end_lock);
+
+    spin_end(p, &sp);
+
+    return room;
+}
+
+// Returns the number of bytes pushed.
+static size_t spsc_push(pipe_t* p, const char* restrict elems, size_t count,
+                        unsigned long long deadline)
+{
+    const size_t cap = p->max_cap;
+    size_t total = 0;
+
+    while(count > 0)
+    {
+        snapshot_t s = spsc_producer_snapshot(p, min(count, cap));
+        size_t room  = cap - bytes_in_use(s);
+
+        if(unlikely(room == 0))
+        {
+            if(!spsc_wait_for_room(p, deadline))
+                break;
+
+            continue;
+        }
+
+        size_t pushed = min(count, room);
+
+        atomic_store_release(&p->end, process_push(s, elems, pushed));
+
+        elems += pushed;
+        count -= pushed;
+        total += pushed;
+
+        wake_waiters(&p->consumers_waiting,
+                     &p->begin_lock, &p->just_pushed, 1);
+        after_push(p, pushed == room);
+    }
+
+    return total;
+}
+
+// Returns how far the slot for `pos' is from being ready for a thread which
+// wants its sequence number to be `pos + want'. Producers want 0 and consumers
+// want 1. If the result is negative, the slot still belongs to the other side.
+// If it's positive, someone on our side has already moved past it.
+static inline intptr_t mpmc_slot_distance(pipe_t* p, size_t pos, size_t want)
+{
+    size_t seq = atomic_load_acquire(&p->slot_seq[pos & p->slot_mask]);
+    return (intptr_t)(seq - (pos + want));
+}
+
+// Is the next slot at `*pos' ready for our side (see mpmc_slot_distance)? This
+// may be answered with a stale position, which is fine for deciding whether to
+// sleep: a stale position can only make a slot look more ready than it is.
+static inline bool mpmc_ready(pipe_t* p, size_t* pos, size_t want)
+{
+    return mpmc_slot_distance(p, atomic_load_relaxed(pos), want) >= 0;
+}
+
+// Claims up to `max' consecutive slots starting at `*pos', all of which must be
+// ready for our side. The slots are all before the end of the array, so they
+// can be copied with a single memcpy. Returns the number of slots claimed, the
+// first of which is stored in `first'. 0 means the pipe is full (or empty).
+static size_t mpmc_claim(pipe_t* p,
+                         size_t* pos_ptr, size_t want,
+                         size_t max,
+                         size_t* first // [out]
+                        )
+{
+    const size_t slots = p->slot_mask + 1;
+
+    size_t pos = atomic_load_relaxed(pos_ptr);
+
+    for(;;)
+    {
+        size_t   n    = min(max, slots - (pos & p->slot_mask)),
+                 k    = 0;
+        intptr_t dist = 0;
+
+        // Nobody else can take any of these slots as long as `*pos_ptr' is
+        // still `pos', so if the CAS below succeeds, they're all ours.
+        while(k < n && (dist = mpmc_slot_distance(p, pos + k, want)) == 0)
+            ++k;
+
+        if(unlikely(k == 0))
+        {
+            if(dist < 0)
+                return 0;
+
+            // Someone beat us to it. Try again from wherever they left off.
+            pos = atomic_load_relaxed(pos_ptr);
+            continue;
+        }
+
+        if(likely(atomic_cas(pos_ptr, &pos, pos + k)))
+        {
+            *first = pos;
+            return k;
+        }
+    }
+}
+
+// Would an MPMC push (or pop) stop waiting? Used for spinning, so they can't
+// lock.
+static bool mpmc_may_push(pipe_t* p)
+{
+    return mpmc_ready(p, &p->enqueue_pos, 0)
+        || atomic_load_acquire(&p->consumer_refcount) == 0;
+}
+
+static bool mpmc_may_pop(pipe_t* p)
+{
+    return mpmc_ready(p, &p->dequeue_pos, 1)
+        || atomic_load_acquire(&p->producer_refcount) == 0;
+}
+
+// Puts a producer to sleep until the pipe looks like it has room. Returns false
+// if every consumer is gone, or if `deadline' passed first.
+static bool mpmc_wait_for_room(pipe_t* p, unsigned long long deadline)
+{
+    spinner_t sp = spin_start(p);
+    bool room, timed_out = false;
+
+    if(spin_until(p, &sp, mpmc_may_push, deadline))
+    {
+        spin_end(p, &sp);
+        return atomic_load_acquire(&p->consumer_refcount) > 0;
+    }
+
+    mutex_lock(&p->end_lock);
+        announce_waiter(&p->producers_waiting);
+
+        while(!(room = mpmc_ready(p, &p->enqueue_pos, 0))
+           && p->consumer_refcount > 0
+           && !timed_out)
+            timed_out = !park(p, &sp, &p->just_popped, &p->end_lock, deadline);
+
+        retire_waiter(&p->producers_waiting);
+        room = room && p->consumer_refcount > 0;
+    mutex_unlock(&p->end_lock);
+
+    spin_end(p, &sp);
+
+    return room;
+}
+
+// Puts a consumer to sleep until the pipe looks like it has elements. Returns
+// false if it's empty and every producer is gone, or if `deadline' passed.
+static bool mpmc_wait_for_elements(pipe_t* p, unsigned long long deadline)
+{
+    spinner_t sp = spin_start(p);
+    bool ready, timed_out = false;
+
+    if(spin_until(p, &sp, mpmc_may_pop, deadline))
+    {
+        spin_end(p, &sp);
+        return mpmc_ready(p, &p->dequeue_pos, 1);
+    }
+
+    mutex_lock(&p->begin_lock);
+        announce_waiter(&p->consumers_waiting);
+
+        while(!(ready = mpmc_ready(p, &p->dequeue_pos, 1))
+           && p->producer_refcount > 0
+           && !timed_out)
+            timed_out = !park(p, &sp, &p->just_pushed, &p->begin_lock,
+                              deadline);
+
+        retire_waiter(&p->consumers_waiting);
+    mutex_unlock(&p->begin_lock);
+
+    spin_end(p, &sp);
+
+    return ready;
+}
+
+// `count' is in elements, not bytes, and so is the number pushed we return.
+static size_t mpmc_push(pipe_t* p, const char* restrict elems, size_t count,
+                        unsigned long long deadline)
+{
+    const size_t elem_size = __pipe_elem_size(p);
+    size_t total = 0;
+
+    while(count > 0)
+    {
+        size_t pos,
+               n = mpmc_claim(p, &p->enqueue_pos, 0, count, &pos);
+
+        if(unlikely(n == 0))
+        {
+            if(!mpmc_wait_for_room(p, deadline))
+                break;
+
+            continue;
+        }
+
+        size_t slot = pos & p->slot_mask;
+
+        memcpy(p->buffer + slot*elem_size, elems, n*elem_size);
+
+        for(size_t i = 0; i < n; ++i)
+            atomic_store_release(&p->slot_seq[slot + i], pos + i + 1);
+
+        elems += n*elem_size;
+        count -= n;
+        total += n;
+
+        wake_waiters(&p->consumers_waiting,
+                     &p->begin_lock, &p->just_pushed, n);
+        after_push(p, !mpmc_ready(p, &p->enqueue_pos, 0));
+    }
+
+    return total;
+}
+
+// Pops eagerly, like __pipe_pop. `requested' is in elements, not bytes.
+static size_t mpmc_pop(pipe_t* p, char* restrict target, size_t requested,
+                       unsigned long long deadline)
+{
+    const size_t elem_size = __pipe_elem_size(p),
+                 slots     = p->slot_mask + 1;
+
+    size_t pos, n;
+
+    while((n = mpmc_claim(p, &p->dequeue_pos, 1, requested, &pos)) == 0)
+        if(!mpmc_wait_for_elements(p, deadline))
+            return 0;
+
+    size_t slot = pos & p->slot_mask;
+
+    memcpy(target, p->buffer + slot*elem_size, n*elem_size);
+
+    // Hand the slots back to the producers, for their next lap of the array.
+    for(size_t i = 0; i < n; ++i)
+        atomic_store_release(&p->slot_seq[slot + i], pos + i + slots);
+
+    wake_waiters(&p->producers_waiting, &p->end_lock, &p->just_popped, n);
+    after_pop(p, !mpmc_ready(p, &p->dequeue_pos, 1));
+
+    return n;
+}
+
+// The segmented engine's view of how full the pipe is. Each side can read its
+// own count with a plain load, since it holds the lock it's written under.
+
+// end_lock must be held.
+static inline size_t segmented_room(pipe_t* p)
+{
+    return p->max_cap
+         - (p->pushed_bytes - atomic_load_acquire(&p->popped_bytes));
+}
+
+// begin_lock must be held.
+static inline size_t segmented_available(pipe_t* p)
+{
+    return atomic_load_acquire(&p->pushed_bytes) - p->popped_bytes;
+}
+
+// Waits, with end_lock held, until a segmented pipe has room, every consumer
+// is gone, or `deadline' passes. This is wait_for_room, except nothing ever
+// has to be copied into a bigger buffer. Returns the room, or 0 if there's no
+// point in pushing.
+static size_t segmented_wait_for_room(pipe_t* p, unsigned long long deadline)
+{
+    spinner_t sp = spin_start(p);
+    size_t    room;
+    bool      announced = false,
+              timed_out = false;
+
+    for(;;)
+    {
+        room = segmented_room(p);
+
+        if(likely(room != 0)
+        || unlikely(p->consumer_refcount == 0)
+        || timed_out)
+            break;
+
+        if(spin_unlocked(p, &sp, &p->end_lock, deadline))
+            continue;
+
+        // Just like wait_for_room.
+        if(!announced)
+        {
+            announce_waiter(&p->producers_waiting);
+            announced = true;
+            continue;
+        }
+
+        timed_out = !park(p, &sp, &p->just_popped, &p->end_lock, deadline);
+    }
+
+    if(announced)
+        retire_waiter(&p->producers_waiting);
+
+    spin_end(p, &sp);
+
+    return p->consumer_refcount > 0 ? room : 0;
+}
+
+// The same, for consumers, with begin_lock held. Returns the number of bytes
+// available.
+static size_t segmented_wait_for_elements(pipe_t* p,
+                                          unsigned long long deadline)
+{
+    spinner_t sp = spin_start(p);
+    size_t    available;
+    bool      announced = false,
+              timed_out = false;
+
+    for(;;)
+    {
+        available = segmented_available(p);
+
+        if(likely(available != 0)
+        || unlikely(p->producer_refcount == 0)
+        || timed_out)
+            break;
+
+        if(spin_unlocked(p, &sp, &p->begin_lock, deadline))
+            continue;
+
+        if(!announced)
+        {
+            announce_waiter(&p->consumers_waiting);
+            announced = true;
+            continue;
+        }
+
+        timed_out = !park(p, &sp, &p->just_pushed, &p->begin_lock, deadline);
+    }
+
+    if(announced)
+        retire_waiter(&p->consumers_waiting);
+
+    spin_end(p, &sp);
+
+    return available;
+}
+
+// Makes sure the producers' segment in lane `t' has room for at least one
+// element, by linking on a new one if it's full. end_lock must be held.
+// Returns false if we're out of memory.
+static inline bool segmented_grow(pipe_t* p, lane_t* t)
+{
+    if(likely(t->used < p->seg_bytes))
+        return true;
+
+    segment_t* s = take_segment(p);
+
+    if(unlikely(s == NULL))
+        return false;
+
+    // Consumers won't follow this until the lane's byte count says there's
+    // something past the end of their segment, and that's released after this.
+    segment_t* done = t->seg;
+
+    done->next = s;
+    t->seg     = s;
+    t->used    = 0;
+
+    // We're done writing it, and it'll be a while before anyone reads it.
+    if(is_spilled(done))
+        spill_evict(p->spill_fd, done->data, done->spilled, p->spill_slot);
+
+    return true;
+}
+
+// Moves the consumers onto the next segment in lane `h' if they've finished
+// theirs. begin_lock must be held, and there must be elements left in the lane.
+static inline void segmented_advance(pipe_t* p, lane_t* h)
+{
+    if(likely(h->used < p->seg_bytes))
+        return;
+
+    segment_t* done = h->seg;
+
+    assertume(done->next != NULL);
+
+    h->seg  = done->next;
+    h->used = 0;
+
+    if(is_spilled(h->seg))
+        spill_prefetch(h->seg->data, p->spill_slot);
+
+    // The producers left it behind when they linked on `next'.
+    give_segment(p, done);
+}
+
+// Publishes `bytes' more bytes in lane `t'. end_lock must be held. The lane
+// goes first, so that consumers who see the total can always find them.
+static inline void segmented_pushed(pipe_t* p, lane_t* t, size_t bytes)
+{
+    atomic_store_release(&t->bytes, t->bytes + bytes);
+    atomic_store_release(&p->pushed_bytes, p->pushed_bytes + bytes);
+}
+
+// Picks the lane consumers should pop from next, and says how many bytes they
+// can take from it before they have to pick again. begin_lock must be held,
+// and there must be elements in the pipe.
+//
+// Without a quantum, that's just the highest lane with anything in it. With
+// one, it's the highest lane which has something in it and hasn't popped its
+// quantum yet this round. Once every lane with anything in it has, the round
+// starts over. So while every lane is busy, each one gets its quantum out of
+// every round, and when only some are, they split the rounds between them.
+static unsigned segmented_pick(pipe_t* p, size_t* bytes)
+{
+    if(p->lanes == 1)
+        return *bytes = ~(size_t)0, 0;
+
+    for(int round = 0; ; ++round)
+    {
+        assertume(round < 2);
+
+        for(unsigned i = p->lanes; i-- > 0;)
+        {
+            size_t in_lane = atomic_load_acquire(&p->tails[i].bytes)
+                           - p->heads[i].bytes;
+
+            if(in_lane == 0)
+                continue;
+
+            if(p->quantum[i] == 0)
+                return *bytes = in_lane, i;
+
+            if(p->credit[i] != 0)
+                return *bytes = min(in_lane, p->credit[i]), i;
+        }
+
+        for(unsigned i = 0; i < p->lanes; ++i)
+            p->credit[i] = p->quantum[i];
+    }
+}
+
+// Counts `bytes' as popped from `lane', and takes them out of its credit.
+// begin_lock must be held.
+static inline void segmented_popped(pipe_t* p, unsigned lane, size_t bytes)
+{
+    p->heads[lane].bytes += bytes;
+
+    if(p->quantum[lane])
+        p->credit[lane] -= bytes;
+}
+
+// Returns the number of bytes pushed into `lane'. `count' is in bytes, too.
+static size_t segmented_push(pipe_t* p, unsigned lane,
+                             const char* restrict elems,
+                             size_t count, unsigned long long deadline)
+{
+    const size_t elem_size = __pipe_elem_size(p);
+    lane_t*      t         = &p->tails[lane];
+    size_t total = 0;
+
+    while(count > 0)
+    {
+        size_t pushed = 0;
+        bool   full;
+
+        { policy_lock(p, &p->end_lock);
+            size_t room = segmented_wait_for_room(p, deadline),
+                   want = min(count, room);
+
+            while(pushed < want && likely(segmented_grow(p, t)))
+            {
+                size_t n = min(want - pushed, p->seg_bytes - t->used);
+
+                memcpy(segment_data(t->seg) + t->used, elems + pushed, n);
+
+                t->used += n;
+                pushed  += n;
+            }
+
+            segmented_pushed(p, t, pushed);
+            full = pushed == room;
+        } mutex_unlock(&p->end_lock);
+
+        // No consumers, no time, or no memory.
+        if(unlikely(pushed == 0))
+            break;
+
+        wake_waiters(&p->consumers_waiting, &p->begin_lock, &p->just_pushed,
+                     pushed / elem_size);
+        after_push(p, full);
+
+        elems += pushed;
+        count -= pushed;
+        total += pushed;
+    }
+
+    return total;
+}
+
+// Pops eagerly, like __pipe_pop. `requested' is in bytes.
+static size_t segmented_pop(pipe_t* p, char* restrict target,
+                            size_t requested, unsigned long long deadline)
+{
+    size_t popped = 0,
+           available;
+
+    { policy_lock(p, &p->begin_lock);
+        available = segmented_wait_for_elements(p, deadline);
+
+        size_t want = min(requested, available);
+
+        while(popped < want)
+        {
+            size_t   in_lane;
+            unsigned lane = segmented_pick(p, &in_lane);
+            lane_t*  h    = &p->heads[lane];
+
+            // Finish a whole turn in the lane before picking another.
+            size_t turn = min(want - popped, in_lane),
+                   done = 0;
+
+            while(done < turn)
+            {
+                segmented_advance(p, h);
+
+                size_t n = min(turn - done, p->seg_bytes - h->used);
+
+                memcpy(target + popped + done, segment_data(h->seg) + h->used, n);
+
+                h->used += n;
+                done    += n;
+            }
+
+            segmented_popped(p, lane, turn);
+            popped += turn;
+        }
+
+        atomic_store_release(&p->popped_bytes, p->popped_bytes + popped);
+    } mutex_unlock(&p->begin_lock);
+
+    if(unlikely(popped == 0))
+        return 0;
+
+    wake_waiters(&p->producers_waiting, &p->end_lock, &p->just_popped,
+                 popped / __pipe_elem_size(p));
+    after_pop(p, popped == available);
+
+    return popped;
+}
+
+// Pushes as much as it can before `deadline', and returns the number of bytes
+// that made it in. `count' is in bytes, too.
+// The shared engine. Each side only reads its own count under its own lock,
+// but acquires the other's, the same way the segmented engine does.
+static inline size_t shared_room(shared_t* s)
+{
+    return s->cap - (size_t)(s->pushed - atomic_load_acquire(&s->popped));
+}
+
+static inline size_t shared_available(shared_t* s)
+{
+    return (size_t)(atomic_load_acquire(&s->pushed)
+                  - atomic_load_acquire(&s->popped));
+}
+
+// Copies `bytes' bytes to or from the ring, starting `at' that many bytes in,
+// wrapping around the end if it has to.
+static void shared_copy_in(shared_t* s, unsigned long long at,
+                           const char* restrict elems, size_t bytes)
+{
+    size_t offset = (size_t)(at % s->cap),
+           first  = min(bytes, s->cap - offset);
+
+    memcpy(shared_ring(s) + offset, elems, first);
+    memcpy(shared_ring(s), elems + first, bytes - first);
+}
+
+static void shared_copy_out(shared_t* s, unsigned long long at,
+                            char* restrict target, size_t bytes)
+{
+    size_t offset = (size_t)(at % s->cap),
+           first  = min(bytes, s->cap - offset);
+
+    memcpy(target, shared_ring(s) + offset, first);
+    memcpy(target + first, shared_ring(s), bytes - first);
+}
+
+// Just like wait_for_room, but holding the shared push_lock. Returns the room
+// in bytes, which is 0 if every consumer is gone or `deadline' passed first.
+static size_t shared_wait_for_room(pipe_t* p, unsigned long long deadline)
+{
+    shared_t*  s  = p->shm;
+    spinner_t  sp = spin_start(p);
+    size_t     room;
+    bool       announced = false,
+               timed_out = false;
+
+    for(;;)
+    {
+        room = shared_room(s);
+
+        if(likely(room != 0) || unlikely(s->consumers == 0) || timed_out)
+            break;
+
+        if(spin_unlocked(p, &sp, &s->push_lock, deadline))
+            continue;
+
+        if(!announced)
+        {
+            announce_waiter(&s->producers_waiting);
+            announced = true;
+            continue;
+        }
+
+        timed_out = !park(p, &sp, &s->just_popped, &s->push_lock, deadline);
+    }
+
+    if(announced)
+        retire_waiter(&s->producers_waiting);
+
+    spin_end(p, &sp);
+
+    return s->consumers > 0 ? room : 0;
+}
+
+// And wait_for_elements. Returns the number of bytes available, which is 0 if
+// every producer is gone and the pipe is empty, or `deadline' passed first.
+static size_t shared_wait_for_elements(pipe_t* p, unsigned long long deadline)
+{
+    shared_t*  s  = p->shm;
+    spinner_t  sp = spin_start(p);
+    size_t     available;
+    bool       announced = false,
+               timed_out = false;
+
+    for(;;)
+    {
+        available = shared_available(s);
+
+        if(likely(available != 0) || unlikely(s->producers == 0) || timed_out)
+            break;
+
+        if(spin_unlocked(p, &sp, &s->pop_lock, deadline))
+            continue;
+
+        if(!announced)
+        {
+            announce_waiter(&s->consumers_waiting);
+            announced = true;
+            continue;
+        }
+
+        timed_out = !park(p, &sp, &s->just_pushed, &s->pop_lock, deadline);
+    }
+
+    if(announced)
+        retire_waiter(&s->consumers_waiting);
+
+    spin_end(p, &sp);
+
+    return available;
+}
+
+// Returns the number of bytes pushed. Like __pipe_push, this keeps going
+// until everything is pushed, unless it runs out of time or consumers.
+static size_t shared_push(pipe_t* p, const char* restrict elems, size_t count,
+                          unsigned long long deadline)
+{
+    shared_t* s         = p->shm;
+    size_t    elem_size = __pipe_elem_size(p),
+              total     = 0;
+
+    while(count > 0)
+    {
+        size_t pushed;
+
+        { policy_lock(p, &s->push_lock);
+            size_t room = shared_wait_for_room(p, deadline);
+
+            if(unlikely(room == 0))
+            {
+                mutex_unlock(&s->push_lock);
+                break;
+            }
+
+            pushed = min(count, room);
+
+            shared_copy_in(s, s->pushed, elems, pushed);
+            atomic_store_release(&s->pushed, s->pushed + pushed);
+        } mutex_unlock(&s->push_lock);
+
+        wake_waiters(&s->consumers_waiting, &s->pop_lock, &s->just_pushed,
+                     pushed / elem_size);
+
+        elems += pushed;
+        count -= pushed;
+        total += pushed;
+    }
+
+    return total;
+}
+
+static size_t shared_pop(pipe_t* p, char* restrict target, size_t requested,
+                         unsigned long long deadline)
+{
+    shared_t* s = p->shm;
+    size_t    popped;
+
+    { policy_lock(p, &s->pop_lock);
+        size_t available = shared_wait_for_elements(p, deadline);
+
+        if(unlikely(available == 0))
+        {
+            mutex_unlock(&s->pop_lock);
+            return 0;
+        }
+
+        popped = min(requested, available);
+
+        shared_copy_out(s, s->popped, target, popped);
+        atomic_store_release(&s->popped, s->popped + popped);
+    } mutex_unlock(&s->pop_lock);
+
+    wake_waiters(&s->producers_waiting, &s->push_lock, &s->just_popped,
+                 popped / __pipe_elem_size(p));
+
+    return popped;
+}
+
+// The broadcast engine. Producers read the subscribers' cursors, and
+// subscribers read `pushed', with acquire loads.
+static void broadcast_copy_in(broadcast_t* b, unsigned long long at,
+                              const char* restrict elems, size_t bytes)
+{
+    size_t offset = (size_t)(at % b->cap),
+           first  = min(bytes, b->cap - offset);
+
+    memcpy(b->ring + offset, elems, first);
+    memcpy(b->ring, elems + first, bytes - first);
+}
+
+static void broadcast_copy_out(broadcast_t* b, unsigned long long at,
+                               char* restrict target, size_t bytes)
+{
+    size_t offset = (size_t)(at % b->cap),
+           first  = min(bytes, b->cap - offset);
+
+    memcpy(target, b->ring + offset, first);
+    memcpy(target + first, b->ring, bytes - first);
+}
+
+// How much room the slowest subscriber leaves, in bytes. push_lock must be
+// held. Sets `subscribed' to whether there are any subscribers at all.
+static size_t broadcast_room(broadcast_t* b, bool* subscribed)
+{
+    unsigned long long slowest = b->pushed;
+
+    mutex_lock(&b->sub_lock);
+        *subscribed = b->subs != NULL;
+
+        for(pipe_t* s = b->subs; s != NULL; s = s->next_sub)
+            slowest = min(slowest, atomic_load_acquire(&s->cursor));
+    mutex_unlock(&b->sub_lock);
+
+    return b->cap - (size_t)(b->pushed - slowest);
+}
+
+// Makes room for `bytes' more by skipping every subscriber that's too far
+// behind ahead, for PIPE_LAG_DROP. push_lock must be held. Returns whether
+// there are any subscribers at all.
+static bool broadcast_drop(broadcast_t* b, size_t bytes)
+{
+    bool subscribed;
+
+    mutex_lock(&b->sub_lock);
+        subscribed = b->subs != NULL;
+
+        // Everyone has to be at least this far along.
+        unsigned long long keep = b->pushed + bytes > b->cap
+                                ? b->pushed + bytes - b->cap
+                                : 0;
+
+        for(pipe_t* s = b->subs; s != NULL; s = s->next_sub)
+        {
+            if(likely(atomic_load_acquire(&s->cursor) >= keep))
+                continue;
+
+            // Wait for it to finish with the bytes we're about to overwrite.
+            mutex_lock(&s->begin_lock);
+                if(s->cursor < keep)
+                {
+                    s->dropped += (keep - s->cursor) / b->elem_size;
+                    atomic_store_release(&s->cursor, keep);
+                }
+            mutex_unlock(&s->begin_lock);
+        }
+    mutex_unlock(&b->sub_lock);
+
+    return subscribed;
+}
+
+// Just like wait_for_room, but holding the broadcast_t's push_lock. Returns
+// the room in bytes, which is 0 if every subscriber is gone or `deadline'
+// passed first.
+static size_t broadcast_wait_for_room(pipe_t* p, unsigned long long deadline)
+{
+    broadcast_t* b  = p->bcast;
+    spinner_t    sp = spin_start(p);
+    size_t       room;
+    bool         subscribed,
+                 announced = false,
+                 timed_out = false;
+
+    for(;;)
+    {
+        room = broadcast_room(b, &subscribed);
+
+        if(likely(room != 0) || unlikely(!subscribed) || timed_out)
+            break;
+
+        if(spin_unlocked(p, &sp, &b->push_lock, deadline))
+            continue;
+
+        if(!announced)
+        {
+            announce_waiter(&b->producers_waiting);
+            announced = true;
+            continue;
+        }
+
+        timed_out = !park(p, &sp, &b->just_popped, &b->push_lock, deadline);
+    }
+
+    if(announced)
+        retire_waiter(&b->producers_waiting);
+
+    spin_end(p, &sp);
+
+    return subscribed ? room : 0;
+}
+
+// And wait_for_elements, holding this subscriber's begin_lock. Returns the
+// number of bytes available.
+static size_t broadcast_wait_for_elements(pipe_t* p,
+                                          unsigned long long deadline)
+{
+    broadcast_t* b  = p->bcast;
+    spinner_t    sp = spin_start(p);
+    size_t       available;
+    bool         announced = false,
+                 timed_out = false;
+
+    for(;;)
+    {
+        available = (size_t)(atomic_load_acquire(&b->pushed) - p->cursor);
+
+        if(likely(available != 0)
+        || unlikely(atomic_load_acquire(&b->producers) == 0)
+        || timed_out)
+            break;
+
+        if(spin_unlocked(p, &sp, &p->begin_lock, deadline))
+            continue;
+
+        if(!announced)
+        {
+            announce_waiter(&p->consumers_waiting);
+            announced = true;
+            continue;
+        }
+
+        timed_out = !park(p, &sp, &p->just_pushed, &p->begin_lock, deadline);
+    }
+
+    if(announced)
+        retire_waiter(&p->consumers_waiting);
+
+    spin_end(p, &sp);
+
+    return available;
+}
+
+// Wakes up to `n' of each subscriber's sleeping consumers.
+static void broadcast_wake(broadcast_t* b, size_t n)
+{
+    mutex_lock(&b->sub_lock);
+        for(pipe_t* s = b->subs; s != NULL; s = s->next_sub)
+            wake_waiters(&s->consumers_waiting, &s->begin_lock,
+                         &s->just_pushed, n);
+    mutex_unlock(&b->sub_lock);
+}
+
+// Returns the number of bytes pushed. Like __pipe_push, this keeps going until
+// everything is pushed, unless it runs out of time or subscribers.
+static size_t broadcast_push(pipe_t* p, const char* restrict elems,
+                             size_t count, unsigned long long deadline)
+{
+    broadcast_t* b         = p->bcast;
+    size_t       elem_size = __pipe_elem_size(p),
+                 total     = 0;
+
+    while(count > 0)
+    {
+        size_t pushed;
+
+        { policy_lock(p, &b->push_lock);
+            size_t room;
+
+            if(b->lag == PIPE_LAG_DROP)
+                room = broadcast_drop(b, min(count, b->cap)) ? b->cap : 0;
+            else
+                room = broadcast_wait_for_room(p, deadline);
+
+            if(unlikely(room == 0))
+            {
+                mutex_unlock(&b->push_lock);
+                break;
+            }
+
+            pushed = min(count, room);
+
+            broadcast_copy_in(b, b->pushed, elems, pushed);
+            atomic_store_release(&b->pushed, b->pushed + pushed);
+        } mutex_unlock(&b->push_lock);
+
+        broadcast_wake(b, pushed / elem_size);
+
+        elems += pushed;
+        count -= pushed;
+        total += pushed;
+    }
+
+    return total;
+}
+
+static size_t broadcast_pop(pipe_t* p, char* restrict target,
+                            size_t requested, unsigned long long deadline)
+{
+    broadcast_t* b = p->bcast;
+    size_t       popped;
+
+    { policy_lock(p, &p->begin_lock);
+        size_t available = broadcast_wait_for_elements(p, deadline);
+
+        if(unlikely(available == 0))
+        {
+            mutex_unlock(&p->begin_lock);
+            return 0;
+        }
+
+        popped = min(requested, available);
+
+        broadcast_copy_out(b, p->cursor, target, popped);
+        atomic_store_release(&p->cursor, p->cursor + popped);
+    } mutex_unlock(&p->begin_lock);
+
+    // Producers who drop elements never wait for anyone.
+    if(b->lag == PIPE_LAG_BLOCK)
+        wake_waiters(&b->producers_waiting, &b->push_lock, &b->just_popped,
+                     popped / __pipe_elem_size(p));
+
+    return popped;
+}
+
+size_t __pipe_push(pipe_t* p,
+                   const void* restrict elems,
+                   size_t count,
+                   unsigned long long deadline)
+{
+    size_t elem_size = __pipe_elem_size(p);
+
+    if(unlikely(count == 0))
+        return 0;
+
+    if(p->engine == ENGINE_SPSC)
+        return spsc_push(p, elems, count, deadline);
+
+    if(p->engine == ENGINE_MPMC)
+        return mpmc_push(p, elems, count / elem_size, deadline) * elem_size;
+
+    if(p->engine == ENGINE_SEGMENTED)
+        return segmented_push(p, 0, elems, count, deadline);
+
+    if(p->engine == ENGINE_SHARED)
+        return shared_push(p, elems, count, deadline);
+
+    if(p->engine == ENGINE_BROADCAST)
+        return broadcast_push(p, elems, count, deadline);
+
+    size_t pushed = 0;
+    bool   full;
+
+    { policy_lock(p, &p->end_lock);
+        size_t max_cap;
+        snapshot_t s = wait_for_room(p, elem_size, &max_cap, deadline);
+
+        // if no more consumers, or out of time...
+        if(unlikely(p->consumer_refcount == 0)
+        || unlikely(bytes_in_use(s) == max_cap))
+        {
+            mutex_unlock(&p->end_lock);
+            return 0;
+        }
+
+        s = validate_size(p, s, count);
+
+        size_t room = room_left(s, max_cap);
+
+        // Growing the buffer failed, and the old one is full. Stop short, just
+        // like running out of time.
+        if(unlikely(room == 0))
+        {
+            mutex_unlock(&p->end_lock);
+            return 0;
+        }
+
+        // Finally, we can now begin with pushing as many elements into the
+        // queue as possible.
+        atomic_store_release(&p->end, process_push(s, elems,
+                     pushed = min(count, room)));
+
+        full = bytes_in_use(s) + pushed == max_cap;
+    } mutex_unlock(&p->end_lock);
+
+    assertume(pushed > 0);
+
+    // Each element we pushed is good for one consumer.
+    wake_waiters(&p->consumers_waiting, &p->begin_lock, &p->just_pushed,
+                 pushed / elem_size);
+
+    after_push(p, full);
+
+    // We might not be done pushing. If the max_cap was reached, we'll need to
+    // recurse.
+    size_t bytes_remaining = count - pushed;
+
+    if(unlikely(bytes_remaining))
+        pushed += __pipe_push(p, (const char*)elems + pushed, bytes_remaining,
+                              deadline);
+
+    return pushed;
+}
+
+static size_t push_until(pipe_producer_t* p,
+                         const void* restrict elems,
+                         size_t count,
+                         unsigned long long deadline)
+{
+    pipe_t* p0 = PIPIFY(p);
+    size_t elem_size = __pipe_elem_size(p0);
+    size_t pushed = __pipe_push(p0, elems, count*elem_size, deadline) / elem_size;
+
+    note_push(p0, pushed);
+
+    return pushed;
+}
+
+void pipe_push(pipe_producer_t* p, const void* restrict elems, size_t count)
+{
+    push_until(p, elems, count, NO_DEADLINE);
+}
+
+size_t pipe_try_push(pipe_producer_t* p,
+                     const void* restrict elems, size_t count)
+{
+    return push_until(p, elems, count, 0);
+}
+
+size_t pipe_push_timed(pipe_producer_t* p,
+                       const void* restrict elems, size_t count,
+                       unsigned long long deadline)
+{
+    return push_until(p, elems, count, deadline);
+}
+
+void pipe_push_lane(pipe_producer_t* handle, unsigned lane,
+                    const void* restrict elems, size_t count)
+{
+    pipe_t* p = PIPIFY(handle);
+    size_t elem_size = __pipe_elem_size(p);
+
+    assertume(lane < max(p->lanes, 1u) && "The pipe doesn't have that lane.");
+
+    // Every pipe has a lane 0.
+    if(lane == 0)
+    {
+        pipe_push(handle, elems, count);
+        return;
+    }
+
+    if(unlikely(count == 0))
+        return;
+
+    note_push(p, segmented_push(p, lane, elems, count*elem_size, NO_DEADLINE)
+                 / elem_size);
+}
+
+// Returns the number of bytes that can be written after `end' in one go,
+// without wrapping around or running into `begin'. Mirrored buffers can just
+// run off the end, so all their room is contiguous.
+static inline size_t contiguous_room(snapshot_t s)
+{
+    if(s.mirrored)
+        return capacity(s) - bytes_in_use(s);
+
+    return wraps_around(s) ? (size_t)(s.begin - s.end)
+                           : (size_t)(s.bufend - s.end);
+}
+
+// The default engine hands out its room while holding end_lock, which is only
+// released by pipe_push_commit. That keeps other producers out of the region,
+// as well as any resizes (which need both locks).
+static void locked_push_reserve(pipe_t* p, size_t bytes,
+                                void** ptr, size_t* reserved)
+{
+    policy_lock(p, &p->end_lock);
+
+    size_t max_cap;
+    snapshot_t s = wait_for_room(p, p->elem_size, &max_cap, NO_DEADLINE);
+
+    if(unlikely(p->consumer_refcount == 0))
+        return;
+
+    // Try to make room for all of it, just like a push would.
+    s = validate_size(p, s, bytes);
+
+    bytes = min(bytes, room_left(s, max_cap));
+    bytes = min(bytes, contiguous_room(s));
+
+    *ptr      = s.end;
+    *reserved = bytes;
+}
+
+static void spsc_push_reserve(pipe_t* p, size_t bytes,
+                              void** ptr, size_t* reserved)
+{
+    size_t need  = min(bytes, p->max_cap);
+    snapshot_t s = spsc_producer_snapshot(p, need);
+
+    while(unlikely(bytes_in_use(s) == p->max_cap))
+    {
+        if(!spsc_wait_for_room(p, NO_DEADLINE))
+            return;
+
+        s = spsc_producer_snapshot(p, need);
+    }
+
+    bytes = min(bytes, p->max_cap - bytes_in_use(s));
+    bytes = min(bytes, contiguous_room(s));
+
+    *ptr      = s.end;
+    *reserved = bytes;
+}
+
+// Hands out the rest of the producers' segment, with end_lock held until
+// pipe_push_commit, just like locked_push_reserve.
+static void segmented_push_reserve(pipe_t* p, size_t bytes,
+                                   void** ptr, size_t* reserved)
+{
+    policy_lock(p, &p->end_lock);
+
+    size_t  room = segmented_wait_for_room(p, NO_DEADLINE);
+    lane_t* t    = &p->tails[0];
+
+    if(unlikely(room == 0) || unlikely(!segmented_grow(p, t)))
+        return;
+
+    bytes = min(bytes, room);
+    bytes = min(bytes, p->seg_bytes - t->used);
+
+    *ptr      = segment_data(t->seg) + t->used;
+    *reserved = bytes;
+}
+
+void pipe_push_reserve(pipe_producer_t* handle, size_t max_count,
+                       void** ptr, size_t* count)
+{
+    pipe_t* p = PIPIFY(handle);
+    size_t elem_size = __pipe_elem_size(p);
+
+    // MPMC slots belong to one producer at a time, and can't be handed back
+    // unused, so there's no region we could safely lend out.
+    assertume(p->engine != ENGINE_MPMC
+           && "pipe_push_reserve is not supported on MPMC pipes.");
+    assertume(p->engine != ENGINE_SHARED
+           && "pipe_push_reserve is not supported on shared pipes.");
+    assertume(p->engine != ENGINE_BROADCAST
+           && "pipe_push_reserve is not supported on broadcast pipes.");
+
+    size_t reserved = 0;
+    *ptr = NULL;
+
+    if(p->engine == ENGINE_SPSC)
+        spsc_push_reserve(p, max_count*elem_size, ptr, &reserved);
+    else if(p->engine == ENGINE_LOCKED)
+        locked_push_reserve(p, max_count*elem_size, ptr, &reserved);
+    else if(p->engine == ENGINE_SEGMENTED)
+        segmented_push_reserve(p, max_count*elem_size, ptr, &reserved);
+
+    // We now own the push side of the pipe, so this is safe to write.
+    p->reserved = reserved;
+    *count      = reserved / elem_size;
+}
+
+void pipe_push_commit(pipe_producer_t* handle, size_t count)
+{
+    pipe_t* p = PIPIFY(handle);
+    size_t elem_size = __pipe_elem_size(p);
+    size_t bytes     = count*elem_size;
+
+    assertume(bytes <= p->reserved
+           && "Committed more elements than were reserved.");
+
+    p->reserved = 0;
+
+    if(p->engine == ENGINE_SPSC)
+    {
+        if(likely(bytes))
+        {
+            atomic_store_release(&p->end,
+                wrap_ptr_if_necessary(p->buffer, p->end + bytes, p->bufend));
+
+            note_push(p, count);
+
+            wake_waiters(&p->consumers_waiting,
+                         &p->begin_lock, &p->just_pushed, 1);
+            after_push(p,
+                bytes_in_use(spsc_producer_snapshot(p, 0)) == p->max_cap);
+        }
+
+        return;
+    }
+
+    if(p->engine == ENGINE_MPMC || p->engine == ENGINE_SHARED
+    || p->engine == ENGINE_BROADCAST)
+        return;
+
+    bool full;
+
+    if(p->engine == ENGINE_SEGMENTED)
+    {
+        p->tails[0].used += bytes;
+        segmented_pushed(p, &p->tails[0], bytes);
+
+        full = segmented_room(p) == 0;
+    }
+    else
+    {
+        if(likely(bytes))
+            atomic_store_release(&p->end,
+                wrap_ptr_if_necessary(p->buffer, p->end + bytes, p->bufend));
+
+        full = bytes_in_use(make_snapshot(p)) == p->max_cap;
+    }
+
+    mutex_unlock(&p->end_lock);
+
+    if(unlikely(bytes == 0))
+        return;
+
+    note_push(p, count);
+
+    // Same as __pipe_push.
+    wake_waiters(&p->consumers_waiting, &p->begin_lock, &p->just_pushed,
+                 count);
+
+    after_push(p, full);
+}
+
+/*
+#ifdef PIPE_DEBUG
+// For testing/debugging only, and is only available in debug mode. Assuming a
+// pipe of ints, prints them out. This function is not included or documented
+// in the header file!
+
+#include <stdio.h>
+
+void pipe_debug(pipe_t* p, const char* id)
+{
+    printf("%s: [ ", id);
+    for(int* ptr = (int*)p->buffer; ptr != (int*)p->bufend; ++ptr)
+        printf("%i ", *ptr);
+    printf("]\n");
+    printf("begin: %lu    end: %lu\n", p->begin - p->buffer, p->end - p->buffer);
+}
+#endif
+*/
+
+// Waits for at least one element to be in the pipe, or for `deadline' to pass.
+// p->begin_lock must be locked when entering this function, and a new, valid
+// snapshot is returned.
+static inline snapshot_t wait_for_elements(pipe_t* p,
+                                           unsigned long long deadline)
+{
+    spinner_t  sp = spin_start(p);
+    snapshot_t s;
+    bool       announced = false,
+               timed_out = false;
+
+    for(;;)
+    {
+        s = make_snapshot(p);
+
+        if(likely(bytes_in_use(s) != 0)
+        || unlikely(p->producer_refcount == 0)
+        || timed_out)
+            break;
+
+        if(spin_unlocked(p, &sp, &p->begin_lock, deadline))
+            continue;
+
+        // Just like wait_for_room.
+        if(!announced)
+        {
+            announce_waiter(&p->consumers_waiting);
+            announced = true;
+            continue;
+        }
+
+        timed_out = !park(p, &sp, &p->just_pushed, &p->begin_lock, deadline);
+    }
+
+    if(announced)
+        retire_waiter(&p->consumers_waiting);
+
+    spin_end(p, &sp);
+
+    return s;
+}
+
+// wow, I didn't even intend for the name to work like that...
+// returns a new snapshot, with the updated changes also reflected onto the
+// pipe.
+static inline snapshot_t pop_without_locking(snapshot_t s,
+                                             void* restrict target,
+                                             size_t bytes_to_copy,
+                                             char** begin // [out]
+                                            )
+{
+    assertume(s.begin != s.bufend);
+
+    size_t elem_size = s.elem_size;
+
+    // The mirror takes care of any wrapping for us.
+    if(s.mirrored)
+    {
+        memcpy(target, s.begin + elem_size, bytes_to_copy);
+        *begin = wrap_ptr_if_necessary(s.buffer, s.begin + bytes_to_copy,
+                                       s.bufend);
+
+        return s.begin = *begin, s;
+    }
+
+    // Copy either as many bytes as requested, or the available bytes in the RHS
+    // of a wrapped buffer - whichever is smaller.
+    {
+        size_t first_bytes_to_copy = min(bytes_to_copy, (size_t)(s.bufend - s.begin - elem_size));
+
+        target = offset_memcpy(target, s.begin + elem_size, first_bytes_to_copy);
+
+        bytes_to_copy -= first_bytes_to_copy;
+
+        s.begin       += first_bytes_to_copy;
+        s.begin = wrap_ptr_if_necessary(s.buffer, s.begin, s.bufend);
+    }
+
+    if(unlikely(bytes_to_copy > 0))
+    {
+        s.begin += elem_size;
+        s.begin = wrap_ptr_if_necessary(s.buffer, s.begin, s.bufend);
+
+        memcpy(target, s.begin, bytes_to_copy);
+
+        s.begin += bytes_to_copy;
+        s.begin = wrap_ptr_if_necessary(s.buffer, s.begin, s.bufend);
+
+        s.begin -= elem_size;
+        s.begin = rev_wrap_ptr_if_necessary(s.buffer, s.begin, s.bufend);
+    }
+
+    // Since we cached begin on the stack, we need to reflect our changes back
+    // on the pipe.
+    *begin = s.begin;
+
+    return s;
+}
+
+// If the buffer is shrunk to something a lot smaller than our current
+// capacity, resize it to something sane. This function must be entered with
+// only p->begin_lock locked, and will automatically unlock p->begin_lock on
+// exit.
+static inline void trim_buffer(pipe_t* p, snapshot_t s)
+{
+    if(p->resize == PIPE_RESIZE_NEVER_SHRINK
+    || p->resize == PIPE_RESIZE_FIXED)
+    {
+        mutex_unlock(&p->begin_lock);
+        return;
+    }
+
+    size_t cap = capacity(s);
+
+    // A mirrored buffer may already be as small as its granule allows, in
+    // which case resizing would be a waste of a lock upgrade.
+    bool can_shrink = round_to_granule(cap / 2 + s.elem_size, p->granule)
+                    < (size_t)(s.bufend - s.buffer);
+
+    // We have a sane size. We're done here.
+    if(likely(bytes_in_use(s) > cap / 4) || !can_shrink)
+    {
+        p->quiet_pops = 0;
+        mutex_unlock(&p->begin_lock);
+        return;
+    }
+
+    // Or we've been told to hang on to it a little longer.
+    if(p->resize == PIPE_RESIZE_HYSTERESIS
+    && ++p->quiet_pops < p->shrink_window)
+    {
+        mutex_unlock(&p->begin_lock);
+        return;
+    }
+
+    p->quiet_pops = 0;
+
+    // Okay, we need to resize now. Upgrade our lock so we can check again. The
+    // weird lock/unlock order is to make sure we always acquire the end_lock
+    // before begin_lock. Deadlock can arise otherwise.
+    mutex_unlock(&p->begin_lock);
+    mutex_lock(&p->end_lock);
+    mutex_lock(&p->begin_lock);
+
+    s   = make_snapshot(p);
+    cap = capacity(s);
+
+    // To conserve space like the good computizens we are, we'll shrink
+    // our buffer if our memory usage efficiency drops below 25%. However,
+    // since shrinking/growing the buffer is the most expensive part of a push
+    // or pop, we only shrink it to bring us up to a 50% efficiency. A common
+    // pipe usage pattern is sudden bursts of pushes and pops. This ensures it
+    // doesn't get too time-inefficient.
+    if(likely(bytes_in_use(s) <= cap / 4))
+        resize_buffer(p, cap / 2 / s.elem_size * s.elem_size);
+
+    // All done. Unlock the pipe. The reason we don't let the calling function
+    // unlock begin_lock is so that we can do it BEFORE end_lock. This prevents
+    // the lock order from being fudged.
+    mutex_unlock(&p->begin_lock);
+    mutex_unlock(&p->end_lock);
+}
+
+// Would an SPSC pop stop waiting? Used for spinning, so it can't lock.
+static bool spsc_may_pop(pipe_t* p)
+{
+    return bytes_in_use(spsc_consumer_snapshot(p, p->elem_size)) != 0
+        || atomic_load_acquire(&p->producer_refcount) == 0;
+}
+
+// Puts an SPSC consumer to sleep until there's at least one element in the
+// pipe, until every producer is gone, or until `deadline' passes. Returns a
+// fresh snapshot.
+static snapshot_t spsc_wait_for_elements(pipe_t* p,
+                                         unsigned long long deadline)
+{
+    spinner_t  sp = spin_start(p);
+    snapshot_t s;
+    bool timed_out = false;
+
+    if(spin_until(p, &sp, spsc_may_pop, deadline))
+    {
+        spin_end(p, &sp);
+        return spsc_consumer_snapshot(p, p->elem_size);
+    }
+
+    mutex_lock(&p->begin_lock);
+        announce_waiter(&p->consumers_waiting);
+
+        for(s = spsc_consumer_snapshot(p, p->elem_size);
+            bytes_in_use(s) == 0 && p->producer_refcount > 0 && !timed_out;
+            s = spsc_consumer_snapshot(p, p->elem_size))
+            timed_out = !park(p, &sp, &p->just_pushed, &p->begin_lock,
+                              deadline);
+
+        retire_waiter(&p->consumers_waiting);
+    mutex_unlock(&p->begin_lock);
+
+    spin_end(p, &sp);
+
+    return s;
+}
+
+static size_t spsc_pop(pipe_t* p, void* restrict target, size_t requested,
+                       unsigned long long deadline)
+{
+    snapshot_t s      = spsc_consumer_snapshot(p, min(requested, p->max_cap));
+    size_t bytes_used = bytes_in_use(s);
+
+    if(unlikely(bytes_used == 0))
+    {
+        s          = spsc_wait_for_elements(p, deadline);
+        bytes_used = bytes_in_use(s);
+
+        if(unlikely(bytes_used == 0))
+            return 0;
+    }
+
+    size_t popped = min(requested, bytes_used);
+    char*  begin;
+
+    pop_without_locking(s, target, popped, &begin);
+    atomic_store_release(&p->begin, begin);
+
+    wake_waiters(&p->producers_waiting, &p->end_lock, &p->just_popped, 1);
+    after_pop(p, popped == bytes_used);
+
+    return popped;
+}
+
+// Performs the actual pop, except `requested' is now in bytes as opposed to
+// elements.
+//
+// This will behave eagerly, returning as many elements that it can into
+// `target' as it can fill right now. If the pipe's empty, it waits until
+// `deadline' for something to show up.
+static inline size_t __pipe_pop(pipe_t* p,
+                                void* restrict target,
+                                size_t requested,
+                                unsigned long long deadline)
+{
+    if(unlikely(requested == 0))
+        return 0;
+
+    if(p->engine == ENGINE_SPSC)
+        return spsc_pop(p, target, requested, deadline);
+
+    if(p->engine == ENGINE_MPMC)
+        return mpmc_pop(p, target, requested / __pipe_elem_size(p), deadline)
+             * __pipe_elem_size(p);
+
+    if(p->engine == ENGINE_SEGMENTED)
+        return segmented_pop(p, target, requested, deadline);
+
+    if(p->engine == ENGINE_SHARED)
+        return shared_pop(p, target, requested, deadline);
+
+    if(p->engine == ENGINE_BROADCAST)
+        return broadcast_pop(p, target, requested, deadline);
+
+    size_t popped = 0;
+    bool   empty;
+    char*  begin;
+
+    { policy_lock(p, &p->begin_lock);
+        snapshot_t s      = wait_for_elements(p, deadline);
+        size_t bytes_used = bytes_in_use(s);
+
+        if(unlikely(bytes_used == 0))
+        {
+            mutex_unlock(&p->begin_lock);
+            return 0;
+        }
+
+        check_invariants(p);
+
+        s = pop_without_locking(s, target,
+                                popped = min(requested, bytes_used),
+                                &begin
+        );
+
+        // Producers peek at begin without our lock.
+        atomic_store_release(&p->begin, begin);
+
+        empty = popped == bytes_used;
+
+        check_invariants(p);
+
+        trim_buffer(p, s);
+    } // p->begin_lock was unlocked by trim_buffer.
+
+    assertume(popped);
+
+    // Each element we popped made room for one producer.
+    wake_waiters(&p->producers_waiting, &p->end_lock, &p->just_popped,
+                 popped / __pipe_elem_size(p));
+
+    after_pop(p, empty);
+
+    return popped;
+}
+
+// Keeps popping until `target' is full, the pipe runs dry for good, or
+// `deadline' passes.
+static size_t pop_until(pipe_consumer_t* p, void* target, size_t count,
+                        unsigned long long deadline)
+{
+    size_t elem_size = __pipe_elem_size(PIPIFY(p));
+
+    size_t bytes_left  = count*elem_size;
+    size_t bytes_popped = 0;
+    size_t ret = -1;
+
+    do {
+        ret = __pipe_pop(PIPIFY(p), target, bytes_left, deadline);
+        target = (void*)((char*)target + ret);
+        bytes_popped += ret;
+        bytes_left   -= ret;
+    } while(ret != 0 && bytes_left);
+
+    note_pop(PIPIFY(p), bytes_popped / elem_size);
+
+    return bytes_popped / elem_size;
+}
+
+size_t pipe_pop(pipe_consumer_t* p, void* target, size_t count)
+{
+    return pop_until(p, target, count, NO_DEADLINE);
+}
+
+size_t pipe_pop_eager(pipe_consumer_t* p, void* target, size_t count)
+{
+    size_t elem_size = __pipe_elem_size(PIPIFY(p));
+    size_t popped = __pipe_pop(PIPIFY(p), target, count*elem_size, NO_DEADLINE)
+                  / elem_size;
+
+    note_pop(PIPIFY(p), popped);
+
+    return popped;
+}
+
+size_t pipe_try_pop(pipe_consumer_t* p, void* target, size_t count)
+{
+    return pop_until(p, target, count, 0);
+}
+
+size_t pipe_pop_timed(pipe_consumer_t* p, void* target, size_t count,
+                      unsigned long long deadline)
+{
+    return pop_until(p, target, count, deadline);
+}
+
+unsigned long long pipe_now(void)
+{
+    return now_ns();
+}
+
+// Returns a pointer to the left-most element in the pipe, and in `bytes' the
+// number of bytes which can be read from there in one go, without wrapping.
+static inline const char* contiguous_elems(snapshot_t s, size_t* bytes)
+{
+    const char* first = wrap_ptr_if_necessary(s.buffer,
+                                              s.begin + s.elem_size,
+                                              s.bufend);
+
+    *bytes = s.mirrored ? bytes_in_use(s)
+                        : min(bytes_in_use(s), (size_t)(s.bufend - first));
+
+    return first;
+}
+
+// Like locked_push_reserve, this returns with begin_lock held. It is released
+// by pipe_pop_release.
+static void locked_pop_acquire(pipe_t* p, size_t bytes,
+                               const void** ptr, size_t* acquired)
+{
+    policy_lock(p, &p->begin_lock);
+
+    snapshot_t s = wait_for_elements(p, NO_DEADLINE);
+
+    if(unlikely(bytes_in_use(s) == 0))
+        return;
+
+    size_t available;
+    *ptr      = contiguous_elems(s, &available);
+    *acquired = min(bytes, available);
+}
+
+static void spsc_pop_acquire(pipe_t* p, size_t bytes,
+                             const void** ptr, size_t* acquired)
+{
+    snapshot_t s = spsc_consumer_snapshot(p, min(bytes, p->max_cap));
+
+    if(unlikely(bytes_in_use(s) == 0))
+    {
+        s = spsc_wait_for_elements(p, NO_DEADLINE);
+
+        if(unlikely(bytes_in_use(s) == 0))
+            return;
+    }
+
+    size_t available;
+    *ptr      = contiguous_elems(s, &available);
+    *acquired = min(bytes, available);
+}
+
+// Hands out the rest of the consumers' segment, with begin_lock held until
+// pipe_pop_release.
+static void segmented_pop_acquire(pipe_t* p, size_t bytes,
+                                  const void** ptr, size_t* acquired)
+{
+    policy_lock(p, &p->begin_lock);
+
+    size_t available = segmented_wait_for_elements(p, NO_DEADLINE),
+           in_lane;
+
+    if(unlikely(available == 0))
+        return;
+
+    unsigned lane = segmented_pick(p, &in_lane);
+    lane_t*  h    = &p->heads[lane];
+
+    segmented_advance(p, h);
+
+    bytes = min(bytes, available);
+    bytes = min(bytes, in_lane);
+    bytes = min(bytes, p->seg_bytes - h->used);
+
+    p->acquired_lane = lane;
+
+    *ptr      = segment_data(h->seg) + h->used;
+    *acquired = bytes;
+}
+
+// Hands out the subscriber's next bytes up to the end of the ring, with
+// begin_lock held until pipe_pop_release. Dropping producers have to wait for
+// it too, so they can't overwrite what's been handed out.
+static void broadcast_pop_acquire(pipe_t* p, size_t bytes,
+                                  const void** ptr, size_t* acquired)
+{
+    broadcast_t* b = p->bcast;
+
+    policy_lock(p, &p->begin_lock);
+
+    size_t available = broadcast_wait_for_elements(p, NO_DEADLINE);
+
+    if(unlikely(available == 0))
+        return;
+
+    size_t offset = (size_t)(p->cursor % b->cap);
+
+    *ptr      = b->ring + offset;
+    *acquired = min(min(bytes, available), b->cap - offset);
+}
+
+void pipe_pop_acquire(pipe_consumer_t* handle, size_t max_count,
+                      const void** ptr, size_t* count)
+{
+    pipe_t* p = PIPIFY(handle);
+    size_t elem_size = __pipe_elem_size(p);
+
+    // See pipe_push_reserve.
+    assertume(p->engine != ENGINE_MPMC
+           && "pipe_pop_acquire is not supported on MPMC pipes.");
+    assertume(p->engine != ENGINE_SHARED
+           && "pipe_pop_acquire is not supported on shared pipes.");
+
+    size_t acquired = 0;
+    *ptr = NULL;
+
+    if(p->engine == ENGINE_SPSC)
+        spsc_pop_acquire(p, max_count*elem_size, ptr, &acquired);
+    else if(p->engine == ENGINE_LOCKED)
+        locked_pop_acquire(p, max_count*elem_size, ptr, &acquired);
+    else if(p->engine == ENGINE_SEGMENTED)
+        segmented_pop_acquire(p, max_count*elem_size, ptr, &acquired);
+    else if(p->engine == ENGINE_BROADCAST)
+        broadcast_pop_acquire(p, max_count*elem_size, ptr, &acquired);
+
+    // We now own the pop side of the pipe, so this is safe to write.
+    p->acquired = acquired;
+    *count      = acquired / elem_size;
+}
+
+void pipe_pop_release(pipe_consumer_t* handle, size_t count)
+{
+    pipe_t* p = PIPIFY(handle);
+    size_t elem_size = __pipe_elem_size(p);
+    size_t bytes     = count*elem_size;
+
+    assertume(bytes <= p->acquired
+           && "Released more elements than were acquired.");
+
+    p->acquired = 0;
+
+    if(p->engine == ENGINE_SPSC)
+    {
+        if(likely(bytes))
+        {
+            atomic_store_release(&p->begin,
+                wrap_ptr_if_necessary(p->buffer, p->begin + bytes, p->bufend));
+
+            note_pop(p, count);
+
+            wake_waiters(&p->producers_waiting,
+                         &p->end_lock, &p->just_popped, 1);
+            after_pop(p, bytes_in_use(spsc_consumer_snapshot(p, 0)) == 0);
+        }
+
+        return;
+    }
+
+    if(p->engine == ENGINE_MPMC || p->engine == ENGINE_SHARED)
+        return;
+
+    if(unlikely(bytes == 0))
+    {
+        mutex_unlock(&p->begin_lock);
+        return;
+    }
+
+    note_pop(p, count);
+
+    if(p->engine == ENGINE_SEGMENTED)
+    {
+        p->heads[p->acquired_lane].used += bytes;
+        segmented_popped(p, p->acquired_lane, bytes);
+        atomic_store_release(&p->popped_bytes, p->popped_bytes + bytes);
+
+        bool empty = segmented_available(p) == 0;
+
+        mutex_unlock(&p->begin_lock);
+
+        wake_waiters(&p->producers_waiting, &p->end_lock, &p->just_popped,
+                     count);
+
+        after_pop(p, empty);
+        return;
+    }
+
+    if(p->engine == ENGINE_BROADCAST)
+    {
+        atomic_store_release(&p->cursor, p->cursor + bytes);
+
+        mutex_unlock(&p->begin_lock);
+
+        if(p->bcast->lag == PIPE_LAG_BLOCK)
+            wake_waiters(&p->bcast->producers_waiting, &p->bcast->push_lock,
+                         &p->bcast->just_popped, count);
+        return;
+    }
+
+    atomic_store_release(&p->begin,
+        wrap_ptr_if_necessary(p->buffer, p->begin + bytes, p->bufend));
+
+    check_invariants(p);
+
+    snapshot_t s     = make_snapshot(p);
+    bool       empty = bytes_in_use(s) == 0;
+
+    trim_buffer(p, s); // unlocks begin_lock.
+
+    // Same as __pipe_pop.
+    wake_waiters(&p->producers_waiting, &p->end_lock, &p->just_popped, count);
+
+    after_pop(p, empty);
+}
+
+// Message pipes. See PIPE_MESSAGES.
+//
+// Every message is stored as a msg_header_t holding its length, followed by
+// the message itself. A producer pushes both under end_lock and publishes them
+// with a single store to `end', and a consumer pops both under begin_lock, so
+// whenever a consumer sees any bytes at all, it's looking at a whole message.
+// Resizes copy the bytes over in order, so they keep the framing intact.
+
+typedef uint32_t msg_header_t;
+
+#define MSG_HEADER sizeof(msg_header_t)
+
+int pipe_push_msg(pipe_producer_t* handle, const void* msg, size_t len)
+{
+    pipe_t* p = PIPIFY(handle);
+
+    assertume(p->messages && "pipe_push_msg needs a PIPE_MESSAGES pipe.");
+
+    const msg_header_t header = (msg_header_t)len;
+    const size_t       bytes  = MSG_HEADER + len;
+
+    if(unlikely(header != len))
+        return 0;
+
+    bool full;
+
+    { policy_lock(p, &p->end_lock);
+        size_t max_cap = p->max_cap;
+
+        // It would wait forever for room that can never be there.
+        if(unlikely(bytes > max_cap))
+        {
+            mutex_unlock(&p->end_lock);
+            return 0;
+        }
+
+        snapshot_t s = wait_for_room(p, bytes, &max_cap, NO_DEADLINE);
+
+        if(unlikely(p->consumer_refcount == 0))
+        {
+            mutex_unlock(&p->end_lock);
+            return 0;
+        }
+
+        s = validate_size(p, s, bytes);
+
+        // Unlike an ordinary push, we can't push just part of it if growing
+        // the buffer failed.
+        if(unlikely(capacity(s) - bytes_in_use(s) < bytes))
+        {
+            mutex_unlock(&p->end_lock);
+            return 0;
+        }
+
+        s.end = process_push(s, &header, MSG_HEADER);
+
+        if(likely(len))
+            s.end = process_push(s, msg, len);
+
+        atomic_store_release(&p->end, s.end);
+
+        full = max_cap - bytes_in_use(s) < MSG_HEADER;
+    } mutex_unlock(&p->end_lock);
+
+    note_push(p, bytes);
+
+    // A message is only good for one consumer.
+    wake_waiters(&p->consumers_waiting, &p->begin_lock, &p->just_pushed, 1);
+
+    after_push(p, full);
+
+    return 1;
+}
+
+// Waits for a message at the front of the pipe, and reads its length. Returns
+// with begin_lock held and `*s' pointing just past the header, unless the pipe
+// is empty for good, in which case it unlocks and returns false.
+static bool wait_for_msg(pipe_t* p, snapshot_t* s, size_t* len)
+{
+    assertume(p->messages && "Message pops need a PIPE_MESSAGES pipe.");
+
+    policy_lock(p, &p->begin_lock);
+
+    *s = wait_for_elements(p, NO_DEADLINE);
+
+    if(unlikely(bytes_in_use(*s) == 0))
+    {
+        mutex_unlock(&p->begin_lock);
+        return false;
+    }
+
+    msg_header_t header;
+    char*        begin;
+
+    // This only moves the snapshot's begin. The pipe's stays put until the
+    // whole message is popped.
+    *s   = pop_without_locking(*s, &header, MSG_HEADER, &begin);
+    *len = header;
+
+    return true;
+}
+
+// Pops the `bytes' bytes of the message at the front of the pipe, header and
+// all. Must be entered with begin_lock held, like trim_buffer, which unlocks
+// it.
+static void drop_msg(pipe_t* p, size_t bytes)
+{
+    atomic_store_release(&p->begin,
+        wrap_ptr_if_necessary(p->buffer, p->begin + bytes, p->bufend));
+
+    check_invariants(p);
+
+    snapshot_t s     = make_snapshot(p);
+    bool       empty = bytes_in_use(s) == 0;
+
+    trim_buffer(p, s); // unlocks begin_lock.
+
+    note_pop(p, bytes);
+
+    // Same as __pipe_pop.
+    wake_waiters(&p->producers_waiting, &p->end_lock, &p->just_popped, bytes);
+
+    after_pop(p, empty);
+}
+
+int pipe_pop_msg(pipe_consumer_t* handle, void* target, size_t max_len,
+                 size_t* len)
+{
+    pipe_t*    p = PIPIFY(handle);
+    snapshot_t s;
+    char*      begin;
+
+    if(!wait_for_msg(p, &s, len))
+        return 0;
+
+    if(likely(min(*len, max_len)))
+        pop_without_locking(s, target, min(*len, max_len), &begin);
+
+    drop_msg(p, MSG_HEADER + *len);
+
+    return 1;
+}
+
+int pipe_pop_msg_acquire(pipe_consumer_t* handle, const void** msg,
+                         size_t* len)
+{
+    pipe_t*    p = PIPIFY(handle);
+    snapshot_t s;
+
+    *msg = NULL;
+
+    if(!wait_for_msg(p, &s, len))
+        return 0;
+
+    size_t      available;
+    const char* first = contiguous_elems(s, &available);
+
+    // It wraps around the end of the buffer, so it has to be copied out.
+    if(unlikely(available < *len))
+    {
+        if(p->msg_scratch_size < *len)
+        {
+            size_t size    = next_pow2(*len);
+            char*  scratch = malloc(size);
+
+            if(unlikely(scratch == NULL))
+            {
+                mutex_unlock(&p->begin_lock);
+                return 0;
+            }
+
+            free(p->msg_scratch);
+
+            p->msg_scratch      = scratch;
+            p->msg_scratch_size = size;
+        }
+
+        char* begin;
+        pop_without_locking(s, p->msg_scratch, *len, &begin);
+
+        first = p->msg_scratch;
+    }
+
+    // We now own the pop side of the pipe, so this is safe to write.
+    p->acquired = MSG_HEADER + *len;
+    *msg        = first;
+
+    return 1;
+}
+
+void pipe_pop_msg_release(pipe_consumer_t* handle)
+{
+    pipe_t* p     = PIPIFY(handle);
+    size_t  bytes = p->acquired;
+
+    assertume(bytes >= MSG_HEADER
+           && "pipe_pop_msg_release without a pipe_pop_msg_acquire.");
+
+    p->acquired = 0;
+
+    drop_msg(p, bytes);
+}
+
+// One consumer registered with one poller. Each pipe_poller_add makes one, which
+// lives in both the poller's array and the pipe's list of watches.
+struct poll_watch_t {
+    pipe_poller_t* poller;
+    pipe_t*        pipe;
+    void*          tag;
+
+    poll_watch_t*  next; // The next watch on the same pipe. Guarded by the
+                         // pipe's end_lock.
+};
+
+struct pipe_poller_t {
+    poll_watch_t** watches; // Every consumer we're watching, in the order
+    size_t         count,   // they were added.
+                   cap,
+                   next;    // Where the next pipe_poll will start looking, so
+                            // that the first few pipes can't starve the rest.
+
+    mutex_t lock;
+    cond_t  poked;    // Signaled by pushes into any of our pipes.
+    int     sleeping; // 1 while we're about to sleep. See announce_waiter.
+};
+
+// end_lock must be held.
+static void notify_pollers(pipe_t* p)
+{
+    for(poll_watch_t* w = p->watches; unlikely(w != NULL); w = w->next)
+        wake_waiters(&w->poller->sleeping,
+                     &w->poller->lock, &w->poller->poked, 1);
+}
+
+// An SPSC snapshot for a thread that might be neither the producer nor the
+// consumer. It can't use (or update) either side's cached index.
+static inline snapshot_t spsc_snapshot(pipe_t* p)
+{
+    return (snapshot_t) {
+        .buffer = p->buffer,
+        .bufend = p->bufend,
+        .begin  = atomic_load_acquire(&p->begin),
+        .end    = atomic_load_acquire(&p->end),
+        .elem_size = __pipe_elem_size(p),
+        .mirrored  = p->granule != 0,
+    };
+}
+
+// Is there anything in the pipe? `begin_lock' must be held.
+static bool has_elements(pipe_t* p)
+{
+    if(p->engine == ENGINE_MPMC)
+        return mpmc_ready(p, &p->dequeue_pos, 1);
+    else if(p->engine == ENGINE_SPSC)
+        return bytes_in_use(spsc_snapshot(p)) != 0;
+    else if(p->engine == ENGINE_SEGMENTED)
+        return segmented_available(p) != 0;
+    else if(p->engine == ENGINE_SHARED)
+        return shared_available(p->shm) != 0;
+    else if(p->engine == ENGINE_BROADCAST)
+        return atomic_load_acquire(&p->bcast->pushed) != p->cursor;
+    else
+        return bytes_in_use(make_snapshot(p)) != 0;
+}
+
+// Would popping from `p' return right away? That's either because there's
+// something in it, or because there never will be again.
+static bool poll_ready(pipe_t* p)
+{
+    bool ready;
+
+    mutex_lock(&p->begin_lock);
+        ready = has_elements(p) || p->producer_refcount == 0;
+    mutex_unlock(&p->begin_lock);
+
+    return ready;
+}
+
+int pipe_eof(pipe_consumer_t* handle)
+{
+    pipe_t* p = PIPIFY(handle);
+    bool eof;
+
+    // Shared pipes may have producers in other processes, too, and broadcast
+    // pipes in other subscribers.
+    mutex_lock(&p->begin_lock);
+        eof = (p->shm   ? atomic_load_acquire(&p->shm->producers)
+             : p->bcast ? atomic_load_acquire(&p->bcast->producers)
+             :            p->producer_refcount) == 0
+           && !has_elements(p);
+    mutex_unlock(&p->begin_lock);
+
+    return eof;
+}
+
+int pipe_orphaned(pipe_producer_t* handle)
+{
+    pipe_t* p = PIPIFY(handle);
+    bool orphaned;
+
+    // Same as pipe_eof.
+    if(p->shm)
+        return atomic_load_acquire(&p->shm->consumers) == 0;
+
+    if(p->bcast)
+    {
+        mutex_lock(&p->bcast->sub_lock);
+            orphaned = p->bcast->subs == NULL;
+        mutex_unlock(&p->bcast->sub_lock);
+
+        return orphaned;
+    }
+
+    return atomic_load_acquire(&p->consumer_refcount) == 0;
+}
+
+// Would pushing into `p' return right away? The same as poll_ready, but for
+// the other side. The buffer may be gone once the consumers are, so that's
+// checked first.
+static bool room_ready(pipe_t* p)
+{
+    bool ready;
+
+    mutex_lock(&p->end_lock);
+        if(p->consumer_refcount == 0)
+            ready = true;
+        else if(p->engine == ENGINE_MPMC)
+            ready = mpmc_ready(p, &p->enqueue_pos, 0);
+        else if(p->engine == ENGINE_SPSC)
+            ready = bytes_in_use(spsc_snapshot(p)) < p->max_cap;
+        else if(p->engine == ENGINE_SEGMENTED)
+            ready = segmented_room(p) != 0;
+        else
+            ready = bytes_in_use(make_snapshot(p)) < p->max_cap;
+    mutex_unlock(&p->end_lock);
+
+    return ready;
+}
+
+// Makes `nf' signaled exactly when `ready' says so. See "Notification
+// descriptors" above. No pipe locks may be held.
+static void refresh_notifier(pipe_t* p, notifier_t* nf, bool (*ready)(pipe_t*))
+{
+    mutex_lock(&p->notify_lock);
+        if(likely(nf->active))
+        {
+            bool now = ready(p);
+
+            if(now && !nf->set)
+            {
+                notify_set(&nf->n);
+                atomic_store_relaxed(&nf->set, 1);
+            }
+            else if(!now && nf->set)
+            {
+                notify_clear(&nf->n);
+                atomic_store_relaxed(&nf->set, 0);
+
+                // Anyone who changes the pipe from now on will see `set' is 0,
+                // and come through here themselves. Anyone who changed it
+                // before will be seen by this check.
+                atomic_fence();
+
+                if(ready(p))
+                {
+                    notify_set(&nf->n);
+                    atomic_store_relaxed(&nf->set, 1);
+                }
+            }
+        }
+    mutex_unlock(&p->notify_lock);
+}
+
+static void refresh_readable(pipe_t* p)
+{
+    refresh_notifier(p, &p->readable, &poll_ready);
+}
+
+static void refresh_writable(pipe_t* p)
+{
+    refresh_notifier(p, &p->writable, &room_ready);
+}
 
-    // This shouldn't be necessary.
-    //s.end = wrap_ptr_if_necessary(s.buffer, s.end, s.bufend);
-    assertume(s.end != s.bufend);
+// Called once a push has made its elements visible, with no locks held.
+// `looks_full' is whether the pushing thread thinks it filled up the pipe. It
+// may be wrong, as long as it's only ever wrong by saying yes.
+static void after_push(pipe_t* p, bool looks_full)
+{
+    // Both sides fence between their store and their load (see
+    // announce_waiter), so either we see a new watch (or notifier) here, or
+    // the other side sees our elements.
+    atomic_fence();
 
-    // If we currently have a nowrap buffer, we may have to wrap the new
-    // elements. Copy as many as we can at the end, then start copying into the
-    // beginning. This basically reduces the problem to only deal with wrapped
-    // buffers, which can be dealt with using a single offset_memcpy.
-    if(!wraps_around(s))
+    if(unlikely(atomic_load_relaxed(&p->watches) != NULL))
     {
-        size_t at_end = min(bytes_to_copy, (size_t)(s.bufend - s.end));
+        mutex_lock(&p->end_lock);
+            notify_pollers(p);
+        mutex_unlock(&p->end_lock);
+    }
 
-        s.end = offset_memcpy(s.end, elems, at_end);
+    if(unlikely(atomic_load_relaxed(&p->readable.active))
+    && !atomic_load_relaxed(&p->readable.set))
+        refresh_readable(p);
 
-        elems = (const char*)elems + at_end;
-        bytes_to_copy -= at_end;
-    }
+    if(unlikely(atomic_load_relaxed(&p->readers) != NULL))
+        run_wakers(p, &p->readers);
 
-    // Now copy any remaining data...
-    if(unlikely(bytes_to_copy))
-    {
-        s.end = wrap_ptr_if_necessary(s.buffer, s.end, s.bufend);
-        s.end = offset_memcpy(s.end, elems, bytes_to_copy);
-    }
+    if(unlikely(looks_full)
+    && atomic_load_relaxed(&p->writable.active)
+    && atomic_load_relaxed(&p->writable.set))
+        refresh_writable(p);
+}
 
-    s.end = wrap_ptr_if_necessary(s.buffer, s.end, s.bufend);
+// The mirror image of after_push.
+static void after_pop(pipe_t* p, bool looks_empty)
+{
+    atomic_fence();
 
-    // ...and update the end pointer!
-    return s.end;
+    if(unlikely(atomic_load_relaxed(&p->writable.active))
+    && !atomic_load_relaxed(&p->writable.set))
+        refresh_writable(p);
+
+    if(unlikely(atomic_load_relaxed(&p->writers) != NULL))
+        run_wakers(p, &p->writers);
+
+    if(unlikely(looks_empty)
+    && atomic_load_relaxed(&p->readable.active)
+    && atomic_load_relaxed(&p->readable.set))
+        refresh_readable(p);
 }
 
-// Will spin until there is enough room in the buffer to push any elements.
-// Returns the number of elements currently in the buffer. `end_lock` should be
-// locked on entrance to this function.
-static inline snapshot_t wait_for_room(pipe_t* p, size_t* max_cap)
+// Creates the notifier if necessary, and returns its descriptor.
+static pipe_fd_t notifier_fd(pipe_t* p, notifier_t* nf, bool (*ready)(pipe_t*))
 {
-    snapshot_t s = make_snapshot(p);
+    // Other processes (or subscribers) would never signal it.
+    if(p->shm || p->bcast)
+        return PIPE_NO_FD;
 
-    size_t bytes_used = bytes_in_use(s);
+    mutex_lock(&p->notify_lock);
+        bool ok = nf->active || notify_new(&nf->n);
 
-    size_t consumer_refcount = p->consumer_refcount;
+        if(likely(ok) && !nf->active)
+        {
+            nf->set = 0;
+            atomic_store_relaxed(&nf->active, 1);
+        }
+    mutex_unlock(&p->notify_lock);
 
-    *max_cap = p->max_cap;
+    if(unlikely(!ok))
+        return PIPE_NO_FD;
 
-    for(; unlikely(bytes_used == *max_cap) && likely(consumer_refcount > 0);
-          s                 = make_snapshot(p),
-          bytes_used        = bytes_in_use(s),
-          consumer_refcount = p->consumer_refcount,
-          *max_cap          = p->max_cap)
-        cond_wait(&p->just_popped, &p->end_lock);
+    // Just like a clear, anyone around before we announced ourselves will be
+    // seen here.
+    atomic_fence();
+    refresh_notifier(p, nf, ready);
 
-    return s;
+    return notify_fd(&nf->n);
 }
 
-void __pipe_push(pipe_t* p,
-                 const void* restrict elems,
-                 size_t count)
+pipe_fd_t pipe_readable_fd(pipe_consumer_t* handle)
 {
-    size_t elem_size = __pipe_elem_size(p);
+    pipe_t* p = PIPIFY(handle);
+    return notifier_fd(p, &p->readable, &poll_ready);
+}
 
-    if(unlikely(count == 0))
-        return;
+pipe_fd_t pipe_writable_fd(pipe_producer_t* handle)
+{
+    pipe_t* p = PIPIFY(handle);
+    return notifier_fd(p, &p->writable, &room_ready);
+}
 
-    size_t pushed = 0;
+// Puts `w' on `list', unless `ready' says it's not needed. See "Wakers" above.
+static int add_waker(pipe_t* p, pipe_waker_t** list, pipe_waker_t* w,
+                     bool (*ready)(pipe_t*))
+{
+    // Same as notifier_fd.
+    assertume(!p->shm && !p->bcast
+           && "Shared and broadcast pipes don't support wakers.");
 
-    { mutex_lock(&p->end_lock);
-        size_t max_cap;
-        snapshot_t s = wait_for_room(p, &max_cap);
+    bool now;
 
-        // if no more consumers...
-        if(unlikely(p->consumer_refcount == 0))
-        {
-            mutex_unlock(&p->end_lock);
-            return;
-        }
+    mutex_lock(&p->notify_lock);
+        w->next = *list;
+        atomic_store_relaxed(list, w);
 
-        s = validate_size(p, s, count);
+        // Anyone who changes the pipe from now on will see the waker. Anyone
+        // who changed it before will be seen by this check.
+        atomic_fence();
 
-        // Finally, we can now begin with pushing as many elements into the
-        // queue as possible.
-        p->end = process_push(s, elems,
-                     pushed = min(count, max_cap - bytes_in_use(s)));
-    } mutex_unlock(&p->end_lock);
+        // Nobody can have run it yet, since they'd need notify_lock.
+        if((now = ready(p)))
+            atomic_store_relaxed(list, w->next);
+    mutex_unlock(&p->notify_lock);
 
-    assertume(pushed > 0);
+    return !now;
+}
 
-    // Signal if we've only pushed one element, broadcast if we've pushed more.
-    if(unlikely(pushed == elem_size))
-        cond_signal(&p->just_pushed);
-    else
-        cond_broadcast(&p->just_pushed);
+// Forgets every waker on `list', then calls them. No pipe locks may be held.
+static void run_wakers(pipe_t* p, pipe_waker_t** list)
+{
+    pipe_waker_t* w;
 
-    // We might not be done pushing. If the max_cap was reached, we'll need to
-    // recurse.
-    size_t bytes_remaining = count - pushed;
+    mutex_lock(&p->notify_lock);
+        w = *list;
+        atomic_store_relaxed(list, NULL);
+    mutex_unlock(&p->notify_lock);
 
-    if(unlikely(bytes_remaining))
-        __pipe_push(p, (const char*)elems + pushed, bytes_remaining);
+    while(w != NULL)
+    {
+        // It's theirs again the moment it's called.
+        pipe_waker_t* next = w->next;
+        w->wake(w->ctx);
+        w = next;
+    }
 }
 
-void pipe_push(pipe_producer_t* p, const void* restrict elems, size_t count)
+int pipe_wake_on_readable(pipe_consumer_t* handle, pipe_waker_t* waker)
 {
-    pipe_t* p0 = PIPIFY(p);
-    count *= __pipe_elem_size(p0);
-    __pipe_push(p0, elems, count);
+    pipe_t* p = PIPIFY(handle);
+    return add_waker(p, &p->readers, waker, &poll_ready);
 }
 
-/*
-#ifdef PIPE_DEBUG
-// For testing/debugging only, and is only available in debug mode. Assuming a
-// pipe of ints, prints them out. This function is not included or documented
-// in the header file!
-
-#include <stdio.h>
+int pipe_wake_on_writable(pipe_producer_t* handle, pipe_waker_t* waker)
+{
+    pipe_t* p = PIPIFY(handle);
+    return add_waker(p, &p->writers, waker, &room_ready);
+}
 
-void pipe_debug(pipe_t* p, const char* id)
+// Takes `w' back off `list', if it's still on it. notify_lock must be held.
+static bool remove_waker(pipe_waker_t** list, pipe_waker_t* w)
 {
-    printf("%s: [ ", id);
-    for(int* ptr = (int*)p->buffer; ptr != (int*)p->bufend; ++ptr)
-        printf("%i ", *ptr);
-    printf("]\n");
-    printf("begin: %lu    end: %lu\n", p->begin - p->buffer, p->end - p->buffer);
+    for(pipe_waker_t** at = list; *at != NULL; at = &(*at)->next)
+        if(*at == w)
+        {
+            atomic_store_relaxed(at, w->next);
+            return true;
+        }
+
+    return false;
 }
-#endif
-*/
 
-// Waits for at least one element to be in the pipe. p->begin_lock must be
-// locked when entering this function, and a new, valid snapshot is returned.
-static inline snapshot_t wait_for_elements(pipe_t* p)
+int pipe_wake_cancel(pipe_generic_t* handle, pipe_waker_t* waker)
 {
-    snapshot_t s = make_snapshot(p);
+    pipe_t* p = PIPIFY(handle);
+    bool found;
 
-    size_t bytes_used = bytes_in_use(s);
+    // They can't have any.
+    if(p->shm || p->bcast)
+        return 0;
 
-    for(; unlikely(bytes_used == 0) && likely(p->producer_refcount > 0);
-          s = make_snapshot(p),
-          bytes_used = bytes_in_use(s))
-        cond_wait(&p->just_pushed, &p->begin_lock);
+    mutex_lock(&p->notify_lock);
+        found = remove_waker(&p->readers, waker)
+             || remove_waker(&p->writers, waker);
+    mutex_unlock(&p->notify_lock);
 
-    return s;
+    return found;
 }
 
-// wow, I didn't even intend for the name to work like that...
-// returns a new snapshot, with the updated changes also reflected onto the
-// pipe.
-static inline snapshot_t pop_without_locking(snapshot_t s,
-                                             void* restrict target,
-                                             size_t bytes_to_copy,
-                                             char** begin // [out]
-                                            )
+// Takes the poller's `i'th watch off its pipe, and frees it.
+static void remove_watch(pipe_poller_t* poller, size_t i)
 {
-    assertume(s.begin != s.bufend);
+    poll_watch_t* w = poller->watches[i];
+    pipe_t*       p = w->pipe;
 
-    size_t elem_size = s.elem_size;
+    mutex_lock(&p->end_lock);
+        poll_watch_t** link = &p->watches;
 
-    // Copy either as many bytes as requested, or the available bytes in the RHS
-    // of a wrapped buffer - whichever is smaller.
-    {
-        size_t first_bytes_to_copy = min(bytes_to_copy, (size_t)(s.bufend - s.begin - elem_size));
+        while(*link != w)
+            link = &(*link)->next;
 
-        target = offset_memcpy(target, s.begin + elem_size, first_bytes_to_copy);
+        atomic_store_relaxed(link, w->next);
+    mutex_unlock(&p->end_lock);
 
-        bytes_to_copy -= first_bytes_to_copy;
+    // Keep the rest in order, so the round-robin stays fair.
+    memmove(poller->watches + i, poller->watches + i + 1,
+            (poller->count - i - 1) * sizeof *poller->watches);
 
-        s.begin       += first_bytes_to_copy;
-        s.begin = wrap_ptr_if_necessary(s.buffer, s.begin, s.bufend);
-    }
+    poller->count--;
 
-    if(unlikely(bytes_to_copy > 0))
-    {
-        s.begin += elem_size;
-        s.begin = wrap_ptr_if_necessary(s.buffer, s.begin, s.bufend);
+    free(w);
+}
 
-        memcpy(target, s.begin, bytes_to_copy);
+pipe_poller_t* pipe_poller_new(void)
+{
+    pipe_poller_t* poller = malloc(sizeof *poller);
 
-        s.begin += bytes_to_copy;
-        s.begin = wrap_ptr_if_necessary(s.buffer, s.begin, s.bufend);
+    if(unlikely(poller == NULL))
+        return NULL;
 
-        s.begin -= elem_size;
-        s.begin = rev_wrap_ptr_if_necessary(s.buffer, s.begin, s.bufend);
-    }
+    *poller = (pipe_poller_t) { .watches = NULL };
 
-    // Since we cached begin on the stack, we need to reflect our changes back
-    // on the pipe.
-    *begin = s.begin;
+    mutex_init(&poller->lock);
+    cond_init(&poller->poked);
 
-    return s;
+    return poller;
 }
 
-// If the buffer is shrunk to something a lot smaller than our current
-// capacity, resize it to something sane. This function must be entered with
-// only p->begin_lock locked, and will automatically unlock p->begin_lock on
-// exit.
-static inline void trim_buffer(pipe_t* p, snapshot_t s)
+void pipe_poller_free(pipe_poller_t* poller)
 {
-    size_t cap = capacity(s);
+    while(poller->count > 0)
+        remove_watch(poller, poller->count - 1);
 
-    // We have a sane size. We're done here.
-    if(likely(bytes_in_use(s) > cap / 4))
+    mutex_destroy(&poller->lock);
+    cond_destroy(&poller->poked);
+
+    free(poller->watches);
+    free(poller);
+}
+
+int pipe_poller_add(pipe_poller_t* poller, pipe_consumer_t* handle, void* tag)
+{
+    pipe_t* p = PIPIFY(handle);
+
+    // Same as notifier_fd.
+    if(p->shm || p->bcast)
+        return 0;
+
+    if(poller->count == poller->cap)
     {
-        mutex_unlock(&p->begin_lock);
-        return;
+        size_t new_cap = poller->cap ? 2*poller->cap : 8;
+        poll_watch_t** watches = realloc(poller->watches,
+                                         new_cap * sizeof *watches);
+
+        if(unlikely(watches == NULL))
+            return 0;
+
+        poller->watches = watches;
+        poller->cap     = new_cap;
     }
 
-    // Okay, we need to resize now. Upgrade our lock so we can check again. The
-    // weird lock/unlock order is to make sure we always acquire the end_lock
-    // before begin_lock. Deadlock can arise otherwise.
-    mutex_unlock(&p->begin_lock);
-    mutex_lock(&p->end_lock);
-    mutex_lock(&p->begin_lock);
+    poll_watch_t* w = malloc(sizeof *w);
 
-    s   = make_snapshot(p);
-    cap = capacity(s);
+    if(unlikely(w == NULL))
+        return 0;
 
-    // To conserve space like the good computizens we are, we'll shrink
-    // our buffer if our memory usage efficiency drops below 25%. However,
-    // since shrinking/growing the buffer is the most expensive part of a push
-    // or pop, we only shrink it to bring us up to a 50% efficiency. A common
-    // pipe usage pattern is sudden bursts of pushes and pops. This ensures it
-    // doesn't get too time-inefficient.
-    if(likely(bytes_in_use(s) <= cap / 4))
-        resize_buffer(p, cap / 2);
+    *w = (poll_watch_t) {
+        .poller = poller,
+        .pipe   = p,
+        .tag    = tag,
+    };
 
-    // All done. Unlock the pipe. The reason we don't let the calling function
-    // unlock begin_lock is so that we can do it BEFORE end_lock. This prevents
-    // the lock order from being fudged.
-    mutex_unlock(&p->begin_lock);
+    mutex_lock(&p->end_lock);
+        w->next = p->watches;
+        atomic_store_relaxed(&p->watches, w);
     mutex_unlock(&p->end_lock);
-}
 
-// Performs the actual pop, except `requested' is now in bytes as opposed to
-// elements.
-//
-// This will behave eagerly, returning as many elements that it can into
-// `target' as it can fill right now.
-static inline size_t __pipe_pop(pipe_t* p,
-                                void* restrict target,
-                                size_t requested)
-{
-    if(unlikely(requested == 0))
-        return 0;
+    poller->watches[poller->count++] = w;
 
-    size_t popped = 0;
+    return 1;
+}
 
-    { mutex_lock(&p->begin_lock);
-        snapshot_t s      = wait_for_elements(p);
-        size_t bytes_used = bytes_in_use(s);
+void pipe_poller_remove(pipe_poller_t* poller, pipe_consumer_t* handle)
+{
+    pipe_t* p = PIPIFY(handle);
 
-        if(unlikely(bytes_used == 0))
+    for(size_t i = 0; i < poller->count; ++i)
+        if(poller->watches[i]->pipe == p)
         {
-            mutex_unlock(&p->begin_lock);
-            return 0;
+            remove_watch(poller, i);
+            return;
         }
+}
 
-        check_invariants(p);
-
-        s = pop_without_locking(s, target,
-                                popped = min(requested, bytes_used),
-                                &p->begin
-        );
+void pipe_poller_remove_tag(pipe_poller_t* poller, pipe_consumer_t* handle,
+                            void* tag)
+{
+    pipe_t* p = PIPIFY(handle);
 
-        check_invariants(p);
+    for(size_t i = 0; i < poller->count; ++i)
+        if(poller->watches[i]->pipe == p && poller->watches[i]->tag == tag)
+        {
+            remove_watch(poller, i);
+            return;
+        }
+}
 
-        trim_buffer(p, s);
-    } // p->begin_lock was unlocked by trim_buffer.
+// Fills `ready' with the tags of up to `max' ready consumers, starting with the
+// one after where we left off last time.
+static size_t poll_once(pipe_poller_t* poller, void** ready, size_t max)
+{
+    size_t found = 0,
+           count = poller->count,
+           start = poller->next;
 
-    assertume(popped);
+    for(size_t k = 0; k < count && found < max; ++k)
+    {
+        size_t i = (start + k) % count;
 
-    if(unlikely(popped == __pipe_elem_size(p)))
-        cond_signal(&p->just_popped);
-    else
-        cond_broadcast(&p->just_popped);
+        if(poll_ready(poller->watches[i]->pipe))
+        {
+            ready[found++] = poller->watches[i]->tag;
+            poller->next   = i + 1;
+        }
+    }
 
-    return popped;
+    return found;
 }
 
-size_t pipe_pop(pipe_consumer_t* p, void* target, size_t count)
+size_t pipe_poll(pipe_poller_t* poller, void** ready, size_t max)
 {
-    size_t elem_size = __pipe_elem_size(PIPIFY(p));
+    if(unlikely(poller->count == 0 || max == 0))
+        return 0;
 
-    size_t bytes_left  = count*elem_size;
-    size_t bytes_popped = 0;
-    size_t ret = -1;
+    size_t found = poll_once(poller, ready, max);
 
-    do {
-        ret = __pipe_pop(PIPIFY(p), target, bytes_left);
-        target = (void*)((char*)target + ret);
-        bytes_popped += ret;
-        bytes_left   -= ret;
-    } while(ret != 0 && bytes_left);
+    if(likely(found > 0))
+        return found;
 
-    return bytes_popped / elem_size;
-}
+    mutex_lock(&poller->lock);
+        announce_waiter(&poller->sleeping);
 
-size_t pipe_pop_eager(pipe_consumer_t* p, void* target, size_t count)
-{
-    size_t elem_size = __pipe_elem_size(PIPIFY(p));
-    return __pipe_pop(PIPIFY(p), target, count*elem_size) / elem_size;
+        // Anything pushed after this check will see that we're sleeping, and
+        // will have to take our lock to poke us. Since we hold it until we're
+        // waiting, we can't miss it.
+        while((found = poll_once(poller, ready, max)) == 0)
+            cond_wait(&poller->poked, &poller->lock);
+
+        retire_waiter(&poller->sleeping);
+    mutex_unlock(&poller->lock);
+
+    return found;
 }
 
 void pipe_reserve(pipe_generic_t* gen, size_t count)
 {
     pipe_t* p = PIPIFY(gen);
 
+    // Fixed-size pipes have nothing to reserve.
+    if(p->engine != ENGINE_LOCKED || p->resize == PIPE_RESIZE_FIXED)
+        return;
+
     count *= __pipe_elem_size(p); // now `count' is in "bytes" instead of "elements".
 
     if(count == 0)
@@ -1122,4 +6500,48 @@ void pipe_reserve(pipe_generic_t* gen, size_t count)
     );
 }
 
+#ifdef PIPE_STATS
+static void read_wait_stats(pipe_wait_stats_t* to, pipe_wait_stats_t* from)
+{
+    to->count    = atomic_load_relaxed(&from->count);
+    to->total_ns = atomic_load_relaxed(&from->total_ns);
+    to->max_ns   = atomic_load_relaxed(&from->max_ns);
+
+    for(size_t i = 0; i < PIPE_STATS_BUCKETS; ++i)
+        to->histogram[i] = atomic_load_relaxed(&from->histogram[i]);
+}
+#endif
+
+int pipe_get_stats(pipe_generic_t* gen, pipe_stats_t* stats)
+{
+    memset(stats, 0, sizeof *stats);
+
+#ifdef PIPE_STATS
+    pipe_t* p = PIPIFY(gen);
+    size_t elem_size = __pipe_elem_size(p);
+
+    stats->pushes = atomic_load_relaxed(&p->push_stats.calls);
+    stats->pushed = atomic_load_relaxed(&p->push_stats.elems);
+    stats->pops   = atomic_load_relaxed(&p->pop_stats.calls);
+    stats->popped = atomic_load_relaxed(&p->pop_stats.elems);
+
+    stats->pushed_bytes = stats->pushed * elem_size;
+    stats->popped_bytes = stats->popped * elem_size;
+
+    stats->resizes    = atomic_load_relaxed(&p->resizes);
+    stats->spills     = atomic_load_relaxed(&p->spills);
+    stats->high_water = atomic_load_relaxed(&p->high_water);
+
+    read_wait_stats(&stats->room_waits, &p->push_stats.sleeps);
+    read_wait_stats(&stats->elem_waits, &p->pop_stats.sleeps);
+    read_wait_stats(&stats->push_lock,  &p->push_stats.lock);
+    read_wait_stats(&stats->pop_lock,   &p->pop_stats.lock);
+
+    return 1;
+#else
+    (void)gen;
+    return 0;
+#endif
+}
+
 /* vim: set et ts=4 sw=4 softtabstop=4 textwidth=80: */
@@ -153,6 +153,316 @@ typedef struct pipe_generic_t  pipe_generic_t;
  */
 pipe_t* MALLOC_LIKE WARN_UNUSED_RESULT pipe_new(size_t elem_size, size_t limit);
 
+/*
+ * Initializes a new single-producer single-consumer pipe. It is used exactly
+ * like a pipe returned by pipe_new, except that at most one thread may be
+ * pushing into it and at most one thread may be popping from it at any given
+ * time. In exchange, pushes and pops don't take any locks unless the other end
+ * has to be woken up.
+ *
+ * SPSC pipes never resize, so they always have a limit. If `limit' is 0, a
+ * reasonable default is picked for you. pipe_reserve does nothing on them.
+ */
+pipe_t* MALLOC_LIKE WARN_UNUSED_RESULT pipe_new_spsc(size_t elem_size,
+                                                     size_t limit);
+
+/*
+ * Initializes a new lock-free pipe which any number of threads may push into
+ * and pop from, like one returned by pipe_new. Instead of serializing on a
+ * mutex, concurrent pushes and pops each claim their room in the pipe with a
+ * single atomic operation. Use this when many threads hammer the same pipe.
+ *
+ * MPMC pipes never resize, so they always have a limit, which is rounded up to
+ * the next power of two. If `limit' is 0, a reasonable default is picked for
+ * you. pipe_reserve does nothing on them.
+ */
+pipe_t* MALLOC_LIKE WARN_UNUSED_RESULT pipe_new_mpmc(size_t elem_size,
+                                                     size_t limit);
+
+/*
+ * The engines a pipe can run on. See pipe_new, pipe_new_spsc and pipe_new_mpmc.
+ *
+ * PIPE_ENGINE_SEGMENTED pipes are used just like the default ones, but keep
+ * their elements in a chain of fixed-size segments instead of one big buffer.
+ * Growing them just links on another segment, and shrinking hands finished
+ * segments back, so neither ever has to copy the elements already in the pipe
+ * or stop the other side while it happens. Use them for pipes which can build
+ * up huge backlogs. They can't be mirrored, and pipe_reserve does nothing on
+ * them.
+ *
+ * PIPE_ENGINE_BROADCAST pipes hand every element to every subscriber, instead
+ * of to just one consumer. See pipe_subscribe.
+ */
+typedef enum {
+    PIPE_ENGINE_LOCKED = 0,
+    PIPE_ENGINE_SPSC,
+    PIPE_ENGINE_MPMC,
+    PIPE_ENGINE_SEGMENTED,
+    PIPE_ENGINE_BROADCAST
+} pipe_engine_t;
+
+/*
+ * Maps the pipe's buffer twice in a row in virtual memory, so that elements
+ * which wrap around the end of the buffer are still contiguous. Pushes and pops
+ * then never have to be split in two, and pipe_push_reserve/pipe_pop_acquire
+ * always hand out everything that's available. This costs a little address
+ * space, and rounds the buffer up to a whole number of pages.
+ *
+ * It is silently ignored by MPMC pipes (which don't wrap anyways), and on
+ * platforms that can't do it (Windows before 10, mostly).
+ */
+#define PIPE_MIRRORED 0x1u
+
+/*
+ * Binds the pipe's memory to NUMA node `numa_node' (see pipe_options_t), so
+ * that its pages are only ever allocated there, whichever thread touches them
+ * first. Memory from a custom allocator is bound too, as far as it can be:
+ * only whole pages can be moved, so make sure your allocator hands out page
+ * aligned memory if you need all of it on the node.
+ *
+ * This only does anything on Linux, and is ignored if the node doesn't exist.
+ */
+#define PIPE_NUMA_BIND 0x2u
+
+/*
+ * Makes a message pipe, which carries variable-sized messages instead of
+ * fixed-size elements. Each message is kept in the pipe's buffer right behind
+ * a 4-byte length, so there's no need to pad them all out to the biggest one,
+ * or to push pointers to them instead. Push and pop them with pipe_push_msg,
+ * pipe_pop_msg and pipe_pop_msg_acquire, and never with the other push and pop
+ * functions.
+ *
+ * Message pipes must have an `elem_size' of 1, and their `limit' is in bytes,
+ * headers included. Only the default engine carries messages, so pipe_new_ex
+ * returns NULL for any other. Make them PIPE_MIRRORED too, and
+ * pipe_pop_msg_acquire never has to copy anything.
+ */
+#define PIPE_MESSAGES 0x4u
+
+/*
+ * What a thread does when it has to wait on a pipe, whether for room, for
+ * elements, or for one of the pipe's locks. Spinning notices the other side
+ * within nanoseconds instead of microseconds, but burns a whole core while it
+ * waits, so only spin if every spinning thread has a core to itself.
+ */
+typedef enum {
+    PIPE_WAIT_PARK = 0, /* Go straight to sleep. The default.                */
+    PIPE_WAIT_SPIN,     /* Busy-wait, and never sleep.                      */
+    PIPE_WAIT_YIELD,    /* Busy-wait for `spins' laps, then keep yielding
+                           the processor to other threads. Never sleeps.    */
+    PIPE_WAIT_ADAPTIVE  /* Busy-wait for a while, then sleep. How long is
+                           learned from how long recent waits took, and
+                           is at most `spins' laps.                         */
+} pipe_wait_t;
+
+/*
+ * How a locked pipe's buffer grows and shrinks as elements come and go. SPSC
+ * and MPMC pipes never resize, so they ignore this. Segmented pipes always grow
+ * one segment at a time, and normally only keep a couple of finished segments
+ * around for reuse. PIPE_RESIZE_FIXED and PIPE_RESIZE_NEVER_SHRINK have them
+ * keep every segment instead, and PIPE_RESIZE_FIXED allocates enough segments
+ * for the whole limit up front.
+ */
+typedef enum {
+    PIPE_RESIZE_DEFAULT = 0,  /* Double the buffer whenever it fills up, and
+                                 halve it when it drops below a quarter full. */
+    PIPE_RESIZE_FIXED,        /* Allocate room for the whole limit up front,
+                                 and never resize. Pipes without a limit treat
+                                 this like PIPE_RESIZE_NEVER_SHRINK.          */
+    PIPE_RESIZE_NEVER_SHRINK, /* Grow like the default, but keep the memory
+                                 until the pipe is freed.                     */
+    PIPE_RESIZE_HYSTERESIS    /* Like the default, but only shrink once the
+                                 pipe has stayed below a quarter full for
+                                 `shrink_window' pops in a row.               */
+} pipe_resize_t;
+
+/*
+ * What a broadcast pipe does once a subscriber is `limit' elements behind.
+ */
+typedef enum {
+    PIPE_LAG_BLOCK = 0, /* Producers wait for the slowest subscriber.       */
+    PIPE_LAG_DROP       /* Producers never wait. They overwrite the oldest
+                           elements, and subscribers that hadn't got to them
+                           yet skip them (see pipe_dropped).                */
+} pipe_lag_t;
+
+/*
+ * Where a pipe's buffer comes from, instead of malloc and free. Use this to
+ * put pipes in an arena, on hugepages, or on a particular NUMA node.
+ *
+ * `alloc' returns `bytes' bytes, aligned for any element like malloc's, or
+ * NULL. `free' is given back the same pointer and size. Every call gets `ctx'.
+ * A pipe calls them from whichever thread happens to resize it, while holding
+ * its own locks, so they must not touch the pipe, and must be thread-safe if
+ * `ctx' is shared. If allocating fails while creating a pipe, pipe_new_ex
+ * returns NULL. If growing an existing pipe fails, it keeps the buffer it has:
+ * pushes fill what's left of it, then stop short, as if their deadline had
+ * passed, and pipe_push_reserve hands out no more room than that. pipe_push
+ * can't tell you, so use PIPE_RESIZE_FIXED with allocators that can run out,
+ * or check what pipe_try_push returns.
+ *
+ * Mirrored buffers are mapped by the pipe itself, so they don't come from here
+ * unless mirroring fails. The allocator must outlive every pipe using it.
+ */
+typedef struct {
+    void* (*alloc)(void* ctx, size_t bytes);
+    void  (*free)(void* ctx, void* ptr, size_t bytes);
+    void*   ctx;
+} pipe_allocator_t;
+
+/*
+ * Everything pipe_new_ex can be told. Zero-initialize it and fill in what you
+ * care about; zeros are always the same as pipe_new's defaults.
+ */
+typedef struct {
+    pipe_engine_t engine;
+    unsigned      flags;  /* A bitwise-or of the PIPE_* flags above. */
+    pipe_wait_t   wait;
+    unsigned      spins;  /* See pipe_wait_t. 0 picks a default.     */
+
+    pipe_resize_t resize;
+    unsigned      shrink_window; /* See pipe_resize_t. 0 picks a default. */
+
+    const pipe_allocator_t* allocator; /* NULL means malloc and free. */
+
+    size_t        segment; /* The number of elements in each segment of a
+                              PIPE_ENGINE_SEGMENTED pipe. 0 picks a default. */
+
+    unsigned      numa_node; /* See PIPE_NUMA_BIND. */
+
+    const char*   spill_dir;   /* See below. NULL never spills.         */
+    size_t        spill_after; /* In elements. 0 picks a default (64 MiB
+                                  worth).                               */
+
+    unsigned        lanes;        /* See below. 0 is the same as 1.       */
+    const unsigned* lane_weights; /* `lanes' of them, or NULL.            */
+
+    pipe_lag_t    lag; /* Only for PIPE_ENGINE_BROADCAST. */
+} pipe_options_t;
+
+/*
+ * Lanes:
+ *
+ * A PIPE_ENGINE_SEGMENTED pipe can have up to PIPE_MAX_LANES lanes, each its
+ * own FIFO, which share the pipe's limit. Push into them with pipe_push_lane.
+ * Pops take from the highest lane with anything in it first, so urgent
+ * elements pushed into a high lane skip ahead of everything in the lower ones.
+ * Elements from one lane still come out in the order they went in. Popping
+ * blocks and ends just as it does for any other pipe, so the consumer end can
+ * go anywhere a normal pipe's can.
+ *
+ * Busy high lanes can starve the low ones forever. To stop that, give every
+ * lane a weight in `lane_weights', and each gets to pop that many elements in
+ * turn, highest first, before the lanes below it get theirs. While every lane
+ * has elements, lane i gets lane_weights[i] out of every sum(lane_weights).
+ * A weight of 0 counts as 1.
+ *
+ * pipe_new_ex returns NULL for more than PIPE_MAX_LANES lanes, or for more
+ * than 1 on any other engine. Each lane starts out with a segment of its own,
+ * so keep segments small if there are lots of lanes.
+ */
+#define PIPE_MAX_LANES 8
+
+/*
+ * Spilling:
+ *
+ * A PIPE_ENGINE_SEGMENTED pipe with a `spill_dir' keeps at most about
+ * `spill_after' elements in memory. Past that, new segments go in a file in
+ * `spill_dir' instead, which is written out as soon as each segment fills up,
+ * and read back in as the consumers get to it. Elements still come out in the
+ * order they went in, and producers never wait for the consumers to catch up,
+ * unless the pipe has a limit. That's for pipes whose consumers can fall
+ * hours behind, where an unbounded pipe would eventually eat all the memory.
+ *
+ * The file has no name, so it's gone as soon as the pipe is, even if the
+ * process dies. It's as big as the most that's ever been spilled at once, but
+ * gives back the disk space of whatever's been popped. If the disk fills up,
+ * new segments come from memory again. Put `spill_dir' on a real disk, since
+ * a tmpfs is only memory anyway, and make segments big (a megabyte or so), so
+ * each one is worth a trip to the disk.
+ *
+ * pipe_new_ex returns NULL if the file can't be made, if the pipe isn't
+ * segmented, or on platforms which can't map files.
+ */
+
+/*
+ * Like pipe_new, but with knobs. pipe_new(elem_size, limit) is the same as
+ * pipe_new_ex(elem_size, limit, NULL).
+ */
+pipe_t* MALLOC_LIKE WARN_UNUSED_RESULT pipe_new_ex(size_t elem_size,
+                                                   size_t limit,
+                                                   const pipe_options_t*);
+
+/*
+ * Makes a pipe in shared memory, named `name', which other processes can open
+ * with pipe_open_shared. Names work like shm_open's: a leading slash, and no
+ * others. This fails if the name is already taken, and returns NULL.
+ *
+ * Shared pipes are pushed and popped like any others, from any of the
+ * processes, and each element costs just a memcpy in and a memcpy out. Their
+ * buffer is fixed at `limit' elements, or a default if that's 0, and must hold
+ * plain data, since the other processes see it at different addresses. They
+ * can't be polled, can't have descriptors, and don't support pipe_push_reserve
+ * or pipe_pop_acquire.
+ *
+ * The name goes away once every process that had it open has freed all its
+ * handles, so open it before the creator is done with it. If a process dies
+ * while it's holding one of the pipe's locks, or without freeing its handles,
+ * everyone else waits on it forever. Use the *_timed functions if that's a
+ * worry, and shm_unlink the name yourself if it's left behind.
+ *
+ * This only works on POSIX systems which can share mutexes and condition
+ * variables between processes. Everywhere else, it returns NULL.
+ */
+pipe_t* MALLOC_LIKE WARN_UNUSED_RESULT NO_NULL_POINTERS
+pipe_new_shared(const char* name, size_t elem_size, size_t limit);
+
+/*
+ * Opens the shared pipe made by pipe_new_shared in another process (or this
+ * one). The pipe_t it returns works just like the creator's: it counts as both
+ * a producer and a consumer until it's freed. Returns NULL if there's no such
+ * pipe, or if it's already been let go by everyone.
+ */
+pipe_t* MALLOC_LIKE WARN_UNUSED_RESULT NO_NULL_POINTERS
+pipe_open_shared(const char* name);
+
+/*
+ * Subscribes to a PIPE_ENGINE_BROADCAST pipe, through any of its handles. The
+ * pipe_t it returns is a new subscriber, which gets its own copy of every
+ * element pushed after this, alongside every other subscriber. The pipe_t
+ * pipe_new_ex returned is the first subscriber.
+ *
+ * Every subscriber works like a pipe_t of its own: make consumers from it to
+ * read its copy (if it has several, they split that copy between them, like
+ * any other pipe's consumers), and producers to push to everyone. It counts as
+ * a producer and a consumer until it's freed, so free it as soon as you've
+ * made its handles. Subscribers whose consumers are all gone stop getting
+ * elements, and stop holding anyone up. Once every subscriber's producers are
+ * gone, every subscriber sees the end of the pipe after its last element.
+ *
+ * Each element is only stored once, in a ring of `limit' elements, or a
+ * default if that's 0. Subscribers read it straight out of there, and
+ * pipe_pop_acquire hands out the ring itself, so nothing is copied for each
+ * subscriber unless it asks. What happens when the slowest subscriber
+ * falls a whole ring behind depends on the pipe's pipe_lag_t. Producers
+ * dropping elements have to wait for a subscriber to finish copying (or
+ * release what it acquired) before they can skip it ahead, so never push to
+ * a broadcast pipe while holding an acquire on it.
+ *
+ * Broadcast pipes can't be polled, can't have descriptors, and don't support
+ * pipe_push_reserve. Returns NULL if the pipe isn't a broadcast pipe, or if
+ * we're out of memory.
+ */
+pipe_t* MALLOC_LIKE WARN_UNUSED_RESULT NO_NULL_POINTERS
+pipe_subscribe(pipe_generic_t*);
+
+/*
+ * How many elements have been dropped before this subscriber could get to
+ * them, because it fell too far behind a PIPE_LAG_DROP pipe. It's always 0
+ * for other pipes.
+ */
+unsigned long long NO_NULL_POINTERS pipe_dropped(pipe_consumer_t*);
+
 /*
  * Makes a production handle to the pipe, allowing push operations. This
  * function is extremely cheap; it doesn't allocate memory.
@@ -177,6 +487,62 @@ void pipe_consumer_free(pipe_consumer_t*);
 /* Copies `count' elements from `elems' into the pipe. */
 void NO_NULL_POINTERS pipe_push(pipe_producer_t*, const void* elems, size_t count);
 
+/*
+ * The current time, in nanoseconds, according to a monotonic clock that starts
+ * at some arbitrary point. Deadlines given to the *_timed functions are in
+ * terms of this clock, so "one millisecond from now" is pipe_now() + 1000000.
+ */
+unsigned long long pipe_now(void);
+
+/*
+ * Like pipe_push, but gives up once `deadline' (see pipe_now) has passed
+ * instead of waiting forever for room. Returns the number of elements that were
+ * pushed, which is less than `count' if time ran out first or if all the
+ * consumers are gone. Whatever was pushed stays pushed.
+ */
+size_t NO_NULL_POINTERS pipe_push_timed(pipe_producer_t*,
+                                        const void* elems, size_t count,
+                                        unsigned long long deadline);
+
+/*
+ * Pushes as many of the `count' elements as fit right now, without ever
+ * blocking, and returns how many that was. Unbounded pipes always fit
+ * everything.
+ */
+size_t NO_NULL_POINTERS pipe_try_push(pipe_producer_t*,
+                                      const void* elems, size_t count);
+
+/*
+ * Like pipe_push, but into one of the pipe's lanes (see "Lanes" above).
+ * Every pipe has a lane 0, which is the one pipe_push and pipe_push_reserve
+ * use.
+ */
+void NO_NULL_POINTERS pipe_push_lane(pipe_producer_t*, unsigned lane,
+                                     const void* elems, size_t count);
+
+/*
+ * Lends out room for up to `max_count' elements inside the pipe itself, so you
+ * can build them in place (or read() straight into it) instead of copying them
+ * in with pipe_push. On return, `*ptr' points at the room and `*count' is how
+ * many elements fit there. This blocks until there's room for at least one.
+ *
+ * The room is always contiguous, so you may get fewer than `max_count' elements
+ * even if more room is available (unless the pipe is PIPE_MIRRORED). Just
+ * reserve again once you've committed.
+ *
+ * Every call must be followed by exactly one pipe_push_commit, which makes the
+ * first `count' elements of the region (at most what was reserved) visible to
+ * consumers. Until then, nobody else can push into the pipe, so don't sit on
+ * it. If every consumer is gone, `*count' is 0, but you must still commit.
+ *
+ * This is not supported on pipes made with pipe_new_mpmc.
+ */
+void NO_NULL_POINTERS pipe_push_reserve(pipe_producer_t*, size_t max_count,
+                                        void** ptr, size_t* count);
+
+/* Pushes the first `count' elements of the region from pipe_push_reserve. */
+void NO_NULL_POINTERS pipe_push_commit(pipe_producer_t*, size_t count);
+
 /*
  * Copies `count' elements from `elems' into the pipe.
  *
@@ -230,13 +596,258 @@ size_t NO_NULL_POINTERS WARN_UNUSED_RESULT pipe_pop_eager(pipe_consumer_t*,
                                                           void* target,
                                                           size_t count);
 
+/*
+ * Like pipe_pop, but gives up once `deadline' (see pipe_now) has passed,
+ * returning however many elements were popped by then.
+ *
+ * Since 0 can now also mean "not yet", use pipe_eof to tell it apart from "not
+ * ever".
+ */
+size_t NO_NULL_POINTERS WARN_UNUSED_RESULT pipe_pop_timed(pipe_consumer_t*,
+                                                          void* target,
+                                                          size_t count,
+                                                     unsigned long long deadline);
+
+/*
+ * Pops up to `count' elements that are in the pipe right now, without ever
+ * blocking, and returns how many that was. As with pipe_pop_timed, a return
+ * value of 0 doesn't mean the pipe is finished; ask pipe_eof.
+ */
+size_t NO_NULL_POINTERS WARN_UNUSED_RESULT pipe_try_pop(pipe_consumer_t*,
+                                                        void* target,
+                                                        size_t count);
+
+/*
+ * Returns nonzero if the pipe is empty and all producer_t handles have been
+ * freed (including the parent pipe_t), meaning nothing will ever be popped
+ * from it again. Once this is true, it stays true.
+ */
+int NO_NULL_POINTERS pipe_eof(pipe_consumer_t*);
+
+/*
+ * The producers' pipe_eof: returns nonzero once all consumer_t handles have
+ * been freed (including the parent pipe_t), meaning anything pushed from now
+ * on is just thrown away. Once this is true, it stays true.
+ */
+int NO_NULL_POINTERS pipe_orphaned(pipe_producer_t*);
+
+/*
+ * Lends out up to `max_count' elements from the front of the pipe, without
+ * copying them anywhere. On return, `*ptr' points at the elements and `*count'
+ * is how many of them there are. Like pipe_pop_eager, this blocks until there
+ * is at least one element to hand out, or until all producers have been freed
+ * and the pipe is empty, in which case `*count' is 0.
+ *
+ * The elements are always contiguous, so you may get fewer than `max_count'
+ * even if more are available (unless the pipe is PIPE_MIRRORED). Just acquire
+ * again once you've released.
+ *
+ * Every call must be followed by exactly one pipe_pop_release, which removes
+ * the first `count' elements (at most what was acquired) from the pipe.
+ * The rest stay in the pipe for the next pop. Until then, nobody else can pop
+ * from the pipe, so don't sit on it.
+ *
+ * This is not supported on pipes made with pipe_new_mpmc.
+ */
+void NO_NULL_POINTERS pipe_pop_acquire(pipe_consumer_t*, size_t max_count,
+                                       const void** ptr, size_t* count);
+
+/* Pops the first `count' elements of the region from pipe_pop_acquire. */
+void NO_NULL_POINTERS pipe_pop_release(pipe_consumer_t*, size_t count);
+
+/*
+ * Pushes the `len' bytes at `msg' into a PIPE_MESSAGES pipe as one message,
+ * waiting until there's room for all of it. It gets popped whole, never mixed
+ * up with anyone else's. Returns 0 if it wasn't pushed, either because every
+ * consumer is gone, or because it's bigger than the pipe's limit (or 4GB) and
+ * would never fit.
+ */
+int NO_NULL_POINTERS pipe_push_msg(pipe_producer_t*, const void* msg,
+                                   size_t len);
+
+/*
+ * Pops the message at the front of a PIPE_MESSAGES pipe, waiting until there
+ * is one. Its length goes in `*len', and as much of it as fits in `max_len'
+ * bytes is copied into `target'. The rest of it is thrown away. Returns 0,
+ * without touching `*len', once the pipe is empty and all producer_t handles
+ * have been freed.
+ */
+int NO_NULL_POINTERS WARN_UNUSED_RESULT pipe_pop_msg(pipe_consumer_t*,
+                                                     void* target,
+                                                     size_t max_len,
+                                                     size_t* len);
+
+/*
+ * Lends out the message at the front of a PIPE_MESSAGES pipe, waiting until
+ * there is one, without copying it anywhere. On return, `*msg' points at it and
+ * `*len' is its length. It isn't aligned in any way. A message that wraps
+ * around the end of the buffer has to be copied somewhere contiguous first, but
+ * that never happens in PIPE_MIRRORED pipes.
+ *
+ * If this returns 1, it must be followed by exactly one pipe_pop_msg_release,
+ * and nobody else can pop from the pipe until then. It returns 0, with nothing
+ * to release, once the pipe is empty and all producer_t handles have been
+ * freed, or if there was no memory to copy a wrapped message into. Ask pipe_eof
+ * which it was.
+ */
+int NO_NULL_POINTERS WARN_UNUSED_RESULT pipe_pop_msg_acquire(pipe_consumer_t*,
+                                                             const void** msg,
+                                                             size_t* len);
+
+/* Pops the message lent out by pipe_pop_msg_acquire. */
+void NO_NULL_POINTERS pipe_pop_msg_release(pipe_consumer_t*);
+
+/*
+ * A pipe_poller_t waits on many consumers at once, much like poll(2) waits on
+ * many file descriptors. Use it when one thread has to serve lots of pipes,
+ * instead of dedicating a thread to each.
+ *
+ * Sample code:
+ *
+ *   pipe_poller_t* poller = pipe_poller_new();
+ *
+ *   for(int i = 0; i < N; ++i)
+ *     pipe_poller_add(poller, cons[i], cons[i]);
+ *
+ *   void*  ready[N];
+ *   size_t n;
+ *
+ *   while((n = pipe_poll(poller, ready, N)))
+ *     for(size_t i = 0; i < n; ++i)
+ *     {
+ *       pipe_consumer_t* c = ready[i];
+ *
+ *       if(pipe_pop_eager(c, buf, BUFSIZE) == 0)
+ *         pipe_poller_remove(poller, c); // no more producers.
+ *       else
+ *         ...
+ *     }
+ *
+ *   pipe_poller_free(poller);
+ *
+ * Pushes into the pipes may come from any thread, but the poller itself must
+ * only be used by one thread at a time.
+ */
+typedef struct pipe_poller_t pipe_poller_t;
+
+pipe_poller_t* MALLOC_LIKE WARN_UNUSED_RESULT pipe_poller_new(void);
+
+/* Removes every consumer from the poller, then frees it. */
+void pipe_poller_free(pipe_poller_t*);
+
+/*
+ * Starts watching a consumer. pipe_poll reports it by `tag', which may be
+ * anything (even NULL). It must be removed before the consumer is freed.
+ * Returns 0 if we ran out of memory, nonzero otherwise.
+ */
+int pipe_poller_add(pipe_poller_t*, pipe_consumer_t*, void* tag);
+
+/* Stops watching a consumer. If it was added twice, only one is removed. */
+void pipe_poller_remove(pipe_poller_t*, pipe_consumer_t*);
+
+/*
+ * Stops watching a consumer that was added with `tag'. Every consumer of a
+ * pipe looks the same to pipe_poller_remove, so use this when the poller
+ * watches more than one of them.
+ */
+void pipe_poller_remove_tag(pipe_poller_t*, pipe_consumer_t*, void* tag);
+
+/*
+ * Blocks until at least one of the poller's consumers is ready, then stores the
+ * tags of up to `max' ready ones into `ready' and returns how many there were.
+ * A consumer is ready when a pop wouldn't block: either its pipe has elements
+ * in it, or all of its producers have been freed. That means a consumer whose
+ * producers are gone is ready forever, so remove it once you're done with it.
+ *
+ * Returns 0 right away if the poller has no consumers.
+ */
+size_t pipe_poll(pipe_poller_t*, void** ready, size_t max);
+
+/*
+ * Something an event loop can wait on: a file descriptor (an eventfd on Linux)
+ * which polls as readable, or a HANDLE to an event on Windows.
+ */
+#if defined(_WIN32) || defined(_WIN64)
+typedef void* pipe_fd_t;
+#define PIPE_NO_FD ((pipe_fd_t)0)
+#else
+typedef int pipe_fd_t;
+#define PIPE_NO_FD (-1)
+#endif
+
+/*
+ * Returns a descriptor which is signaled (readable, to epoll and friends)
+ * whenever a pop from the pipe would return right away: either there are
+ * elements in it, or all producers have been freed. This lets a pipe be driven
+ * from the same reactor as your sockets, without a thread sitting in pipe_pop.
+ * Keep in mind that another consumer might still beat you to the elements.
+ *
+ * The descriptor is made the first time this is called, and subsequent calls
+ * return the same one. It belongs to the pipe, and is closed along with it, so
+ * don't close, read, or write it yourself. Returns PIPE_NO_FD on failure.
+ *
+ * Pipes without a descriptor don't pay for any of this.
+ */
+pipe_fd_t NO_NULL_POINTERS pipe_readable_fd(pipe_consumer_t*);
+
+/*
+ * The same as pipe_readable_fd, except the descriptor is signaled whenever a
+ * push wouldn't block: either the pipe has room, or all consumers are gone.
+ */
+pipe_fd_t NO_NULL_POINTERS pipe_writable_fd(pipe_producer_t*);
+
+/*
+ * A pipe_waker_t is a one-shot callback, for code that can't tie up a thread
+ * waiting on a pipe, like coroutines or an event loop's tasks. Fill in `wake'
+ * and `ctx', and hand it to pipe_wake_on_readable (or pipe_wake_on_writable).
+ * The next time a pop (or push) might not block any more, for the same reasons
+ * pipe_readable_fd's (or pipe_writable_fd's) descriptor would be signaled, the
+ * pipe forgets the waker and calls wake(ctx), with no locks held, from
+ * whichever thread made it so. Every waker on that side is called, and another
+ * consumer (or producer) might still beat yours to it, so try again, and wait
+ * again if that doesn't work out.
+ *
+ * Keep `wake' short, like posting a task to run somewhere else. It may call
+ * back into the pipe, but mustn't block on it. The waker has to stay put until
+ * it's called (or cancelled), and its handle mustn't be freed before then.
+ *
+ * Shared and broadcast pipes don't support wakers.
+ */
+typedef struct pipe_waker_t {
+    void (*wake)(void* ctx);
+    void* ctx;
+
+    struct pipe_waker_t* next; /* Belongs to the pipe. */
+} pipe_waker_t;
+
+/*
+ * Arranges for `waker' to be called once a pop might not block. Returns 1 if
+ * it will be, or 0 if a pop wouldn't block right now, in which case the waker
+ * was never registered and won't be called.
+ */
+int NO_NULL_POINTERS WARN_UNUSED_RESULT pipe_wake_on_readable(pipe_consumer_t*,
+                                                              pipe_waker_t*);
+
+/* The same, once a push might not block. */
+int NO_NULL_POINTERS WARN_UNUSED_RESULT pipe_wake_on_writable(pipe_producer_t*,
+                                                              pipe_waker_t*);
+
+/*
+ * Takes back a waker that hasn't been called yet, through any handle to its
+ * pipe, so it never will be. Returns 1 if it was still waiting, or 0 if it
+ * wasn't registered. That includes one that's already been called, and one
+ * another thread is calling right now, so only free it if you can tell the
+ * call is over.
+ */
+int NO_NULL_POINTERS pipe_wake_cancel(pipe_generic_t*, pipe_waker_t*);
+
 /*
  * Modifies the pipe to have room for at least `count' elements. If more room
  * is already allocated, the call does nothing. This can be useful if requests
  * tend to come in bursts.
  *
  * The default minimum is 32 elements. To reset the reservation size to the
- * default, set count to 0.
+ * default, set count to 0. Pipes created with PIPE_RESIZE_FIXED ignore this.
  */
 void NO_NULL_POINTERS pipe_reserve(pipe_generic_t*, size_t count);
 
@@ -246,6 +857,116 @@ void NO_NULL_POINTERS pipe_reserve(pipe_generic_t*, size_t count);
  */
 size_t PURE NO_NULL_POINTERS pipe_elem_size(pipe_generic_t*);
 
+/*
+ * How long one kind of wait has taken, over the pipe's whole life. Waits are
+ * only counted when they actually happen, so a pipe that never fills up never
+ * counts any waits for room.
+ *
+ * histogram[i] counts the waits which took less than 2^(i+1) nanoseconds, and
+ * at least 2^i of them. The first bucket also counts anything shorter, and the
+ * last one anything longer.
+ */
+#define PIPE_STATS_BUCKETS 32
+
+typedef struct {
+    unsigned long long count,
+                       total_ns,
+                       max_ns,
+                       histogram[PIPE_STATS_BUCKETS];
+} pipe_wait_stats_t;
+
+/*
+ * Everything a pipe has counted since it was made. See pipe_get_stats.
+ */
+typedef struct {
+    unsigned long long pushes,       /* Pushes and commits of anything.      */
+                       pushed,       /* Elements they pushed.                */
+                       pushed_bytes,
+                       pops,         /* Pops and releases of anything.       */
+                       popped,       /* Elements they popped.                */
+                       popped_bytes,
+                       resizes,      /* Buffers (or segments) allocated after
+                                        the pipe was made.                   */
+                       spills,       /* Segments taken from the spill file.  */
+                       high_water;   /* The most elements ever in the pipe.  */
+
+    pipe_wait_stats_t  room_waits,   /* Producers asleep on a full pipe.     */
+                       elem_waits,   /* Consumers asleep on an empty pipe.   */
+                       push_lock,    /* Producers held up by each other.     */
+                       pop_lock;     /* Consumers held up by each other.     */
+} pipe_stats_t;
+
+/*
+ * Fills in `stats' with what the pipe has counted so far, and returns nonzero.
+ * Pipes only count anything if pipe.c was built with PIPE_STATS defined, since
+ * counting costs a few atomic adds on every push and pop, and a clock read on
+ * every wait. Otherwise, `stats' is zeroed and this returns 0.
+ *
+ * The counters are read one at a time, while everyone else keeps updating
+ * them, so they may disagree with each other a little. high_water is worked
+ * out from the counters too, so it may overshoot by a pop or two that hadn't
+ * been counted yet.
+ *
+ * To watch the pipes in the middle of a pipeline, keep a spare consumer handle
+ * to each of them around. Unlike a spare producer, it doesn't keep anyone from
+ * seeing the end of the pipe.
+ */
+int NO_NULL_POINTERS pipe_get_stats(pipe_generic_t*, pipe_stats_t* stats);
+
+/*
+ * The things a tracer hears about. See pipe_set_tracer.
+ */
+typedef enum {
+    PIPE_TRACE_PUSH = 0,    /* `count' elements were pushed into `pipe'.     */
+    PIPE_TRACE_POP,         /* `count' elements were popped from it.         */
+    PIPE_TRACE_WAIT_ROOM,   /* A producer is going to sleep until there's
+                               room in `pipe'...                             */
+    PIPE_TRACE_WAIT_ELEMS,  /* ...or a consumer until there are elements...  */
+    PIPE_TRACE_WAIT_END,    /* ...and it woke back up.                       */
+    PIPE_TRACE_STAGE_BEGIN, /* A pipe_util.h stage reading from `pipe' is
+                               about to process `count' elements...          */
+    PIPE_TRACE_STAGE_END    /* ...and it's done with them.                   */
+} pipe_trace_event_t;
+
+typedef struct {
+    pipe_trace_event_t    event;
+    const pipe_generic_t* pipe;
+    size_t                count;
+    unsigned long long    time;  /* When it happened. See pipe_now. */
+} pipe_trace_t;
+
+/*
+ * Something to tell about everything that happens to every pipe. `trace' is
+ * called on the thread it happened on, as it happens, and is given `ctx'. It
+ * may be called while the pipe's locks are held, so it mustn't use the pipe
+ * it's hearing about, or block on anything that might be waiting for it. It
+ * may use other pipes.
+ */
+typedef struct {
+    void (*trace)(const pipe_trace_t* event, void* ctx);
+    void*  ctx;
+} pipe_tracer_t;
+
+/*
+ * Starts sending every pipe's events to `tracer', or stops if it's NULL. There
+ * is only ever one tracer. Threads that are already in the middle of telling
+ * the old one something might still do so after this returns, so it must stay
+ * around until they're done.
+ *
+ * As with pipe_get_stats, pipes are only traced if pipe.c was built with
+ * PIPE_TRACE defined. Otherwise, this does nothing and returns 0. Building with
+ * PIPE_USDT as well fires a USDT probe (provider `pipe', named after the event)
+ * at each of the same points, whether or not anyone is listening.
+ */
+int pipe_set_tracer(const pipe_tracer_t* tracer);
+
+/*
+ * Tells the tracer about an event which didn't come from a pipe, such as a
+ * stage starting on a batch. pipe_util.h's stages already do this.
+ */
+void NO_NULL_POINTERS pipe_trace(pipe_generic_t*, pipe_trace_event_t event,
+                                 size_t count);
+
 /*
  * Use this to run the pipe self-test. It will call abort() if anything is
  * wrong. This is usually unnecessary. If this is never called, pipe_test.c
@@ -0,0 +1,637 @@
+/* pipe.hpp - A typed C++ layer over pipe.h. Everything here is a thin inline
+ *            wrapper around the C API, which it doesn't replace.
+ *
+ * The MIT License
+ * Copyright (c) 2011 Clark Gaebel <cg.wowus.cg@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#include "pipe.h"
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Only C++20 compilers have coroutines. See async_push and async_pop.
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define PIPES_COROUTINES 1
+#endif
+#endif
+
+/*
+ * pipes::pipe<T, Capacity, Engine> is a pipe of T's, holding at most `Capacity'
+ * of them (or any number, if it's 0), running on `Engine'. Handles are RAII
+ * objects: make producers and consumers with make_producer and make_consumer,
+ * and they're freed when they go out of scope. They can be moved, but not
+ * copied, since each one is a reference on the pipe. As in C, the pipe itself
+ * counts as both a producer and a consumer, so don't keep it around for longer
+ * than you need to hand out handles.
+ *
+ * Sample code:
+ *
+ *   pipes::pipe<std::unique_ptr<job>, 1024>::producer_type in;
+ *   pipes::pipe<std::unique_ptr<job>, 1024>::consumer_type out;
+ *
+ *   {
+ *     pipes::pipe<std::unique_ptr<job>, 1024> p;
+ *     in  = p.make_producer();
+ *     out = p.make_consumer();
+ *   }
+ *
+ *   in.push(std::unique_ptr<job>(new job));
+ *
+ *   std::unique_ptr<job> j;
+ *   while(out.pop(j))
+ *     j->run();
+ *
+ * Single elements are built straight into the pipe's buffer with
+ * pipe_push_reserve, and moved straight out of it with pipe_pop_acquire. Since
+ * sizeof(T) is known here, those copies compile down to a couple of moves
+ * instead of a memcpy of a size only known at runtime. Whole arrays of
+ * trivially copyable T's still go through pipe_push and pipe_pop, which is
+ * faster for them.
+ *
+ * Anything that isn't trivially copyable only ever gets constructed in the
+ * pipe and moved out of it, never memcpy'd. That means the pipe can't move its
+ * elements around when it resizes, so these pipes use an engine that doesn't:
+ * an unbounded Engine of PIPE_ENGINE_LOCKED becomes PIPE_ENGINE_SEGMENTED, a
+ * bounded one preallocates (PIPE_RESIZE_FIXED), and PIPE_ENGINE_MPMC isn't
+ * allowed at all. Neither is PIPE_ENGINE_BROADCAST, since every subscriber
+ * would be moving out of the same element. Pop everything before the last
+ * consumer goes away: elements left in a pipe nobody can pop from are freed
+ * without being destroyed.
+ *
+ * With C++20, handles can also be co_await'ed on instead of blocking:
+ *
+ *   int x;
+ *   while(co_await out.async_pop(x, ex))
+ *     if(!co_await in.async_push(x + 1, ex))
+ *       break; // nobody's left to pop it.
+ *
+ * A coroutine that would have had to wait registers a pipe_waker_t instead, and
+ * suspends, leaving its thread free for other work. Once the pipe changes,
+ * whichever thread changed it tries again on the coroutine's behalf, and once
+ * that works out, hands it to `ex', which is anything callable with a
+ * std::coroutine_handle<>. That will usually post it to whatever thread pool
+ * the coroutine runs on. The default, inline_executor, just resumes it right
+ * there, in that thread. These only take trivially copyable T's on pipes which
+ * aren't shared or broadcast, since the C API has no way to build or move
+ * elements in place without blocking.
+ *
+ * A coroutine suspended in one of these can be destroyed, which cancels its
+ * waker with pipe_wake_cancel. That's only safe while nothing else can change
+ * the pipe, though: another thread may already have taken the waker, and
+ * would go on to push or pop on the dead coroutine's behalf, then resume it.
+ *
+ * Memory allocation failures throw std::bad_alloc. Anything T's constructors
+ * or consume's `f' throw goes straight through, and whatever was already pushed
+ * (or popped) by then stays that way. The element it was thrown on is never
+ * pushed, or is left in the pipe to be popped again.
+ */
+namespace pipes {
+
+namespace detail {
+
+template <typename T>
+struct is_fast
+    : std::integral_constant<bool, std::is_trivially_copyable<T>::value> {};
+
+// The engine and resize policy a pipe of T's really gets. See above.
+template <typename T, std::size_t Capacity, pipe_engine_t Engine>
+struct layout
+{
+    static_assert(is_fast<T>::value || Engine != PIPE_ENGINE_MPMC,
+                  "MPMC pipes can only hold trivially copyable types.");
+
+    static_assert(is_fast<T>::value || Engine != PIPE_ENGINE_BROADCAST,
+                  "Broadcast pipes can only hold trivially copyable types.");
+
+    static_assert(alignof(T) <= alignof(std::max_align_t),
+                  "Pipes can't hold over-aligned types.");
+
+    static const pipe_engine_t engine =
+        !is_fast<T>::value && Engine == PIPE_ENGINE_LOCKED && Capacity == 0
+            ? PIPE_ENGINE_SEGMENTED
+            : Engine;
+
+    static const pipe_resize_t resize =
+        !is_fast<T>::value && Engine == PIPE_ENGINE_LOCKED && Capacity != 0
+            ? PIPE_RESIZE_FIXED
+            : PIPE_RESIZE_DEFAULT;
+};
+
+// MPMC pipes don't support reserving and acquiring. Broadcast pipes don't
+// support reserving, and popping copies keeps their consumers from holding up
+// producers while `f' runs.
+template <pipe_engine_t Engine>
+struct in_place
+    : std::integral_constant<bool, Engine != PIPE_ENGINE_MPMC
+                                && Engine != PIPE_ENGINE_BROADCAST> {};
+
+// Commits however many elements have been built so far on the way out, even
+// if building the next one throws, so the room gets handed back either way.
+struct commit_guard
+{
+    pipe_producer_t* p;
+    std::size_t      done;
+
+    ~commit_guard() { pipe_push_commit(p, done); }
+};
+
+// The same for acquired elements, once they've been consumed and destroyed.
+struct release_guard
+{
+    pipe_consumer_t* c;
+    std::size_t      done;
+
+    ~release_guard() { pipe_pop_release(c, done); }
+};
+
+} // namespace detail
+
+#ifdef PIPES_COROUTINES
+/* Resumes a coroutine right away, in whichever thread woke it up. */
+struct inline_executor
+{
+    void operator()(std::coroutine_handle<> h) const { h.resume(); }
+};
+
+namespace detail {
+
+template <typename T>
+struct push_op
+{
+    pipe_producer_t* p;
+    T                elem;
+    bool             ok;
+
+    bool attempt()
+    {
+        if(pipe_try_push(p, &elem, 1) == 1)
+            return ok = true;
+
+        return pipe_orphaned(p) != 0;
+    }
+
+    int wait(pipe_waker_t* w) { return pipe_wake_on_writable(p, w); }
+    int cancel(pipe_waker_t* w) { return pipe_wake_cancel(PIPE_GENERIC(p), w); }
+};
+
+template <typename T>
+struct pop_op
+{
+    pipe_consumer_t* c;
+    T*               elem;
+    bool             ok;
+
+    bool attempt()
+    {
+        if(pipe_try_pop(c, elem, 1) == 1)
+            return ok = true;
+
+        return pipe_eof(c) != 0;
+    }
+
+    int wait(pipe_waker_t* w) { return pipe_wake_on_readable(c, w); }
+    int cancel(pipe_waker_t* w) { return pipe_wake_cancel(PIPE_GENERIC(c), w); }
+};
+
+// What async_push and async_pop return. `Op' tries to push (or pop) once
+// without blocking, returning whether it's done, either successfully (setting
+// `ok') or because it never can be. If it isn't, we wait for the pipe to
+// change and try again, so the coroutine only ever resumes once it's done.
+template <typename Op, typename Executor>
+class awaiter
+{
+public:
+    awaiter(Op op, Executor ex)
+        : op_(op), ex_(std::move(ex)), waiting_(false) {}
+
+    // The waker points at us.
+    awaiter(const awaiter&) = delete;
+    awaiter& operator=(const awaiter&) = delete;
+
+    // Only if the coroutine was destroyed while it was suspended. See above.
+    ~awaiter()
+    {
+        if(waiting_)
+            op_.cancel(&waker_);
+    }
+
+    bool await_ready() { return op_.attempt(); }
+
+    bool await_suspend(std::coroutine_handle<> h)
+    {
+        handle_     = h;
+        waker_.wake = &awaiter::woken;
+        waker_.ctx  = this;
+
+        return wait();
+    }
+
+    bool await_resume() const { return op_.ok; }
+
+private:
+    // Returns true once the waker is registered, after which it could be
+    // called (and the coroutine resumed) at any moment, so we can't touch
+    // anything anymore. Returns false if the op finished instead.
+    bool wait()
+    {
+        for(;;)
+        {
+            waiting_ = true;
+
+            if(op_.wait(&waker_))
+                return true;
+
+            waiting_ = false;
+
+            if(op_.attempt())
+                return false;
+        }
+    }
+
+    static void woken(void* ctx)
+    {
+        awaiter* a = static_cast<awaiter*>(ctx);
+        a->waiting_ = false;
+
+        if(!a->op_.attempt() && a->wait())
+            return;
+
+        // Resuming the coroutine destroys us.
+        Executor                ex(std::move(a->ex_));
+        std::coroutine_handle<> h = a->handle_;
+
+        ex(h);
+    }
+
+    Op                      op_;
+    Executor                ex_;
+    std::coroutine_handle<> handle_;
+    pipe_waker_t            waker_;
+    bool                    waiting_; // Whether waker_ is registered.
+};
+
+} // namespace detail
+#endif
+
+template <typename T, pipe_engine_t Engine>
+class producer
+{
+public:
+    producer() : p_(NULL) {}
+
+    explicit producer(pipe_producer_t* p) : p_(p) {}
+
+    producer(producer&& other) : p_(other.release()) {}
+
+    producer& operator=(producer&& other)
+    {
+        reset(other.release());
+        return *this;
+    }
+
+    producer(const producer&) = delete;
+    producer& operator=(const producer&) = delete;
+
+    ~producer() { reset(); }
+
+    /* Builds a T in the pipe from `args'. */
+    template <typename... Args>
+    void emplace(Args&&... args)
+    {
+        auto build = [&](void* at) { ::new(at) T(std::forward<Args>(args)...); };
+        push_in_place(build, in_place());
+    }
+
+    void push(const T& elem) { emplace(elem); }
+    void push(T&& elem)      { emplace(std::move(elem)); }
+
+    /* Copies `count' elements in, like pipe_push. */
+    void push(const T* elems, std::size_t count)
+    {
+        push_all(elems, count, detail::is_fast<T>());
+    }
+
+#ifdef PIPES_COROUTINES
+    /*
+     * Pushes `elem' without blocking the thread, resuming the coroutine on
+     * `ex' once it's in. co_await'ing it returns false if it couldn't be, since
+     * every consumer is gone. See above.
+     */
+    template <typename Executor = inline_executor>
+    detail::awaiter<detail::push_op<T>, Executor>
+    async_push(const T& elem, Executor ex = Executor())
+    {
+        static_assert(detail::is_fast<T>::value,
+                      "async_push only takes trivially copyable types.");
+
+        return { detail::push_op<T> { p_, elem, false }, std::move(ex) };
+    }
+#endif
+
+    pipe_producer_t* native_handle() const { return p_; }
+
+    /* Gives up ownership of the handle. */
+    pipe_producer_t* release()
+    {
+        pipe_producer_t* p = p_;
+        p_ = NULL;
+        return p;
+    }
+
+    void reset(pipe_producer_t* p = NULL)
+    {
+        if(p_)
+            pipe_producer_free(p_);
+
+        p_ = p;
+    }
+
+private:
+    typedef detail::in_place<Engine> in_place;
+
+    template <typename Build>
+    void push_in_place(Build& build, std::true_type)
+    {
+        void* at;
+        std::size_t room;
+
+        pipe_push_reserve(p_, 1, &at, &room);
+
+        detail::commit_guard guard = { p_, 0 };
+
+        if(room)
+            build(at);
+
+        guard.done = room;
+    }
+
+    // MPMC and broadcast pipes can't lend out room, so they build the element
+    // on the stack and push that. They only hold trivially copyable types, so
+    // that's fine.
+    template <typename Build>
+    void push_in_place(Build& build, std::false_type)
+    {
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type buf;
+        build(&buf);
+        pipe_push(p_, &buf, 1);
+    }
+
+    void push_all(const T* elems, std::size_t count, std::true_type)
+    {
+        pipe_push(p_, elems, count);
+    }
+
+    void push_all(const T* elems, std::size_t count, std::false_type)
+    {
+        while(count > 0)
+        {
+            void* at;
+            std::size_t room;
+
+            pipe_push_reserve(p_, count, &at, &room);
+
+            {
+                T* dst = static_cast<T*>(at);
+                detail::commit_guard guard = { p_, 0 };
+
+                for(; guard.done < room; ++guard.done)
+                    ::new(dst + guard.done) T(elems[guard.done]);
+            }
+
+            // All the consumers are gone.
+            if(room == 0)
+                return;
+
+            elems += room;
+            count -= room;
+        }
+    }
+
+    pipe_producer_t* p_;
+};
+
+template <typename T, pipe_engine_t Engine>
+class consumer
+{
+public:
+    consumer() : c_(NULL) {}
+
+    explicit consumer(pipe_consumer_t* c) : c_(c) {}
+
+    consumer(consumer&& other) : c_(other.release()) {}
+
+    consumer& operator=(consumer&& other)
+    {
+        reset(other.release());
+        return *this;
+    }
+
+    consumer(const consumer&) = delete;
+    consumer& operator=(const consumer&) = delete;
+
+    ~consumer() { reset(); }
+
+    /*
+     * Moves the next element into `elem'. Blocks until there is one, and
+     * returns false if there never will be.
+     */
+    bool pop(T& elem)
+    {
+        return consume(1, [&](T&& e) { elem = std::move(e); }) == 1;
+    }
+
+    /*
+     * Calls `f' on up to `max_count' elements, each as a T&& pointing straight
+     * into the pipe, then pops them. Like pipe_pop_eager, this waits for at
+     * least one element, and returns how many there were (0 at the end).
+     */
+    template <typename F>
+    std::size_t consume(std::size_t max_count, F f)
+    {
+        return consume(max_count, f, detail::in_place<Engine>());
+    }
+
+    /* Copies up to `count' elements out, like pipe_pop. */
+    std::size_t pop(T* elems, std::size_t count)
+    {
+        return pop_all(elems, count, detail::is_fast<T>());
+    }
+
+#ifdef PIPES_COROUTINES
+    /*
+     * Pops the next element into `elem' without blocking the thread, resuming
+     * the coroutine on `ex' once it's there. co_await'ing it returns false if
+     * there never will be one. See above.
+     */
+    template <typename Executor = inline_executor>
+    detail::awaiter<detail::pop_op<T>, Executor>
+    async_pop(T& elem, Executor ex = Executor())
+    {
+        static_assert(detail::is_fast<T>::value,
+                      "async_pop only takes trivially copyable types.");
+
+        return { detail::pop_op<T> { c_, &elem, false }, std::move(ex) };
+    }
+#endif
+
+    bool eof() { return pipe_eof(c_) != 0; }
+
+    pipe_consumer_t* native_handle() const { return c_; }
+
+    pipe_consumer_t* release()
+    {
+        pipe_consumer_t* c = c_;
+        c_ = NULL;
+        return c;
+    }
+
+    void reset(pipe_consumer_t* c = NULL)
+    {
+        if(c_)
+            pipe_consumer_free(c_);
+
+        c_ = c;
+    }
+
+private:
+    template <typename F>
+    std::size_t consume(std::size_t max_count, F& f, std::true_type)
+    {
+        const void* at;
+        std::size_t count;
+
+        pipe_pop_acquire(c_, max_count, &at, &count);
+
+        // We own these until we release them, so they may as well be moved.
+        T* elems = static_cast<T*>(const_cast<void*>(at));
+
+        // If `f' throws, the element it threw on stays in the pipe.
+        detail::release_guard guard = { c_, 0 };
+
+        for(; guard.done < count; ++guard.done)
+        {
+            f(std::move(elems[guard.done]));
+            elems[guard.done].~T();
+        }
+
+        return count;
+    }
+
+    // MPMC and broadcast pipes only hold trivially copyable types, so popping
+    // onto the stack is fine.
+    template <typename F>
+    std::size_t consume(std::size_t max_count, F& f, std::false_type)
+    {
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type buf[64];
+
+        if(max_count > sizeof buf / sizeof *buf)
+            max_count = sizeof buf / sizeof *buf;
+
+        std::size_t count = pipe_pop_eager(c_, buf, max_count);
+
+        for(std::size_t i = 0; i < count; ++i)
+            f(std::move(*reinterpret_cast<T*>(&buf[i])));
+
+        return count;
+    }
+
+    std::size_t pop_all(T* elems, std::size_t count, std::true_type)
+    {
+        return pipe_pop(c_, elems, count);
+    }
+
+    std::size_t pop_all(T* elems, std::size_t count, std::false_type)
+    {
+        std::size_t popped = 0;
+
+        while(popped < count)
+        {
+            std::size_t n = consume(count - popped,
+                                    [&](T&& e) { elems[popped++] = std::move(e); });
+
+            if(n == 0)
+                break;
+        }
+
+        return popped;
+    }
+
+    pipe_consumer_t* c_;
+};
+
+template <typename T, std::size_t Capacity = 0,
+          pipe_engine_t Engine = PIPE_ENGINE_LOCKED>
+class pipe
+{
+    typedef detail::layout<T, Capacity, Engine> layout;
+
+public:
+    typedef pipes::producer<T, layout::engine> producer_type;
+    typedef pipes::consumer<T, layout::engine> consumer_type;
+
+    static const std::size_t capacity = Capacity;
+
+    /* `options' may set anything but the engine and resize policy. */
+    explicit pipe(const pipe_options_t* options = NULL)
+    {
+        pipe_options_t o = pipe_options_t();
+
+        if(options)
+            o = *options;
+
+        o.engine = layout::engine;
+        o.resize = layout::resize;
+
+        p_ = pipe_new_ex(sizeof(T), Capacity, &o);
+
+        if(p_ == NULL)
+            throw std::bad_alloc();
+    }
+
+    pipe(pipe&& other) : p_(other.p_) { other.p_ = NULL; }
+
+    pipe(const pipe&) = delete;
+    pipe& operator=(const pipe&) = delete;
+    pipe& operator=(pipe&&) = delete;
+
+    ~pipe()
+    {
+        if(p_)
+            pipe_free(p_);
+    }
+
+    producer_type make_producer() { return producer_type(pipe_producer_new(p_)); }
+    consumer_type make_consumer() { return consumer_type(pipe_consumer_new(p_)); }
+
+    pipe_t* native_handle() const { return p_; }
+
+private:
+    pipe_t* p_;
+};
+
+} // namespace pipes
+
+/* vim: set et ts=4 sw=4 softtabstop=4 textwidth=80: */
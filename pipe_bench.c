@@ -0,0 +1,353 @@
+/*
+ * pipe_bench.c - Pushes a lot of elements through pipes, sweeping over every
+ *                engine, element size, batch size, number of producers and
+ *                consumers, bounded and unbounded pipes, and steady and bursty
+ *                producers. Reports the throughput and handoff latency of each.
+ *
+ * Usage: pipe_bench [-c] [N]
+ *
+ *   N  = the number of elements to push through each pipe.
+ *   -c = print CSV instead of a table, to keep around and compare against.
+ *
+ * Latency is how long an element took from just before it was pushed to just
+ * after it was popped. Only one in every SAMPLE_EVERY batches is timed, so
+ * that reading the clock doesn't swamp what it's measuring.
+ *
+ * The small bounded pipes here are always full or empty or close to it, so the
+ * producers and consumers keep fighting over the pipe's cache lines. Comparing
+ * this against pipe_bench_unpadded (the same thing built with
+ * PIPE_NO_CACHE_ISOLATION) shows how much of that fighting the pipe's layout
+ * saves. Bursty producers push BURST elements at a time and then take a break,
+ * so an unbounded pipe has to keep growing and shrinking. Their throughput
+ * includes the breaks.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include "pipe.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#define LIMIT        1024
+#define MAX_THREADS  4
+#define SAMPLE_EVERY 16
+#define BURST        4096
+#define BURST_GAP_NS 200000
+
+typedef struct {
+    pipe_engine_t engine;
+    const char*   name;
+    size_t        elem_size,
+                  batch,
+                  producers,
+                  consumers,
+                  limit;
+    bool          bursty;
+} config_t;
+
+typedef struct {
+    unsigned long long ns,
+                       p50,
+                       p99,
+                       p999;
+} result_t;
+
+// Every element starts with the time it was pushed, or 0 if it isn't timed.
+typedef uint64_t stamp_t;
+
+typedef struct {
+    const config_t*  cfg;
+    pipe_producer_t* out;
+    uint64_t         count;
+} producer_context_t;
+
+typedef struct {
+    const config_t*  cfg;
+    pipe_consumer_t* in;
+    uint64_t         popped;
+
+    unsigned long long* samples;
+    size_t              sample_count,
+                        sample_cap;
+} consumer_context_t;
+
+static void nap(unsigned long long ns)
+{
+    struct timespec t = { 0, (long)ns };
+    nanosleep(&t, NULL);
+}
+
+static void* producer_func(void* context)
+{
+    producer_context_t* ctx = context;
+    const config_t*     cfg = ctx->cfg;
+
+    char* buf = calloc(cfg->batch, cfg->elem_size);
+
+    uint64_t batches = 0;
+
+    for(uint64_t i = 0; i < ctx->count; ++batches)
+    {
+        size_t n = cfg->batch < ctx->count - i ? cfg->batch : ctx->count - i;
+
+        stamp_t stamp = batches % SAMPLE_EVERY == 0 ? pipe_now() : 0;
+        memcpy(buf, &stamp, sizeof stamp);
+
+        pipe_push(ctx->out, buf, n);
+
+        if(cfg->bursty && (i + n) / BURST != i / BURST)
+            nap(BURST_GAP_NS);
+
+        i += n;
+    }
+
+    pipe_producer_free(ctx->out);
+    free(buf);
+
+    return NULL;
+}
+
+static void* consumer_func(void* context)
+{
+    consumer_context_t* ctx = context;
+    const config_t*     cfg = ctx->cfg;
+
+    char*  buf = malloc(cfg->batch * cfg->elem_size);
+    size_t popped;
+
+    while((popped = pipe_pop_eager(ctx->in, buf, cfg->batch)) > 0)
+    {
+        unsigned long long now = 0;
+
+        for(size_t i = 0; i < popped; ++i)
+        {
+            stamp_t stamp;
+            memcpy(&stamp, buf + i*cfg->elem_size, sizeof stamp);
+
+            if(stamp == 0 || ctx->sample_count == ctx->sample_cap)
+                continue;
+
+            if(now == 0)
+                now = pipe_now();
+
+            ctx->samples[ctx->sample_count++] = now - stamp;
+        }
+
+        ctx->popped += popped;
+    }
+
+    pipe_consumer_free(ctx->in);
+    free(buf);
+
+    return NULL;
+}
+
+static int compare_ull(const void* a, const void* b)
+{
+    unsigned long long x = *(const unsigned long long*)a,
+                       y = *(const unsigned long long*)b;
+
+    return (x > y) - (x < y);
+}
+
+static unsigned long long percentile(const unsigned long long* sorted,
+                                     size_t count, double p)
+{
+    return count ? sorted[(size_t)(p * (count - 1))] : 0;
+}
+
+// Runs `count' elements through a pipe set up like `cfg'. Returns false if
+// the elements didn't all come out the other end.
+static bool run(const config_t* cfg, uint64_t count, result_t* result)
+{
+    pipe_options_t options = { .engine = cfg->engine };
+    pipe_t* p = pipe_new_ex(cfg->elem_size, cfg->limit, &options);
+
+    if(p == NULL)
+        return false;
+
+    producer_context_t producers[MAX_THREADS];
+    consumer_context_t consumers[MAX_THREADS];
+
+    // Every batch could be timed, and any one consumer could pop them all.
+    size_t max_samples = count / SAMPLE_EVERY + cfg->producers;
+
+    for(size_t i = 0; i < cfg->producers; ++i)
+        producers[i] = (producer_context_t) {
+            .cfg   = cfg,
+            .out   = pipe_producer_new(p),
+            .count = count / cfg->producers
+                   + (i < count % cfg->producers),
+        };
+
+    for(size_t i = 0; i < cfg->consumers; ++i)
+        consumers[i] = (consumer_context_t) {
+            .cfg        = cfg,
+            .in         = pipe_consumer_new(p),
+            .samples    = malloc(max_samples * sizeof(unsigned long long)),
+            .sample_cap = max_samples,
+        };
+
+    pipe_free(p);
+
+    pthread_t threads[2*MAX_THREADS];
+    size_t    thread_count = 0;
+
+    unsigned long long start = pipe_now();
+
+    for(size_t i = 0; i < cfg->consumers; ++i)
+        pthread_create(&threads[thread_count++], NULL,
+                       &consumer_func, &consumers[i]);
+
+    for(size_t i = 0; i < cfg->producers; ++i)
+        pthread_create(&threads[thread_count++], NULL,
+                       &producer_func, &producers[i]);
+
+    for(size_t i = 0; i < thread_count; ++i)
+        pthread_join(threads[i], NULL);
+
+    result->ns = pipe_now() - start;
+
+    // Pool everyone's samples, so the percentiles cover the whole pipe.
+    uint64_t popped = 0;
+    size_t   samples = 0;
+
+    unsigned long long* all = malloc(cfg->consumers * max_samples
+                                     * sizeof(unsigned long long));
+
+    for(size_t i = 0; i < cfg->consumers; ++i)
+    {
+        popped += consumers[i].popped;
+
+        memcpy(all + samples, consumers[i].samples,
+               consumers[i].sample_count * sizeof(unsigned long long));
+        samples += consumers[i].sample_count;
+
+        free(consumers[i].samples);
+    }
+
+    qsort(all, samples, sizeof *all, &compare_ull);
+
+    result->p50  = percentile(all, samples, 0.5);
+    result->p99  = percentile(all, samples, 0.99);
+    result->p999 = percentile(all, samples, 0.999);
+
+    free(all);
+
+    return popped == count;
+}
+
+static void print_header(bool csv)
+{
+    if(csv)
+        printf("engine,elem_size,batch,producers,consumers,limit,pattern,"
+               "elems,ns,ops_per_sec,bytes_per_sec,p50_ns,p99_ns,p999_ns\n");
+    else
+        printf("%-9s %5s %5s %5s %6s %-6s %10s %10s %9s %9s %9s\n",
+               "engine", "size", "batch", "p*c", "limit", "burst",
+               "Melem/s", "MB/s", "p50 ns", "p99 ns", "p999 ns");
+}
+
+static void print_result(bool csv, const config_t* cfg, uint64_t count,
+                         const result_t* r)
+{
+    double ops   = count * 1e9 / r->ns,
+           bytes = ops * cfg->elem_size;
+
+    if(csv)
+        printf("%s,%zu,%zu,%zu,%zu,%zu,%s,%llu,%llu,%.0f,%.0f,%llu,%llu,%llu\n",
+               cfg->name, cfg->elem_size, cfg->batch,
+               cfg->producers, cfg->consumers, cfg->limit,
+               cfg->bursty ? "bursty" : "steady",
+               (unsigned long long)count, r->ns, ops, bytes,
+               r->p50, r->p99, r->p999);
+    else
+        printf("%-9s %5zu %5zu %3zu*%-1zu %6zu %-6s %10.2f %10.1f %9llu %9llu %9llu\n",
+               cfg->name, cfg->elem_size, cfg->batch,
+               cfg->producers, cfg->consumers, cfg->limit,
+               cfg->bursty ? "yes" : "no",
+               ops / 1e6, bytes / 1e6, r->p50, r->p99, r->p999);
+
+    fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+    bool     csv   = false;
+    uint64_t count = 1000000;
+
+    for(int i = 1; i < argc; ++i)
+        if(strcmp(argv[i], "-c") == 0)
+            csv = true;
+        else
+            count = strtoull(argv[i], NULL, 10);
+
+    static const struct {
+        pipe_engine_t engine;
+        const char*   name;
+        bool          resizes;    // Whether an unbounded pipe makes sense.
+        bool          concurrent; // Whether it takes more than one a side.
+    } engines[] = {
+        { PIPE_ENGINE_LOCKED,    "locked",    true,  true  },
+        { PIPE_ENGINE_SPSC,      "spsc",      false, false },
+        { PIPE_ENGINE_MPMC,      "mpmc",      false, true  },
+        { PIPE_ENGINE_SEGMENTED, "segmented", true,  true  },
+    };
+
+    static const size_t elem_sizes[] = { sizeof(stamp_t), 64, 256 },
+                        batches[]    = { 1, 64 },
+                        threads[]    = { 1, MAX_THREADS },
+                        limits[]     = { LIMIT, 0 };
+
+    if(count == 0)
+    {
+        printf("Usage: %s [-c] [N]\nN  = the number of elements to push "
+               "through each pipe.\n-c = print CSV.\n", argv[0]);
+        return 255;
+    }
+
+    print_header(csv);
+
+    for(size_t e = 0; e < sizeof engines / sizeof *engines; ++e)
+    for(size_t s = 0; s < sizeof elem_sizes / sizeof *elem_sizes; ++s)
+    for(size_t b = 0; b < sizeof batches / sizeof *batches; ++b)
+    for(size_t t = 0; t < sizeof threads / sizeof *threads; ++t)
+    for(size_t l = 0; l < sizeof limits / sizeof *limits; ++l)
+    for(int bursty = 0; bursty <= 1; ++bursty)
+    {
+        if(threads[t] > 1 && !engines[e].concurrent)
+            continue;
+
+        if(limits[l] == 0 && !engines[e].resizes)
+            continue;
+
+        config_t cfg = {
+            .engine    = engines[e].engine,
+            .name      = engines[e].name,
+            .elem_size = elem_sizes[s],
+            .batch     = batches[b],
+            .producers = threads[t],
+            .consumers = threads[t],
+            .limit     = limits[l],
+            .bursty    = bursty,
+        };
+
+        result_t r;
+
+        if(!run(&cfg, count, &r))
+        {
+            printf("%s FAILED\n", cfg.name);
+            return 1;
+        }
+
+        print_result(csv, &cfg, count, &r);
+    }
+
+    return 0;
+}
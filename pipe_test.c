@@ -29,6 +29,14 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+#else
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
 #define UNUSED_PARAMETER(var) (var) = (var)
 
 // All this hackery is just to get asserts to work in release build.
@@ -147,6 +155,21 @@ static void validate_consumer(pipe_consumer_t* c, unsigned doublings)
         validate_test_data(t, 1 << doublings);
 }
 
+// Like validate_consumer, but also makes sure nothing was lost.
+static void validate_consumer_all(pipe_consumer_t* c, unsigned doublings)
+{
+    testdata_t t;
+    int count = 0;
+
+    while(pipe_pop(c, &t, 1))
+    {
+        validate_test_data(t, 1 << doublings);
+        ++count;
+    }
+
+    assert(count == MAX_NUM);
+}
+
 DEF_TEST(pipeline_multiplier)
 {
     pipeline_t pipeline =
@@ -184,6 +207,2185 @@ DEF_TEST(parallel_multiplier)
     validate_consumer(pipeline.out, 1); pipe_consumer_free(pipeline.out);
 }
 
+DEF_TEST(parallel_stealing)
+{
+    pipeline_t pipeline =
+        pipe_parallel_stealing(4,
+                               sizeof(testdata_t),
+                               &double_elems, (void*)NULL,
+                               sizeof(testdata_t));
+
+    assert(pipeline.in);
+    assert(pipeline.out);
+
+    generate_test_data(pipeline.in); pipe_producer_free(pipeline.in);
+    validate_consumer_all(pipeline.out, 1); pipe_consumer_free(pipeline.out);
+}
+
+DEF_TEST(parallel_numa)
+{
+    // Node 1 probably doesn't exist here. Its queue should work anyway, just
+    // without being bound anywhere.
+    static const unsigned cpu0 = 0;
+    const pipe_cpuset_t cpus[] = { { &cpu0, 1 }, { NULL, 0 } };
+
+    pipeline_t pipeline =
+        pipe_parallel_numa(2, cpus, 2,
+                           sizeof(testdata_t),
+                           &double_elems, (void*)NULL,
+                           sizeof(testdata_t));
+
+    assert(pipeline.in);
+    assert(pipeline.out);
+
+    generate_test_data(pipeline.in); pipe_producer_free(pipeline.in);
+    validate_consumer_all(pipeline.out, 1); pipe_consumer_free(pipeline.out);
+}
+
+// Like validate_consumer, but also makes sure nothing was reordered.
+static void validate_consumer_in_order(pipe_consumer_t* c, unsigned doublings)
+{
+    testdata_t t;
+    int expected = 0;
+
+    while(pipe_pop(c, &t, 1))
+    {
+        assert(t.orig == expected++);
+        validate_test_data(t, 1 << doublings);
+    }
+
+    assert(expected == MAX_NUM);
+}
+
+DEF_TEST(parallel_ordered)
+{
+    for(size_t window = 1; window <= 8; window *= 8)
+    {
+        pipeline_t pipeline =
+            pipe_parallel_ordered(4, window,
+                                  sizeof(testdata_t),
+                                  &double_elems, (void*)NULL,
+                                  sizeof(testdata_t));
+
+        assert(pipeline.in);
+        assert(pipeline.out);
+
+        generate_test_data(pipeline.in); pipe_producer_free(pipeline.in);
+        validate_consumer_in_order(pipeline.out, 1); pipe_consumer_free(pipeline.out);
+    }
+}
+
+typedef struct {
+    size_t largest;
+} batch_stats_t;
+
+// Passes elements straight through, remembering the biggest batch it saw.
+static void forward_and_measure(const void* elems, size_t count,
+                                pipe_producer_t* out, void* aux)
+{
+    batch_stats_t* stats = aux;
+
+    if(count == 0)
+        return;
+
+    if(count > stats->largest)
+        stats->largest = count;
+
+    pipe_push(out, elems, count);
+}
+
+// Connects forward_and_measure between two new pipes.
+static pipeline_t measured_stage(batch_stats_t* stats,
+                                 const pipe_stage_options_t* options)
+{
+    pipe_t* in  = pipe_new(sizeof(testdata_t), 0),
+          * out = pipe_new(sizeof(testdata_t), 0);
+
+    pipe_connect_ex(pipe_consumer_new(in), &forward_and_measure, stats,
+                    pipe_producer_new(out), options);
+
+    pipeline_t ret = { pipe_producer_new(in), pipe_consumer_new(out) };
+
+    pipe_free(in);
+    pipe_free(out);
+
+    return ret;
+}
+
+DEF_TEST(stage_batching)
+{
+    // Small batches, in order.
+    {
+        batch_stats_t stats = { 0 };
+        pipe_stage_options_t options = { .min_batch = 1, .max_batch = 4 };
+        pipeline_t pipeline = measured_stage(&stats, &options);
+
+        generate_test_data(pipeline.in); pipe_producer_free(pipeline.in);
+        validate_consumer_in_order(pipeline.out, 0); pipe_consumer_free(pipeline.out);
+
+        assert(stats.largest > 0 && stats.largest <= 4);
+    }
+
+    // A partial batch only lingers for so long.
+    {
+        batch_stats_t stats = { 0 };
+        pipe_stage_options_t options = {
+            .min_batch = 8, .max_batch = 8, .linger = 1000000
+        };
+        pipeline_t pipeline = measured_stage(&stats, &options);
+
+        testdata_t t[3] = { { 0, 0 }, { 1, 1 }, { 2, 2 } };
+        pipe_push(pipeline.in, t, countof(t));
+
+        assert(pipe_pop(pipeline.out, t, countof(t)) == countof(t));
+        assert(t[2].orig == 2);
+
+        pipe_producer_free(pipeline.in);
+        assert(pipe_pop(pipeline.out, t, 1) == 0);
+        pipe_consumer_free(pipeline.out);
+
+        assert(stats.largest == 3);
+    }
+
+    // Adaptive batches stay within their bounds.
+    {
+        batch_stats_t stats = { 0 };
+        pipe_stage_options_t options = {
+            .min_batch = 1, .max_batch = 64, .linger = 100000,
+            .flags = PIPE_BATCH_ADAPTIVE
+        };
+        pipeline_t pipeline = measured_stage(&stats, &options);
+
+        generate_test_data(pipeline.in); pipe_producer_free(pipeline.in);
+        validate_consumer_in_order(pipeline.out, 0); pipe_consumer_free(pipeline.out);
+
+        assert(stats.largest > 0 && stats.largest <= 64);
+    }
+}
+
+// double_elems, which also counts its termination calls in `*aux'.
+static void double_and_count(const void* elems, size_t count,
+                             pipe_producer_t* out, void* aux)
+{
+    if(count == 0)
+        ++*(int*)aux;
+    else
+        double_elems(elems, count, out, NULL);
+}
+
+// double_elems, which also pushes into `aux' for every termination call, since
+// parallel stages can't all write to the same counter.
+static void double_and_report(const void* elems, size_t count,
+                              pipe_producer_t* out, void* aux)
+{
+    int finished = 1;
+
+    if(count == 0)
+        pipe_push(aux, &finished, 1);
+    else
+        double_elems(elems, count, out, NULL);
+}
+
+// Runs a pipeline and a parallel stage on fewer workers than there are
+// stages. The executor is only freed once every stage has finished, so by then
+// each one must have made exactly one termination call.
+DEF_TEST(executor)
+{
+    pipe_executor_t* ex = pipe_executor_new(2);
+    assert(ex);
+
+    int done[3] = { 0 };
+
+    pipeline_t pipeline =
+        pipe_executor_pipeline(ex, sizeof(testdata_t),
+                               &double_and_count, (void*)&done[0], sizeof(testdata_t),
+                               &double_and_count, (void*)&done[1], sizeof(testdata_t),
+                               &double_and_count, (void*)&done[2], sizeof(testdata_t),
+                               (void*)NULL
+                              );
+
+    pipeline_t parallel =
+        pipe_executor_parallel(ex, 4,
+                               sizeof(testdata_t),
+                               &double_elems, (void*)NULL,
+                               sizeof(testdata_t));
+
+    assert(pipeline.in && pipeline.out);
+    assert(parallel.in && parallel.out);
+
+    generate_test_data(pipeline.in); pipe_producer_free(pipeline.in);
+    validate_consumer_in_order(pipeline.out, 3); pipe_consumer_free(pipeline.out);
+
+    generate_test_data(parallel.in); pipe_producer_free(parallel.in);
+    validate_consumer_all(parallel.out, 1); pipe_consumer_free(parallel.out);
+
+    pipe_executor_free(ex);
+
+    for(int i = 0; i < 3; ++i)
+        assert(done[i] == 1);
+
+    // More stages on one pipe than the dispatcher polls at a time. They all
+    // share an input, and each one still gets finished exactly once.
+    enum { STAGES = 300 };
+
+    pipe_t* finished = pipe_new(sizeof(int), 0);
+    pipe_producer_t* report = pipe_producer_new(finished);
+    pipe_consumer_t* reports = pipe_consumer_new(finished);
+    pipe_free(finished);
+
+    ex = pipe_executor_new(2);
+    parallel = pipe_executor_parallel(ex, STAGES,
+                                      sizeof(testdata_t),
+                                      &double_and_report, report,
+                                      sizeof(testdata_t));
+
+    generate_test_data(parallel.in); pipe_producer_free(parallel.in);
+    validate_consumer_all(parallel.out, 1); pipe_consumer_free(parallel.out);
+
+    pipe_executor_free(ex);
+    pipe_producer_free(report);
+
+    int buf[STAGES + 1];
+    assert(pipe_pop(reports, buf, STAGES + 1) == STAGES);
+    pipe_consumer_free(reports);
+}
+
+static void generate_on_cue(const void* elems, size_t count,
+                            pipe_producer_t* out, void* aux)
+{
+    UNUSED_PARAMETER(elems);
+    UNUSED_PARAMETER(aux);
+
+    if(count > 0)
+        generate_test_data(out);
+}
+
+// Pushes the test data into `out' from another thread, then frees it, so that
+// the caller can pop at the same time. Bounded pipelines need that.
+static void generate_in_background(pipe_producer_t* out)
+{
+    pipe_t* cue = pipe_new(sizeof(int), 0);
+    pipe_producer_t* p = pipe_producer_new(cue);
+
+    pipe_connect(pipe_consumer_new(cue), &generate_on_cue, (void*)NULL, out);
+    pipe_free(cue);
+
+    int go = 1;
+    pipe_push(p, &go, 1);
+    pipe_producer_free(p);
+}
+
+// With nobody popping the output, a pipeline with a budget has to stop taking
+// input after a while. Once its output is popped, everything comes out anyway.
+DEF_TEST(flow_control)
+{
+    pipe_stage_options_t small = { .min_batch = 1, .max_batch = 4 };
+
+    pipe_stage_t stages[] = {
+        { &double_elems, NULL, sizeof(testdata_t), &small },
+        { &double_elems, NULL, sizeof(testdata_t), &small },
+    };
+
+    // Three links (the input, between the stages, and the output) of 10.
+    pipe_flow_t flow = { .budget = 30 };
+
+    pipeline_t pipeline =
+        pipe_pipeline_ex(sizeof(testdata_t), stages, countof(stages), &flow);
+
+    int pushed = 0;
+
+    for(;;)
+    {
+        testdata_t t = { pushed, pushed };
+
+        if(pipe_push_timed(pipeline.in, &t, 1, pipe_now() + 50*1000*1000) == 0)
+            break;
+
+        ++pushed;
+    }
+
+    // Pipes round their limits up to a power of two (of bytes, with room for a
+    // sentinel), and to at least their minimum capacity. On top of that, each
+    // stage may be holding a batch.
+    assert(pushed >= 10 && pushed <= 3*64 + 2*4);
+
+    pipe_producer_free(pipeline.in);
+
+    testdata_t t;
+    int expected = 0;
+
+    while(pipe_pop(pipeline.out, &t, 1))
+    {
+        assert(t.orig == expected++);
+        validate_test_data(t, 4);
+    }
+
+    assert(expected == pushed);
+
+    pipe_consumer_free(pipeline.out);
+
+    // A budget too small to keep every stage busy still gets everything
+    // through, just slowly.
+    flow = (pipe_flow_t) { .budget = 2, .out_limit = 16 };
+    pipeline = pipe_pipeline_ex(sizeof(testdata_t), stages, countof(stages), &flow);
+
+    generate_in_background(pipeline.in);
+    validate_consumer_in_order(pipeline.out, 2); pipe_consumer_free(pipeline.out);
+
+    pipeline = pipe_parallel_ex(4, sizeof(testdata_t),
+                                &double_elems, (void*)NULL,
+                                sizeof(testdata_t), &flow);
+
+    generate_in_background(pipeline.in);
+    validate_consumer_all(pipeline.out, 1); pipe_consumer_free(pipeline.out);
+}
+
+// Eight doublings in three threads: ones that are all fused, split up by an
+// unfused one, and a lone unfused one at the end.
+DEF_TEST(fused_pipeline)
+{
+    int done[8] = { 0 };
+
+    pipe_stage_options_t fused = { .flags = PIPE_STAGE_FUSED, .max_batch = 7 };
+    pipe_stage_t stages[8];
+
+    for(size_t i = 0; i < countof(stages); ++i)
+        stages[i] = (pipe_stage_t) {
+            .proc     = &double_and_count,
+            .aux      = &done[i],
+            .out_size = sizeof(testdata_t),
+            .options  = i == 0 || i == 4 || i == 7 ? NULL : &fused
+        };
+
+    pipeline_t pipeline =
+        pipe_pipeline_stages(sizeof(testdata_t), stages, countof(stages));
+
+    assert(pipeline.in);
+    assert(pipeline.out);
+
+    generate_test_data(pipeline.in); pipe_producer_free(pipeline.in);
+    validate_consumer_in_order(pipeline.out, 8); pipe_consumer_free(pipeline.out);
+
+    // Every stage's termination call comes before its output is finished.
+    for(size_t i = 0; i < countof(done); ++i)
+        assert(done[i] == 1);
+}
+
+// Pushes and pops around the end of a tiny SPSC buffer a few times, to make
+// sure the fixed-size ring wraps correctly.
+DEF_TEST(spsc_wraparound)
+{
+    // Limits whose size in bytes would wrap around are refused outright.
+    assert(pipe_new_spsc(16, ~(size_t)0 / 16 + 1) == NULL);
+    assert(pipe_new_spsc(sizeof(int), ~(size_t)0) == NULL);
+
+    pipe_t* pipe = pipe_new_spsc(sizeof(int), 5);
+    pipe_producer_t* p = pipe_producer_new(pipe);
+    pipe_consumer_t* c = pipe_consumer_new(pipe);
+    pipe_free(pipe);
+
+    int next_in = 0, next_out = 0;
+
+    for(int round = 0; round < 20; ++round)
+    {
+        int in[4], out[4];
+
+        for(size_t i = 0; i < countof(in); ++i)
+            in[i] = next_in++;
+
+        pipe_push(p, in, countof(in));
+
+        size_t popped = pipe_pop(c, out, 3);
+        assert(popped == 3);
+
+        for(size_t i = 0; i < popped; ++i)
+            assert(out[i] == next_out++);
+
+        // Keep at most one element lying around, so we never block.
+        popped = pipe_pop(c, out, 1);
+        assert(popped == 1 && out[0] == next_out++);
+    }
+
+    pipe_producer_free(p);
+
+    int x;
+    assert(pipe_pop(c, &x, 1) == 0);
+
+    pipe_consumer_free(c);
+}
+
+// Runs two stages over small SPSC pipes, so that both ends of each spend a lot
+// of time waiting on each other. The last pipe is unbounded, since we don't
+// start draining it until all the data has been pushed.
+DEF_TEST(spsc_multiplier)
+{
+    pipe_t* in  = pipe_new_spsc(sizeof(testdata_t), 7),
+          * mid = pipe_new_spsc(sizeof(testdata_t), 5),
+          * out = pipe_new(sizeof(testdata_t), 0);
+
+    pipe_connect(pipe_consumer_new(in),
+                 &double_elems, (void*)NULL,
+                 pipe_producer_new(mid));
+
+    pipe_connect(pipe_consumer_new(mid),
+                 &double_elems, (void*)NULL,
+                 pipe_producer_new(out));
+
+    pipe_producer_t* p = pipe_producer_new(in);
+    pipe_consumer_t* c = pipe_consumer_new(out);
+
+    pipe_free(in);
+    pipe_free(mid);
+    pipe_free(out);
+
+    generate_test_data(p);            pipe_producer_free(p);
+    validate_consumer_in_order(c, 2); pipe_consumer_free(c);
+}
+
+// Many threads pushing into and popping out of small MPMC pipes at once.
+DEF_TEST(mpmc_multiplier)
+{
+    // Limits that won't fit once they're rounded up are refused outright.
+    assert(pipe_new_mpmc(16, ~(size_t)0 / 32 + 2) == NULL);
+    assert(pipe_new_mpmc(sizeof(int), ~(size_t)0) == NULL);
+
+    pipe_t* in  = pipe_new_mpmc(sizeof(testdata_t), 8),
+          * mid = pipe_new_mpmc(sizeof(testdata_t), 4),
+          * out = pipe_new(sizeof(testdata_t), 0);
+
+    for(int i = 0; i < 4; ++i)
+        pipe_connect(pipe_consumer_new(in),
+                     &double_elems, (void*)NULL,
+                     pipe_producer_new(mid));
+
+    for(int i = 0; i < 3; ++i)
+        pipe_connect(pipe_consumer_new(mid),
+                     &double_elems, (void*)NULL,
+                     pipe_producer_new(out));
+
+    pipe_producer_t* p = pipe_producer_new(in);
+    pipe_consumer_t* c = pipe_consumer_new(out);
+
+    pipe_free(in);
+    pipe_free(mid);
+    pipe_free(out);
+
+    generate_test_data(p);       pipe_producer_free(p);
+    validate_consumer_all(c, 2); pipe_consumer_free(c);
+}
+
+// Segments which only hold a few elements, so that the tests cross from one to
+// the next all the time.
+static pipe_t* pipe_new_segmented(size_t elem_size, size_t limit,
+                                  size_t segment)
+{
+    pipe_options_t options = {
+        .engine  = PIPE_ENGINE_SEGMENTED,
+        .segment = segment,
+    };
+
+    return pipe_new_ex(elem_size, limit, &options);
+}
+
+// Many threads on either side of segmented pipes, one of which is small enough
+// to keep everyone waiting, and one of which grows segment by segment.
+DEF_TEST(segmented_multiplier)
+{
+    // Limits and segments whose size in bytes would wrap around are refused
+    // outright.
+    assert(pipe_new_segmented(16, ~(size_t)0 / 16 + 1, 0) == NULL);
+    assert(pipe_new_segmented(16, 0, ~(size_t)0 / 16) == NULL);
+
+    pipe_t* in  = pipe_new_segmented(sizeof(testdata_t), 7, 3),
+          * mid = pipe_new_segmented(sizeof(testdata_t), 0, 5),
+          * out = pipe_new_segmented(sizeof(testdata_t), 0, 64);
+
+    for(int i = 0; i < 4; ++i)
+        pipe_connect(pipe_consumer_new(in),
+                     &double_elems, (void*)NULL,
+                     pipe_producer_new(mid));
+
+    for(int i = 0; i < 3; ++i)
+        pipe_connect(pipe_consumer_new(mid),
+                     &double_elems, (void*)NULL,
+                     pipe_producer_new(out));
+
+    pipe_producer_t* p = pipe_producer_new(in);
+    pipe_consumer_t* c = pipe_consumer_new(out);
+
+    pipe_free(in);
+    pipe_free(mid);
+    pipe_free(out);
+
+    generate_test_data(p);       pipe_producer_free(p);
+    validate_consumer_all(c, 2); pipe_consumer_free(c);
+}
+
+// Fills the pipe in place through pipe_push_reserve, sometimes committing less
+// than was reserved, and makes sure everything comes out in order.
+static void check_reserve_commit(pipe_t* pipe)
+{
+    pipe_producer_t* p = pipe_producer_new(pipe);
+    pipe_consumer_t* c = pipe_consumer_new(pipe);
+    pipe_free(pipe);
+
+    int next_in = 0, next_out = 0;
+
+    for(int round = 0; round < 100; ++round)
+    {
+        void*  room;
+        size_t reserved;
+
+        pipe_push_reserve(p, 4, &room, &reserved);
+        assert(reserved >= 1 && reserved <= 4);
+
+        size_t n = (round % 3 == 0) ? reserved - 1 : reserved;
+
+        for(size_t i = 0; i < n; ++i)
+            ((int*)room)[i] = next_in++;
+
+        pipe_push_commit(p, n);
+
+        int out[4];
+        size_t popped = n ? pipe_pop_eager(c, out, countof(out)) : 0;
+        assert(popped == n);
+
+        for(size_t i = 0; i < popped; ++i)
+            assert(out[i] == next_out++);
+    }
+
+    assert(next_in == next_out);
+
+    pipe_producer_free(p);
+    pipe_consumer_free(c);
+}
+
+DEF_TEST(reserve_commit)
+{
+    check_reserve_commit(pipe_new(sizeof(int), 0));
+    check_reserve_commit(pipe_new(sizeof(int), 6));
+    check_reserve_commit(pipe_new_spsc(sizeof(int), 5));
+    check_reserve_commit(pipe_new_segmented(sizeof(int), 0, 3));
+    check_reserve_commit(pipe_new_segmented(sizeof(int), 6, 4));
+}
+
+// The mirror image of check_reserve_commit: reads the pipe in place through
+// pipe_pop_acquire, sometimes releasing less than was acquired.
+static void check_acquire_release(pipe_t* pipe)
+{
+    pipe_producer_t* p = pipe_producer_new(pipe);
+    pipe_consumer_t* c = pipe_consumer_new(pipe);
+    pipe_free(pipe);
+
+    int next_in = 0, next_out = 0;
+
+    for(int round = 0; round < 100; ++round)
+    {
+        int in[3];
+
+        for(size_t i = 0; i < countof(in); ++i)
+            in[i] = next_in++;
+
+        pipe_push(p, in, countof(in));
+
+        // Drain everything but a straggler now and then.
+        while(next_out < next_in - (round % 4 == 0))
+        {
+            const void* elems;
+            size_t      acquired;
+
+            pipe_pop_acquire(c, 2, &elems, &acquired);
+            assert(acquired >= 1 && acquired <= 2);
+
+            size_t n = (round % 3 == 0 && acquired > 1) ? acquired - 1
+                                                        : acquired;
+
+            for(size_t i = 0; i < n; ++i)
+                assert(((const int*)elems)[i] == next_out++);
+
+            pipe_pop_release(c, n);
+        }
+    }
+
+    pipe_producer_free(p);
+
+    const void* elems;
+    size_t      acquired;
+
+    while(pipe_pop_acquire(c, 1, &elems, &acquired), acquired)
+    {
+        assert(*(const int*)elems == next_out++);
+        pipe_pop_release(c, acquired);
+    }
+
+    pipe_pop_release(c, 0);
+
+    assert(next_in == next_out);
+
+    pipe_consumer_free(c);
+}
+
+DEF_TEST(acquire_release)
+{
+    check_acquire_release(pipe_new(sizeof(int), 0));
+    check_acquire_release(pipe_new(sizeof(int), 6));
+    check_acquire_release(pipe_new_spsc(sizeof(int), 5));
+    check_acquire_release(pipe_new_segmented(sizeof(int), 0, 3));
+    check_acquire_release(pipe_new_segmented(sizeof(int), 6, 4));
+}
+
+static pipe_t* pipe_new_mirrored(pipe_engine_t engine, size_t limit)
+{
+    pipe_options_t options = { .engine = engine, .flags = PIPE_MIRRORED };
+    return pipe_new_ex(sizeof(int), limit, &options);
+}
+
+// Mirrored pipes never have to split anything that straddles the end of the
+// buffer, so reserve and acquire should always hand out everything. Linux is
+// the only platform we can count on to actually mirror them, though. Elsewhere,
+// this just checks that they still work.
+static void check_mirrored(pipe_t* pipe)
+{
+    pipe_producer_t* p = pipe_producer_new(pipe);
+    pipe_consumer_t* c = pipe_consumer_new(pipe);
+    pipe_free(pipe);
+
+    int next_in = 0, next_out = 0;
+
+    // 7 doesn't divide the buffer size, so the wrap ends up everywhere.
+    for(int round = 0; round < 3000; ++round)
+    {
+        void*  room;
+        size_t reserved;
+
+        pipe_push_reserve(p, 7, &room, &reserved);
+#ifdef __linux__
+        assert(reserved == 7);
+#endif
+
+        for(size_t i = 0; i < reserved; ++i)
+            ((int*)room)[i] = next_in++;
+
+        pipe_push_commit(p, reserved);
+
+        const void* elems;
+        size_t      acquired;
+
+        pipe_pop_acquire(c, 7, &elems, &acquired);
+#ifdef __linux__
+        assert(acquired == 7);
+#endif
+
+        for(size_t i = 0; i < acquired; ++i)
+            assert(((const int*)elems)[i] == next_out++);
+
+        pipe_pop_release(c, acquired);
+
+        // Plain pushes and pops across the wrap, too.
+        int in[3] = { next_in, next_in + 1, next_in + 2 }, out[3];
+        next_in += 3;
+
+        pipe_push(p, in, countof(in));
+        assert(pipe_pop(c, out, countof(out)) == countof(out));
+
+        for(size_t i = 0; i < countof(out); ++i)
+            assert(out[i] == next_out++);
+    }
+
+    pipe_producer_free(p);
+
+    int x;
+    assert(pipe_pop(c, &x, 1) == 0);
+
+    pipe_consumer_free(c);
+}
+
+DEF_TEST(mirrored)
+{
+    check_mirrored(pipe_new_mirrored(PIPE_ENGINE_LOCKED, 0));
+    check_mirrored(pipe_new_mirrored(PIPE_ENGINE_LOCKED, 6));
+    check_mirrored(pipe_new_mirrored(PIPE_ENGINE_SPSC, 10));
+
+    check_reserve_commit(pipe_new_mirrored(PIPE_ENGINE_LOCKED, 6));
+    check_acquire_release(pipe_new_mirrored(PIPE_ENGINE_SPSC, 5));
+
+    // Grow a mirrored pipe well past a page, then shrink it back down.
+    pipe_t* pipe = pipe_new_mirrored(PIPE_ENGINE_LOCKED, 0);
+    pipe_producer_t* p = pipe_producer_new(pipe);
+    pipe_consumer_t* c = pipe_consumer_new(pipe);
+    pipe_free(pipe);
+
+    static int in[10000], out[10000];
+
+    for(size_t i = 0; i < countof(in); ++i)
+        in[i] = (int)i;
+
+    for(int round = 0; round < 3; ++round)
+    {
+        pipe_push(p, in, 1);
+        pipe_push(p, in + 1, countof(in) - 1);
+
+        for(size_t i = 0; i < countof(out); i += 100)
+            assert(pipe_pop(c, out + i, 100) == 100);
+
+        assert(memcmp(in, out, sizeof in) == 0);
+    }
+
+    pipe_producer_free(p);
+    pipe_consumer_free(c);
+}
+
+#if !defined(_WIN32) && !defined(_WIN64)
+
+// Opens the shared pipe from a child process, and pushes `count' numbers into
+// it. The child's exit status says whether that went well.
+static pid_t push_from_child(const char* name, int count)
+{
+    pid_t pid = fork();
+
+    if(pid != 0)
+        return pid;
+
+    pipe_t* pipe = pipe_open_shared(name);
+
+    if(pipe == NULL)
+        _exit(1);
+
+    pipe_producer_t* p = pipe_producer_new(pipe);
+    pipe_free(pipe);
+
+    for(int i = 0; i < count; ++i)
+        pipe_push(p, &i, 1);
+
+    pipe_producer_free(p);
+    _exit(0);
+}
+
+#endif
+
+DEF_TEST(shared)
+{
+#if defined(_WIN32) || defined(_WIN64)
+    assert(pipe_new_shared("/pipe-test", sizeof(int), 0) == NULL);
+#else
+    enum { NUMS = 20000 };
+
+    char name[64];
+    snprintf(name, sizeof name, "/pipe-test-%ld", (long)getpid());
+
+    pipe_t* pipe = pipe_new_shared(name, sizeof(int), 100);
+    assert(pipe);
+    assert(pipe_new_shared(name, sizeof(int), 100) == NULL);
+
+    // Opening it again maps it somewhere else, even in the same process.
+    pipe_t* other = pipe_open_shared(name);
+    assert(other);
+    assert(pipe_elem_size(PIPE_GENERIC(other)) == sizeof(int));
+
+    pipe_producer_t* p = pipe_producer_new(pipe);
+    pipe_consumer_t* c = pipe_consumer_new(other);
+    pipe_free(pipe);
+
+    // 37 doesn't divide 100, so the wrap ends up everywhere.
+    int in[37], out[37], next = 0;
+
+    for(int round = 0; round < 1000; ++round)
+    {
+        for(size_t i = 0; i < countof(in); ++i)
+            in[i] = next + (int)i;
+
+        pipe_push(p, in, countof(in));
+        assert(pipe_pop(c, out, countof(out)) == countof(out));
+        assert(memcmp(in, out, sizeof in) == 0);
+
+        next += countof(in);
+    }
+
+    assert(pipe_try_pop(c, out, 1) == 0);
+    assert(!pipe_eof(c));
+
+    // Now from another process. Hang on to our producers until its first
+    // element shows up, or we'd see the end of the pipe before it even opened.
+    pid_t child = push_from_child(name, NUMS);
+    assert(child > 0);
+
+    int x;
+    assert(pipe_pop(c, &x, 1) == 1 && x == 0);
+
+    pipe_producer_free(p);
+    pipe_free(other);
+
+    for(int i = 1; i < NUMS; ++i)
+        assert(pipe_pop(c, &x, 1) == 1 && x == i);
+
+    assert(pipe_pop(c, &x, 1) == 0);
+    assert(pipe_eof(c));
+
+    int status;
+    assert(waitpid(child, &status, 0) == child);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    // We were the last ones, so the name is gone.
+    pipe_consumer_free(c);
+    assert(pipe_open_shared(name) == NULL);
+#endif
+}
+
+DEF_TEST(spilling)
+{
+    pipe_options_t options = {
+        .engine      = PIPE_ENGINE_SEGMENTED,
+        .segment     = 1024,
+        .spill_dir   = ".",
+        .spill_after = 4096,
+    };
+
+#if defined(_WIN32) || defined(_WIN64)
+    assert(pipe_new_ex(sizeof(int), 0, &options) == NULL);
+#else
+    enum { NUMS = 100000, BATCH = 1000 };
+
+    // Only segmented pipes spill, and only somewhere that exists.
+    options.engine = PIPE_ENGINE_LOCKED;
+    assert(pipe_new_ex(sizeof(int), 0, &options) == NULL);
+    options.engine = PIPE_ENGINE_SEGMENTED;
+
+    options.spill_dir = "./no-such-dir";
+    assert(pipe_new_ex(sizeof(int), 0, &options) == NULL);
+    options.spill_dir = ".";
+
+    pipe_t* pipe = pipe_new_ex(sizeof(int), 0, &options);
+    assert(pipe);
+
+    pipe_producer_t* p = pipe_producer_new(pipe);
+    pipe_consumer_t* c = pipe_consumer_new(pipe);
+    pipe_free(pipe);
+
+    // Nobody pops until everything's been pushed, so most of it spills. The
+    // second round reuses the first round's part of the file.
+    int buf[BATCH];
+
+    for(int round = 0; round < 2; ++round)
+    {
+        for(int i = 0; i < NUMS; i += BATCH)
+        {
+            for(int j = 0; j < BATCH; ++j)
+                buf[j] = i + j;
+
+            pipe_push(p, buf, BATCH);
+        }
+
+        pipe_stats_t stats;
+
+        // Every segment past the first 4096 elements, give or take one.
+        if(pipe_get_stats(PIPE_GENERIC(c), &stats))
+            assert(stats.spills >= (unsigned long long)(round + 1)
+                                   * ((NUMS - 4096) / 1024 - 1));
+
+        for(int i = 0; i < NUMS; i += BATCH)
+        {
+            assert(pipe_pop(c, buf, BATCH) == BATCH);
+
+            for(int j = 0; j < BATCH; ++j)
+                assert(buf[j] == i + j);
+        }
+
+        assert(pipe_try_pop(c, buf, 1) == 0);
+    }
+
+    pipe_producer_free(p);
+    pipe_consumer_free(c);
+
+    // Now with a few threads at the other end, which can't keep up.
+    pipe_t* in  = pipe_new_ex(sizeof(testdata_t), 0, &options),
+          * out = pipe_new(sizeof(testdata_t), 0);
+
+    for(int i = 0; i < 4; ++i)
+        pipe_connect(pipe_consumer_new(in),
+                     &double_elems, (void*)NULL,
+                     pipe_producer_new(out));
+
+    p = pipe_producer_new(in);
+    c = pipe_consumer_new(out);
+
+    pipe_free(in);
+    pipe_free(out);
+
+    generate_test_data(p);       pipe_producer_free(p);
+    validate_consumer_all(c, 1); pipe_consumer_free(c);
+#endif
+}
+
+static void forward_elems(const void* elems, size_t count,
+                          pipe_producer_t* out, void* aux)
+{
+    UNUSED_PARAMETER(aux);
+
+    if(count > 0)
+        pipe_push(out, elems, count);
+}
+
+static pipe_t* pipe_new_lanes(size_t limit, unsigned lanes,
+                              const unsigned* weights)
+{
+    pipe_options_t options = {
+        .engine       = PIPE_ENGINE_SEGMENTED,
+        .segment      = 16,
+        .lanes        = lanes,
+        .lane_weights = weights,
+    };
+
+    return pipe_new_ex(sizeof(int), limit, &options);
+}
+
+static void push_range(pipe_producer_t* p, unsigned lane, int from, int to)
+{
+    for(int i = from; i < to; ++i)
+        pipe_push_lane(p, lane, &i, 1);
+}
+
+DEF_TEST(lanes)
+{
+    // Only segmented pipes have lanes, and only so many.
+    pipe_options_t options = { .lanes = 2 };
+    assert(pipe_new_ex(sizeof(int), 0, &options) == NULL);
+    assert(pipe_new_lanes(0, PIPE_MAX_LANES + 1, NULL) == NULL);
+
+    // Highest lane first, and in order within each lane.
+    pipe_t* pipe = pipe_new_lanes(0, 3, NULL);
+
+    pipe_producer_t* p = pipe_producer_new(pipe);
+    pipe_consumer_t* c = pipe_consumer_new(pipe);
+    pipe_free(pipe);
+
+    push_range(p, 0, 0,   100);
+    push_range(p, 2, 100, 200);
+    push_range(p, 1, 200, 300);
+
+    int buf[300];
+    assert(pipe_pop(c, buf, 300) == 300);
+
+    for(int i = 0; i < 100; ++i)
+        assert(buf[i]       == 100 + i
+            && buf[100 + i] == 200 + i
+            && buf[200 + i] == i);
+
+    // Acquiring sees the high lanes first, too.
+    const void* at;
+    size_t      n;
+
+    push_range(p, 0, 0, 10);
+    push_range(p, 1, 10, 11);
+
+    pipe_pop_acquire(c, 10, &at, &n);
+    assert(n == 1 && *(const int*)at == 10);
+    pipe_pop_release(c, n);
+
+    assert(pipe_pop(c, buf, 10) == 10 && buf[0] == 0 && buf[9] == 9);
+
+    pipe_producer_free(p);
+    pipe_consumer_free(c);
+
+    // With weights, the low lane gets one in every four while both are busy.
+    static const unsigned weights[] = { 1, 3 };
+    pipe = pipe_new_lanes(0, 2, weights);
+
+    p = pipe_producer_new(pipe);
+    c = pipe_consumer_new(pipe);
+    pipe_free(pipe);
+
+    push_range(p, 0, 0,    40);
+    push_range(p, 1, 1000, 1040);
+
+    int low = 0, high = 1000;
+
+    for(int i = 0; i < 80; ++i)
+    {
+        assert(pipe_pop(c, buf, 1) == 1);
+
+        if(buf[0] < 1000)
+            assert(buf[0] == low++);
+        else
+            assert(buf[0] == high++);
+
+        // The high lane runs out after 4*40/3 pops.
+        if(i < 52)
+            assert(low == (i + 1) / 4);
+    }
+
+    assert(low == 40 && high == 1040);
+
+    pipe_producer_free(p);
+    pipe_consumer_free(c);
+
+    // They block and end like any other pipe, so they work with pipe_connect.
+    pipe_t* in  = pipe_new_lanes(64, 2, weights),
+          * out = pipe_new(sizeof(int), 0);
+
+    pipe_connect(pipe_consumer_new(in),
+                 &forward_elems, (void*)NULL,
+                 pipe_producer_new(out));
+
+    p = pipe_producer_new(in);
+    c = pipe_consumer_new(out);
+
+    pipe_free(in);
+    pipe_free(out);
+
+    enum { BULK = 100000 };
+
+    // Urgent elements are negative.
+    for(int i = 0; i < BULK; ++i)
+    {
+        pipe_push(p, &i, 1);
+
+        if(i % 1000 == 0)
+        {
+            int urgent = -1 - i / 1000;
+            pipe_push_lane(p, 1, &urgent, 1);
+        }
+    }
+
+    pipe_producer_free(p);
+
+    int x, next_bulk = 0, next_urgent = -1;
+
+    while(pipe_pop(c, &x, 1))
+        if(x >= 0)
+            assert(x == next_bulk++);
+        else
+            assert(x == next_urgent--);
+
+    assert(next_bulk == BULK && next_urgent == -1 - BULK / 1000);
+
+    pipe_consumer_free(c);
+}
+
+static pipe_t* pipe_new_broadcast(size_t limit, pipe_lag_t lag)
+{
+    pipe_options_t options = { .engine = PIPE_ENGINE_BROADCAST, .lag = lag };
+    return pipe_new_ex(sizeof(int), limit, &options);
+}
+
+DEF_TEST(broadcast)
+{
+    // Only broadcast pipes take subscribers.
+    pipe_t* plain = pipe_new(sizeof(int), 0);
+    assert(pipe_subscribe(PIPE_GENERIC(plain)) == NULL);
+    pipe_free(plain);
+
+    pipe_t* pipe = pipe_new_broadcast(100, PIPE_LAG_BLOCK);
+
+    pipe_producer_t* p = pipe_producer_new(pipe);
+    pipe_consumer_t* a = pipe_consumer_new(pipe);
+
+    // Subscribers only see what's pushed after they subscribe.
+    int x = -1;
+    pipe_push(p, &x, 1);
+
+    pipe_t*          sub = pipe_subscribe(PIPE_GENERIC(pipe));
+    pipe_consumer_t* b   = pipe_consumer_new(sub);
+    pipe_free(sub);
+    pipe_free(pipe);
+
+    assert(pipe_pop(a, &x, 1) == 1 && x == -1);
+    assert(pipe_try_pop(b, &x, 1) == 0);
+
+    int buf[100];
+    push_range(p, 0, 0, 100);
+
+    // The slowest subscriber holds up the producers.
+    assert(pipe_pop(a, buf, 100) == 100 && buf[0] == 0 && buf[99] == 99);
+    assert(pipe_try_push(p, &x, 1) == 0);
+
+    assert(pipe_pop(b, buf, 30) == 30 && buf[0] == 0 && buf[29] == 29);
+    push_range(p, 0, 100, 130);
+    assert(pipe_try_push(p, &x, 1) == 0);
+
+    // Acquiring stops at the end of the ring, which the -1 pushed us off.
+    const void* at;
+    size_t      n;
+
+    pipe_pop_acquire(b, 100, &at, &n);
+    assert(n == 69 && *(const int*)at == 30);
+    pipe_pop_release(b, n);
+
+    assert(pipe_pop(b, buf, 31) == 31 && buf[0] == 99 && buf[30] == 129);
+    assert(pipe_pop(a, buf, 30) == 30 && buf[0] == 100 && buf[29] == 129);
+
+    // Once a subscriber's consumers are gone, it doesn't hold anyone up.
+    push_range(p, 0, 0, 100);
+    assert(pipe_pop(b, buf, 100) == 100);
+    assert(pipe_try_push(p, &x, 1) == 0);
+
+    pipe_consumer_free(a);
+    assert(pipe_try_push(p, &x, 1) == 1);
+
+    assert(pipe_pop(b, buf, 1) == 1 && buf[0] == -1);
+    assert(pipe_dropped(b) == 0);
+
+    // Nor does it end until every producer is gone.
+    pipe_producer_free(p);
+    assert(pipe_pop(b, buf, 1) == 0);
+    assert(pipe_eof(b));
+
+    pipe_consumer_free(b);
+
+    // With PIPE_LAG_DROP, the producers never wait, and a subscriber who falls
+    // behind skips the oldest elements instead.
+    pipe = pipe_new_broadcast(100, PIPE_LAG_DROP);
+    sub  = pipe_subscribe(PIPE_GENERIC(pipe));
+
+    p = pipe_producer_new(pipe);
+    a = pipe_consumer_new(pipe);
+    b = pipe_consumer_new(sub);
+
+    pipe_free(sub);
+    pipe_free(pipe);
+
+    for(int i = 0; i < 250; ++i)
+    {
+        pipe_push(p, &i, 1);
+        assert(pipe_pop(a, &x, 1) == 1 && x == i);
+    }
+
+    assert(pipe_dropped(a) == 0);
+    assert(pipe_dropped(b) == 150);
+    assert(pipe_pop(b, buf, 100) == 100 && buf[0] == 150 && buf[99] == 249);
+
+    // Pushing more than fits keeps only the end of it.
+    int many[250];
+
+    for(int i = 0; i < 250; ++i)
+        many[i] = i;
+
+    pipe_push(p, many, 250);
+    assert(pipe_pop(b, buf, 100) == 100 && buf[0] == 150 && buf[99] == 249);
+    assert(pipe_dropped(b) == 300);
+
+    pipe_producer_free(p);
+    pipe_consumer_free(a);
+    pipe_consumer_free(b);
+
+    // Subscribers who can't keep up still get everything, in order, from a
+    // small pipe.
+    enum { NUMS = 100000, SUBS = 3 };
+
+    pipe = pipe_new_broadcast(64, PIPE_LAG_BLOCK);
+
+    pipe_consumer_t* outs[SUBS];
+
+    for(int i = 0; i < SUBS; ++i)
+    {
+        pipe_t* s   = pipe_subscribe(PIPE_GENERIC(pipe)),
+              * out = pipe_new(sizeof(int), 0);
+
+        pipe_connect(pipe_consumer_new(s),
+                     &forward_elems, (void*)NULL,
+                     pipe_producer_new(out));
+
+        outs[i] = pipe_consumer_new(out);
+
+        pipe_free(s);
+        pipe_free(out);
+    }
+
+    p = pipe_producer_new(pipe);
+    pipe_free(pipe);
+
+    for(int i = 0; i < NUMS; ++i)
+        pipe_push(p, &i, 1);
+
+    pipe_producer_free(p);
+
+    for(int i = 0; i < SUBS; ++i)
+    {
+        int next = 0;
+
+        while(pipe_pop(outs[i], &x, 1))
+            assert(x == next++);
+
+        assert(next == NUMS);
+
+        pipe_consumer_free(outs[i]);
+    }
+}
+
+static pipe_t* pipe_new_msg(unsigned flags, size_t limit)
+{
+    pipe_options_t options = { .flags = PIPE_MESSAGES | flags };
+    return pipe_new_ex(1, limit, &options);
+}
+
+// Message `n' is n itself, followed by n % 57 more bytes of n.
+static size_t msg_len(int n)
+{
+    return sizeof n + (size_t)(n % 57);
+}
+
+static size_t make_msg(char* msg, int n)
+{
+    memcpy(msg, &n, sizeof n);
+    memset(msg + sizeof n, (char)n, msg_len(n) - sizeof n);
+
+    return msg_len(n);
+}
+
+// Returns the number in the first `len' bytes of a message, checking the rest.
+static int check_msg(const char* msg, size_t len)
+{
+    int n;
+
+    assert(len >= sizeof n);
+    memcpy(&n, msg, sizeof n);
+
+    for(size_t i = sizeof n; i < len; ++i)
+        assert(msg[i] == (char)n);
+
+    return n;
+}
+
+static void push_msgs(const void* elems, size_t count,
+                      pipe_producer_t* out, void* aux)
+{
+    UNUSED_PARAMETER(aux);
+
+    for(size_t i = 0; i < count; ++i)
+    {
+        char   msg[64];
+        int    n   = ((const int*)elems)[i];
+        size_t len = make_msg(msg, n);
+
+        assert(pipe_push_msg(out, msg, len));
+    }
+}
+
+// Pushes three messages and pops them again, over and over, so that they keep
+// wrapping around the end of the buffer. Every pipe has room for three.
+static void check_msgs(pipe_t* pipe)
+{
+    pipe_producer_t* p = pipe_producer_new(pipe);
+    pipe_consumer_t* c = pipe_consumer_new(pipe);
+    pipe_free(pipe);
+
+    char   msg[64], out[64];
+    size_t len;
+    int    next_in = 0, next_out = 0;
+
+    // Alternate between copying, peeking, and truncating.
+    for(int round = 0; round < 3000; ++round)
+    {
+        for(int i = 0; i < 3; ++i, ++next_in)
+            assert(pipe_push_msg(p, msg, make_msg(msg, next_in)));
+
+        assert(pipe_pop_msg(c, out, sizeof out, &len));
+        assert(len == msg_len(next_out));
+        assert(check_msg(out, len) == next_out++);
+
+        const void* peeked;
+        assert(pipe_pop_msg_acquire(c, &peeked, &len));
+        assert(len == msg_len(next_out));
+        assert(check_msg(peeked, len) == next_out++);
+        pipe_pop_msg_release(c);
+
+        memset(out, 0x55, sizeof out);
+        assert(pipe_pop_msg(c, out, sizeof(int), &len));
+        assert(len == msg_len(next_out));
+        assert(check_msg(out, sizeof(int)) == next_out++);
+        assert(out[sizeof(int)] == 0x55);
+    }
+
+    pipe_producer_free(p);
+
+    assert(!pipe_pop_msg(c, out, sizeof out, &len));
+    assert(pipe_eof(c));
+
+    pipe_consumer_free(c);
+}
+
+DEF_TEST(messages)
+{
+    check_msgs(pipe_new_msg(0, 0));
+    check_msgs(pipe_new_msg(0, 200));
+    check_msgs(pipe_new_msg(PIPE_MIRRORED, 0));
+    check_msgs(pipe_new_msg(PIPE_MIRRORED, 200));
+
+    // Messages only come in bytes, on the default engine.
+    pipe_options_t options = { .engine = PIPE_ENGINE_SPSC,
+                               .flags  = PIPE_MESSAGES };
+    assert(pipe_new_ex(1, 0, &options) == NULL);
+    options.engine = PIPE_ENGINE_LOCKED;
+    assert(pipe_new_ex(sizeof(int), 0, &options) == NULL);
+
+    // Messages too big for the limit are turned away instead of waiting
+    // forever. Everything else gets through.
+    pipe_t*          pipe = pipe_new_msg(0, 60);
+    pipe_producer_t* p    = pipe_producer_new(pipe);
+    pipe_consumer_t* c    = pipe_consumer_new(pipe);
+    pipe_free(pipe);
+
+    static char big[4096];
+    char        out[8];
+    size_t      len;
+
+    assert(!pipe_push_msg(p, big, sizeof big));
+    assert(pipe_push_msg(p, big, 0));
+    assert(pipe_pop_msg(c, out, sizeof out, &len) && len == 0);
+
+    pipe_consumer_free(c);
+    assert(!pipe_push_msg(p, big, 1));
+    pipe_producer_free(p);
+
+    // Several producers at once never get their messages mixed up. Each
+    // thread pushes its own share of the numbers, in order.
+    enum { THREADS = 4, NUMS = 20000 };
+
+    pipe  = pipe_new_msg(0, 256);
+    c     = pipe_consumer_new(pipe);
+
+    pipe_producer_t* in[THREADS];
+
+    for(int t = 0; t < THREADS; ++t)
+    {
+        pipe_t* nums = pipe_new(sizeof(int), 0);
+
+        pipe_connect(pipe_consumer_new(nums), &push_msgs, (void*)NULL,
+                     pipe_producer_new(pipe));
+
+        in[t] = pipe_producer_new(nums);
+        pipe_free(nums);
+    }
+
+    pipe_free(pipe);
+
+    for(int i = 0; i < NUMS; ++i)
+        pipe_push(in[i % THREADS], &i, 1);
+
+    for(int t = 0; t < THREADS; ++t)
+        pipe_producer_free(in[t]);
+
+    int  next[THREADS] = { 0, 1, 2, 3 };
+    char msg[64];
+    int  popped = 0;
+
+    while(pipe_pop_msg(c, msg, sizeof msg, &len))
+    {
+        int n = check_msg(msg, len);
+
+        assert(len == msg_len(n));
+        assert(n == next[n % THREADS]);
+
+        next[n % THREADS] += THREADS;
+        ++popped;
+    }
+
+    assert(popped == NUMS);
+
+    pipe_consumer_free(c);
+}
+
+typedef struct {
+    pipe_consumer_t* c;
+    int              next;
+} polled_t;
+
+// Feeds a handful of pipes (one of each engine, twice) from their own threads,
+// and drains all of them from this one with a poller.
+DEF_TEST(poller)
+{
+    enum { PIPES = 8, NUMS = 20000 };
+
+    static int nums[NUMS];
+
+    for(int i = 0; i < NUMS; ++i)
+        nums[i] = i;
+
+    pipe_poller_t* poller = pipe_poller_new();
+    polled_t polled[PIPES];
+
+    for(int i = 0; i < PIPES; ++i)
+    {
+        pipe_t* in  = pipe_new(sizeof(int), 0),
+              * out = i % 4 == 0 ? pipe_new(sizeof(int), 16)
+                    : i % 4 == 1 ? pipe_new_spsc(sizeof(int), 16)
+                    : i % 4 == 2 ? pipe_new_mpmc(sizeof(int), 16)
+                    :              pipe_new_segmented(sizeof(int), 16, 5);
+
+        polled[i] = (polled_t) { .c = pipe_consumer_new(out), .next = 0 };
+        assert(pipe_poller_add(poller, polled[i].c, &polled[i]));
+
+        pipe_connect(pipe_consumer_new(in),
+                     &forward_elems, (void*)NULL,
+                     pipe_producer_new(out));
+
+        pipe_producer_t* p = pipe_producer_new(in);
+
+        pipe_free(in);
+        pipe_free(out);
+
+        for(int j = 0; j < NUMS; j += 100)
+            pipe_push(p, nums + j, 100);
+
+        pipe_producer_free(p);
+    }
+
+    void*  ready[PIPES];
+    size_t n;
+    int    finished = 0;
+
+    while((n = pipe_poll(poller, ready, countof(ready))))
+    {
+        for(size_t i = 0; i < n; ++i)
+        {
+            polled_t* x = ready[i];
+            int buf[64];
+
+            size_t popped = pipe_pop_eager(x->c, buf, countof(buf));
+
+            if(popped == 0)
+            {
+                assert(x->next == NUMS);
+
+                pipe_poller_remove(poller, x->c);
+                pipe_consumer_free(x->c);
+                ++finished;
+            }
+
+            for(size_t j = 0; j < popped; ++j)
+                assert(buf[j] == x->next++);
+        }
+    }
+
+    assert(finished == PIPES);
+
+    pipe_poller_free(poller);
+}
+
+// Is the descriptor signaled right now? If `block' is set, waits until it is.
+static int fd_signaled(pipe_fd_t fd, int block)
+{
+#if defined(_WIN32) || defined(_WIN64)
+    return WaitForSingleObject(fd, block ? INFINITE : 0) == WAIT_OBJECT_0;
+#else
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    return poll(&pfd, 1, block ? -1 : 0) == 1;
+#endif
+}
+
+// Walks a pipe with a limit through empty, full and closed, making sure the
+// descriptors keep up. Pipes may round their limits up, so we just push until
+// the writable descriptor says it would block.
+static void check_fds(pipe_t* pipe, size_t limit)
+{
+    pipe_producer_t* p = pipe_producer_new(pipe);
+    pipe_consumer_t* c = pipe_consumer_new(pipe);
+    pipe_free(pipe);
+
+    pipe_fd_t rfd = pipe_readable_fd(c),
+              wfd = pipe_writable_fd(p);
+
+    assert(rfd != PIPE_NO_FD && wfd != PIPE_NO_FD);
+    assert(pipe_readable_fd(c) == rfd);
+
+    assert(!fd_signaled(rfd, 0) && fd_signaled(wfd, 0));
+
+    int    x;
+    size_t count;
+
+    for(count = 0; fd_signaled(wfd, 0); ++count)
+    {
+        x = (int)count;
+        pipe_push(p, &x, 1);
+
+        assert(fd_signaled(rfd, 0));
+    }
+
+    assert(count >= limit);
+
+    for(size_t i = 0; i < count; ++i)
+    {
+        assert(fd_signaled(rfd, 0));
+
+        assert(pipe_pop(c, &x, 1) == 1 && x == (int)i);
+
+        assert(fd_signaled(wfd, 0));
+    }
+
+    assert(!fd_signaled(rfd, 0));
+
+    // No more producers means pops won't block anymore.
+    pipe_producer_free(p);
+    assert(fd_signaled(rfd, 0));
+
+    pipe_consumer_free(c);
+}
+
+// Drains a pipe fed from another thread, only popping once its descriptor says
+// we can. If a wakeup ever goes missing, this hangs.
+static void check_fd_reactor(pipe_t* pipe)
+{
+    pipe_t* in = pipe_new(sizeof(int), 0);
+
+    pipe_consumer_t* c = pipe_consumer_new(pipe);
+    pipe_fd_t rfd = pipe_readable_fd(c);
+
+    pipe_connect(pipe_consumer_new(in),
+                 &forward_elems, (void*)NULL,
+                 pipe_producer_new(pipe));
+
+    pipe_producer_t* p = pipe_producer_new(in);
+
+    pipe_free(in);
+    pipe_free(pipe);
+
+    for(int i = 0; i < 10000; ++i)
+        pipe_push(p, &i, 1);
+
+    pipe_producer_free(p);
+
+    int next = 0, buf[16];
+    size_t n;
+
+    do
+    {
+        assert(fd_signaled(rfd, 1));
+
+        n = pipe_pop_eager(c, buf, countof(buf));
+
+        for(size_t i = 0; i < n; ++i)
+            assert(buf[i] == next++);
+    } while(n > 0);
+
+    assert(next == 10000);
+
+    pipe_consumer_free(c);
+}
+
+DEF_TEST(fds)
+{
+    check_fds(pipe_new(sizeof(int), 4), 4);
+    check_fds(pipe_new_spsc(sizeof(int), 4), 4);
+    check_fds(pipe_new_mpmc(sizeof(int), 4), 4);
+
+    check_fd_reactor(pipe_new(sizeof(int), 8));
+    check_fd_reactor(pipe_new_spsc(sizeof(int), 8));
+    check_fd_reactor(pipe_new_mpmc(sizeof(int), 8));
+}
+
+static void count_wakeup(void* ctx)
+{
+    ++*(int*)ctx;
+}
+
+// Wakers fire once, when the pipe changes or the other side goes away, but
+// never if the pipe was ready to begin with.
+static void check_wakers(pipe_engine_t engine)
+{
+    pipe_options_t options = { .engine = engine };
+    pipe_t* pipe = pipe_new_ex(sizeof(int), 4, &options);
+
+    pipe_producer_t* p = pipe_producer_new(pipe);
+    pipe_consumer_t* c = pipe_consumer_new(pipe);
+    pipe_free(pipe);
+
+    int wakeups = 0, x = 0;
+    pipe_waker_t w = { &count_wakeup, &wakeups, NULL };
+
+    assert(pipe_wake_on_readable(c, &w) == 1);
+    assert(wakeups == 0);
+
+    pipe_push(p, &x, 1);
+    assert(wakeups == 1);
+
+    pipe_push(p, &x, 1);
+    assert(wakeups == 1);
+
+    assert(pipe_wake_on_readable(c, &w) == 0);
+    assert(pipe_wake_on_writable(p, &w) == 0);
+
+    // Cancelled wakers are never called, even from the middle of the list.
+    while(pipe_try_pop(c, &x, 1) == 1)
+        ;
+
+    int others = 0;
+    pipe_waker_t other = { &count_wakeup, &others, NULL };
+
+    assert(pipe_wake_on_readable(c, &other) == 1);
+    assert(pipe_wake_on_readable(c, &w) == 1);
+    assert(pipe_wake_cancel(PIPE_GENERIC(p), &other) == 1);
+    assert(pipe_wake_cancel(PIPE_GENERIC(c), &other) == 0);
+
+    pipe_push(p, &x, 1);
+    assert(wakeups == 2 && others == 0);
+    assert(pipe_wake_cancel(PIPE_GENERIC(c), &w) == 0);
+
+    while(pipe_try_push(p, &x, 1) == 1)
+        ;
+
+    assert(pipe_wake_on_writable(p, &w) == 1);
+    assert(pipe_pop(c, &x, 1) == 1);
+    assert(wakeups == 3);
+
+    while(pipe_try_pop(c, &x, 1) == 1)
+        ;
+
+    // The end of the pipe counts as readable.
+    assert(pipe_wake_on_readable(c, &w) == 1);
+    pipe_producer_free(p);
+    assert(wakeups == 4);
+    assert(pipe_wake_on_readable(c, &w) == 0);
+
+    pipe_consumer_free(c);
+
+    // And losing every consumer counts as writable.
+    pipe = pipe_new_ex(sizeof(int), 4, &options);
+
+    p = pipe_producer_new(pipe);
+    c = pipe_consumer_new(pipe);
+    pipe_free(pipe);
+
+    while(pipe_try_push(p, &x, 1) == 1)
+        ;
+
+    assert(pipe_wake_on_writable(p, &w) == 1);
+    assert(!pipe_orphaned(p));
+
+    pipe_consumer_free(c);
+    assert(wakeups == 5);
+    assert(pipe_orphaned(p));
+    assert(pipe_wake_on_writable(p, &w) == 0);
+
+    pipe_producer_free(p);
+}
+
+DEF_TEST(wakers)
+{
+    check_wakers(PIPE_ENGINE_LOCKED);
+    check_wakers(PIPE_ENGINE_SPSC);
+    check_wakers(PIPE_ENGINE_MPMC);
+    check_wakers(PIPE_ENGINE_SEGMENTED);
+}
+
+// `pipe' must be bounded.
+static void check_timed(pipe_t* pipe)
+{
+    pipe_producer_t* p = pipe_producer_new(pipe);
+    pipe_consumer_t* c = pipe_consumer_new(pipe);
+    pipe_free(pipe);
+
+    int x = 0, y = 0;
+
+    // Nothing to pop, and nothing will wait for it.
+    assert(pipe_try_pop(c, &y, 1) == 0);
+    assert(!pipe_eof(c));
+
+    unsigned long long start = pipe_now();
+    assert(pipe_pop_timed(c, &y, 1, start + 2000000) == 0);
+    assert(pipe_now() >= start + 2000000);
+
+    // A deadline in the past is the same as trying.
+    assert(pipe_pop_timed(c, &y, 1, 0) == 0);
+
+    // Fill it up without blocking...
+    int n = 0;
+    for(x = 0; pipe_try_push(p, &x, 1) == 1; ++x)
+        ++n;
+
+    assert(n > 0);
+
+    // ...and time out pushing any more.
+    start = pipe_now();
+    assert(pipe_push_timed(p, &x, 1, start + 2000000) == 0);
+    assert(pipe_now() >= start + 2000000);
+
+    // Everything must still be there, in order.
+    for(int i = 0; i < n; ++i)
+    {
+        assert(pipe_try_pop(c, &y, 1) == 1);
+        assert(y == i);
+    }
+
+    assert(pipe_try_pop(c, &y, 1) == 0);
+
+    int xs[3] = { 1, 2, 3 }, ys[4];
+    assert(pipe_push_timed(p, xs, 3, pipe_now() + 2000000) == 3);
+    pipe_producer_free(p);
+
+    // No producers left, but there's still something to pop.
+    assert(!pipe_eof(c));
+    assert(pipe_try_pop(c, ys, 4) == 3);
+    assert(array_eq_len(xs, ys, 3));
+    assert(pipe_eof(c));
+    assert(pipe_pop_timed(c, ys, 4, ~0ULL) == 0);
+
+    pipe_consumer_free(c);
+}
+
+DEF_TEST(timed)
+{
+    check_timed(pipe_new(sizeof(int), 4));
+    check_timed(pipe_new_spsc(sizeof(int), 4));
+    check_timed(pipe_new_mpmc(sizeof(int), 4));
+    check_timed(pipe_new_segmented(sizeof(int), 4, 3));
+}
+
+// Runs data through a small pipe with the wait policy `wait', into a stage
+// which pops from it and pushes into an unbounded pipe with the same policy.
+static void check_wait_policy(pipe_engine_t engine, pipe_wait_t wait)
+{
+    pipe_options_t options = { .engine = engine, .wait = wait, .spins = 64 };
+    pipe_options_t locked  = { .wait = wait, .spins = 64 };
+
+    pipe_t* in  = pipe_new_ex(sizeof(testdata_t), 4, &options),
+          * out = pipe_new_ex(sizeof(testdata_t), 0, &locked);
+
+    pipe_connect(pipe_consumer_new(in),
+                 &double_elems, (void*)NULL,
+                 pipe_producer_new(out));
+
+    pipe_producer_t* p = pipe_producer_new(in);
+    pipe_consumer_t* c = pipe_consumer_new(out);
+
+    pipe_free(in);
+    pipe_free(out);
+
+    static const int NUM = 20000;
+
+    testdata_t t;
+
+    // Even spinners have to give up at their deadline.
+    assert(pipe_pop_timed(c, &t, 1, pipe_now() + 1000000) == 0);
+
+    for(int i = 0; i < NUM; ++i)
+    {
+        t = (testdata_t) { i, i };
+        pipe_push(p, &t, 1);
+    }
+
+    // The stage waits for full batches, so it won't pass the last one along
+    // until we're gone.
+    pipe_producer_free(p);
+
+    for(int i = 0; i < NUM; ++i)
+    {
+        assert(pipe_pop(c, &t, 1) == 1);
+        assert(t.orig == i);
+        validate_test_data(t, 2);
+    }
+
+    assert(pipe_pop(c, &t, 1) == 0);
+
+    pipe_consumer_free(c);
+}
+
+DEF_TEST(wait_policies)
+{
+    static const pipe_engine_t engines[] = {
+        PIPE_ENGINE_LOCKED, PIPE_ENGINE_SPSC, PIPE_ENGINE_MPMC,
+        PIPE_ENGINE_SEGMENTED
+    };
+
+    static const pipe_wait_t policies[] = {
+        PIPE_WAIT_PARK, PIPE_WAIT_SPIN, PIPE_WAIT_YIELD, PIPE_WAIT_ADAPTIVE
+    };
+
+    for(size_t i = 0; i < countof(engines); ++i)
+    for(size_t j = 0; j < countof(policies); ++j)
+        check_wait_policy(engines[i], policies[j]);
+}
+
+typedef struct {
+    size_t allocs, frees, live;
+} alloc_stats_t;
+
+static void* counting_alloc(void* ctx, size_t bytes)
+{
+    alloc_stats_t* stats = ctx;
+
+    stats->allocs++;
+    stats->live += bytes;
+
+    return malloc(bytes);
+}
+
+static void counting_free(void* ctx, void* ptr, size_t bytes)
+{
+    alloc_stats_t* stats = ctx;
+
+    assert(stats->live >= bytes);
+
+    stats->frees++;
+    stats->live -= bytes;
+
+    free(ptr);
+}
+
+// Pushes a burst of ints into a fresh pipe, then pops them back out, and checks
+// whether the buffer was reallocated while it drained. Everything the pipe
+// allocated has to be given back by the time it's freed.
+static void check_resize(pipe_engine_t engine, pipe_resize_t resize,
+                         unsigned shrink_window, size_t limit,
+                         int should_reallocate_while_draining)
+{
+    enum { BURST = 1000 };
+
+    static int in[BURST];
+
+    alloc_stats_t stats = { 0, 0, 0 };
+    pipe_allocator_t allocator = { &counting_alloc, &counting_free, &stats };
+
+    pipe_options_t options = {
+        .engine        = engine,
+        .resize        = resize,
+        .shrink_window = shrink_window,
+        .allocator     = &allocator,
+        .segment       = 16,
+    };
+
+    pipe_t* pipe = pipe_new_ex(sizeof(int), limit, &options);
+    pipe_producer_t* p = pipe_producer_new(pipe);
+    pipe_consumer_t* c = pipe_consumer_new(pipe);
+    pipe_free(pipe);
+
+    assert(stats.allocs > 0);
+
+    for(int i = 0; i < BURST; ++i)
+        in[i] = i;
+
+    size_t allocs_before_burst = stats.allocs;
+
+    pipe_push(p, in, BURST);
+
+    // Fixed pipes already had room for all of it, unless they had no limit to
+    // grow to.
+    if(engine == PIPE_ENGINE_LOCKED || engine == PIPE_ENGINE_SEGMENTED)
+        assert((resize == PIPE_RESIZE_FIXED && limit != 0)
+            == (stats.allocs == allocs_before_burst));
+
+    size_t allocs_before_drain = stats.allocs;
+
+    for(int i = 0; i < BURST; ++i)
+    {
+        int x;
+        assert(pipe_pop(c, &x, 1) == 1);
+        assert(x == i);
+    }
+
+    assert((stats.allocs != allocs_before_drain)
+        == should_reallocate_while_draining);
+
+    pipe_producer_free(p);
+    pipe_consumer_free(c);
+
+    assert(stats.live == 0);
+    assert(stats.allocs == stats.frees);
+}
+
+// Gives out `*ctx' buffers, then fails.
+static void* limited_alloc(void* ctx, size_t bytes)
+{
+    size_t* left = ctx;
+
+    if(*left == 0)
+        return NULL;
+
+    --*left;
+    return malloc(bytes);
+}
+
+static void limited_free(void* ctx, void* ptr, size_t bytes)
+{
+    (void)ctx;
+    (void)bytes;
+
+    free(ptr);
+}
+
+// A pipe that can't grow keeps using the buffer it has, and pushes and
+// reserves come up short instead of running off the end of it.
+DEF_TEST(failed_growth)
+{
+    enum { BURST = 1000 };
+
+    static int in[BURST];
+
+    size_t left = 1;
+    pipe_allocator_t allocator = { &limited_alloc, &limited_free, &left };
+    pipe_options_t options = { .allocator = &allocator };
+
+    pipe_t* pipe = pipe_new_ex(sizeof(int), 0, &options);
+    pipe_producer_t* p = pipe_producer_new(pipe);
+    pipe_consumer_t* c = pipe_consumer_new(pipe);
+    pipe_free(pipe);
+
+    for(int i = 0; i < BURST; ++i)
+        in[i] = i;
+
+    size_t pushed = pipe_try_push(p, in, BURST);
+    assert(pushed > 0 && pushed < BURST);
+
+    // Full, and still can't grow.
+    assert(pipe_try_push(p, in, 1) == 0);
+
+    void*  at;
+    size_t room;
+
+    pipe_push_reserve(p, BURST, &at, &room);
+    assert(room == 0);
+    pipe_push_commit(p, 0);
+
+    for(size_t i = 0; i < pushed; ++i)
+    {
+        int x;
+        assert(pipe_pop(c, &x, 1) == 1);
+        assert(x == (int)i);
+    }
+
+    // Emptying it made room again.
+    pipe_push_reserve(p, BURST, &at, &room);
+    assert(room > 0 && room < BURST);
+    pipe_push_commit(p, 0);
+
+    pipe_producer_free(p);
+    pipe_consumer_free(c);
+}
+
+DEF_TEST(resize_policies)
+{
+    check_resize(PIPE_ENGINE_LOCKED, PIPE_RESIZE_DEFAULT,      0,       0, 1);
+    check_resize(PIPE_ENGINE_LOCKED, PIPE_RESIZE_FIXED,        0,    1000, 0);
+    check_resize(PIPE_ENGINE_LOCKED, PIPE_RESIZE_FIXED,        0,       0, 0);
+    check_resize(PIPE_ENGINE_LOCKED, PIPE_RESIZE_NEVER_SHRINK, 0,       0, 0);
+    check_resize(PIPE_ENGINE_LOCKED, PIPE_RESIZE_HYSTERESIS,   1,       0, 1);
+    check_resize(PIPE_ENGINE_LOCKED, PIPE_RESIZE_HYSTERESIS, 100000,    0, 0);
+
+    check_resize(PIPE_ENGINE_SPSC, PIPE_RESIZE_DEFAULT, 0, 1000, 0);
+    check_resize(PIPE_ENGINE_MPMC, PIPE_RESIZE_DEFAULT, 0, 1024, 0);
+
+    // Segmented pipes only ever allocate while growing.
+    check_resize(PIPE_ENGINE_SEGMENTED, PIPE_RESIZE_DEFAULT,      0,    0, 0);
+    check_resize(PIPE_ENGINE_SEGMENTED, PIPE_RESIZE_FIXED,        0, 1000, 0);
+    check_resize(PIPE_ENGINE_SEGMENTED, PIPE_RESIZE_NEVER_SHRINK, 0,    0, 0);
+}
+
+static void check_wait_stats(const pipe_wait_stats_t* w)
+{
+    unsigned long long bucketed = 0;
+
+    for(size_t i = 0; i < PIPE_STATS_BUCKETS; ++i)
+        bucketed += w->histogram[i];
+
+    assert(bucketed == w->count);
+    assert(w->max_ns <= w->total_ns);
+    assert(w->count > 0 || w->total_ns == 0);
+}
+
+static void check_stats(pipe_engine_t engine)
+{
+    pipe_options_t options = { .engine = engine };
+    pipe_t* pipe = pipe_new_ex(sizeof(int), 16, &options);
+
+    pipe_producer_t* p = pipe_producer_new(pipe);
+    pipe_consumer_t* c = pipe_consumer_new(pipe);
+    pipe_free(pipe);
+
+    pipe_stats_t stats;
+
+    if(!pipe_get_stats(PIPE_GENERIC(c), &stats))
+    {
+        pipe_stats_t zero;
+        memset(&zero, 0, sizeof zero);
+
+        // Built without PIPE_STATS.
+        assert(memcmp(&stats, &zero, sizeof zero) == 0);
+
+        pipe_producer_free(p);
+        pipe_consumer_free(c);
+        return;
+    }
+
+    assert(stats.pushes == 0 && stats.pops == 0 && stats.resizes == 0);
+
+    int elems[15] = { 0 }, buf[15];
+
+    pipe_push(p, elems, 10);
+
+    for(int i = 0; i < 5; ++i)
+        pipe_push(p, elems, 1);
+
+    for(int i = 0; i < 3; ++i)
+        assert(pipe_pop(c, buf, 5) == 5);
+
+    // Nothing to pop, so this has to sleep.
+    assert(pipe_pop_timed(c, buf, 1, pipe_now() + 1000*1000) == 0);
+
+    // Fill it up, then push one more, which has to sleep too.
+    size_t filled = 0, n;
+
+    while((n = pipe_try_push(p, elems, countof(elems))) > 0)
+        filled += n;
+
+    assert(pipe_push_timed(p, elems, 1, pipe_now() + 1000*1000) == 0);
+
+    pipe_get_stats(PIPE_GENERIC(p), &stats);
+
+    assert(stats.pushed == 15 + filled);
+    assert(stats.popped == 15);
+    assert(stats.pops   == 3);
+    assert(stats.pushed_bytes == stats.pushed * sizeof(int));
+    assert(stats.popped_bytes == stats.popped * sizeof(int));
+    assert(stats.pushes >= 6 + 1);
+
+    // Nobody was racing us, so the counters are exact.
+    assert(stats.high_water == filled);
+
+    assert(stats.elem_waits.count >= 1);
+    assert(stats.room_waits.count >= 1);
+    assert(stats.elem_waits.total_ns > 0);
+
+    check_wait_stats(&stats.room_waits);
+    check_wait_stats(&stats.elem_waits);
+    check_wait_stats(&stats.push_lock);
+    check_wait_stats(&stats.pop_lock);
+
+    // Only the default engine reallocates its buffer. Segmented pipes allocate
+    // segments, but their first one holds more than 16 elements.
+    assert((stats.resizes > 0) == (engine == PIPE_ENGINE_LOCKED));
+
+    pipe_producer_free(p);
+    pipe_consumer_free(c);
+}
+
+DEF_TEST(stats)
+{
+    check_stats(PIPE_ENGINE_LOCKED);
+    check_stats(PIPE_ENGINE_SPSC);
+    check_stats(PIPE_ENGINE_MPMC);
+    check_stats(PIPE_ENGINE_SEGMENTED);
+}
+
+typedef struct {
+    const pipe_generic_t* watched;
+    size_t events[PIPE_TRACE_STAGE_END + 1],
+           elems[PIPE_TRACE_STAGE_END + 1];
+} trace_counts_t;
+
+// Other tests' threads might still be winding down, so only count our pipe.
+static void count_event(const pipe_trace_t* e, void* ctx)
+{
+    trace_counts_t* counts = ctx;
+
+    if(e->pipe != counts->watched)
+        return;
+
+    counts->events[e->event]++;
+    counts->elems[e->event] += e->count;
+}
+
+DEF_TEST(tracing)
+{
+    trace_counts_t counts;
+    memset(&counts, 0, sizeof counts);
+
+    pipe_tracer_t tracer = { &count_event, &counts };
+
+    pipe_t* pipe = pipe_new(sizeof(int), 0);
+    pipe_producer_t* p = pipe_producer_new(pipe);
+    pipe_consumer_t* c = pipe_consumer_new(pipe);
+    pipe_free(pipe);
+
+    counts.watched = PIPE_GENERIC(c);
+
+    if(!pipe_set_tracer(&tracer))
+    {
+        // Built without PIPE_TRACE, so there's nothing to record either.
+        assert(pipe_recorder_new(0) == NULL);
+
+        pipe_producer_free(p);
+        pipe_consumer_free(c);
+        return;
+    }
+
+    int elems[4] = { 0 };
+
+    pipe_push(p, elems, 4);
+    pipe_push(p, elems, 1);
+    assert(pipe_pop(c, elems, 4) == 4);
+    assert(pipe_pop(c, elems, 1) == 1);
+    assert(pipe_pop_timed(c, elems, 1, pipe_now() + 1000*1000) == 0);
+
+    pipe_set_tracer(NULL);
+
+    assert(counts.events[PIPE_TRACE_PUSH] == 2);
+    assert(counts.elems[PIPE_TRACE_PUSH]  == 5);
+    assert(counts.events[PIPE_TRACE_POP]  == 2);
+    assert(counts.elems[PIPE_TRACE_POP]   == 5);
+    assert(counts.events[PIPE_TRACE_WAIT_ROOM] == 0);
+    assert(counts.events[PIPE_TRACE_WAIT_ELEMS] >= 1);
+    assert(counts.events[PIPE_TRACE_WAIT_END]
+        == counts.events[PIPE_TRACE_WAIT_ELEMS]);
+
+    pipe_producer_free(p);
+    pipe_consumer_free(c);
+
+    // Now record a whole pipeline, and make sure it comes out as a trace.
+    pipe_recorder_t* rec = pipe_recorder_new(0);
+    assert(rec);
+
+    pipeline_t pipeline =
+        pipe_pipeline(sizeof(testdata_t),
+                      &double_elems, (void*)NULL, sizeof(testdata_t),
+                      &double_elems, (void*)NULL, sizeof(testdata_t),
+                      (void*)NULL);
+
+    // Every element makes a few events, so keep it short.
+    for(int i = 0; i < 1000; ++i)
+    {
+        testdata_t t = { i, i };
+        pipe_push(pipeline.in, &t, 1);
+    }
+
+    pipe_producer_free(pipeline.in);
+
+    testdata_t t;
+    int popped = 0;
+
+    while(pipe_pop(pipeline.out, &t, 1))
+    {
+        validate_test_data(t, 4);
+        ++popped;
+    }
+
+    assert(popped == 1000);
+    pipe_consumer_free(pipeline.out);
+
+    FILE* f = tmpfile();
+    assert(f);
+    assert(pipe_recorder_write(rec, f));
+
+    pipe_recorder_free(rec);
+
+    long size = ftell(f);
+    assert(size > 0);
+
+    char* json = malloc(size + 1);
+    rewind(f);
+    assert(fread(json, 1, size, f) == (size_t)size);
+    json[size] = '\0';
+    fclose(f);
+
+    // The pipes are numbered in whatever order their threads got going.
+    static const char end[] = "],\"displayTimeUnit\":\"ns\"}\n";
+
+    assert(strncmp(json, "{\"traceEvents\":[", 16) == 0);
+    assert(strcmp(json + size - strlen(end), end) == 0);
+    assert(strstr(json, "\"name\":\"stage reading pipe "));
+    assert(strstr(json, "\"ph\":\"C\""));
+    assert(strstr(json, "\"ph\":\"E\""));
+
+    free(json);
+}
+
 struct Foo
 {
     int a;
@@ -305,8 +2507,36 @@ void pipe_run_test_suite(void)
     RUN_TEST(basic_storage);
     RUN_TEST(pipeline_multiplier);
     RUN_TEST(parallel_multiplier);
+    RUN_TEST(parallel_stealing);
+    RUN_TEST(parallel_numa);
+    RUN_TEST(parallel_ordered);
+    RUN_TEST(stage_batching);
+    RUN_TEST(executor);
+    RUN_TEST(fused_pipeline);
+    RUN_TEST(flow_control);
     RUN_TEST(issue_4);
     RUN_TEST(issue_5);
+    RUN_TEST(spsc_wraparound);
+    RUN_TEST(spsc_multiplier);
+    RUN_TEST(mpmc_multiplier);
+    RUN_TEST(segmented_multiplier);
+    RUN_TEST(reserve_commit);
+    RUN_TEST(acquire_release);
+    RUN_TEST(mirrored);
+    RUN_TEST(messages);
+    RUN_TEST(shared);
+    RUN_TEST(spilling);
+    RUN_TEST(lanes);
+    RUN_TEST(broadcast);
+    RUN_TEST(poller);
+    RUN_TEST(fds);
+    RUN_TEST(wakers);
+    RUN_TEST(timed);
+    RUN_TEST(wait_policies);
+    RUN_TEST(resize_policies);
+    RUN_TEST(failed_growth);
+    RUN_TEST(stats);
+    RUN_TEST(tracing);
 /*
 #ifdef PIPE_DEBUG
     RUN_TEST(clobbering);
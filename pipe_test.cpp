@@ -0,0 +1,633 @@
+/*
+ * pipe_test.cpp - Tests for pipe.hpp. The C API's own tests are in pipe_test.c.
+ */
+#include "pipe.hpp"
+
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+
+#ifdef PIPES_COROUTINES
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <vector>
+#endif
+
+// All this hackery is just to get asserts to work in release build.
+
+#ifdef NDEBUG
+#define NDEBUG_WAS_DEFINED
+#undef NDEBUG
+#endif
+
+#include <cassert>
+
+#ifdef NDEBUG_WAS_DEFINED
+#undef NDEBUG_WAS_DEFINED
+#define NDEBUG
+#endif
+
+#define DEF_TEST(name) \
+    static void test_##name()
+
+#define RUN_TEST(name) \
+    do { \
+        std::printf("%s -> ", #name); \
+        std::fflush(stdout); \
+        test_##name(); \
+        std::printf("[  OK  ]\n"); \
+    } while(0)
+
+static const int NUM = 100000;
+
+// Pushes 0 through NUM - 1 from another thread, boxed, and makes sure they all
+// come out in order. Since unique_ptr can only be moved, nothing in between can
+// have copied them.
+template <typename Pipe>
+static void check_move_only()
+{
+    typename Pipe::producer_type in;
+    typename Pipe::consumer_type out;
+
+    // The pipe itself counts as a producer, so it has to go before the end of
+    // the pipe can be seen.
+    {
+        Pipe p;
+        in  = p.make_producer();
+        out = p.make_consumer();
+    }
+
+    std::thread t([&] {
+        for(int i = 0; i < NUM; ++i)
+            in.push(std::unique_ptr<int>(new int(i)));
+
+        in.reset();
+    });
+
+    std::unique_ptr<int> elem;
+    int expected = 0;
+
+    while(out.pop(elem))
+    {
+        assert(elem && *elem == expected++);
+        elem.reset();
+    }
+
+    assert(expected == NUM);
+    assert(out.eof());
+
+    t.join();
+}
+
+DEF_TEST(move_only)
+{
+    // An unbounded default engine, which has to become a segmented one.
+    check_move_only<pipes::pipe<std::unique_ptr<int> > >();
+
+    // A bounded one, which has to be preallocated.
+    check_move_only<pipes::pipe<std::unique_ptr<int>, 64> >();
+
+    check_move_only<pipes::pipe<std::unique_ptr<int>, 64, PIPE_ENGINE_SPSC> >();
+    check_move_only<pipes::pipe<std::unique_ptr<int>, 0, PIPE_ENGINE_SEGMENTED> >();
+}
+
+struct point {
+    int x, y;
+};
+
+template <typename Pipe>
+static void check_trivial()
+{
+    typename Pipe::producer_type in;
+    typename Pipe::consumer_type out;
+
+    // The pipe itself counts as a producer, so it has to go before the end of
+    // the pipe can be seen.
+    {
+        Pipe p;
+        in  = p.make_producer();
+        out = p.make_consumer();
+    }
+
+    std::thread t([&] {
+        point batch[16];
+
+        for(int i = 0; i < NUM; )
+        {
+            // Alternate between single elements and whole arrays.
+            if(i % 2)
+            {
+                in.emplace(point { i, -i });
+                ++i;
+                continue;
+            }
+
+            int n = 0;
+
+            for(; n < 16 && i < NUM; ++n, ++i)
+                batch[n] = point { i, -i };
+
+            in.push(batch, n);
+        }
+
+        in.reset();
+    });
+
+    int expected = 0;
+    point batch[7];
+    std::size_t n;
+
+    for(;;)
+    {
+        if(expected % 3)
+        {
+            point pt = { 0, 0 };
+
+            if(!out.pop(pt))
+                break;
+
+            assert(pt.x == expected && pt.y == -expected);
+            ++expected;
+        }
+        else
+        {
+            if((n = out.pop(batch, 7)) == 0)
+                break;
+
+            for(std::size_t i = 0; i < n; ++i, ++expected)
+                assert(batch[i].x == expected && batch[i].y == -expected);
+        }
+    }
+
+    assert(expected == NUM);
+
+    t.join();
+}
+
+DEF_TEST(trivial)
+{
+    check_trivial<pipes::pipe<point> >();
+    check_trivial<pipes::pipe<point, 100> >();
+    check_trivial<pipes::pipe<point, 100, PIPE_ENGINE_SPSC> >();
+    check_trivial<pipes::pipe<point, 100, PIPE_ENGINE_MPMC> >();
+    check_trivial<pipes::pipe<point, 0, PIPE_ENGINE_SEGMENTED> >();
+    check_trivial<pipes::pipe<point, 100, PIPE_ENGINE_BROADCAST> >();
+}
+
+// Every subscriber gets its own copy of everything, pushed one at a time or
+// not.
+DEF_TEST(broadcast)
+{
+    typedef pipes::pipe<point, 100, PIPE_ENGINE_BROADCAST> bcast;
+
+    bcast::producer_type in;
+    bcast::consumer_type a, b;
+
+    {
+        bcast p;
+        pipe_t* sub = pipe_subscribe(PIPE_GENERIC(p.native_handle()));
+
+        assert(sub);
+
+        in = p.make_producer();
+        a  = p.make_consumer();
+        b  = bcast::consumer_type(pipe_consumer_new(sub));
+
+        pipe_free(sub);
+    }
+
+    point batch[2] = { { 1, -1 }, { 2, -2 } };
+
+    in.push(point { 0, 0 });
+    in.push(batch, 2);
+    in.reset();
+
+    bcast::consumer_type* subs[] = { &a, &b };
+
+    for(bcast::consumer_type* c : subs)
+    {
+        point pt;
+
+        for(int i = 0; i < 3; ++i)
+            assert(c->pop(pt) && pt.x == i && pt.y == -i);
+
+        assert(!c->pop(pt));
+    }
+}
+
+// Throws whenever it's built from, or copied from, a negative number.
+struct fragile {
+    int v;
+
+    explicit fragile(int v) : v(v) { check(); }
+    fragile(const fragile& other) : v(other.v) { check(); }
+    fragile& operator=(const fragile&) = default;
+
+    void check() const
+    {
+        if(v < 0)
+            throw std::runtime_error("fragile");
+    }
+};
+
+// Exceptions thrown while pushing or popping leave the pipe usable, with
+// everything that got in before them still there, in order. Locks left held
+// would hang the next push or pop.
+template <typename Pipe>
+static void check_throwing()
+{
+    typename Pipe::producer_type in;
+    typename Pipe::consumer_type out;
+
+    {
+        Pipe p;
+        in  = p.make_producer();
+        out = p.make_consumer();
+    }
+
+    bool threw = false;
+
+    try { in.emplace(-1); } catch(const std::exception&) { threw = true; }
+    assert(threw);
+
+    in.emplace(0);
+
+    // Copying that -1 in throws, after 1 and 2 are in.
+    fragile batch[] = { fragile(1), fragile(2), fragile(3), fragile(3) };
+    batch[2].v = -1;
+
+    threw = false;
+    try { in.push(batch, 4); } catch(const std::exception&) { threw = true; }
+    assert(threw);
+
+    in.push(batch[3]);
+
+    // `f' throws on 2, which stays in the pipe.
+    int expected = 0;
+
+    threw = false;
+
+    try
+    {
+        out.consume(10, [&](fragile&& e) {
+            if(e.v == 2)
+                throw std::runtime_error("consume");
+
+            assert(e.v == expected++);
+        });
+    }
+    catch(const std::runtime_error&)
+    {
+        threw = true;
+    }
+
+    assert(threw && expected == 2);
+
+    fragile x(0);
+
+    while(expected < 4)
+        assert(out.pop(x) && x.v == expected++);
+
+    in.reset();
+    assert(!out.pop(x));
+}
+
+DEF_TEST(throwing)
+{
+    check_throwing<pipes::pipe<fragile> >();
+    check_throwing<pipes::pipe<fragile, 64> >();
+    check_throwing<pipes::pipe<fragile, 64, PIPE_ENGINE_SPSC> >();
+    check_throwing<pipes::pipe<fragile, 0, PIPE_ENGINE_SEGMENTED> >();
+}
+
+// Handles move around, and free their references when they're done.
+DEF_TEST(handles)
+{
+    pipes::pipe<int>::consumer_type out;
+
+    {
+        pipes::pipe<int> p;
+        out = p.make_consumer();
+
+        pipes::pipe<int>::producer_type in = p.make_producer();
+        pipes::pipe<int>::producer_type moved(std::move(in));
+
+        assert(in.native_handle() == NULL);
+
+        moved.push(42);
+    }
+
+    // The pipe and its producers are gone, so 42 is the last element.
+    int x;
+    assert(out.pop(x) && x == 42);
+    assert(!out.pop(x));
+}
+
+#ifdef PIPES_COROUTINES
+// A coroutine nobody waits for. It runs until it first suspends, and frees
+// itself once it's done.
+struct detached
+{
+    struct promise_type
+    {
+        detached get_return_object() { return detached(); }
+
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// A coroutine that's destroyed along with this, even if it never finished.
+struct owned
+{
+    struct promise_type
+    {
+        owned get_return_object()
+        {
+            typedef std::coroutine_handle<promise_type> handle;
+            return owned(handle::from_promise(*this));
+        }
+
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    explicit owned(std::coroutine_handle<promise_type> h) : h(h) {}
+
+    owned(const owned&) = delete;
+    owned& operator=(const owned&) = delete;
+
+    ~owned() { h.destroy(); }
+
+    std::coroutine_handle<promise_type> h;
+};
+
+// Runs coroutines on a few threads, until it's destroyed with nothing left to
+// run.
+class thread_pool
+{
+public:
+    explicit thread_pool(int threads)
+    {
+        for(int i = 0; i < threads; ++i)
+            threads_.emplace_back([this] { run(); });
+    }
+
+    ~thread_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            done_ = true;
+        }
+
+        cv_.notify_all();
+
+        for(std::thread& t : threads_)
+            t.join();
+    }
+
+    void post(std::coroutine_handle<> h)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            queue_.push_back(h);
+        }
+
+        cv_.notify_one();
+    }
+
+private:
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(m_);
+
+        for(;;)
+        {
+            cv_.wait(lock, [this] { return done_ || !queue_.empty(); });
+
+            if(queue_.empty())
+                return;
+
+            std::coroutine_handle<> h = queue_.front();
+            queue_.pop_front();
+
+            lock.unlock();
+                h.resume();
+            lock.lock();
+        }
+    }
+
+    std::mutex                          m_;
+    std::condition_variable             cv_;
+    std::deque<std::coroutine_handle<>> queue_;
+    bool                                done_ = false;
+    std::vector<std::thread>            threads_;
+};
+
+struct pool_executor
+{
+    thread_pool* pool;
+
+    void operator()(std::coroutine_handle<> h) const { pool->post(h); }
+};
+
+template <typename Pipe>
+static detached add_one(typename Pipe::consumer_type in,
+                        typename Pipe::producer_type out,
+                        pool_executor ex)
+{
+    int x;
+
+    while(co_await in.async_pop(x, ex))
+        if(!co_await out.async_push(x + 1, ex))
+            break;
+}
+
+// Lots of stages on a handful of threads, joined by tiny pipes, so they're
+// always waiting on each other. Every element goes through all of them, in
+// order, and the end of the input makes its way through too.
+template <typename Pipe>
+static void check_async_chain()
+{
+    enum { STAGES = 200, COUNT = 20000 };
+
+    typename Pipe::producer_type in;
+    typename Pipe::consumer_type out;
+
+    thread_pool pool(4);
+
+    {
+        Pipe first;
+        in  = first.make_producer();
+        out = first.make_consumer();
+    }
+
+    for(int i = 0; i < STAGES; ++i)
+    {
+        Pipe next;
+        typename Pipe::consumer_type stage_in = std::move(out);
+
+        out = next.make_consumer();
+        add_one<Pipe>(std::move(stage_in), next.make_producer(),
+                      pool_executor { &pool });
+    }
+
+    std::thread t([&] {
+        for(int i = 0; i < COUNT; ++i)
+            in.push(i);
+
+        in.reset();
+    });
+
+    int x, expected = 0;
+
+    while(out.pop(x))
+        assert(x == STAGES + expected++);
+
+    assert(expected == COUNT);
+
+    t.join();
+}
+
+static detached pop_into(pipes::pipe<int, 4>::consumer_type& c,
+                         int& x, int& state)
+{
+    state = co_await c.async_pop(x) ? 1 : -1;
+}
+
+static detached push_from(pipes::pipe<int, 4>::producer_type& p,
+                          int x, int& state)
+{
+    state = co_await p.async_push(x) ? 1 : -1;
+}
+
+// Coroutines only suspend when they have to, and the inline executor resumes
+// them inside whatever call let them go on.
+DEF_TEST(async)
+{
+    pipes::pipe<int, 4>::producer_type in;
+    pipes::pipe<int, 4>::consumer_type out;
+
+    {
+        pipes::pipe<int, 4> p;
+        in  = p.make_producer();
+        out = p.make_consumer();
+    }
+
+    int x = 0, state = 0;
+
+    pop_into(out, x, state);
+    assert(state == 0);
+
+    in.push(42);
+    assert(state == 1 && x == 42);
+
+    state = 0;
+    push_from(in, 0, state);
+    assert(state == 1);
+
+    // Fill it up, so the next push has to wait. Small pipes round up.
+    int n = 1;
+
+    while(pipe_try_push(in.native_handle(), &n, 1) == 1)
+        ++n;
+
+    state = 0;
+    push_from(in, n, state);
+    assert(state == 0);
+
+    assert(out.pop(x) && x == 0);
+    assert(state == 1);
+
+    for(int i = 1; i <= n; ++i)
+        assert(out.pop(x) && x == i);
+
+    // The ends of the pipe come through as false.
+    state = 0;
+    pop_into(out, x, state);
+
+    in.reset();
+    assert(state == -1);
+
+    {
+        pipes::pipe<int, 4> p;
+        in  = p.make_producer();
+        out = p.make_consumer();
+    }
+
+    while(pipe_try_push(in.native_handle(), &n, 1) == 1)
+        ;
+
+    state = 0;
+    push_from(in, n, state);
+    assert(state == 0);
+
+    out.reset();
+    assert(state == -1);
+}
+
+static owned pop_forever(pipes::pipe<int, 4>::consumer_type& c, int& state)
+{
+    int x;
+    state = co_await c.async_pop(x) ? 1 : -1;
+}
+
+// Destroying a suspended coroutine takes its waker back, so the next push
+// doesn't pop anything on its behalf.
+DEF_TEST(async_destroy)
+{
+    pipes::pipe<int, 4>::producer_type in;
+    pipes::pipe<int, 4>::consumer_type out;
+
+    {
+        pipes::pipe<int, 4> p;
+        in  = p.make_producer();
+        out = p.make_consumer();
+    }
+
+    int x, state = 0;
+
+    {
+        owned waiting = pop_forever(out, state);
+        assert(!waiting.h.done());
+    }
+
+    in.push(42);
+    assert(state == 0);
+    assert(out.pop(x) && x == 42);
+}
+
+DEF_TEST(async_chain)
+{
+    check_async_chain<pipes::pipe<int, 4> >();
+    check_async_chain<pipes::pipe<int, 4, PIPE_ENGINE_SPSC> >();
+    check_async_chain<pipes::pipe<int, 4, PIPE_ENGINE_MPMC> >();
+    check_async_chain<pipes::pipe<int, 4, PIPE_ENGINE_SEGMENTED> >();
+}
+#endif
+
+int main()
+{
+    RUN_TEST(move_only);
+    RUN_TEST(trivial);
+    RUN_TEST(broadcast);
+    RUN_TEST(throwing);
+    RUN_TEST(handles);
+
+#ifdef PIPES_COROUTINES
+    RUN_TEST(async);
+    RUN_TEST(async_destroy);
+    RUN_TEST(async_chain);
+#endif
+
+    return 0;
+}
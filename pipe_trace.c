@@ -0,0 +1,93 @@
+/*
+ * pipe_trace.c - Runs a small pipeline while recording it, and writes out the
+ *                timeline as a Chrome trace. Open it in chrome://tracing or
+ *                https://ui.perfetto.dev to see how long each stage spends on
+ *                its batches, and how long they sit in the pipes in between.
+ *
+ * This only records anything when built with PIPE_TRACE.
+ */
+#include "pipe.h"
+#include "pipe_util.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define STAGES 4
+
+// Some made-up work, so that there's something to see. The stages get slower
+// as they go, so the pipes in front of the later ones back up.
+static void work(const void* elems, size_t count, pipe_producer_t* out, void* aux)
+{
+    uintptr_t rounds = (uintptr_t)aux;
+
+    if(count == 0)
+        return;
+
+    uint64_t buf[count];
+    const uint64_t* in = elems;
+
+    for(size_t i = 0; i < count; ++i)
+    {
+        buf[i] = in[i];
+
+        for(uintptr_t r = 0; r < rounds; ++r)
+            buf[i] = buf[i] * 6364136223846793005ULL + 1442695040888963407ULL;
+    }
+
+    pipe_push(out, buf, count);
+}
+
+int main(int argc, char** argv)
+{
+    const char* path  = argc > 1 ? argv[1] : "trace.json";
+    uint64_t    count = argc > 2 ? strtoull(argv[2], NULL, 10) : 100000;
+
+    pipe_recorder_t* rec = pipe_recorder_new(1 << 22);
+
+    if(rec == NULL)
+    {
+        printf("%s wasn't built with PIPE_TRACE, so there's nothing to record.\n",
+               argv[0]);
+        return 255;
+    }
+
+    pipe_stage_t stages[STAGES];
+
+    for(size_t i = 0; i < STAGES; ++i)
+        stages[i] = (pipe_stage_t) {
+            &work, (void*)(uintptr_t)(16 << i), sizeof(uint64_t), NULL
+        };
+
+    pipeline_t pipeline = pipe_pipeline_stages(sizeof(uint64_t), stages, STAGES);
+
+    for(uint64_t i = 0; i < count; ++i)
+        pipe_push(pipeline.in, &i, 1);
+
+    pipe_producer_free(pipeline.in);
+
+    uint64_t buf[64];
+
+    while(pipe_pop_eager(pipeline.out, buf, 64) > 0)
+        ;
+
+    pipe_consumer_free(pipeline.out);
+
+    FILE* f = fopen(path, "w");
+    int   ok = f != NULL && pipe_recorder_write(rec, f);
+
+    if(f)
+        fclose(f);
+
+    pipe_recorder_free(rec);
+
+    if(!ok)
+    {
+        printf("Couldn't write %s.\n", path);
+        return 1;
+    }
+
+    printf("Wrote %s.\n", path);
+
+    return 0;
+}
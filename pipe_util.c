@@ -21,10 +21,17 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
  * THE SOFTWARE.
  */
+// For sched_setaffinity. This has to come before any system header.
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include "pipe_util.h"
 
 #include <assert.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #ifdef _WIN32 // use the native win32 API on Windows
@@ -39,18 +46,160 @@
                      0,                             \
                      NULL))
 
+// Joinable threads, for the executor.
+typedef HANDLE thread_t;
+
+static thread_t thread_start(void* (*f)(void*), void* p)
+{
+    return CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)f, p, 0, NULL);
+}
+
+static void thread_join(thread_t t)
+{
+    WaitForSingleObject(t, INFINITE);
+    CloseHandle(t);
+}
+
+static size_t cpu_count(void)
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+}
+
+// Without processor groups, a thread can only be pinned to the first 64 CPUs.
+static void pin_thread(const unsigned* cpus, size_t count)
+{
+    DWORD_PTR mask = 0;
+
+    for(size_t i = 0; i < count; ++i)
+        if(cpus[i] < 8 * sizeof mask)
+            mask |= (DWORD_PTR)1 << cpus[i];
+
+    if(mask)
+        SetThreadAffinityMask(GetCurrentThread(), mask);
+}
+
+// What traces call the current thread.
+static unsigned long long thread_id(void)
+{
+    return GetCurrentThreadId();
+}
+
 #else // fall back on pthreads
 
 #include <pthread.h>
 
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
 static inline void thread_create(void *(*f) (void*), void* p)
 {
     pthread_t t;
     pthread_create(&t, NULL, f, p);
+    pthread_detach(t);
+}
+
+typedef pthread_t thread_t;
+
+static inline thread_t thread_start(void* (*f)(void*), void* p)
+{
+    pthread_t t;
+    pthread_create(&t, NULL, f, p);
+    return t;
+}
+
+static inline void thread_join(thread_t t)
+{
+    pthread_join(t, NULL);
+}
+
+static size_t cpu_count(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (size_t)n : 1;
+}
+
+static void pin_thread(const unsigned* cpus, size_t count)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+
+    for(size_t i = 0; i < count; ++i)
+        if(cpus[i] < CPU_SETSIZE)
+            CPU_SET(cpus[i], &set);
+
+    // If none of the CPUs exist, leave the thread wherever the OS wants it.
+    if(CPU_COUNT(&set) > 0)
+        sched_setaffinity(0, sizeof set, &set);
+#else
+    (void)cpus;
+    (void)count;
+#endif
+}
+
+// Linux thread IDs are small, and match what perf and top show.
+static unsigned long long thread_id(void)
+{
+#ifdef __linux__
+    return (unsigned long long)syscall(SYS_gettid);
+#else
+    return (unsigned long long)(uintptr_t)pthread_self();
+#endif
 }
 
 #endif
 
+// Everything a pinned thread needs to pin itself before it gets going.
+typedef struct {
+    void*  (*f)(void*);
+    void*    param;
+    size_t   count;
+    unsigned cpus[];
+} pinned_start_t;
+
+static void* start_pinned(void* param)
+{
+    pinned_start_t* s = param;
+
+    void* (*f)(void*) = s->f;
+    void* p = s->param;
+
+    pin_thread(s->cpus, s->count);
+    free(s);
+
+    return f(p);
+}
+
+// Runs `f(param)' in a new thread, pinned to `cpus' (if there are any).
+static void thread_create_pinned(void* (*f)(void*), void* param,
+                                 const pipe_cpuset_t* cpus)
+{
+    if(cpus == NULL || cpus->count == 0)
+    {
+        thread_create(f, param);
+        return;
+    }
+
+    pinned_start_t* s = malloc(sizeof *s + cpus->count * sizeof *s->cpus);
+
+    *s = (pinned_start_t) {
+        .f     = f,
+        .param = param,
+        .count = cpus->count
+    };
+
+    for(size_t i = 0; i < cpus->count; ++i)
+        s->cpus[i] = cpus->cpus[i];
+
+    thread_create(&start_pinned, s);
+}
+
 pipeline_t pipe_trivial_pipeline(pipe_t* p)
 {
     return (pipeline_t) {
@@ -61,123 +210,1375 @@ pipeline_t pipe_trivial_pipeline(pipe_t* p)
 
 #define DEFAULT_BUFFER_SIZE     128
 
+// Runs a batch through a stage, and tells the tracer (see pipe_set_tracer).
+// Stages are traced under the pipe they read from.
+static inline void run_batch(pipe_consumer_t* in,
+                             pipe_processor_t proc, void* aux,
+                             const void* elems, size_t count,
+                             pipe_producer_t* out)
+{
+    pipe_trace(PIPE_GENERIC(in), PIPE_TRACE_STAGE_BEGIN, count);
+    proc(elems, count, out, aux);
+    pipe_trace(PIPE_GENERIC(in), PIPE_TRACE_STAGE_END, count);
+}
+
+// One of the stages fused onto the end of a pipe_connect'ed one. Its input is a
+// pipe only this thread ever touches.
+typedef struct {
+    pipe_consumer_t* in;
+    pipe_processor_t proc;
+    void*            aux;
+    pipe_producer_t* out;
+
+    size_t           max_batch;
+    char*            buf;
+} fused_stage_t;
+
 typedef struct {
     pipe_consumer_t* in;
     pipe_processor_t proc;
     void* aux;
     pipe_producer_t* out;
+
+    size_t min_batch,
+           max_batch,
+           target;     // the batch we'd like to wait for. Only changes if
+                       // `adaptive' is set.
+    unsigned long long linger;
+    bool adaptive;
+
+    // Stages fused onto the end of this one, which run in the same thread.
+    // `out' then goes to the first of them instead of to another thread.
+    size_t        fused;
+    fused_stage_t chain[];
 } connect_data_t;
 
+// Pops the next batch for a stage into `buf', which has room for `max_batch'
+// elements. Blocks until there's at least one, then waits up to `linger' for
+// `target' of them, then grabs whatever else is already there. Returns 0
+// once the pipe is finished.
+static size_t pop_batch(connect_data_t* p, char* buf, size_t elem_size)
+{
+    size_t elems_read = pipe_pop_eager(p->in, buf, p->max_batch);
+
+    if(elems_read == 0)
+        return 0;
+
+    // If the first pop filled the target without any waiting, we're behind.
+    bool behind = elems_read >= p->target;
+
+    if(!behind)
+    {
+        char*  rest   = buf + elems_read * elem_size;
+        size_t wanted = p->target - elems_read;
+
+        elems_read += p->linger
+            ? pipe_pop_timed(p->in, rest, wanted, pipe_now() + p->linger)
+            : pipe_pop(p->in, rest, wanted);
+
+        elems_read += pipe_try_pop(p->in, buf + elems_read * elem_size,
+                                   p->max_batch - elems_read);
+    }
+
+    // Wait for bigger batches when they come in faster than we can keep up,
+    // and smaller ones when they don't, so that we aren't lingering for
+    // nothing.
+    if(p->adaptive)
+    {
+        if(behind)
+            p->target = p->target * 2 < p->max_batch ? p->target * 2 : p->max_batch;
+        else if(elems_read < p->target)
+            p->target = p->target / 2 > p->min_batch ? p->target / 2 : p->min_batch;
+    }
+
+    return elems_read;
+}
+
+// Runs every fused stage until everything the stage before it pushed has made
+// it all the way through.
+static void run_fused(fused_stage_t* chain, size_t count)
+{
+    if(count == 0)
+        return;
+
+    size_t elems_read;
+
+    while((elems_read = pipe_try_pop(chain->in, chain->buf, chain->max_batch)))
+    {
+        run_batch(chain->in, chain->proc, chain->aux,
+                  chain->buf, elems_read, chain->out);
+        run_fused(chain + 1, count - 1);
+    }
+}
+
 static void* process_pipe(void* param)
 {
-    connect_data_t p = *(connect_data_t*)param;
-    free(param);
+    connect_data_t* p = param;
 
-    char* buf = malloc(DEFAULT_BUFFER_SIZE * pipe_elem_size(PIPE_GENERIC(p.in)));
+    size_t elem_size = pipe_elem_size(PIPE_GENERIC(p->in));
+
+    char* buf = malloc(p->max_batch * elem_size);
 
     size_t elems_read;
 
-    while((elems_read = pipe_pop(p.in, buf, DEFAULT_BUFFER_SIZE)))
-        p.proc(buf, elems_read, p.out, p.aux);
+    while((elems_read = pop_batch(p, buf, elem_size)))
+    {
+        run_batch(p->in, p->proc, p->aux, buf, elems_read, p->out);
+        run_fused(p->chain, p->fused);
+    }
 
-    p.proc(NULL, 0, NULL, p.aux);
+    p->proc(NULL, 0, NULL, p->aux);
 
     free(buf);
 
-    pipe_consumer_free(p.in);
-    pipe_producer_free(p.out);
+    pipe_consumer_free(p->in);
+    pipe_producer_free(p->out);
+
+    for(size_t i = 0; i < p->fused; ++i)
+    {
+        fused_stage_t* f = &p->chain[i];
+
+        f->proc(NULL, 0, NULL, f->aux);
+
+        free(f->buf);
+
+        pipe_consumer_free(f->in);
+        pipe_producer_free(f->out);
+    }
+
+    free(p);
 
     return NULL;
 }
 
-void pipe_connect(pipe_consumer_t* in,
-                  pipe_processor_t proc, void* aux,
-                  pipe_producer_t* out)
+static const pipe_stage_options_t default_stage_options = { .max_batch = 0 };
+
+static size_t max_batch_of(const pipe_stage_options_t* options)
+{
+    return options->max_batch ? options->max_batch : DEFAULT_BUFFER_SIZE;
+}
+
+// Sets up everything about a stage but its fused stages and its thread.
+static connect_data_t* new_connect_data(pipe_consumer_t* in,
+                                        pipe_processor_t proc, void* aux,
+                                        pipe_producer_t* out,
+                                        const pipe_stage_options_t* options,
+                                        size_t fused)
 {
     assert(in);
     assert(out);
     assert(proc);
 
-    connect_data_t* d = malloc(sizeof *d);
+    size_t max_batch = max_batch_of(options),
+           min_batch = options->min_batch ? options->min_batch : max_batch;
+
+    if(min_batch > max_batch)
+        min_batch = max_batch;
+
+    connect_data_t* d = malloc(sizeof *d + fused * sizeof *d->chain);
 
     *d = (connect_data_t) {
         .in = in,
         .proc = proc,
         .aux = aux,
-        .out = out
+        .out = out,
+
+        .min_batch = min_batch,
+        .max_batch = max_batch,
+        .target    = min_batch,
+        .linger    = options->linger,
+        .adaptive  = (options->flags & PIPE_BATCH_ADAPTIVE) != 0,
+
+        .fused = fused
     };
 
-    thread_create(&process_pipe, d);
+    return d;
 }
 
-pipeline_t pipe_parallel(size_t           instances,
-                         size_t           in_size,
-                         pipe_processor_t proc,
-                         void*            aux,
-                         size_t           out_size)
+void pipe_connect(pipe_consumer_t* in,
+                  pipe_processor_t proc, void* aux,
+                  pipe_producer_t* out)
 {
-    pipe_t* in  = pipe_new(in_size,  0),
-          * out = pipe_new(out_size, 0);
+    pipe_connect_ex(in, proc, aux, out, NULL);
+}
 
-    while(instances--)
-        pipe_connect(pipe_consumer_new(in),
-                     proc, aux,
-                     pipe_producer_new(out));
+void pipe_connect_pinned(pipe_consumer_t* in,
+                         pipe_processor_t proc, void* aux,
+                         pipe_producer_t* out,
+                         const pipe_cpuset_t* cpus)
+{
+    pipe_stage_options_t options = { .cpus = cpus };
+    pipe_connect_ex(in, proc, aux, out, &options);
+}
 
-    pipeline_t ret = {
-        .in  = pipe_producer_new(in),
-        .out = pipe_consumer_new(out)
-    };
+void pipe_connect_ex(pipe_consumer_t* in,
+                     pipe_processor_t proc, void* aux,
+                     pipe_producer_t* out,
+                     const pipe_stage_options_t* options)
+{
+    if(options == NULL)
+        options = &default_stage_options;
 
-    pipe_free(in);
-    pipe_free(out);
+    thread_create_pinned(&process_pipe,
+                         new_connect_data(in, proc, aux, out, options, 0),
+                         options->cpus);
+}
 
-    return ret;
+/*
+ * The executor:
+ *
+ * Stages move between the executor's threads through two pipes. The dispatcher
+ * keeps every idle stage's input in a poller, and, as soon as one is ready,
+ * pushes the stage into `runnable'. Workers pop stages from there, run them,
+ * and push them back into `submitted', which the dispatcher also polls. New
+ * stages come in the same way, and so does a NULL once the executor is being
+ * freed. Since a stage is always in exactly one place (the poller, one of the
+ * pipes, or a worker), nothing about it needs locking.
+ *
+ * A stage that ran out of input isn't finished unless its pipe is too, so the
+ * worker checks, makes the termination call if it is, and sends the stage back
+ * marked as finished so that the dispatcher can stop counting it. Once the
+ * dispatcher has seen the NULL and has no stages left, it frees its side of
+ * `runnable', and the workers all run dry.
+ */
+
+// The number of batches a stage gets to process before it has to give the
+// other stages a turn.
+#define STAGE_QUANTUM           16
+
+typedef enum {
+    STAGE_NEW,      // just connected; the dispatcher hasn't seen it yet.
+    STAGE_WAITING,  // waiting for its input, or running.
+    STAGE_FINISHED  // has made its termination call.
+} stage_state_t;
+
+typedef struct {
+    pipe_consumer_t* in;
+    pipe_processor_t proc;
+    void*            aux;
+    pipe_producer_t* out;
+
+    char*            buf;
+    stage_state_t    state;
+} stage_t;
+
+struct pipe_executor_t {
+    pipe_producer_t* submit;    // stage_t*s going to the dispatcher.
+    pipe_consumer_t* submitted;
+    pipe_producer_t* dispatch;  // stage_t*s ready to run. Only the dispatcher
+    pipe_consumer_t* runnable;  // pushes, and it frees `dispatch' when done.
+
+    thread_t dispatcher;
+    size_t   threads;
+    thread_t workers[];
+};
+
+static void* dispatch_stages(void* param)
+{
+    pipe_executor_t* ex = param;
+
+    pipe_poller_t* poller = pipe_poller_new();
+    assert(poller);
+
+    // `submitted' is the only thing with a NULL tag. Everything else is tagged
+    // with its stage.
+    int added = pipe_poller_add(poller, ex->submitted, NULL);
+    assert(added);
+    (void)added;
+
+    size_t live = 0;
+    bool freeing = false;
+
+    while(!freeing || live > 0)
+    {
+        void* ready[DEFAULT_BUFFER_SIZE];
+        size_t count = pipe_poll(poller, ready, DEFAULT_BUFFER_SIZE);
+
+        for(size_t i = 0; i < count; ++i)
+        {
+            stage_t* s = ready[i];
+
+            if(s != NULL)
+            {
+                // Parallel stages share their input pipe, so find this one's
+                // watch by its tag.
+                pipe_poller_remove_tag(poller, s->in, s);
+                pipe_push(ex->dispatch, &s, 1);
+                continue;
+            }
+
+            stage_t* stages[DEFAULT_BUFFER_SIZE];
+            size_t n;
+
+            while((n = pipe_try_pop(ex->submitted, stages, DEFAULT_BUFFER_SIZE)))
+                for(size_t k = 0; k < n; ++k)
+                {
+                    if((s = stages[k]) == NULL)
+                        freeing = true;
+                    else if(s->state == STAGE_FINISHED)
+                    {
+                        free(s);
+                        --live;
+                    }
+                    else
+                    {
+                        if(s->state == STAGE_NEW)
+                            ++live;
+
+                        s->state = STAGE_WAITING;
+
+                        // If we can't watch its input, just keep running it
+                        // until it's done. That's a worker kept busy, but the
+                        // stage isn't lost.
+                        if(!pipe_poller_add(poller, s->in, s))
+                            pipe_push(ex->dispatch, &s, 1);
+                    }
+                }
+        }
+    }
+
+    pipe_poller_free(poller);
+    pipe_producer_free(ex->dispatch);
+
+    return NULL;
 }
 
-static pipeline_t va_pipe_pipeline(pipeline_t result_so_far,
-                                   va_list args)
+// Runs a stage until it runs out of input or time.
+static void run_stage(stage_t* s)
 {
-    pipe_processor_t proc = va_arg(args, pipe_processor_t);
+    for(int i = 0; i < STAGE_QUANTUM; ++i)
+    {
+        size_t elems_read = pipe_try_pop(s->in, s->buf, DEFAULT_BUFFER_SIZE);
 
-    if(proc == NULL)
-        return result_so_far;
+        if(elems_read == 0)
+        {
+            if(pipe_eof(s->in))
+            {
+                s->proc(NULL, 0, NULL, s->aux);
 
-    void*  aux       = va_arg(args, void*);
-    size_t pipe_size = va_arg(args, size_t);
+                free(s->buf);
 
-    if(pipe_size == 0)
+                pipe_consumer_free(s->in);
+                pipe_producer_free(s->out);
+
+                s->state = STAGE_FINISHED;
+            }
+
+            return;
+        }
+
+        run_batch(s->in, s->proc, s->aux, s->buf, elems_read, s->out);
+    }
+}
+
+static void* run_stages(void* param)
+{
+    pipe_executor_t* ex = param;
+
+    stage_t* s;
+
+    while(pipe_pop(ex->runnable, &s, 1))
     {
-        pipe_consumer_free(result_so_far.out);
-        result_so_far.out = NULL;
-        return result_so_far;
+        run_stage(s);
+        pipe_push(ex->submit, &s, 1);
     }
 
-    pipe_t* pipe = pipe_new(pipe_size, 0);
+    return NULL;
+}
 
-    pipe_connect(result_so_far.out , proc, aux, pipe_producer_new(pipe));
-    result_so_far.out = pipe_consumer_new(pipe);
+pipe_executor_t* pipe_executor_new(size_t threads)
+{
+    if(threads == 0)
+        threads = cpu_count();
 
-    pipe_free(pipe);
+    pipe_executor_t* ex = malloc(sizeof *ex + threads * sizeof *ex->workers);
+
+    if(ex == NULL)
+        return NULL;
+
+    pipe_t* submit   = pipe_new(sizeof(stage_t*), 0),
+          * runnable = pipe_new(sizeof(stage_t*), 0);
+
+    *ex = (pipe_executor_t) {
+        .submit    = pipe_producer_new(submit),
+        .submitted = pipe_consumer_new(submit),
+        .dispatch  = pipe_producer_new(runnable),
+        .runnable  = pipe_consumer_new(runnable),
+        .threads   = threads
+    };
 
-    return va_pipe_pipeline(result_so_far, args);
+    pipe_free(submit);
+    pipe_free(runnable);
+
+    ex->dispatcher = thread_start(&dispatch_stages, ex);
+
+    for(size_t i = 0; i < threads; ++i)
+        ex->workers[i] = thread_start(&run_stages, ex);
+
+    return ex;
 }
 
-pipeline_t pipe_pipeline(size_t first_size, ...)
+void pipe_executor_free(pipe_executor_t* ex)
 {
-    va_list va;
-    va_start(va, first_size);
+    stage_t* none = NULL;
+    pipe_push(ex->submit, &none, 1);
 
-    pipe_t* p = pipe_new(first_size, 0);
+    thread_join(ex->dispatcher);
 
-    pipeline_t ret = va_pipe_pipeline(pipe_trivial_pipeline(p), va);
+    for(size_t i = 0; i < ex->threads; ++i)
+        thread_join(ex->workers[i]);
 
-    pipe_free(p);
+    pipe_producer_free(ex->submit);
+    pipe_consumer_free(ex->submitted);
+    pipe_consumer_free(ex->runnable);
 
-    va_end(va);
+    free(ex);
+}
+
+void pipe_executor_connect(pipe_executor_t* ex,
+                           pipe_consumer_t* in,
+                           pipe_processor_t proc, void* aux,
+                           pipe_producer_t* out)
+{
+    assert(ex);
+    assert(in);
+    assert(out);
+    assert(proc);
+
+    stage_t* s = malloc(sizeof *s);
+
+    *s = (stage_t) {
+        .in    = in,
+        .proc  = proc,
+        .aux   = aux,
+        .out   = out,
+        .buf   = malloc(DEFAULT_BUFFER_SIZE * pipe_elem_size(PIPE_GENERIC(in))),
+        .state = STAGE_NEW
+    };
+
+    pipe_push(ex->submit, &s, 1);
+}
+
+// Starts a stage on `ex', or in a thread of its own if `ex' is NULL.
+static void connect_stage(pipe_executor_t* ex,
+                          pipe_consumer_t* in,
+                          pipe_processor_t proc, void* aux,
+                          pipe_producer_t* out)
+{
+    if(ex)
+        pipe_executor_connect(ex, in, proc, aux, out);
+    else
+        pipe_connect(in, proc, aux, out);
+}
+
+// The limit a pipe ends up with, given the one it asked for and its share of
+// the flow's budget.
+static size_t flow_limit(size_t own, size_t share)
+{
+    return own ? own : share;
+}
+
+// Splits a flow's budget evenly between the pipes that don't have limits of
+// their own. `unlimited' is how many of those there are.
+static size_t budget_share(const pipe_flow_t* flow, size_t unlimited)
+{
+    if(flow == NULL || flow->budget == 0 || unlimited == 0)
+        return 0;
+
+    size_t share = flow->budget / unlimited;
+
+    return share ? share : 1;
+}
+
+static pipeline_t parallel(pipe_executor_t*  ex,
+                           size_t            instances,
+                           size_t            in_size,
+                           pipe_processor_t  proc,
+                           void*             aux,
+                           size_t            out_size,
+                           const pipe_flow_t* flow)
+{
+    size_t in_limit  = flow ? flow->in_limit : 0,
+           out_limit = flow ? flow->out_limit : 0,
+           share     = budget_share(flow, (in_limit == 0) + (out_limit == 0));
+
+    pipe_t* in  = pipe_new(in_size,  flow_limit(in_limit,  share)),
+          * out = pipe_new(out_size, flow_limit(out_limit, share));
+
+    while(instances--)
+        connect_stage(ex,
+                      pipe_consumer_new(in),
+                      proc, aux,
+                      pipe_producer_new(out));
+
+    pipeline_t ret = {
+        .in  = pipe_producer_new(in),
+        .out = pipe_consumer_new(out)
+    };
+
+    pipe_free(in);
+    pipe_free(out);
 
     return ret;
 }
 
+pipeline_t pipe_parallel(size_t           instances,
+                         size_t           in_size,
+                         pipe_processor_t proc,
+                         void*            aux,
+                         size_t           out_size)
+{
+    return parallel(NULL, instances, in_size, proc, aux, out_size, NULL);
+}
+
+pipeline_t pipe_parallel_ex(size_t             instances,
+                            size_t             in_size,
+                            pipe_processor_t   proc,
+                            void*              aux,
+                            size_t             out_size,
+                            const pipe_flow_t* flow)
+{
+    return parallel(NULL, instances, in_size, proc, aux, out_size, flow);
+}
+
+pipeline_t pipe_executor_parallel(pipe_executor_t* ex,
+                                  size_t           instances,
+                                  size_t           in_size,
+                                  pipe_processor_t proc,
+                                  void*            aux,
+                                  size_t           out_size)
+{
+    assert(ex);
+    return parallel(ex, instances, in_size, proc, aux, out_size, NULL);
+}
+
+/*
+ * pipe_parallel_numa and pipe_parallel_stealing give each group of workers a
+ * queue of its own, so that they aren't all fighting over one pipe's lock. A
+ * dealer thread takes whatever comes into the pipeline and hands it out to the
+ * queues, one batch each in turn. Each worker takes from its own queue while
+ * there's anything in it, and steals from the others when there isn't.
+ */
+typedef struct {
+    pipe_consumer_t* in;
+    size_t           count;
+    pipe_producer_t* queues[];
+} deal_data_t;
+
+static void* deal_elems(void* param)
+{
+    deal_data_t* d = param;
+
+    char* buf = malloc(DEFAULT_BUFFER_SIZE * pipe_elem_size(PIPE_GENERIC(d->in)));
+
+    size_t elems_read, next = 0;
+
+    while((elems_read = pipe_pop_eager(d->in, buf, DEFAULT_BUFFER_SIZE)))
+    {
+        pipe_push(d->queues[next], buf, elems_read);
+        next = (next + 1) % d->count;
+    }
+
+    free(buf);
+
+    pipe_consumer_free(d->in);
+
+    for(size_t i = 0; i < d->count; ++i)
+        pipe_producer_free(d->queues[i]);
+
+    free(d);
+
+    return NULL;
+}
+
+typedef struct {
+    pipe_processor_t proc;
+    void*            aux;
+    pipe_producer_t* out;
+    size_t           count;
+    size_t           home; // the queue this worker prefers.
+    pipe_consumer_t* queues[];
+} stealer_t;
+
+// Pops a batch from the first of the queues with anything in it, looking at
+// the worker's own first. Never blocks.
+static size_t steal_elems(stealer_t* w, void* buf)
+{
+    for(size_t i = 0; i < w->count; ++i)
+    {
+        size_t elems_read = pipe_try_pop(w->queues[(w->home + i) % w->count],
+                                         buf, DEFAULT_BUFFER_SIZE);
+
+        if(elems_read)
+            return elems_read;
+    }
+
+    return 0;
+}
+
+static void* process_stealing(void* param)
+{
+    stealer_t* w = param;
+
+    char* buf = malloc(DEFAULT_BUFFER_SIZE * pipe_elem_size(PIPE_GENERIC(w->queues[0])));
+
+    // When every queue is empty, the poller is what we sleep on.
+    pipe_poller_t* poller = pipe_poller_new();
+    assert(poller);
+
+    for(size_t i = 0; i < w->count; ++i)
+        pipe_poller_add(poller, w->queues[i], w->queues[i]);
+
+    size_t live = w->count;
+
+    while(live > 0)
+    {
+        size_t elems_read = steal_elems(w, buf);
+
+        if(elems_read)
+        {
+            run_batch(w->queues[w->home], w->proc, w->aux,
+                      buf, elems_read, w->out);
+            continue;
+        }
+
+        // Something might have turned up (or been stolen from under us) since
+        // we looked, so this only tells us where to look next. A queue that's
+        // finished is ready for good, though, and has to stop being polled.
+        void* ready;
+
+        if(pipe_poll(poller, &ready, 1) && pipe_eof(ready))
+        {
+            pipe_poller_remove(poller, ready);
+            --live;
+        }
+    }
+
+    w->proc(NULL, 0, NULL, w->aux);
+
+    pipe_poller_free(poller);
+    free(buf);
+
+    for(size_t i = 0; i < w->count; ++i)
+        pipe_consumer_free(w->queues[i]);
+
+    pipe_producer_free(w->out);
+
+    free(w);
+
+    return NULL;
+}
+
+// Builds `count' queues with `instances' workers on each. If `numa' is set,
+// queue `i' is bound to NUMA node `i', and its workers pinned to `cpus[i]'.
+static pipeline_t deal_and_steal(size_t               count,
+                                 size_t               instances,
+                                 bool                 numa,
+                                 const pipe_cpuset_t* cpus,
+                                 size_t               in_size,
+                                 pipe_processor_t     proc,
+                                 void*                aux,
+                                 size_t               out_size)
+{
+    assert(count > 0);
+    assert(proc);
+
+    pipe_t* in  = pipe_new(in_size,  0),
+          * out = pipe_new(out_size, 0);
+
+    pipe_t** queues = malloc(count * sizeof *queues);
+
+    deal_data_t* d = malloc(sizeof *d + count * sizeof *d->queues);
+
+    *d = (deal_data_t) {
+        .in    = pipe_consumer_new(in),
+        .count = count
+    };
+
+    for(size_t i = 0; i < count; ++i)
+    {
+        pipe_options_t options = { .flags = 0 };
+
+        if(numa)
+        {
+            options.flags     = PIPE_NUMA_BIND;
+            options.numa_node = (unsigned)i;
+        }
+
+        queues[i]    = pipe_new_ex(in_size, 0, &options);
+        d->queues[i] = pipe_producer_new(queues[i]);
+    }
+
+    for(size_t home = 0; home < count; ++home)
+        for(size_t k = 0; k < instances; ++k)
+        {
+            stealer_t* w = malloc(sizeof *w + count * sizeof *w->queues);
+
+            *w = (stealer_t) {
+                .proc  = proc,
+                .aux   = aux,
+                .out   = pipe_producer_new(out),
+                .count = count,
+                .home  = home
+            };
+
+            for(size_t i = 0; i < count; ++i)
+                w->queues[i] = pipe_consumer_new(queues[i]);
+
+            thread_create_pinned(&process_stealing, w,
+                                 cpus ? &cpus[home] : NULL);
+        }
+
+    thread_create(&deal_elems, d);
+
+    for(size_t i = 0; i < count; ++i)
+        pipe_free(queues[i]);
+
+    free(queues);
+
+    pipeline_t ret = {
+        .in  = pipe_producer_new(in),
+        .out = pipe_consumer_new(out)
+    };
+
+    pipe_free(in);
+    pipe_free(out);
+
+    return ret;
+}
+
+pipeline_t pipe_parallel_numa(size_t               nodes,
+                              const pipe_cpuset_t* node_cpus,
+                              size_t               instances,
+                              size_t               in_size,
+                              pipe_processor_t     proc,
+                              void*                aux,
+                              size_t               out_size)
+{
+    return deal_and_steal(nodes, instances, true, node_cpus,
+                          in_size, proc, aux, out_size);
+}
+
+pipeline_t pipe_parallel_stealing(size_t           instances,
+                                  size_t           in_size,
+                                  pipe_processor_t proc,
+                                  void*            aux,
+                                  size_t           out_size)
+{
+    return deal_and_steal(instances, 1, false, NULL,
+                          in_size, proc, aux, out_size);
+}
+
+/*
+ * pipe_parallel_ordered hands out batches through a fixed set of `window'
+ * ordered_batch_t's. The sequencer takes a free one, fills it from the
+ * pipeline's input, numbers it, and passes it on to the workers. A worker runs
+ * the processor on it, catching whatever it pushes in a private pipe, then
+ * moves that into the batch and passes it on to the reorderer. The reorderer
+ * holds on to each batch until all the ones before it have been pushed into
+ * the output, then pushes it too and hands it back to the sequencer.
+ *
+ * Since there are only `window' batches, the sequencer has to wait for one to
+ * come back once they're all out. That's the backpressure, and it also means
+ * the reorderer can keep batch n in slot n % window of a plain array.
+ */
+typedef struct {
+    size_t seq;
+    size_t count;     // the number of elements in `in'.
+
+    char*  out;       // what the processor pushed, while it's waiting to be
+    size_t out_count, // reordered.
+           out_cap;
+
+    char   in[];
+} ordered_batch_t;
+
+typedef struct {
+    pipe_consumer_t* in;
+    pipe_consumer_t* free_batches;
+    pipe_producer_t* returned;     // so the last batch can be put back.
+    pipe_producer_t* work;
+} sequencer_t;
+
+static void* sequence_batches(void* param)
+{
+    sequencer_t* s = param;
+
+    ordered_batch_t* b;
+    size_t seq = 0;
+
+    // This can't run dry, since we hold a producer ourselves.
+    while(pipe_pop(s->free_batches, &b, 1))
+    {
+        if((b->count = pipe_pop_eager(s->in, b->in, DEFAULT_BUFFER_SIZE)) == 0)
+        {
+            pipe_push(s->returned, &b, 1);
+            break;
+        }
+
+        b->seq = seq++;
+        pipe_push(s->work, &b, 1);
+    }
+
+    pipe_consumer_free(s->in);
+    pipe_consumer_free(s->free_batches);
+    pipe_producer_free(s->returned);
+    pipe_producer_free(s->work);
+
+    free(s);
+
+    return NULL;
+}
+
+typedef struct {
+    pipe_consumer_t* work;
+    pipe_processor_t proc;
+    void*            aux;
+    size_t           out_size;
+    pipe_producer_t* done;
+} ordered_worker_t;
+
+static void* process_ordered(void* param)
+{
+    ordered_worker_t* w = param;
+
+    pipe_t* capture = pipe_new(w->out_size, 0);
+
+    pipe_producer_t* captured = pipe_producer_new(capture);
+    pipe_consumer_t* results  = pipe_consumer_new(capture);
+
+    pipe_free(capture);
+
+    ordered_batch_t* b;
+
+    while(pipe_pop(w->work, &b, 1))
+    {
+        run_batch(w->work, w->proc, w->aux, b->in, b->count, captured);
+
+        for(b->out_count = 0;;)
+        {
+            if(b->out_count == b->out_cap)
+            {
+                b->out_cap = b->out_cap ? 2*b->out_cap : DEFAULT_BUFFER_SIZE;
+                b->out = realloc(b->out, b->out_cap * w->out_size);
+                assert(b->out);
+            }
+
+            size_t elems_read = pipe_try_pop(results,
+                                             b->out + b->out_count * w->out_size,
+                                             b->out_cap - b->out_count);
+
+            if(elems_read == 0)
+                break;
+
+            b->out_count += elems_read;
+        }
+
+        pipe_push(w->done, &b, 1);
+    }
+
+    w->proc(NULL, 0, NULL, w->aux);
+
+    pipe_consumer_free(w->work);
+    pipe_producer_free(w->done);
+    pipe_producer_free(captured);
+    pipe_consumer_free(results);
+
+    free(w);
+
+    return NULL;
+}
+
+typedef struct {
+    pipe_consumer_t* done;
+    pipe_producer_t* out;
+    pipe_producer_t* free_batches;
+    pipe_consumer_t* returned;     // to clean up at the end.
+    size_t           window;
+    ordered_batch_t* slots[];
+} reorderer_t;
+
+static void* reorder_batches(void* param)
+{
+    reorderer_t* r = param;
+
+    ordered_batch_t* b;
+    size_t next = 0;
+
+    while(pipe_pop(r->done, &b, 1))
+    {
+        r->slots[b->seq % r->window] = b;
+
+        // Only batches `next' through `next + window - 1' can be out, so
+        // anything in `next's slot is the batch we're waiting for.
+        while((b = r->slots[next % r->window]) != NULL)
+        {
+            if(b->out_count > 0)
+                pipe_push(r->out, b->out, b->out_count);
+
+            r->slots[next++ % r->window] = NULL;
+
+            pipe_push(r->free_batches, &b, 1);
+        }
+    }
+
+    // Everything's been pushed, so every batch is back.
+    while(pipe_try_pop(r->returned, &b, 1))
+    {
+        free(b->out);
+        free(b);
+    }
+
+    pipe_consumer_free(r->done);
+    pipe_producer_free(r->out);
+    pipe_producer_free(r->free_batches);
+    pipe_consumer_free(r->returned);
+
+    free(r);
+
+    return NULL;
+}
+
+pipeline_t pipe_parallel_ordered(size_t           instances,
+                                 size_t           window,
+                                 size_t           in_size,
+                                 pipe_processor_t proc,
+                                 void*            aux,
+                                 size_t           out_size)
+{
+    assert(instances > 0);
+    assert(proc);
+
+    if(window == 0)
+        window = 2*instances;
+
+    pipe_t* in      = pipe_new(in_size,  0),
+          * out     = pipe_new(out_size, 0),
+          * batches = pipe_new(sizeof(ordered_batch_t*), 0),
+          * work    = pipe_new(sizeof(ordered_batch_t*), 0),
+          * done    = pipe_new(sizeof(ordered_batch_t*), 0);
+
+    {
+        pipe_producer_t* fill = pipe_producer_new(batches);
+
+        for(size_t i = 0; i < window; ++i)
+        {
+            ordered_batch_t* b = malloc(sizeof *b + DEFAULT_BUFFER_SIZE * in_size);
+
+            *b = (ordered_batch_t) { .out = NULL };
+
+            pipe_push(fill, &b, 1);
+        }
+
+        pipe_producer_free(fill);
+    }
+
+    sequencer_t* s = malloc(sizeof *s);
+
+    *s = (sequencer_t) {
+        .in           = pipe_consumer_new(in),
+        .free_batches = pipe_consumer_new(batches),
+        .returned     = pipe_producer_new(batches),
+        .work         = pipe_producer_new(work)
+    };
+
+    reorderer_t* r = malloc(sizeof *r + window * sizeof *r->slots);
+
+    *r = (reorderer_t) {
+        .done         = pipe_consumer_new(done),
+        .out          = pipe_producer_new(out),
+        .free_batches = pipe_producer_new(batches),
+        .returned     = pipe_consumer_new(batches),
+        .window       = window
+    };
+
+    for(size_t i = 0; i < window; ++i)
+        r->slots[i] = NULL;
+
+    while(instances--)
+    {
+        ordered_worker_t* w = malloc(sizeof *w);
+
+        *w = (ordered_worker_t) {
+            .work     = pipe_consumer_new(work),
+            .proc     = proc,
+            .aux      = aux,
+            .out_size = out_size,
+            .done     = pipe_producer_new(done)
+        };
+
+        thread_create(&process_ordered, w);
+    }
+
+    thread_create(&sequence_batches, s);
+    thread_create(&reorder_batches, r);
+
+    pipeline_t ret = {
+        .in  = pipe_producer_new(in),
+        .out = pipe_consumer_new(out)
+    };
+
+    pipe_free(in);
+    pipe_free(out);
+    pipe_free(batches);
+    pipe_free(work);
+    pipe_free(done);
+
+    return ret;
+}
+
+static pipeline_t va_pipe_pipeline(pipe_executor_t* ex,
+                                   pipeline_t result_so_far,
+                                   va_list args)
+{
+    pipe_processor_t proc = va_arg(args, pipe_processor_t);
+
+    if(proc == NULL)
+        return result_so_far;
+
+    void*  aux       = va_arg(args, void*);
+    size_t pipe_size = va_arg(args, size_t);
+
+    if(pipe_size == 0)
+    {
+        pipe_consumer_free(result_so_far.out);
+        result_so_far.out = NULL;
+        return result_so_far;
+    }
+
+    pipe_t* pipe = pipe_new(pipe_size, 0);
+
+    connect_stage(ex, result_so_far.out , proc, aux, pipe_producer_new(pipe));
+    result_so_far.out = pipe_consumer_new(pipe);
+
+    pipe_free(pipe);
+
+    return va_pipe_pipeline(ex, result_so_far, args);
+}
+
+pipeline_t pipe_pipeline(size_t first_size, ...)
+{
+    va_list va;
+    va_start(va, first_size);
+
+    pipe_t* p = pipe_new(first_size, 0);
+
+    pipeline_t ret = va_pipe_pipeline(NULL, pipe_trivial_pipeline(p), va);
+
+    pipe_free(p);
+
+    va_end(va);
+
+    return ret;
+}
+
+pipeline_t pipe_executor_pipeline(pipe_executor_t* ex, size_t first_size, ...)
+{
+    assert(ex);
+
+    va_list va;
+    va_start(va, first_size);
+
+    pipe_t* p = pipe_new(first_size, 0);
+
+    pipeline_t ret = va_pipe_pipeline(ex, pipe_trivial_pipeline(p), va);
+
+    pipe_free(p);
+
+    va_end(va);
+
+    return ret;
+}
+
+// Returns how many stages, starting with stages[0], run in stages[0]'s thread.
+static size_t fused_run(const pipe_stage_t* stages, size_t count)
+{
+    size_t run = 1;
+
+    while(run < count && stages[run].options
+       && (stages[run].options->flags & PIPE_STAGE_FUSED))
+        ++run;
+
+    return run;
+}
+
+// Connects the first `run' stages, which are all fused onto stages[0], between
+// `in' and a new pipe with room for `limit' elements. Returns its consumer.
+static pipe_consumer_t* connect_fused(pipe_consumer_t* in,
+                                      const pipe_stage_t* stages, size_t run,
+                                      size_t limit)
+{
+    const pipe_stage_options_t* options = stages[0].options
+                                        ? stages[0].options
+                                        : &default_stage_options;
+
+    // The first stage's output goes to the second, and so on, and only the
+    // last one pushes into a pipe another thread can see. Nothing else can
+    // pop from the others, so they had better not have limits.
+    pipe_t* next = pipe_new(stages[0].out_size, run == 1 ? limit : 0);
+
+    connect_data_t* d = new_connect_data(in, stages[0].proc, stages[0].aux,
+                                         pipe_producer_new(next),
+                                         options, run - 1);
+
+    for(size_t i = 1; i < run; ++i)
+    {
+        const pipe_stage_t* stage = &stages[i];
+
+        pipe_t* prev = next;
+        next = pipe_new(stage->out_size, i == run - 1 ? limit : 0);
+
+        size_t max_batch = max_batch_of(stage->options);
+
+        d->chain[i - 1] = (fused_stage_t) {
+            .in        = pipe_consumer_new(prev),
+            .proc      = stage->proc,
+            .aux       = stage->aux,
+            .out       = pipe_producer_new(next),
+            .max_batch = max_batch,
+            .buf       = malloc(max_batch * pipe_elem_size(PIPE_GENERIC(prev)))
+        };
+
+        pipe_free(prev);
+    }
+
+    pipe_consumer_t* out = pipe_consumer_new(next);
+    pipe_free(next);
+
+    thread_create_pinned(&process_pipe, d, options->cpus);
+
+    return out;
+}
+
+// Each run of fused stages has one pipe at the end of it, whose limit comes
+// from the last stage in the run, or from the flow if it's the pipeline's
+// output. Returns 0 if it doesn't have one.
+static size_t run_limit(const pipe_stage_t* stages, size_t i, size_t run,
+                        size_t count, const pipe_flow_t* flow)
+{
+    const pipe_stage_options_t* last = stages[i + run - 1].options;
+
+    if(last && last->limit)
+        return last->limit;
+
+    return i + run == count && flow ? flow->out_limit : 0;
+}
+
+pipeline_t pipe_pipeline_stages(size_t first_size,
+                                const pipe_stage_t* stages, size_t count)
+{
+    return pipe_pipeline_ex(first_size, stages, count, NULL);
+}
+
+pipeline_t pipe_pipeline_ex(size_t first_size,
+                            const pipe_stage_t* stages, size_t count,
+                            const pipe_flow_t* flow)
+{
+    size_t in_limit  = flow ? flow->in_limit : 0,
+           unlimited = in_limit == 0;
+
+    for(size_t i = 0, run; i < count; i += run)
+    {
+        run = fused_run(stages + i, count - i);
+        unlimited += run_limit(stages, i, run, count, flow) == 0;
+    }
+
+    size_t share = budget_share(flow, unlimited);
+
+    pipe_t* p = pipe_new(first_size, flow_limit(in_limit, share));
+
+    pipeline_t ret = pipe_trivial_pipeline(p);
+
+    pipe_free(p);
+
+    for(size_t i = 0, run; i < count; i += run)
+    {
+        assert(stages[i].proc);
+        assert(stages[i].out_size);
+
+        run = fused_run(stages + i, count - i);
+
+        ret.out = connect_fused(ret.out, stages + i, run,
+                                flow_limit(run_limit(stages, i, run, count, flow),
+                                           share));
+    }
+
+    return ret;
+}
+
+/*
+ * The recorder:
+ *
+ * Tracing threads push their events into the recorder's own pipe, which is
+ * what puts them in order, and pipe_recorder_write pops them back out. The
+ * pipe's own pushes and pops are traced like any other pipe's, so the recorder
+ * has to ignore them, or every event would record another one forever.
+ */
+
+typedef struct {
+    pipe_trace_t       e;
+    unsigned long long thread;
+} recorded_t;
+
+// What the writer remembers about every pipe it has seen.
+typedef struct {
+    const pipe_generic_t* pipe;
+    long long             elems;
+} traced_pipe_t;
+
+struct pipe_recorder_t {
+    pipe_tracer_t      tracer;
+    pipe_producer_t*   in;
+    pipe_consumer_t*   out;
+    unsigned long long start;
+
+    // Only the writer touches these.
+    traced_pipe_t* pipes;
+    size_t         pipe_count,
+                   pipe_cap;
+};
+
+static void record_event(const pipe_trace_t* e, void* ctx)
+{
+    pipe_recorder_t* r = ctx;
+
+    if(e->pipe == PIPE_GENERIC(r->in))
+        return;
+
+    recorded_t rec = { *e, thread_id() };
+
+    (void)pipe_try_push(r->in, &rec, 1);
+}
+
+pipe_recorder_t* pipe_recorder_new(size_t max_events)
+{
+    pipe_recorder_t* r = malloc(sizeof *r);
+    assert(r);
+
+    pipe_t* events = pipe_new(sizeof(recorded_t), max_events);
+
+    *r = (pipe_recorder_t) {
+        .tracer = { &record_event, r },
+        .in     = pipe_producer_new(events),
+        .out    = pipe_consumer_new(events),
+        .start  = pipe_now(),
+    };
+
+    pipe_free(events);
+
+    if(!pipe_set_tracer(&r->tracer))
+    {
+        pipe_recorder_free(r);
+        return NULL;
+    }
+
+    return r;
+}
+
+// Returns the pipe's entry, adding one if it's new.
+static traced_pipe_t* traced_pipe(pipe_recorder_t* r, const pipe_generic_t* p)
+{
+    for(size_t i = 0; i < r->pipe_count; ++i)
+        if(r->pipes[i].pipe == p)
+            return &r->pipes[i];
+
+    if(r->pipe_count == r->pipe_cap)
+    {
+        r->pipe_cap = r->pipe_cap ? 2*r->pipe_cap : 16;
+        r->pipes = realloc(r->pipes, r->pipe_cap * sizeof *r->pipes);
+        assert(r->pipes);
+    }
+
+    r->pipes[r->pipe_count] = (traced_pipe_t) { p, 0 };
+
+    return &r->pipes[r->pipe_count++];
+}
+
+static const char* const begin_names[] = {
+    [PIPE_TRACE_WAIT_ROOM]   = "wait for room in pipe",
+    [PIPE_TRACE_WAIT_ELEMS]  = "wait for elements in pipe",
+    [PIPE_TRACE_STAGE_BEGIN] = "stage reading pipe",
+};
+
+static void write_event(pipe_recorder_t* r, FILE* f, const recorded_t* rec,
+                        bool first)
+{
+    const pipe_trace_t* e = &rec->e;
+
+    traced_pipe_t* p  = traced_pipe(r, e->pipe);
+    size_t         id = p - r->pipes + 1;
+
+    // Chrome wants microseconds.
+    double ts = e->time >= r->start ? (e->time - r->start) / 1000.0 : 0;
+
+    fprintf(f, first ? "\n" : ",\n");
+
+    switch(e->event)
+    {
+    case PIPE_TRACE_PUSH:
+    case PIPE_TRACE_POP:
+        p->elems += e->event == PIPE_TRACE_PUSH ? (long long)e->count
+                                                : -(long long)e->count;
+
+        // A pop can be recorded just before the push it popped, and we might
+        // have missed pushes from before we started.
+        fprintf(f, "{\"name\":\"pipe %zu\",\"ph\":\"C\",\"ts\":%.3f,"
+                   "\"pid\":1,\"args\":{\"elements\":%lld}}",
+                id, ts, p->elems > 0 ? p->elems : 0);
+        break;
+
+    case PIPE_TRACE_WAIT_ROOM:
+    case PIPE_TRACE_WAIT_ELEMS:
+    case PIPE_TRACE_STAGE_BEGIN:
+        fprintf(f, "{\"name\":\"%s %zu\",\"ph\":\"B\",\"ts\":%.3f,"
+                   "\"pid\":1,\"tid\":%llu,\"args\":{\"elements\":%zu}}",
+                begin_names[e->event], id, ts, rec->thread, e->count);
+        break;
+
+    case PIPE_TRACE_WAIT_END:
+    case PIPE_TRACE_STAGE_END:
+        fprintf(f, "{\"ph\":\"E\",\"ts\":%.3f,\"pid\":1,\"tid\":%llu}",
+                ts, rec->thread);
+        break;
+    }
+}
+
+int pipe_recorder_write(pipe_recorder_t* r, FILE* f)
+{
+    // Busy pipes might record events faster than we can write them, so stop at
+    // the first one that happened after we started.
+    unsigned long long until = pipe_now();
+
+    recorded_t buf[DEFAULT_BUFFER_SIZE];
+    size_t     elems_read;
+    bool       first = true,
+               done  = false;
+
+    fprintf(f, "{\"traceEvents\":[");
+
+    while(!done && (elems_read = pipe_try_pop(r->out, buf, DEFAULT_BUFFER_SIZE)))
+        for(size_t i = 0; i < elems_read; ++i)
+        {
+            write_event(r, f, &buf[i], first);
+
+            first = false;
+            done |= buf[i].e.time > until;
+        }
+
+    fprintf(f, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+    return !ferror(f);
+}
+
+void pipe_recorder_free(pipe_recorder_t* r)
+{
+    pipe_set_tracer(NULL);
+
+    pipe_producer_free(r->in);
+    pipe_consumer_free(r->out);
+
+    free(r->pipes);
+    free(r);
+}
 
 /* vim: set et ts=4 sw=4 softtabstop=4 textwidth=80: */
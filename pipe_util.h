@@ -25,6 +25,8 @@
 #pragma once
 #include "pipe.h"
 
+#include <stdio.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -71,6 +73,82 @@ void pipe_connect(pipe_consumer_t* in,
                   pipe_processor_t proc, void* aux,
                   pipe_producer_t* out);
 
+/*
+ * A set of CPUs, numbered the way the OS numbers them. A thread pinned to the
+ * set will only ever be scheduled on one of them. Pinning is supported on
+ * Linux, and on Windows for the first 64 CPUs. Elsewhere, it does nothing.
+ */
+typedef struct {
+    const unsigned* cpus;
+    size_t          count;
+} pipe_cpuset_t;
+
+/*
+ * The same as pipe_connect, except the new thread pins itself to `cpus' before
+ * it starts processing anything. The set is copied, so it doesn't have to
+ * outlive the call. NULL (or an empty set) doesn't pin anything.
+ */
+void pipe_connect_pinned(pipe_consumer_t* in,
+                         pipe_processor_t proc, void* aux,
+                         pipe_producer_t* out,
+                         const pipe_cpuset_t* cpus);
+
+/*
+ * Makes a stage's batches grow while it's falling behind, and shrink again once
+ * it catches up. See pipe_stage_options_t.
+ */
+#define PIPE_BATCH_ADAPTIVE 0x1u
+
+/*
+ * Only means something to pipe_pipeline_stages. Runs the stage in the same
+ * thread as the one before it, which calls it as soon as it's done with each of
+ * its own batches. Nothing it pushes has to be handed over to another thread,
+ * so this is the way to go for stages that cost less than that handoff does.
+ * A fused stage's batches are at most its `max_batch', and everything else in
+ * its options is ignored, except for a `limit' on the last stage of a fused run:
+ * it never waits for anything, and runs wherever the stage it's fused onto
+ * does.
+ */
+#define PIPE_STAGE_FUSED 0x2u
+
+/*
+ * Everything pipe_connect_ex can be told about a stage. As with pipe_options_t,
+ * zero-initialize it and fill in what you care about. All zeros is the same as
+ * pipe_connect.
+ *
+ * The processor is given at most `max_batch' elements at a time. Once at least
+ * one element is available, the stage waits up to `linger' nanoseconds (or
+ * forever, if that's 0) until it has `min_batch' of them, then takes whatever
+ * else is in the pipe too. So a latency-critical stage wants a `min_batch' of
+ * 1, and a throughput-critical one wants a big `min_batch' and some lingering.
+ *
+ * With PIPE_BATCH_ADAPTIVE, `min_batch' is only where the stage starts. Each
+ * time a batch is already there in full, it starts waiting for twice as many
+ * elements next time, up to `max_batch'. Each time it comes up short, it goes
+ * back to waiting for half as many, down to `min_batch'.
+ */
+typedef struct {
+    size_t min_batch; /* 0 means the same as `max_batch'. */
+    size_t max_batch; /* 0 picks a default (128).         */
+
+    unsigned long long linger;
+
+    unsigned flags;   /* A bitwise-or of the PIPE_BATCH_* and PIPE_STAGE_*
+                         flags above. */
+
+    const pipe_cpuset_t* cpus; /* As in pipe_connect_pinned. */
+
+    size_t limit;     /* The most elements allowed to wait in the stage's
+                         output, when a pipeline builder makes it. 0 means
+                         unlimited (or a share of the pipe_flow_t's budget). */
+} pipe_stage_options_t;
+
+/* pipe_connect, with options. `options' may be NULL. */
+void pipe_connect_ex(pipe_consumer_t* in,
+                     pipe_processor_t proc, void* aux,
+                     pipe_producer_t* out,
+                     const pipe_stage_options_t* options);
+
 /*
  * Creates a pipeline with multiple instances of the same function working on
  * the same queue. Whenever elements are pushed into the pipeline, the
@@ -88,6 +166,64 @@ pipeline_t pipe_parallel(size_t           instances,
                          void*            aux,
                          size_t           out_size);
 
+/*
+ * The same as pipe_parallel, except that each instance gets an input queue of
+ * its own. Elements pushed into the pipeline are dealt out to the queues in
+ * batches by one more thread, and an instance with nothing left in its own
+ * queue steals from the others'. Since instances mostly stay out of each
+ * other's way, this scales to many more of them than pipe_parallel does, at
+ * the cost of that extra thread and a little latency.
+ */
+pipeline_t pipe_parallel_stealing(size_t           instances,
+                                  size_t           in_size,
+                                  pipe_processor_t proc,
+                                  void*            aux,
+                                  size_t           out_size);
+
+/*
+ * The same as pipe_parallel, except that whatever the instances push comes out
+ * of the pipeline in the same order as what it was made from went in. Elements
+ * are handed to the instances in numbered batches, and each batch's results
+ * are held back until the results of every batch before it have been pushed.
+ *
+ * At most `window' batches are ever being processed or held back at once. When
+ * that many are, nothing more is taken from the pipeline's input until the
+ * oldest one is done, so one slow batch can't make the others pile up. The
+ * window has to be at least `instances' to keep all of them busy. 0 picks
+ * twice that.
+ *
+ * Each time `proc' is called, everything it pushes is kept together, so it's
+ * fine for it to push more or fewer elements than it was given.
+ */
+pipeline_t pipe_parallel_ordered(size_t           instances,
+                                 size_t           window,
+                                 size_t           in_size,
+                                 pipe_processor_t proc,
+                                 void*            aux,
+                                 size_t           out_size);
+
+/*
+ * pipe_parallel for machines with several NUMA nodes. Each of the `nodes' nodes
+ * gets its own input queue, whose memory is bound to that node (see
+ * PIPE_NUMA_BIND), and `instances' threads pinned to `node_cpus[node]'.
+ * Elements pushed into the pipeline are dealt out to the nodes' queues in
+ * batches by one more thread. Each worker only takes from its own node's queue
+ * while there's anything in it, and steals from the other nodes' queues when
+ * there isn't, so no work is left waiting on a busy node while another one
+ * idles.
+ *
+ * Node `i' is NUMA node `i' as the OS numbers them. If `node_cpus' is NULL, the
+ * workers aren't pinned. Everything else works exactly like pipe_parallel,
+ * including the termination call, which happens once per worker.
+ */
+pipeline_t pipe_parallel_numa(size_t               nodes,
+                              const pipe_cpuset_t* node_cpus,
+                              size_t               instances,
+                              size_t               in_size,
+                              pipe_processor_t     proc,
+                              void*                aux,
+                              size_t               out_size);
+
 /*
  * A pipeline consists of a list of functions and pipes. As data is recieved in
  * one end, it is processed by each of the pipes and pushed into the other end.
@@ -125,6 +261,175 @@ pipeline_t pipe_parallel(size_t           instances,
  */
 pipeline_t MUST_SENTINEL pipe_pipeline(size_t first_size, ...);
 
+/*
+ * How much the pipeline builders that take one let pile up in a pipeline. Left
+ * alone (or NULL), every pipe is unlimited, like the ones pipe_pipeline makes.
+ * Memory use then has no bound but how far ahead of the last stage the first
+ * one gets.
+ *
+ * Each pipe in the pipeline acts as a link between two stages, and the free room
+ * in it is the credit the stage upstream has to push into. Once a stage has
+ * used up those credits, it blocks until the stage downstream pops something
+ * and hands them back, and so on back to whoever is pushing into the
+ * pipeline. Since every link has its own credits, one stage falling behind can
+ * never starve the others of credit they need to catch up. Flow control alone
+ * can't deadlock a pipeline, as long as something is popping its output.
+ *
+ * `in_limit' and `out_limit' are the credits of the pipeline's input and
+ * output, and per-stage limits (see pipe_stage_options_t) are the credits of
+ * their output; 0 leaves them up to `budget'. That is shared out evenly between
+ * every link without a limit of its own. So, with all of them left up to the
+ * budget, no more than `budget' elements are ever waiting in the pipeline,
+ * plus up to one batch per stage that's being processed, plus anything a
+ * fused stage is yet to pass on. (Pipes round their limits up a bit, so for
+ * small budgets that's more of a ballpark than a bound.)
+ */
+typedef struct {
+    size_t in_limit;
+    size_t out_limit;
+    size_t budget;
+} pipe_flow_t;
+
+/*
+ * pipe_parallel, but with flow control. `flow' may be NULL, which is the same
+ * as pipe_parallel.
+ */
+pipeline_t pipe_parallel_ex(size_t             instances,
+                            size_t             in_size,
+                            pipe_processor_t   proc,
+                            void*              aux,
+                            size_t             out_size,
+                            const pipe_flow_t* flow);
+
+/* One stage of pipe_pipeline_stages. */
+typedef struct {
+    pipe_processor_t proc;
+    void*            aux;
+    size_t           out_size; /* The size of the elements `proc' pushes. */
+
+    const pipe_stage_options_t* options; /* May be NULL. */
+} pipe_stage_t;
+
+/*
+ * pipe_pipeline, for when the stages come in an array, or need options. Each
+ * stage gets a thread of its own, unless it's PIPE_STAGE_FUSED.
+ */
+pipeline_t pipe_pipeline_stages(size_t first_size,
+                                const pipe_stage_t* stages, size_t count);
+
+/* pipe_pipeline_stages, with flow control. `flow' may be NULL. */
+pipeline_t pipe_pipeline_ex(size_t first_size,
+                            const pipe_stage_t* stages, size_t count,
+                            const pipe_flow_t* flow);
+
+/*
+ * An executor runs pipe processors on a fixed pool of threads, instead of
+ * giving each one a thread of its own. Every processor connected to it becomes
+ * a "stage", which sits idle until its input pipe has something in it (or is
+ * finished), and is then handed to a free worker. The worker runs it for a few
+ * batches, and gives it back to wait for more. So any number of stages, from
+ * any number of pipelines, can share one core-sized pool.
+ *
+ * A stage only ever runs on one worker at a time, so it sees its elements in
+ * order, exactly as it would with pipe_connect, and its termination call
+ * (count of 0) happens once, after everything else.
+ *
+ * The catch is that a processor that blocks ties up its worker while it does.
+ * If every worker is stuck pushing into a full pipe, the stages that would
+ * empty it never get to run. The pipes these functions create are unbounded, so
+ * that can only happen through pipes you limited yourself. Stages reading from
+ * pipes that can't be polled (shared and broadcast ones) can't sit idle
+ * either, so they're run over and over until they finish, keeping a worker
+ * busy.
+ */
+typedef struct pipe_executor_t pipe_executor_t;
+
+/*
+ * Starts an executor with `threads' workers, or one per CPU if `threads' is 0.
+ * There's also one extra thread, which just waits for stages to be ready.
+ */
+pipe_executor_t* pipe_executor_new(size_t threads);
+
+/*
+ * Waits for every stage connected to the executor to finish (that is, for all
+ * their input pipes to be emptied and have their producers freed), then stops
+ * its threads and frees it. Don't connect anything else to it once you've
+ * called this.
+ */
+void pipe_executor_free(pipe_executor_t*);
+
+/* Like pipe_connect, but runs `proc' as a stage on the executor. */
+void pipe_executor_connect(pipe_executor_t*,
+                           pipe_consumer_t* in,
+                           pipe_processor_t proc, void* aux,
+                           pipe_producer_t* out);
+
+/*
+ * Like pipe_parallel, but with `instances' stages on the executor instead of
+ * `instances' new threads. As with pipe_parallel, elements may come out in a
+ * different order than they went in.
+ */
+pipeline_t pipe_executor_parallel(pipe_executor_t* ex,
+                                  size_t           instances,
+                                  size_t           in_size,
+                                  pipe_processor_t proc,
+                                  void*            aux,
+                                  size_t           out_size);
+
+/* Like pipe_pipeline, but every stage runs on the executor. */
+pipeline_t MUST_SENTINEL pipe_executor_pipeline(pipe_executor_t* ex,
+                                                size_t first_size, ...);
+
+/*
+ * A recorder keeps every pipe's trace events (see pipe_set_tracer), and writes
+ * them out as a Chrome trace, which chrome://tracing and https://ui.perfetto.dev
+ * show as a timeline. Every thread gets a row of its own, showing when its
+ * stages were busy with a batch and when it was asleep on a pipe, and every
+ * pipe gets a counter of the elements in it. Together, they show how long
+ * elements sat in each pipe, and how long each stage spent on them.
+ *
+ * Sample code:
+ *
+ *   pipe_recorder_t* rec = pipe_recorder_new(1 << 20);
+ *
+ *   pipeline_t pipeline = pipe_pipeline(...);
+ *   ...
+ *
+ *   FILE* f = fopen("trace.json", "w");
+ *   pipe_recorder_write(rec, f);
+ *   fclose(f);
+ *
+ * Stages are named after the pipe they read from, and pipes are numbered in
+ * the order the recorder first hears about them.
+ */
+typedef struct pipe_recorder_t pipe_recorder_t;
+
+/*
+ * Makes a recorder, and makes it the tracer. Once it's holding `max_events'
+ * events it drops any more, until they're written out. If `max_events' is 0,
+ * it keeps everything.
+ *
+ * Returns NULL if pipes aren't being traced (see PIPE_TRACE).
+ */
+pipe_recorder_t* pipe_recorder_new(size_t max_events);
+
+/*
+ * Writes out everything recorded since the last call as a whole trace, and
+ * forgets it. This may be called while the pipes are busy, though only from
+ * one thread at a time. Returns 0 if writing failed.
+ *
+ * Elements counts start at 0 when the recorder is made, so elements which were
+ * already in a pipe by then won't show up in its counter.
+ */
+int pipe_recorder_write(pipe_recorder_t*, FILE*);
+
+/*
+ * Stops tracing, and frees the recorder. Threads that were in the middle of
+ * recording something might not be done with it yet, so only free it once
+ * whatever it was watching has stopped.
+ */
+void pipe_recorder_free(pipe_recorder_t*);
+
 #undef MUST_SENTINEL
 
 #ifdef __cplusplus
@@ -1,10 +1,7 @@
 #!/bin/bash
 
-./pipe_release
-mv gmon.out gmon.sum
+# Records a timeline of a pipeline into trace.json. Open it in chrome://tracing
+# or https://ui.perfetto.dev. Unlike gprof, this shows where each batch spent
+# its time on its way between threads, not just which functions were hot.
 
-for i in {1..100}
-do
-    ./pipe_release
-    gprof -s pipe_release gmon.out gmon.sum
-done
+make pipe_trace && ./pipe_trace trace.json "$@"